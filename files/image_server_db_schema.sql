@@ -541,6 +541,23 @@ CREATE TABLE `image_statistics` (
 ) ENGINE=MyISAM AUTO_INCREMENT=15371288 DEFAULT CHARSET=latin1 ROW_FORMAT=DYNAMIC;
 /*!40101 SET character_set_client = @saved_cs_client */;
 
+--
+-- Table structure for table `image_transfer_chunks`
+--
+
+DROP TABLE IF EXISTS `image_transfer_chunks`;
+/*!40101 SET @saved_cs_client     = @@character_set_client */;
+/*!40101 SET character_set_client = utf8 */;
+CREATE TABLE `image_transfer_chunks` (
+  `image_id` bigint(20) unsigned NOT NULL DEFAULT '0',
+  `chunk` int(10) unsigned NOT NULL DEFAULT '0',
+  `chunk_size` int(10) unsigned NOT NULL DEFAULT '0',
+  `file_size` bigint(20) unsigned NOT NULL DEFAULT '0',
+  `checksum` int(10) unsigned NOT NULL DEFAULT '0',
+  PRIMARY KEY (`image_id`,`chunk`)
+) ENGINE=InnoDB DEFAULT CHARSET=latin1;
+/*!40101 SET character_set_client = @saved_cs_client */;
+
 --
 -- Table structure for table `images`
 --
@@ -643,8 +660,11 @@ CREATE TABLE `processing_job_queue` (
   `job_submission_time` int(10) unsigned NOT NULL DEFAULT '0',
   `job_class` int(10) unsigned NOT NULL DEFAULT '0',
   `paused` int(10) unsigned NOT NULL DEFAULT '0',
+  `claim_token` bigint(20) unsigned NOT NULL DEFAULT '0',
+  `claim_expiration_time` int(10) unsigned NOT NULL DEFAULT '0',
   PRIMARY KEY (`id`),
-  KEY `priority_index` (`priority`,`problem`,`job_class`,`processor_id`) USING BTREE
+  KEY `priority_index` (`priority`,`problem`,`job_class`,`processor_id`) USING BTREE,
+  KEY `claim_index` (`claim_token`)
 ) ENGINE=MyISAM AUTO_INCREMENT=9659081 DEFAULT CHARSET=latin1;
 /*!40101 SET character_set_client = @saved_cs_client */;
 
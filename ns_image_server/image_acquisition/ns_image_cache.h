@@ -2,43 +2,23 @@
 #define NS_IMAGE_CACHE
 #include "ns_image.h"
 #include "ns_image_storage.h"
+#include "ns_thread.h"
+#include "ns_single_thread_coordinator.h"
 #include <map>
+#include <deque>
 
-#define NS_VERBOSE_IMAGE_CACHE
+//#define NS_VERBOSE_IMAGE_CACHE
 
 #ifdef  NS_VERBOSE_IMAGE_CACHE
 #include <iostream>
 #endif
 class ns_image_storage_handler;
-
-
-
-template<class ns_component>
-struct ns_image_cache_object{
-	ns_image_cache_object():size_in_memory(0),size_on_disk(0),do_not_cache_to_disk(false),to_erase(false){}
-	unsigned long last_access; //the last time (in UNIX time seconds) that the image was requested from the cache
-	std::string filename_on_disk;   //If specified, the image has been swapped to disk under the specified filename
-	bool do_not_cache_to_disk; //if images are open for reading, they can't be swapped to the disk
-							   //as the disk copy would not reflect any changes made to the active copy.
-	unsigned long size_in_memory; //if size_in_memory != 0, the image is present in memory and is of the specified size.
-	unsigned long size_on_disk;
-
-	ns_image_whole<ns_component> image; //the image cached in memory.
-	unsigned long image_uncompressed_size(){ return image_uncompressed_size(image.properties());  }
-	static unsigned long image_uncompressed_size(ns_image_properties & p){ 
-		return(p.width*
-		p.height*
-		p.components)/1024;
-	}
-	bool to_erase;
-};
-
+class ns_image_server_sql;
 
-bool ns_storage_delete_from_local_cache(ns_image_storage_handler * image_storage,const std::string & filename);
 bool ns_storage_delete_from_local_cache(ns_image_storage_handler * image_storage,const std::string & filename);
 unsigned long ns_storage_request_local_cache_file_size(ns_image_storage_handler * image_storage,const std::string & filename);
 
-void ns_full_drive_cache_panic(const ns_ex & ex);
+void ns_full_drive_cache_panic(const ns_ex & ex,ns_image_server_sql * sql);
 
 ns_image_storage_source_handle<ns_8_bit>  ns_storage_request_from_local_cache(ns_image_storage_handler * image_storage, const std::string & filename);
 //ns_image_storage_source_handle<ns_16_bit>  ns_storage_request_from_local_cache(ns_image_storage_handler* image_storage, const std::string & filename);
@@ -49,269 +29,507 @@ ns_image_storage_source_handle<ns_8_bit> ns_storage_request_from_storage(ns_imag
 ns_image_storage_reciever_handle<ns_8_bit> ns_storage_request_local_cache_storage(ns_image_storage_handler * image_storage, const std::string & filename, const unsigned long max_line_length, const bool report_to_db = true);
 //ns_image_storage_reciever_handle<ns_16_bit> ns_storage_request_local_cache_storage(ns_image_storage_handler * image_storage, const std::string & filename, const unsigned long max_line_length, const bool report_to_db = true);
 
-///ns_image_cache implements a local cache for images loaded from the central file server.
+template<class ns_component>
+class ns_image_cache;
+
+template<class ns_component>
+struct ns_image_cache_entry{
+	ns_image_cache_entry(const ns_64_bit id_):id(id_),in_memory(false),size_in_memory(0),size_on_disk(0),reference_count(0),
+		recently_used(true),spill_pending(false),load_lock("ns_image_cache_entry::load_lock"){}
+
+	const ns_64_bit id;
+	ns_image_whole<ns_component> image;
+	bool in_memory;
+	ns_64_bit size_in_memory, //in bytes
+			  size_on_disk;   //if size_on_disk != 0, a copy of the image has been written to filename_on_disk
+	std::string filename_on_disk;
+
+	//the number of ns_image_cache_read_handles referring to the image.
+	//Referenced images are never removed from memory.
+	unsigned long reference_count;
+	//the CLOCK eviction algorithm's reference bit, set each time the image is requested
+	//and cleared as the clock hand passes over it.
+	bool recently_used;
+	//the image has been queued to be written to the disk cache
+	bool spill_pending;
+
+	//held by the thread loading the image into memory, so that other threads requesting the image wait for it.
+	ns_lock load_lock;
+
+	static ns_64_bit image_size_in_bytes(const ns_image_properties & p){
+		return ((ns_64_bit)p.width)*p.height*p.components*sizeof(ns_component);
+	}
+};
+
+///A reference-counted, read-only handle to an image held in an ns_image_cache.
+///The image is kept in memory until every handle referring to it has been released or destroyed.
+template<class ns_component>
+class ns_image_cache_read_handle{
+public:
+	ns_image_cache_read_handle():cache(0),entry(0){}
+	ns_image_cache_read_handle(const ns_image_cache_read_handle & h):cache(h.cache),entry(h.entry){
+		if (entry != 0)
+			cache->add_reference(entry);
+	}
+	ns_image_cache_read_handle & operator=(const ns_image_cache_read_handle & h){
+		if (this == &h)
+			return *this;
+		release();
+		cache = h.cache;
+		entry = h.entry;
+		if (entry != 0)
+			cache->add_reference(entry);
+		return *this;
+	}
+	~ns_image_cache_read_handle(){release();}
+
+	const ns_image_whole<ns_component> & operator()() const{
+		if (entry == 0)
+			throw ns_ex("ns_image_cache_read_handle::Accessing an empty handle");
+		return entry->image;
+	}
+	bool is_null() const{return entry == 0;}
+
+	void release(){
+		if (entry != 0)
+			cache->remove_reference(entry);
+		entry = 0;
+		cache = 0;
+	}
+private:
+	//takes ownership of a reference already counted by the cache
+	ns_image_cache_read_handle(ns_image_cache<ns_component> * cache_, ns_image_cache_entry<ns_component> * entry_):cache(cache_),entry(entry_){}
+	ns_image_cache<ns_component> * cache;
+	ns_image_cache_entry<ns_component> * entry;
+	friend class ns_image_cache<ns_component>;
+};
+
+///ns_image_cache implements a local cache for images loaded from the central file server,
+///such as the static masks and region masks that are used repeatedly by many processing jobs.
 ///After an image is requested, ns_image_cache maintains a copy in memory for later use.
-///Maximum memory usage can be specified (images in memory run ~750Mb and a few of these can
-///exausts windows virtual memory default limits).  When the maximum memory usage is reached
-///images are swapped in and out out to the disk cache.
-///Disk swapping is done according to temporal priority--the most rececently accessed images are
-///least likely to be swapped out of memory.
+///
+///The cache can be used by any number of threads simultaneously.
+///Images are distributed between number_of_shards independently locked maps by id,
+///so that threads requesting different images rarely wait for each other.
+///If several threads request the same uncached image, it is loaded once and shared.
+///
+///get_for_read() returns a reference-counted handle rather than a copy of the image.
+///When the memory used exceeds the specified limit, unreferenced images are removed from memory
+///using the CLOCK approximation of least-recently-used eviction.
+///Evicted images are written to the local disk cache by a background thread, if there is room,
+///so that they can later be reloaded without going back to long term storage.
 template<class ns_component>
 class ns_image_cache{
 public:
-	ns_image_cache(ns_image_storage_handler * image_storage, const unsigned long & max_memory_usage_, const unsigned long & max_disk_usage_):
-	  disk_cached_cleared(false),storage(image_storage),max_memory_usage(max_memory_usage_),current_memory_usage(0),max_disk_usage(max_disk_usage_),current_disk_usage(0){}
-
+	enum{number_of_shards=16};
+	typedef ns_image_cache_read_handle<ns_component> read_handle;
+
+	//limits are specified in kilobytes
+	ns_image_cache(ns_image_storage_handler * image_storage, const unsigned long max_memory_usage_in_kb, const unsigned long max_disk_usage_in_kb=0):
+		storage(image_storage),max_memory_usage(((ns_64_bit)max_memory_usage_in_kb)*1024),max_disk_usage(((ns_64_bit)max_disk_usage_in_kb)*1024),
+		current_memory_usage(0),current_disk_usage(0),pending_spill_usage(0),
+		clock_shard(0),clock_position(0),clock_at_start_of_shard(true),spill_thread_running(false),
+		accounting_lock("ns_image_cache::accounting_lock"),spill_queue_lock("ns_image_cache::spill_queue_lock"),spill_thread_lock("ns_image_cache::spill_thread_lock"){}
+
+	~ns_image_cache(){
+		stop_spilling();
+		for (unsigned int i = 0; i < number_of_shards; i++){
+			for (typename ns_entry_map::iterator p = shards[i].entries.begin(); p != shards[i].entries.end(); p++)
+				delete p->second;
+			shards[i].entries.clear();
+		}
+	}
 
 	void set_memory_allocation_limit(const unsigned long & max){//in kilobytes
-		max_memory_usage = max;
+		ns_acquire_lock_for_scope lock(accounting_lock,__FILE__,__LINE__);
+		max_memory_usage = ((ns_64_bit)max)*1024;
+		lock.release();
+		make_room_in_memory();
 	}
 	void set_disk_usage_limit(const unsigned long & max){//in kilobytes
-		max_disk_usage = max;
-	}
-	void clear_memory_cache(){
-		ns_image_server_image im;
-		im.id = 0;
-		make_room_in_memory_for_new_image(im,max_memory_usage);
-	}
-	const ns_image_whole<ns_component> & get_for_read(ns_image_server_image & image, ns_sql & sql){
-		return get_image(image,sql,true);
+		ns_acquire_lock_for_scope lock(accounting_lock,__FILE__,__LINE__);
+		max_disk_usage = ((ns_64_bit)max)*1024;
+		lock.release();
 	}
 
-	ns_image_whole<ns_component> & get_for_write(ns_image_server_image & image, ns_sql & sql){
-		return get_image(image,sql,false);
+	read_handle get_for_read(ns_image_server_image & image, ns_sql & sql){
+		ns_image_cache_shard & shard(shard_for(image.id));
+		ns_acquire_lock_for_scope lock(shard.lock,__FILE__,__LINE__);
+		typename ns_entry_map::iterator p(shard.entries.find(image.id));
+		ns_image_cache_entry<ns_component> * entry;
+		if (p != shard.entries.end())
+			entry = p->second;
+		else{
+			entry = new ns_image_cache_entry<ns_component>(image.id);
+			shard.entries[image.id] = entry;
+		}
+		entry->reference_count++;
+		entry->recently_used = true;
+		lock.release();
+		//the handle now owns the reference and will release it if loading fails.
+		read_handle handle(this,entry);
+		load_into_memory(*entry,image,sql);
+		return handle;
 	}
 
-	void finished_writing(ns_image_server_image & image, ns_sql & sql){
-		typename cache_t::iterator p = images.find(image.id);
-		if (p == images.end() || p->second.do_not_cache_to_disk == false)
-			throw ns_ex("ns_image_cache::Specified image has not been checked out for writing.");
-		p->second.do_not_cache_to_disk = false;
+	///removes all unreferenced images from memory.  Copies written to the disk cache are kept.
+	void clear_memory_cache(){
+		ns_acquire_lock_for_scope lock(accounting_lock,__FILE__,__LINE__);
+		for (unsigned int i = 0; i < number_of_shards; i++){
+			ns_acquire_lock_for_scope shard_lock(shards[i].lock,__FILE__,__LINE__);
+			for (typename ns_entry_map::iterator p = shards[i].entries.begin(); p != shards[i].entries.end();){
+				ns_image_cache_entry<ns_component> & e(*p->second);
+				if (!e.in_memory || e.reference_count > 0 || e.spill_pending){
+					p++;
+					continue;
+				}
+				current_memory_usage-=e.size_in_memory;
+				if (e.size_on_disk != 0){
+					remove_from_memory(e);
+					p++;
+				}
+				else{
+					delete p->second;
+					shards[i].entries.erase(p++);
+				}
+			}
+			shard_lock.release();
+		}
+		lock.release();
 	}
+
+	///removes all unreferenced images from memory and from the disk cache.
 	void clear_cache(){
-		for (typename cache_t::iterator p = images.begin(); p != images.end();++p){
-			ns_storage_delete_from_local_cache(storage,p->second.filename_on_disk);
+		stop_spilling();
+		ns_acquire_lock_for_scope lock(accounting_lock,__FILE__,__LINE__);
+		current_memory_usage = 0;
+		for (unsigned int i = 0; i < number_of_shards; i++){
+			ns_acquire_lock_for_scope shard_lock(shards[i].lock,__FILE__,__LINE__);
+			for (typename ns_entry_map::iterator p = shards[i].entries.begin(); p != shards[i].entries.end();){
+				ns_image_cache_entry<ns_component> & e(*p->second);
+				//an image being written keeps its spill_pending flag until here, so the spill thread
+				//knows that its share of pending_spill_usage has already been removed.
+				if (e.spill_pending){
+					pending_spill_usage-=e.size_in_memory;
+					current_disk_usage-=e.size_in_memory;
+					e.spill_pending = false;
+				}
+				if (e.reference_count > 0){
+					if (e.in_memory)
+						current_memory_usage+=e.size_in_memory;
+					p++;
+					continue;
+				}
+				if (e.size_on_disk != 0)
+					remove_from_disk(e);
+				delete p->second;
+				shards[i].entries.erase(p++);
+			}
+			shard_lock.release();
 		}
-		//clear memory cache and all records
-		this->current_disk_usage = 0;
-		this->current_memory_usage = 0;
-		images.clear();
+		lock.release();
+	}
+
+	ns_64_bit memory_usage_in_bytes(){
+		ns_acquire_lock_for_scope lock(accounting_lock,__FILE__,__LINE__);
+		const ns_64_bit r(current_memory_usage);
+		lock.release();
+		return r;
 	}
 
 private:
-	bool disk_cached_cleared;
-	typedef std::map<unsigned long,ns_image_cache_object<ns_component> > cache_t;
-	cache_t images;
+	typedef std::map<ns_64_bit,ns_image_cache_entry<ns_component> *> ns_entry_map;
+	struct ns_image_cache_shard{
+		ns_image_cache_shard():lock("ns_image_cache::shard_lock"){}
+		ns_lock lock;
+		ns_entry_map entries;
+	};
+	ns_image_cache_shard shards[number_of_shards];
+	inline ns_image_cache_shard & shard_for(const ns_64_bit id){return shards[id%number_of_shards];}
+
 	ns_image_storage_handler * storage;
-	unsigned long max_memory_usage;
-	unsigned long max_disk_usage;
-	unsigned long current_memory_usage;
-	unsigned long current_disk_usage;
-
-	ns_image_whole<ns_component> & get_image(ns_image_server_image & image, ns_sql & sql, const bool read_only){
-		//check to see if we have this in the cache somewhere
-		typename cache_t::iterator p = images.find(image.id);
-		unsigned long image_size;
-
-		try{	
-			if (p != images.end()){
-				if (p->second.size_in_memory == 0){
-					//if the image has been cached to disk, load it back in
-					if (p->second.size_on_disk== 0)
-						throw ns_ex("ns_image_cache::An image appears to have been transfered to the disk cache, but data seems to have been written") << ns_cache;
-				
-						ns_image_storage_source_handle<ns_component> im(ns_storage_request_from_local_cache(storage,p->second.filename_on_disk));
-						const unsigned long im_s(ns_image_cache_object<ns_component>::image_uncompressed_size(im.input_stream().properties()));
-						make_room_in_memory_for_new_image(image,im_s);
-						//the previous operation might have scrambled our iterators, so we refind the correct one.
-						p = images.find(image.id);
-						if (p == images.end())
-							throw ns_ex("ns_image_cache::get_image()::The cache records were scrambled after memory cleanup!") << ns_cache;
-						p->second.size_in_memory = im_s;
-						im.input_stream().pump(p->second.image,512);
-						current_memory_usage+=p->second.size_in_memory;
-
-					}
-					p->second.last_access = ns_current_time();
-					//if the image can be modified, the copy of the image on disk is invalidated.
-					if (!read_only){
-						ns_storage_delete_from_local_cache(storage,p->second.filename_on_disk);
-						p->second.filename_on_disk.resize(0);
-						p->second.do_not_cache_to_disk = true;
-					}
-				return p->second.image;
-			}
 
-			//since we're here, we couldn't find the image in the cache.  First thing we do is to make room for it in memory.
-
-			//if the cache grows too large, transfer old images to disk.
-			//that has gone unused the longest
-			ns_image_storage_source_handle<ns_component> im(ns_storage_request_from_storage(storage,image,sql));
-			image_size = ns_image_cache_object<ns_component>::image_uncompressed_size(im.input_stream().properties());
-			ns_image_server_image imc;
-			imc.id = 0;
-			make_room_in_memory_for_new_image(imc,image_size);
-			im.clear();
-			
+	//the following are protected by accounting_lock,
+	//which is always acquired before (never while holding) any shard lock.
+	ns_64_bit max_memory_usage,
+			  max_disk_usage,
+			  current_memory_usage,
+			  current_disk_usage,
+			  pending_spill_usage; //memory that will be freed once queued images have been written to disk
+	unsigned long clock_shard;
+	ns_64_bit clock_position;
+	bool clock_at_start_of_shard;
+	ns_lock accounting_lock;
+
+	std::deque<ns_64_bit> spill_queue;
+	bool spill_thread_running;
+	ns_single_thread_coordinator spill_thread;
+	ns_lock spill_queue_lock;
+	//ns_single_thread_coordinator is not thread-safe, so spill_thread is only started or joined while holding spill_thread_lock,
+	//which is always acquired before (never while holding) spill_queue_lock.  The spill thread itself never acquires it.
+	ns_lock spill_thread_lock;
+
+	friend class ns_image_cache_read_handle<ns_component>;
+
+	void add_reference(ns_image_cache_entry<ns_component> * entry){
+		ns_image_cache_shard & shard(shard_for(entry->id));
+		ns_acquire_lock_for_scope lock(shard.lock,__FILE__,__LINE__);
+		entry->reference_count++;
+		lock.release();
+	}
+	void remove_reference(ns_image_cache_entry<ns_component> * entry){
+		ns_image_cache_shard & shard(shard_for(entry->id));
+		ns_acquire_lock_for_scope lock(shard.lock,__FILE__,__LINE__);
+		entry->reference_count--;
+		//discard records of images that could not be loaded
+		if (entry->reference_count == 0 && !entry->in_memory && entry->size_on_disk == 0){
+			shard.entries.erase(entry->id);
+			delete entry;
+		}
+		lock.release();
+	}
+
+	void remove_from_memory(ns_image_cache_entry<ns_component> & e){
+		e.image.use_more_memory_to_avoid_reallocations(false);
+		e.image.clear();
+		e.in_memory = false;
+	}
+	//The caller must hold accounting_lock and the entry's shard lock.
+	void remove_from_disk(ns_image_cache_entry<ns_component> & e){
+		ns_storage_delete_from_local_cache(storage,e.filename_on_disk);
+		current_disk_usage-=e.size_on_disk;
+		e.size_on_disk = 0;
+		e.filename_on_disk.clear();
+	}
+
+	//The caller must hold a reference to the entry, which guarentees it will not be evicted.
+	void load_into_memory(ns_image_cache_entry<ns_component> & entry, ns_image_server_image & image, ns_sql & sql){
+		ns_acquire_lock_for_scope load_lock(entry.load_lock,__FILE__,__LINE__);
+		if (entry.in_memory){
+			load_lock.release();
+			return;
+		}
+		try{
+			bool loaded(false);
+			if (entry.size_on_disk != 0){
+				try{
+					ns_image_storage_source_handle<ns_component> im(ns_storage_request_from_local_cache(storage,entry.filename_on_disk));
+					im.input_stream().pump(entry.image,1024);
+					loaded = true;
+				}
+				catch(ns_ex & ex){
+					//the disk cache copy is lost; fall back on long term storage.
+					#ifdef NS_VERBOSE_IMAGE_CACHE
+					std::cerr << "ns_image_cache::Could not reload " << entry.filename_on_disk << ": " << ex.text() << "\n";
+					#endif
+					ns_acquire_lock_for_scope lock(accounting_lock,__FILE__,__LINE__);
+					ns_image_cache_shard & shard(shard_for(entry.id));
+					ns_acquire_lock_for_scope shard_lock(shard.lock,__FILE__,__LINE__);
+					remove_from_disk(entry);
+					shard_lock.release();
+					lock.release();
+				}
+			}
+			if (!loaded){
+				ns_image_storage_source_handle<ns_component> im(ns_storage_request_from_storage(storage,image,sql));
+				im.input_stream().pump(entry.image,1024);
+			}
 		}
 		catch(ns_ex & ex){
+			load_lock.release();
 			//any error that happens here is likely due to cache problems, rather than any problem with the source file.  flag as such.
 			ns_ex ex2(ex);
 			ex2 << ns_cache;
 			throw ex2;
 		}
-
-		//now we create a cache entry and load the file to disk
-		std::pair<typename cache_t::iterator,bool> r = images.insert(typename cache_t::value_type(image.id,ns_image_cache_object<ns_component>()));
-		p = r.first;
-		try{
-			ns_image_storage_source_handle<ns_component> im(ns_storage_request_from_storage(storage,image,sql));
-			im.input_stream().pump(p->second.image,1024);
-		}
-		catch(...){
-			images.erase(p);
-			throw;
-		}
-		p->second.last_access = ns_current_time();
-		p->second.size_in_memory = image_size;
-		current_memory_usage+=image_size;
-		if (!read_only)
-			p->second.do_not_cache_to_disk = true;
-		return p->second.image;
+		const ns_64_bit size(ns_image_cache_entry<ns_component>::image_size_in_bytes(entry.image.properties()));
+		ns_image_cache_shard & shard(shard_for(entry.id));
+		ns_acquire_lock_for_scope shard_lock(shard.lock,__FILE__,__LINE__);
+		entry.size_in_memory = size;
+		entry.in_memory = true;
+		shard_lock.release();
+		load_lock.release();
+
+		ns_acquire_lock_for_scope lock(accounting_lock,__FILE__,__LINE__);
+		current_memory_usage+=size;
+		#ifdef NS_VERBOSE_IMAGE_CACHE
+		std::cerr << "Loaded image " << entry.id << " of size " << size/1024 << "kb into the cache.  Cache status is currently "<< current_memory_usage/1024 << "/" << max_memory_usage/1024 << "kb\n";
+		#endif
+		lock.release();
+		make_room_in_memory();
 	}
 
-	
-	//invalidates all references to the cache
-	void make_room_in_memory_for_new_image(const ns_image_server_image & im, const unsigned long new_image_memory_req){
-
+	inline bool memory_limit_exceeded() const{
+		return current_memory_usage > max_memory_usage + pending_spill_usage;
+	}
 
-		while(current_memory_usage + new_image_memory_req > max_memory_usage){
-			
-			#ifdef NS_VERBOSE_IMAGE_CACHE
-			std::cerr << "Memory cache exceeded.  Moving files to disk\n";
-			#endif
-			if (images.size() == 0)
-				throw ns_ex("ns_image_cache::Cache size exceeded on an empty cache");
-			typename cache_t::iterator oldest_in_memory = images.end();
-			unsigned int num_locked = 0;
-			for (typename cache_t::iterator p = images.begin(); p != images.end(); p++){
-				if (p->first == im.id)
+	//Sweeps the clock hand across all the shards' images, evicting unreferenced images
+	//until memory usage falls below the limit.
+	//Once an image has been discarded for lack of disk space, unreferenced copies
+	//that exist only on disk are removed as the hand passes them, to make room for later spills.
+	//If every image in memory is referenced, we roll with it and allow the memory cache to get too large.
+	void make_room_in_memory(){
+		ns_acquire_lock_for_scope lock(accounting_lock,__FILE__,__LINE__);
+		bool queued_spill(false),
+			 disk_full(false);
+		//two full rotations are enough to clear every reference bit and then find any unreferenced image.
+		for (unsigned int shards_visited = 0; shards_visited <= 2*number_of_shards && memory_limit_exceeded(); ){
+			ns_image_cache_shard & shard(shards[clock_shard]);
+			ns_acquire_lock_for_scope shard_lock(shard.lock,__FILE__,__LINE__);
+			typename ns_entry_map::iterator p(clock_at_start_of_shard?shard.entries.begin():shard.entries.upper_bound(clock_position));
+			while (p != shard.entries.end() && memory_limit_exceeded()){
+				ns_image_cache_entry<ns_component> & e(*p->second);
+				clock_position = p->first;
+				clock_at_start_of_shard = false;
+				if (disk_full && !e.in_memory && e.size_on_disk != 0 && e.reference_count == 0 && !e.spill_pending){
+					remove_from_disk(e);
+					delete p->second;
+					shard.entries.erase(p++);
 					continue;
-				if (p->second.size_in_memory == 0 )
-					continue; //this image is already cached on disk
-				if (p->second.do_not_cache_to_disk){
-					num_locked++;
+				}
+				if (!e.in_memory || e.spill_pending || e.reference_count > 0){
+					p++;
+					continue;
+				}
+				if (e.recently_used){
+					e.recently_used = false;
+					p++;
 					continue;
 				}
-				if(oldest_in_memory == images.end() || p->second.last_access <= oldest_in_memory->second.last_access)
-					oldest_in_memory = p;
+				if (e.size_on_disk != 0){
+					//the image is read-only, so the copy on disk is still valid.
+					current_memory_usage-=e.size_in_memory;
+					remove_from_memory(e);
+					p++;
+				}
+				else if (current_disk_usage + e.size_in_memory <= max_disk_usage){
+					e.spill_pending = true;
+					pending_spill_usage+=e.size_in_memory;
+					current_disk_usage+=e.size_in_memory;
+					ns_acquire_lock_for_scope queue_lock(spill_queue_lock,__FILE__,__LINE__);
+					spill_queue.push_back(e.id);
+					queue_lock.release();
+					queued_spill = true;
+					p++;
+				}
+				else{
+					#ifdef NS_VERBOSE_IMAGE_CACHE
+					std::cerr << "Discarding image " << e.id << " of size " << e.size_in_memory/1024 << "kb from the cache\n";
+					#endif
+					current_memory_usage-=e.size_in_memory;
+					delete p->second;
+					shard.entries.erase(p++);
+					disk_full = true;
+				}
 			}
-		
-			if (oldest_in_memory == images.end()){
-				//memory is full.  We roll with it and allow the memory cache to get too large
-				return;
+			if (p == shard.entries.end()){
+				clock_shard = (clock_shard+1)%number_of_shards;
+				clock_at_start_of_shard = true;
+				shards_visited++;
 			}
-		
-			write_image_to_disk(oldest_in_memory,im);
-				
+			shard_lock.release();
 		}
-		return;
+		lock.release();
+		if (queued_spill)
+			start_spilling();
 	}
 
-	//invalidates all pointers to the image map!
-	void write_image_to_disk(typename cache_t::iterator & subject,const ns_image_server_image & image_not_to_delete){
-		const unsigned long new_disk_req(subject->second.size_in_memory);
-		bool can_write_to_disk(true);
-
-		//if the job has already been done, we're golden!
-		if (subject->second.size_on_disk > 0){
-			#ifdef NS_VERBOSE_IMAGE_CACHE
-			std::cerr << "Image has already been transferred to disk.\n";
-			#endif
-			subject->second.image.resize(ns_image_properties(0,0,0));
-			current_memory_usage-=subject->second.size_in_memory;
-			subject->second.size_in_memory = 0;
+	void start_spilling(){
+		ns_acquire_lock_for_scope thread_lock(spill_thread_lock,__FILE__,__LINE__);
+		ns_acquire_lock_for_scope queue_lock(spill_queue_lock,__FILE__,__LINE__);
+		if (spill_thread_running || spill_queue.empty()){
+			queue_lock.release();
+			thread_lock.release();
 			return;
-
 		}
+		spill_thread_running = true;
+		queue_lock.release();
+		//joins the previous spill thread, which may still be exiting, before starting a new one
+		spill_thread.run(run_spill_thread,this);
+		thread_lock.release();
+	}
+	//abandons any queued spills and waits for the current one to finish
+	void stop_spilling(){
+		ns_acquire_lock_for_scope thread_lock(spill_thread_lock,__FILE__,__LINE__);
+		ns_acquire_lock_for_scope queue_lock(spill_queue_lock,__FILE__,__LINE__);
+		spill_queue.clear();
+		queue_lock.release();
+		spill_thread.block_on_finish();
+		thread_lock.release();
+	}
 
-		//start deleting files from disk until there is space for the current one
-		while(current_disk_usage + new_disk_req > max_disk_usage){
-			
-			#ifdef NS_VERBOSE_IMAGE_CACHE
-			std::cerr << "Disk cache size exceeded.  Cleaning up...\n";
-			#endif
-			if (images.size() == 0)
-				throw ns_ex("ns_image_cache::write_image_to_disk()::Disk cache size exceeded on an empty cache");
-
-			//identify the oldest image written to disk
-			typename cache_t::iterator oldest_on_disk = images.end();
-			unsigned int num_locked = 0;
-			for (typename cache_t::iterator p = images.begin(); p != images.end(); p++){
-				if (p->first == image_not_to_delete.id) continue; //don't delete image if it will be needed (ie if it is the one we're transferring into memory)
-				if (p->second.size_on_disk == 0) continue; //nothing to be gained by deleting this one from disk
-				if (p == subject) continue; //this image is the one we're trying to write to disk!
-				if(oldest_on_disk == images.end() || p->second.last_access <= oldest_on_disk->second.last_access)
-					oldest_on_disk = p;
+	static ns_thread_return_type run_spill_thread(void * cache){
+		ns_image_cache<ns_component> * c(static_cast<ns_image_cache<ns_component> *>(cache));
+		while(true){
+			ns_acquire_lock_for_scope queue_lock(c->spill_queue_lock,__FILE__,__LINE__);
+			if (c->spill_queue.empty()){
+				c->spill_thread_running = false;
+				c->spill_thread.report_as_finished();
+				queue_lock.release();
+				return 0;
 			}
-			if (oldest_on_disk == images.end())
-				break;
+			const ns_64_bit id(c->spill_queue.front());
+			c->spill_queue.pop_front();
+			queue_lock.release();
+			c->spill_to_disk(id);
+		}
+	}
 
-			//delete the image
-			
-			#ifdef NS_VERBOSE_IMAGE_CACHE
-			std::cerr << "Deleting file " << oldest_on_disk->second.filename_on_disk << "\n";
-			#endif
-			ns_storage_delete_from_local_cache(storage,oldest_on_disk->second.filename_on_disk);
-			current_disk_usage-=oldest_on_disk->second.size_on_disk;
-			oldest_on_disk->second.size_on_disk = 0;
-			oldest_on_disk->second.to_erase = true;
+	void spill_to_disk(const ns_64_bit id){
+		ns_image_cache_shard & shard(shard_for(id));
+		ns_acquire_lock_for_scope shard_lock(shard.lock,__FILE__,__LINE__);
+		typename ns_entry_map::iterator p(shard.entries.find(id));
+		if (p == shard.entries.end() || !p->second->spill_pending){
+			shard_lock.release();
+			return;
 		}
-				
-		
-		//now write the subject to disk
-		if (subject->second.filename_on_disk.size() == 0)
-			subject->second.filename_on_disk = "image_cache=" + ns_to_string(subject->second.last_access) + "=" + ns_to_string(ns_current_time()) + "=" + ns_to_string(subject->first) + ".tif";
-		
-		#ifdef NS_VERBOSE_IMAGE_CACHE
-		std::cerr << "Caching file to disk:" << subject->second.filename_on_disk << "\n";
-		#endif
-		try{	
-			ns_image_storage_reciever_handle<ns_component> r( ns_storage_request_local_cache_storage(storage,subject->second.filename_on_disk,512,false));
-			subject->second.image.pump(r.output_stream(),512);
+		ns_image_cache_entry<ns_component> & e(*p->second);
+		//hold a reference so the image isn't removed while it is being written
+		e.reference_count++;
+		const ns_64_bit size(e.size_in_memory);
+		//the process id keeps nodes that share a cache directory from overwriting each other's files
+		const std::string filename("image_cache=" + ns_to_string(ns_thread::ns_get_process_id()) + "=" + ns_to_string(ns_current_time()) + "=" + ns_to_string(id) + ".tif");
+		shard_lock.release();
+
+		bool written(false);
+		try{
+			ns_image_storage_reciever_handle<ns_component> r(ns_storage_request_local_cache_storage(storage,filename,1024,false));
+			e.image.pump(r.output_stream(),1024);
+			written = true;
 		}
 		catch(ns_ex & ex){
-			ns_ex ex3("Cache problems: ");
-			ex3 << ex.text() << ns_cache;
-			ns_full_drive_cache_panic(ex3);
-			throw ex3;
+			//the image simply stays in memory until it can be discarded.
+			#ifdef NS_VERBOSE_IMAGE_CACHE
+			std::cerr << "ns_image_cache::Could not write image " << id << " to the disk cache: " << ex.text() << "\n";
+			#endif
 		}
-		subject->second.size_on_disk=subject->second.size_in_memory;
-		current_disk_usage+=subject->second.size_in_memory;
 
-		subject->second.image.resize(ns_image_properties(0,0,0));
-		current_memory_usage-=subject->second.size_in_memory;
-		subject->second.size_in_memory = 0;
-
-		//now go through and delete everything that needs to be deleted.
-		bool deleted_something(true);
-		#ifdef NS_VERBOSE_IMAGE_CACHE
-		std::cerr << "Commiting pending image cache deletions:\n";
-		#endif
-		while(deleted_something){
-			deleted_something = false;
-			for (typename cache_t::iterator p = images.begin(); p != images.end(); p++){
-				if (p->second.to_erase){
-					
-					#ifdef NS_VERBOSE_IMAGE_CACHE
-					std::cerr << "Deleting record for " << p->second.filename_on_disk << "\n";
-					#endif
-					images.erase(p);
-					deleted_something = true;
-					break;
+		ns_acquire_lock_for_scope lock(accounting_lock,__FILE__,__LINE__);
+		shard_lock.get(__FILE__,__LINE__);
+		e.reference_count--;
+		if (e.spill_pending){	//otherwise, the cache was cleared while we were writing and has already discounted the image
+			pending_spill_usage-=size;
+			e.spill_pending = false;
+			if (written){
+				e.filename_on_disk = filename;
+				e.size_on_disk = size;
+			}
+			else current_disk_usage-=size;
+			//images requested while we were writing stay in memory
+			if (e.reference_count == 0 && !e.recently_used){
+				current_memory_usage-=size;
+				if (written)
+					remove_from_memory(e);
+				else{
+					shard.entries.erase(id);
+					delete &e;
 				}
 			}
 		}
+		else if (written)
+			ns_storage_delete_from_local_cache(storage,filename);
+		shard_lock.release();
+		lock.release();
 	}
 };
 
@@ -5,6 +5,7 @@
 #include <ctime>
 #include "ns_high_precision_timer.h"
 #include "ns_process_16_bit_images.h"
+#include "ns_image_processing_pipeline.h"
 
 using namespace std;
 void ns_image_capture_data_manager::initialize_capture_start(ns_image_capture_specification & capture_specification, ns_local_buffer_connection & sql){
@@ -93,15 +94,94 @@ void ns_image_capture_data_manager::register_capture_stop(ns_image_capture_speci
 	}
 }
 
+//the sample image is no longer stored once it has been split into its regions
+void ns_remove_captured_image_record(ns_image_server_captured_image & image, ns_sql & sql){
+	sql << "UPDATE captured_images SET image_id = 0 WHERE id = " << image.captured_images_id;
+	sql.send_query();
+	sql << "DELETE FROM images WHERE id = " << image.capture_images_image_id;
+	sql.send_query();
+}
+
+///Records the chunks of a captured image that have been verified in long term storage, so that an interrupted transfer can be resumed.
+///Chunks are recorded on their own connection, so they are kept even if the rest of the transfer is rolled back.
+class ns_captured_image_transfer_log : public ns_chunked_file_transfer_log{
+public:
+	ns_captured_image_transfer_log(const ns_64_bit image_id_):image_id(image_id_){}
+	void load(std::vector<ns_file_transfer_chunk> & chunks, ns_sql & sql){
+		sql << "SELECT chunk, chunk_size, file_size, checksum FROM image_transfer_chunks WHERE image_id = " << image_id;
+		ns_sql_result res;
+		sql.get_rows(res);
+		chunks.resize(res.size());
+		for (unsigned int i = 0; i < res.size(); i++){
+			chunks[i].chunk = atol(res[i][0].c_str());
+			chunks[i].chunk_size = atol(res[i][1].c_str());
+			chunks[i].file_size = ns_atoi64(res[i][2].c_str());
+			chunks[i].checksum = (unsigned int)ns_atoi64(res[i][3].c_str());
+		}
+	}
+	void record_verified_chunks(const std::vector<ns_file_transfer_chunk> & chunks){
+		if (log_sql.is_null())
+			log_sql.attach(image_server.new_sql_connection(__FILE__,__LINE__));
+		log_sql() << "INSERT INTO image_transfer_chunks (image_id, chunk, chunk_size, file_size, checksum) VALUES ";
+		for (unsigned int i = 0; i < chunks.size(); i++){
+			if (i != 0)
+				log_sql() << ",";
+			log_sql() << "(" << image_id << "," << chunks[i].chunk << "," << chunks[i].chunk_size << "," << chunks[i].file_size << "," << chunks[i].checksum << ")";
+		}
+		log_sql() << " ON DUPLICATE KEY UPDATE chunk_size=VALUES(chunk_size), file_size=VALUES(file_size), checksum=VALUES(checksum)";
+		log_sql().send_query();
+	}
+	//once the file is in place, its chunks no longer need to be tracked
+	void clear(ns_sql & sql){
+		sql << "DELETE FROM image_transfer_chunks WHERE image_id = " << image_id;
+		sql.send_query();
+	}
+private:
+	ns_64_bit image_id;
+	ns_acquire_for_scope<ns_sql> log_sql;
+};
+
 bool ns_image_capture_data_manager::transfer_data_to_long_term_storage(ns_image_server_captured_image & image,
 									ns_64_bit & time_during_transfer_to_long_term_storage,
 									ns_64_bit & time_during_deletion_from_local_storage,
+									std::vector<ns_image_server_captured_image_region> & output_regions,
 									ns_sql & sql){
 	if (image.capture_images_image_id == 0)
 		throw ns_ex("transfer_data_to_long_term_storage() was passed an image with no captured image image id");
 	if (image.captured_images_id == 0)
 		throw ns_ex("transfer_data_to_long_term_storage() was passed an image with no captured image id");
 	bool had_to_use_local_storage(false);
+	output_regions.resize(0);
+
+	//If requested, captured images are split into their regions as they are transferred, so that the sample image does not need
+	//to be written to long term storage and then read back again to be masked.  The sample image is then stored only as a compressed copy,
+	//or not at all if the experiment deletes captured images after masking.
+	//Samples that require vertical registration are masked later, as their registration cannot be calculated until the whole image has been read.
+	ns_captured_image_region_splitter mask_regions(1024);
+	ns_mask_application mask_application;
+	const bool split_into_regions(image_server.get_cluster_constant_value("stream_captured_images_to_regions","0",&sql) != "0" &&
+								  mask_regions.load_mask_application(image,mask_application,sql) &&
+								  !mask_application.apply_vertical_image_registration);
+	const bool store_sample_image(!split_into_regions || !mask_application.delete_captured_image);
+	const ns_image_type sample_image_type(split_into_regions?ns_tiff_zip:ns_tiff);
+	//the sample image is never written to long term storage, so it does not need to be deleted from there
+	mask_application.delete_captured_image = false;
+
+	//The sample image is encoded into volatile storage and then copied to long term storage in chunks, several at a time.
+	//Each chunk is checked after it is written and recorded in the db, so that if the file server becomes unavailable
+	//during the copy, the next attempt only needs to copy the chunks that did not arrive.
+	std::string staged_filename(std::string("transfer_") + ns_to_string(image.captured_images_id));
+	ns_add_image_suffix(staged_filename,sample_image_type);
+	ns_chunked_file_transfer transfer(1024*atol(image_server.get_cluster_constant_value("long_term_storage_transfer_chunk_size_in_kb","4096",&sql).c_str()),
+									  atol(image_server.get_cluster_constant_value("long_term_storage_transfer_threads","4",&sql).c_str()));
+	ns_captured_image_transfer_log transfer_log(image.capture_images_image_id);
+	std::vector<ns_file_transfer_chunk> previously_verified_chunks;
+	if (store_sample_image)
+		transfer_log.load(previously_verified_chunks,sql);
+	//If the sample image is not stored, it is discarded only once its regions have been recorded, so that it is never lost if masking fails.
+	//After that point the regions are the only copy of the image, and must never be removed.
+	bool regions_finished(false);
+
 	if (image.specified_16_bit){
 		try{
 			sql.send_query("COMMIT");
@@ -109,7 +189,16 @@ bool ns_image_capture_data_manager::transfer_data_to_long_term_storage(ns_image_
 			ns_image_storage_source_handle<ns_16_bit> high_depth(storage_handler->request_from_storage_n_bits<ns_16_bit>(image,&sql,ns_image_storage_handler::ns_volatile_storage));
 			image.specified_16_bit = false;
 			
-			ns_image_storage_reciever_handle<ns_8_bit> low_depth(storage_handler->request_storage_ci(image,ns_tiff,1024,&sql,had_to_use_local_storage,true));
+			ns_image_stream_fan_out<ns_8_bit> low_depth_outputs(1024);
+			ns_image_storage_reciever_handle<ns_8_bit> low_depth(0);
+			if (store_sample_image){
+				low_depth = storage_handler->request_volatile_storage<ns_8_bit>(staged_filename,1024,false,sample_image_type);
+				low_depth_outputs.add_output(low_depth.output_stream());
+			}
+			if (split_into_regions){
+				mask_regions.prepare_region_outputs(image,output_regions,mask_application,ns_vector_2i(0,0),sql);
+				low_depth_outputs.add_output(mask_regions.region_splitter());
+			}
 			ns_image_server_image small_image(image.make_small_image_storage(&sql));
 
 			bool had_to_use_local_storage_2;
@@ -121,7 +210,7 @@ bool ns_image_capture_data_manager::transfer_data_to_long_term_storage(ns_image_
 			processor.set_crop_value(200);
 			
 			ns_image_stream_binding< ns_image_process_16_bit<ns_features_are_light, ns_image_stream_static_offset_buffer<ns_16_bit> >,
-									 ns_image_storage_reciever<ns_8_bit> > binding(processor,low_depth.output_stream(),1024);
+									 ns_image_stream_fan_out<ns_8_bit> > binding(processor,low_depth_outputs,1024);
 			
 		//	cerr << "Attempting to write to 8 bit copy...\n";
 			ns_high_precision_timer hptimer;
@@ -129,17 +218,24 @@ bool ns_image_capture_data_manager::transfer_data_to_long_term_storage(ns_image_
 			//cerr << "pump\n";
 			high_depth.input_stream().pump(binding,1024);
 		//	cerr << "done\n";
+			if (store_sample_image){
+				low_depth.clear();
+				//regions cannot be split from a sample image that has been left in volatile storage
+				storage_handler->transfer_volatile_file_to_storage_ci(staged_filename,image,sample_image_type,transfer,previously_verified_chunks,transfer_log,&sql,had_to_use_local_storage,!split_into_regions);
+				transfer_log.clear(sql);
+			}
 			time_during_transfer_to_long_term_storage = hptimer.stop();
-			image.specified_16_bit = true;
-			hptimer.start();
-		//	cerr << "Delete";
-			storage_handler->delete_from_storage(image,ns_delete_volatile,&sql);
-			time_during_deletion_from_local_storage = hptimer.stop();
-			image.specified_16_bit = false;
-			string partition = storage_handler->get_partition_for_experiment(image.experiment_id,&sql);
-		//	cerr << "Commit\n";
-			
-			image.update_captured_image_image_info(partition,ns_tiff,&sql);
+			if (store_sample_image){
+				image.specified_16_bit = true;
+				hptimer.start();
+			//	cerr << "Delete";
+				storage_handler->delete_from_storage(image,ns_delete_volatile,&sql);
+				time_during_deletion_from_local_storage = hptimer.stop();
+				image.specified_16_bit = false;
+				string partition = storage_handler->get_partition_for_experiment(image.experiment_id,&sql);
+			//	cerr << "Commit\n";
+				image.update_captured_image_image_info(partition,sample_image_type,&sql);
+			}
 			small_image.save_to_db(0,&sql);
 			image.capture_images_small_image_id = small_image.id;
 			sql.send_query("COMMIT");
@@ -163,9 +259,19 @@ bool ns_image_capture_data_manager::transfer_data_to_long_term_storage(ns_image_
 
 			}
 			sql.send_query("COMMIT");
-
-
-
+			if (split_into_regions){
+				mask_regions.finish_applying_mask(image,output_regions,mask_application,sql);
+				regions_finished = true;
+			}
+			if (!store_sample_image){
+				image.specified_16_bit = true;
+				hptimer.start();
+				storage_handler->delete_from_storage(image,ns_delete_volatile,&sql);
+				time_during_deletion_from_local_storage = hptimer.stop();
+				image.specified_16_bit = false;
+				ns_remove_captured_image_record(image,sql);
+				sql.send_query("COMMIT");
+			}
 			
 			if (had_to_use_local_storage_2 != had_to_use_local_storage){
 				image_server.register_server_event(
@@ -176,8 +282,11 @@ bool ns_image_capture_data_manager::transfer_data_to_long_term_storage(ns_image_
 		}
 		catch(ns_ex  ex){
 			image.specified_16_bit = true;
-			if (ex.type() != ns_sql_fatal)
+			if (ex.type() != ns_sql_fatal){
 				sql.send_query("ROLLBACK");
+				if (!output_regions.empty() && !regions_finished)
+					mask_regions.remove_region_images(output_regions,sql);
+			}
 			cerr << "File conversion exception(1) found: " << ex.text() << "\n";
 			ns_ex file_conversion_ex(ex);
 			file_conversion_ex << ns_file_io;
@@ -187,6 +296,8 @@ bool ns_image_capture_data_manager::transfer_data_to_long_term_storage(ns_image_
 			cerr << "File conversion exception(2) found: " << e.what() << "\n";
 			image.specified_16_bit = true;
 			sql.send_query("ROLLBACK");
+			if (!output_regions.empty() && !regions_finished)
+				mask_regions.remove_region_images(output_regions,sql);
 			throw ns_ex(e);
 
 		}
@@ -194,6 +305,8 @@ bool ns_image_capture_data_manager::transfer_data_to_long_term_storage(ns_image_
 			cerr << "File conversion exception(3) found (Uknown)\n";
 			image.specified_16_bit = true;
 			sql.send_query("ROLLBACK");
+			if (!output_regions.empty() && !regions_finished)
+				mask_regions.remove_region_images(output_regions,sql);
 			throw;
 		}
 	}
@@ -205,18 +318,53 @@ bool ns_image_capture_data_manager::transfer_data_to_long_term_storage(ns_image_
 
 		ns_image_storage_source_handle<ns_8_bit> in(storage_handler->request_from_storage(image,&sql));
 		try{
-			ns_image_storage_reciever_handle<ns_8_bit> out(storage_handler->request_storage_ci(image,ns_tiff,1024,&sql,had_to_use_local_storage,false));
-		
-			if (had_to_use_local_storage)
-				return had_to_use_local_storage;
-			in.input_stream().pump(out.output_stream(),1024);
-			storage_handler->delete_from_storage(image,ns_delete_volatile,&sql);
-			string partition = storage_handler->get_partition_for_experiment(image.experiment_id,&sql);
-			image.update_captured_image_image_info(partition,ns_tiff,&sql);
-			sql.send_query("COMMIT");
+			ns_image_storage_reciever_handle<ns_8_bit> out(0);
+			if (store_sample_image)
+				out = storage_handler->request_volatile_storage<ns_8_bit>(staged_filename,1024,false,sample_image_type);
+			if (!split_into_regions)
+				in.input_stream().pump(out.output_stream(),1024);
+			else{
+				ns_image_stream_fan_out<ns_8_bit> sample_outputs(1024);
+				if (store_sample_image)
+					sample_outputs.add_output(out.output_stream());
+				mask_regions.prepare_region_outputs(image,output_regions,mask_application,ns_vector_2i(0,0),sql);
+				sample_outputs.add_output(mask_regions.region_splitter());
+				//8 bit captures do not otherwise get a small image until they are masked
+				ns_acquire_for_scope<ns_sample_image_thumbnail> thumbnail;
+				if (image.capture_images_small_image_id == 0){
+					thumbnail.attach(new ns_sample_image_thumbnail(image,1024,sql));
+					sample_outputs.add_output(thumbnail().input());
+				}
+				in.input_stream().pump(sample_outputs,1024);
+				if (!thumbnail.is_null())
+					thumbnail().save(image,sql);
+			}
+			if (store_sample_image){
+				out.clear();
+				storage_handler->transfer_volatile_file_to_storage_ci(staged_filename,image,sample_image_type,transfer,previously_verified_chunks,transfer_log,&sql,had_to_use_local_storage,false);
+				transfer_log.clear(sql);
+				storage_handler->delete_from_storage(image,ns_delete_volatile,&sql);
+				string partition = storage_handler->get_partition_for_experiment(image.experiment_id,&sql);
+				image.update_captured_image_image_info(partition,sample_image_type,&sql);
+				sql.send_query("COMMIT");
+			}
+			if (split_into_regions){
+				mask_regions.finish_applying_mask(image,output_regions,mask_application,sql);
+				regions_finished = true;
+			}
+			if (!store_sample_image){
+				storage_handler->delete_from_storage(image,ns_delete_volatile,&sql);
+				ns_remove_captured_image_record(image,sql);
+				sql.send_query("COMMIT");
+			}
 		}
 		catch(ns_ex & ex){
 			cerr << "\nCould not move 8 bit copy because : " << ex.text() << "\n";
+			if (!output_regions.empty() && !regions_finished){
+				sql.clear_query();
+				mask_regions.remove_region_images(output_regions,sql);
+				output_regions.resize(0);
+			}
 			throw;
 		}
 
@@ -286,7 +434,8 @@ void ns_image_capture_data_manager::transfer_image_to_long_term_storage_locked(n
 	ns_64_bit time_during_deletion_from_local_storage;
 
 	bool had_to_use_local_storage;
-	had_to_use_local_storage = transfer_data_to_long_term_storage(image,time_during_transfer_to_long_term_storage,time_during_deletion_from_local_storage,sql);
+	std::vector<ns_image_server_captured_image_region> output_regions;
+	had_to_use_local_storage = transfer_data_to_long_term_storage(image,time_during_transfer_to_long_term_storage,time_during_deletion_from_local_storage,output_regions,sql);
 	
 	transfer_status = ns_transferred_to_long_term_storage;
 	if (had_to_use_local_storage)
@@ -334,7 +483,10 @@ void ns_image_capture_data_manager::transfer_image_to_long_term_storage_locked(n
 			//report new image to database (as it might be ready for processing)
 			ns_image_server_push_job_scheduler job_scheduler;
 
-			job_scheduler.report_capture_sample_image(vector<ns_image_server_captured_image>(1,image),sql);
+			//images split into regions during their transfer are ready for region processing
+			if (!output_regions.empty())
+				job_scheduler.report_sample_region_image(output_regions,sql);
+			else job_scheduler.report_capture_sample_image(vector<ns_image_server_captured_image>(1,image),sql);
 		}
 		catch(ns_ex & ex){
 			image_server.register_server_event(ns_image_server_event("Problem encountered reporting possible jobs resulting from the current capture: ") << ex.text() << "\n",&sql);
@@ -397,6 +549,20 @@ ns_thread_return_type ns_image_capture_data_manager::thread_start_handle_pending
 	}
 	
 
+	//interrupted transfers are rare, so there is no need to look for abandoned ones often
+	if (ns_current_time() > arg->capture_data_manager->time_of_last_abandoned_transfer_cleanup + 60*60 &&
+		arg->capture_data_manager->storage_handler->test_connection_to_long_term_storage(false)){
+		try{
+			ns_acquire_for_scope<ns_sql> sql(image_server.new_sql_connection(__FILE__,__LINE__));
+			arg->capture_data_manager->clean_up_abandoned_transfers(sql());
+			sql.release();
+		}
+		catch(ns_ex & ex){
+			cerr << "\nns_image_capture_data_manager::thread_start_handle_pending_transfers_to_long_term_storage()::Could not clean up abandoned transfers: " << ex.text() << "\n";
+		}
+		arg->capture_data_manager->time_of_last_abandoned_transfer_cleanup = ns_current_time();
+	}
+
 	//ns_acquire_lock_for_scope pending_transfers_lock(arg->capture_data_manager->pending_transfers_lock,__FILE__,__LINE__);
 	arg->capture_data_manager->pending_transfers_thread.report_as_finished();
 	//pending_transfers_lock.release();
@@ -406,6 +572,36 @@ ns_thread_return_type ns_image_capture_data_manager::thread_start_handle_pending
 }
 
 
+void ns_image_capture_data_manager::clean_up_abandoned_transfers(ns_sql & sql){
+	//A capture's transfer is abandoned once it is no longer waiting to be transferred: its captured image or capture schedule entry
+	//has been deleted, or it has since reached long term storage by another route.
+	sql << "SELECT DISTINCT t.image_id, c.id FROM image_transfer_chunks as t "
+		   "LEFT JOIN captured_images as c ON c.image_id = t.image_id "
+		   "LEFT JOIN capture_schedule as s ON s.captured_image_id = c.id "
+		   "AND (s.transferred_to_long_term_storage = " << (int)ns_on_local_server_in_16bit << " || s.transferred_to_long_term_storage = " << (int)ns_on_local_server_in_8bit << ") "
+		   "WHERE s.id IS NULL";
+	ns_sql_result res;
+	sql.get_rows(res);
+	for (unsigned int i = 0; i < res.size(); i++){
+		//without its captured image record the partial file cannot be located, but its chunks are still removed from the db.
+		const ns_64_bit captured_images_id(ns_atoi64(res[i][1].c_str()));
+		if (captured_images_id != 0){
+			try{
+				ns_image_server_captured_image im;
+				im.load_from_db(captured_images_id,&sql);
+				storage_handler->delete_partial_transfer_ci(im,&sql);
+			}
+			catch(ns_ex & ex){
+				image_server.register_server_event(ns_image_server_event("Could not remove the partial transfer of captured image ") << captured_images_id << ": " << ex.text(),&sql);
+			}
+		}
+		sql << "DELETE FROM image_transfer_chunks WHERE image_id = " << res[i][0];
+		sql.send_query();
+	}
+	if (!res.empty())
+		image_server.register_server_event(ns_image_server_event("Cleaned up ") << res.size() << " abandoned transfers to long term storage",&sql);
+}
+
 unsigned long ns_image_capture_data_manager::handle_pending_transfers(const string & device_name){
 	
 	if (!storage_handler->test_connection_to_long_term_storage(true))
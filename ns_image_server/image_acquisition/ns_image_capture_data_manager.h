@@ -46,7 +46,7 @@ class ns_image_capture_data_manager{
 public:
 	typedef enum{ns_not_finished,ns_on_local_server_in_16bit,ns_on_local_server_in_8bit,ns_transferred_to_long_term_storage} ns_capture_image_status;
 
-	ns_image_capture_data_manager(ns_image_storage_handler & storage_handler_):check_sql_lock("icdm::sql"),check_sql(0),device_transfer_state_lock("icdm::dev"),storage_handler(&storage_handler_),pending_transfers_lock("ns_icd::transfer"){}
+	ns_image_capture_data_manager(ns_image_storage_handler & storage_handler_):check_sql_lock("icdm::sql"),check_sql(0),device_transfer_state_lock("icdm::dev"),storage_handler(&storage_handler_),pending_transfers_lock("ns_icd::transfer"),time_of_last_abandoned_transfer_cleanup(0){}
 	
 	void initialize_capture_start(ns_image_capture_specification & capture_specification, ns_local_buffer_connection & local_buffer_sql);
 
@@ -72,9 +72,14 @@ private:
 
 	unsigned long handle_pending_transfers(const std::string & device_name);
 
+	//removes the partial files and recorded chunks of interrupted transfers whose captures are no longer waiting to be transferred
+	void clean_up_abandoned_transfers(ns_sql & sql);
+	unsigned long time_of_last_abandoned_transfer_cleanup;
+
 	bool transfer_data_to_long_term_storage(ns_image_server_captured_image & image,
 									unsigned long long & time_during_transfer_to_long_term_storage,
 									unsigned long long & time_during_deletion_from_local_storage,
+									std::vector<ns_image_server_captured_image_region> & output_regions,
 									ns_sql & sql);
 
 	ns_single_thread_coordinator pending_transfers_thread;
@@ -377,6 +377,15 @@ void ns_image_server_dispatcher::clear_for_termination(){
 	ns_safe_delete(delayed_exception);
 	
 	ns_acquire_lock_for_scope work_lock(work_sql_management_lock,__FILE__,__LINE__);
+	if (work_sql_connection != 0){
+		//return jobs claimed but not started to the queue, rather than leaving them until their claims expire
+		try{
+			job_scheduler.release_prefetched_jobs(*work_sql_connection);
+		}
+		catch(ns_ex & ex){
+			image_server.register_server_event_no_db(ns_image_server_event("Could not release claimed jobs: ") << ex.text());
+		}
+	}
 	ns_safe_delete(work_sql_connection);
 	work_lock.release();
 	ns_acquire_lock_for_scope timer_lock(timer_sql_management_lock,__FILE__,__LINE__);
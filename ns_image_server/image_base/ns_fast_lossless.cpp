@@ -0,0 +1,368 @@
+#include "ns_fast_lossless.h"
+#include "zlib.h"
+#include <string.h>
+using namespace std;
+
+//row groups are sized so that the working set of the compressor stays in cache
+#define NS_FAST_LOSSLESS_TARGET_BLOCK_SIZE (256*1024)
+#define NS_FAST_LOSSLESS_HASH_BITS 14
+#define NS_FAST_LOSSLESS_MIN_MATCH 4
+#define NS_FAST_LOSSLESS_MAX_OFFSET 65535
+
+inline unsigned int ns_fast_lossless_read_32(const ns_8_bit * p){
+	unsigned int v;
+	memcpy(&v,p,4);
+	return v;
+}
+inline unsigned long ns_fast_lossless_hash(const unsigned int v){
+	return (unsigned int)(v*2654435761U) >> (32-NS_FAST_LOSSLESS_HASH_BITS);
+}
+//lengths that do not fit in a token nibble are continued as a run of bytes, with 255 indicating that another byte follows.
+inline void ns_fast_lossless_write_length(unsigned long length, std::vector<ns_8_bit> & output){
+	for (length-=15; length >= 255; length-=255)
+		output.push_back(255);
+	output.push_back((ns_8_bit)length);
+}
+inline void ns_fast_lossless_read_length(const ns_8_bit * data, const unsigned long size, unsigned long & pos, unsigned long & length){
+	for(;;){
+		if (pos >= size)
+			throw ns_ex("ns_fast_lossless_decompress()::Truncated length") << ns_file_io;
+		const ns_8_bit b(data[pos++]);
+		length+=b;
+		if (b != 255)
+			return;
+	}
+}
+
+///Each sequence consists of a token byte, holding the number of literals in its high nibble and the match length (minus 4) in its low nibble,
+///followed by any extended literal length, the literals, a two byte little-endian match offset, and any extended match length.
+///The final sequence contains only literals.
+void ns_fast_lossless_compress(const ns_8_bit * data, const unsigned long size, std::vector<ns_8_bit> & output){
+	output.resize(0);
+	output.reserve(size + size/255 + 16);
+	//positions are stored offset by one, so that zero marks an empty slot
+	std::vector<unsigned long> table(1<<NS_FAST_LOSSLESS_HASH_BITS,0);
+
+	unsigned long anchor(0),
+				  pos(0),
+				  misses(0);
+	while (pos + NS_FAST_LOSSLESS_MIN_MATCH <= size){
+		const unsigned int v(ns_fast_lossless_read_32(data+pos));
+		const unsigned long h(ns_fast_lossless_hash(v));
+		const unsigned long candidate(table[h]);
+		table[h] = pos+1;
+		if (candidate == 0 || pos - (candidate-1) > NS_FAST_LOSSLESS_MAX_OFFSET || ns_fast_lossless_read_32(data+candidate-1) != v){
+			//step faster through data that does not compress
+			misses++;
+			pos+=1+(misses>>6);
+			continue;
+		}
+		misses = 0;
+		const unsigned long match(candidate-1);
+		unsigned long length(NS_FAST_LOSSLESS_MIN_MATCH);
+		while (pos+length < size && data[match+length] == data[pos+length])
+			length++;
+
+		const unsigned long literals(pos-anchor),
+							offset(pos-match);
+		output.push_back((ns_8_bit)(((literals < 15)?literals:15) << 4 | ((length-NS_FAST_LOSSLESS_MIN_MATCH < 15)?(length-NS_FAST_LOSSLESS_MIN_MATCH):15)));
+		if (literals >= 15)
+			ns_fast_lossless_write_length(literals,output);
+		output.insert(output.end(),data+anchor,data+pos);
+		output.push_back((ns_8_bit)(offset & 0xFF));
+		output.push_back((ns_8_bit)(offset >> 8));
+		if (length-NS_FAST_LOSSLESS_MIN_MATCH >= 15)
+			ns_fast_lossless_write_length(length-NS_FAST_LOSSLESS_MIN_MATCH,output);
+		pos+=length;
+		anchor = pos;
+	}
+	const unsigned long literals(size-anchor);
+	output.push_back((ns_8_bit)(((literals < 15)?literals:15) << 4));
+	if (literals >= 15)
+		ns_fast_lossless_write_length(literals,output);
+	output.insert(output.end(),data+anchor,data+size);
+}
+
+void ns_fast_lossless_decompress(const ns_8_bit * data, const unsigned long size, ns_8_bit * output, const unsigned long output_size){
+	unsigned long in(0),
+				  out(0);
+	for(;;){
+		if (in >= size)
+			throw ns_ex("ns_fast_lossless_decompress()::Truncated sequence") << ns_file_io;
+		const ns_8_bit token(data[in++]);
+		unsigned long literals(token >> 4);
+		if (literals == 15)
+			ns_fast_lossless_read_length(data,size,in,literals);
+		if (literals > size - in || literals > output_size - out)
+			throw ns_ex("ns_fast_lossless_decompress()::Literal run overflows block") << ns_file_io;
+		memcpy(output+out,data+in,literals);
+		in+=literals;
+		out+=literals;
+		if (in == size)
+			break;
+
+		if (size - in < 2)
+			throw ns_ex("ns_fast_lossless_decompress()::Truncated match offset") << ns_file_io;
+		const unsigned long offset(data[in] | (((unsigned long)data[in+1]) << 8));
+		in+=2;
+		if (offset == 0 || offset > out)
+			throw ns_ex("ns_fast_lossless_decompress()::Invalid match offset") << ns_file_io;
+		unsigned long length(token & 15);
+		if (length == 15)
+			ns_fast_lossless_read_length(data,size,in,length);
+		length+=NS_FAST_LOSSLESS_MIN_MATCH;
+		if (length > output_size - out)
+			throw ns_ex("ns_fast_lossless_decompress()::Match overflows block") << ns_file_io;
+		if (offset >= length)
+			memcpy(output+out,output+out-offset,length);
+		else if (offset == 1)
+			memset(output+out,output[out-1],length);
+		else{
+			//overlapping matches repeat the most recent offset bytes.
+			//Each copy doubles the length of the repeated region that can be used as a source.
+			for (unsigned long copied = 0; copied < length;){
+				const unsigned long n((length-copied < offset+copied)?(length-copied):(offset+copied));
+				memcpy(output+out+copied,output+out-offset,n);
+				copied+=n;
+			}
+		}
+		out+=length;
+	}
+	if (out != output_size)
+		throw ns_ex("ns_fast_lossless_decompress()::Block decompressed to ") << out << " bytes rather than " << output_size << ns_file_io;
+}
+
+//Replacing each value with its difference from the previous pixel turns smooth image regions into runs of small, repeated values.
+template<class T>
+void ns_fast_lossless_difference(ns_8_bit * data, const unsigned long lines, const unsigned long bytes_per_line, const unsigned long components){
+	const unsigned long n(bytes_per_line/sizeof(T));
+	for (unsigned long y = 0; y < lines; y++){
+		T * l(reinterpret_cast<T *>(data + y*bytes_per_line));
+		if (components == 1){
+			T previous(l[0]);
+			for (unsigned long i = 1; i < n; i++){
+				const T current(l[i]);
+				l[i] = (T)(current - previous);
+				previous = current;
+			}
+			continue;
+		}
+		for (unsigned long i = n; i-- > components;)
+			l[i] = (T)(l[i] - l[i-components]);
+	}
+}
+template<class T>
+void ns_fast_lossless_undo_difference(ns_8_bit * data, const unsigned long lines, const unsigned long bytes_per_line, const unsigned long components){
+	const unsigned long n(bytes_per_line/sizeof(T));
+	for (unsigned long y = 0; y < lines; y++){
+		T * l(reinterpret_cast<T *>(data + y*bytes_per_line));
+		if (components == 1){
+			T sum(l[0]);
+			for (unsigned long i = 1; i < n; i++){
+				sum = (T)(sum + l[i]);
+				l[i] = sum;
+			}
+			continue;
+		}
+		for (unsigned long i = components; i < n; i++)
+			l[i] = (T)(l[i] + l[i-components]);
+	}
+}
+void ns_fast_lossless_filter(ns_8_bit * data, const unsigned long lines, const unsigned long bytes_per_line, const unsigned long bytes_per_component, const unsigned long components, const bool undo){
+	switch(bytes_per_component){
+		case 1: if (undo) ns_fast_lossless_undo_difference<ns_8_bit>(data,lines,bytes_per_line,components);
+				else ns_fast_lossless_difference<ns_8_bit>(data,lines,bytes_per_line,components);
+				break;
+		case 2: if (undo) ns_fast_lossless_undo_difference<ns_16_bit>(data,lines,bytes_per_line,components);
+				else ns_fast_lossless_difference<ns_16_bit>(data,lines,bytes_per_line,components);
+				break;
+		case 4: if (undo) ns_fast_lossless_undo_difference<unsigned int>(data,lines,bytes_per_line,components);
+				else ns_fast_lossless_difference<unsigned int>(data,lines,bytes_per_line,components);
+				break;
+		//other component sizes are stored unfiltered
+	}
+}
+inline void ns_fast_lossless_filter(ns_8_bit * data, const unsigned long lines, const unsigned long bytes_per_line, const ns_fast_lossless_header & h, const bool undo){
+	ns_fast_lossless_filter(data,lines,bytes_per_line,h.bytes_per_component,h.components,undo);
+}
+inline unsigned int ns_fast_lossless_checksum(const ns_8_bit * data, const unsigned long size){
+	return (unsigned int)adler32(adler32(0,Z_NULL,0),data,(uInt)size);
+}
+
+void ns_fast_lossless_writer::open(const std::string & filename_, const ns_image_properties & properties, const unsigned long bytes_per_component){
+	filename = filename_;
+	out.clear();
+	out.open(filename.c_str(),std::ios::binary|std::ios::trunc);
+	if (out.fail())
+		throw ns_ex("ns_fast_lossless_writer::Could not open ") << filename << ns_file_io;
+
+	memcpy(header.magic,ns_fast_lossless_header::magic_string(),8);
+	header.byte_order_mark = 0x01020304;
+	header.version = ns_fast_lossless_header::current_version;
+	header.bytes_per_component = bytes_per_component;
+	header.width = properties.width;
+	header.height = properties.height;
+	header.components = properties.components;
+	header.resolution = properties.resolution;
+	header.description_length = (unsigned int)properties.description.size();
+	header.index_offset = 0;
+
+	bytes_per_line = properties.width*properties.components*bytes_per_component;
+	header.rows_per_block = (bytes_per_line == 0)?1:(NS_FAST_LOSSLESS_TARGET_BLOCK_SIZE/bytes_per_line);
+	if (header.rows_per_block == 0)
+		header.rows_per_block = 1;
+	header.number_of_blocks = (header.height + header.rows_per_block-1)/header.rows_per_block;
+
+	//the index offset is filled in by close()
+	out.write(reinterpret_cast<const char *>(&header),sizeof(header));
+	out.write(properties.description.c_str(),header.description_length);
+
+	index.resize(0);
+	index.reserve(header.number_of_blocks);
+	buffer.resize(header.rows_per_block*bytes_per_line+1);
+	lines_in_buffer = 0;
+	lines_written = 0;
+}
+
+void ns_fast_lossless_writer::write_block(){
+	if (lines_in_buffer == 0)
+		return;
+	if (lines_written + lines_in_buffer > header.height)
+		throw ns_ex("ns_fast_lossless_writer::Too many lines written to ") << filename << ns_file_io;
+	const unsigned long size(lines_in_buffer*bytes_per_line);
+	ns_fast_lossless_block_info info;
+	info.offset = out.tellp();
+	info.checksum = ns_fast_lossless_checksum(&buffer[0],size);
+
+	ns_fast_lossless_filter(&buffer[0],lines_in_buffer,bytes_per_line,header,false);
+	ns_fast_lossless_compress(&buffer[0],size,compressed);
+	if (compressed.size() < size){
+		info.compressed_size = (unsigned int)compressed.size();
+		out.write(reinterpret_cast<const char *>(&compressed[0]),compressed.size());
+	}
+	else{
+		info.compressed_size = (unsigned int)size;
+		out.write(reinterpret_cast<const char *>(&buffer[0]),size);
+	}
+	if (out.fail())
+		throw ns_ex("ns_fast_lossless_writer::Could not write to ") << filename << ns_file_io;
+	index.push_back(info);
+	lines_written+=lines_in_buffer;
+	lines_in_buffer = 0;
+}
+
+void ns_fast_lossless_writer::close(){
+	if (!out.is_open())
+		return;
+	try{
+		write_block();
+		if (lines_written != header.height)
+			throw ns_ex("ns_fast_lossless_writer::Only ") << lines_written << " of " << header.height << " lines were written to " << filename << ns_file_io;
+		header.index_offset = out.tellp();
+		if (!index.empty())
+			out.write(reinterpret_cast<const char *>(&index[0]),sizeof(ns_fast_lossless_block_info)*index.size());
+		out.seekp(0);
+		out.write(reinterpret_cast<const char *>(&header),sizeof(header));
+		out.close();
+		if (out.fail())
+			throw ns_ex("ns_fast_lossless_writer::Could not write to ") << filename << ns_file_io;
+	}
+	catch(...){
+		if (out.is_open())
+			out.close();
+		throw;
+	}
+}
+
+void ns_fast_lossless_reader::open(const std::string & filename_, const unsigned long bytes_per_component, ns_image_properties & properties){
+	close();
+	filename = filename_;
+	in.clear();
+	in.open(filename.c_str(),std::ios::binary);
+	if (in.fail())
+		throw ns_ex("ns_fast_lossless_reader::Could not open ") << filename << ns_file_io;
+	in.seekg(0,std::ios::end);
+	const ns_64_bit file_size(in.tellg());
+	in.seekg(0);
+	in.read(reinterpret_cast<char *>(&header),sizeof(header));
+	if (in.fail() || memcmp(header.magic,ns_fast_lossless_header::magic_string(),8) != 0)
+		throw ns_ex("ns_fast_lossless_reader::") << filename << " is not a fast lossless image file" << ns_file_io;
+	if (header.byte_order_mark != 0x01020304)
+		throw ns_ex("ns_fast_lossless_reader::") << filename << " was written on a machine with a different byte order" << ns_file_io;
+	if (header.version != ns_fast_lossless_header::current_version)
+		throw ns_ex("ns_fast_lossless_reader::") << filename << " has an unsupported version: " << header.version << ns_file_io;
+	if (header.bytes_per_component != bytes_per_component)
+		throw ns_ex("ns_fast_lossless_reader::") << filename << " contains a " << 8*header.bytes_per_component << " bit image, but a " << 8*bytes_per_component << " bit image was requested" << ns_file_io;
+	if (header.rows_per_block == 0 || header.number_of_blocks != (header.height + header.rows_per_block-1)/header.rows_per_block
+		|| sizeof(header) + (ns_64_bit)header.description_length > header.index_offset
+		|| header.index_offset + sizeof(ns_fast_lossless_block_info)*(ns_64_bit)header.number_of_blocks > file_size)
+		throw ns_ex("ns_fast_lossless_reader::") << filename << " has a corrupt header" << ns_file_io;
+
+	bytes_per_line = header.width*header.components*header.bytes_per_component;
+	std::string description(header.description_length,' ');
+	if (!description.empty())
+		in.read(&description[0],description.size());
+	index.resize(header.number_of_blocks);
+	in.seekg(header.index_offset);
+	if (!index.empty())
+		in.read(reinterpret_cast<char *>(&index[0]),sizeof(ns_fast_lossless_block_info)*index.size());
+	if (in.fail())
+		throw ns_ex("ns_fast_lossless_reader::Could not read ") << filename << ns_file_io;
+	for (unsigned long i = 0; i < index.size(); i++){
+		if (index[i].offset + index[i].compressed_size > header.index_offset || index[i].compressed_size > header.rows_per_block*bytes_per_line)
+			throw ns_ex("ns_fast_lossless_reader::") << filename << " has a corrupt index" << ns_file_io;
+	}
+
+	properties.width = header.width;
+	properties.height = header.height;
+	properties.components = header.components;
+	properties.resolution = header.resolution;
+	properties.description = description;
+	buffer.resize(header.rows_per_block*bytes_per_line+1);
+	block_loaded = false;
+}
+
+void ns_fast_lossless_reader::load_block(const unsigned long block){
+	block_loaded = false;
+	const unsigned long first_line(block*header.rows_per_block),
+						lines((first_line + header.rows_per_block > header.height)?(header.height-first_line):header.rows_per_block),
+						size(lines*bytes_per_line);
+	const ns_fast_lossless_block_info & info(index[block]);
+	in.seekg(info.offset);
+	if (info.compressed_size == size)
+		in.read(reinterpret_cast<char *>(&buffer[0]),size);
+	else{
+		compressed.resize(info.compressed_size+1);
+		in.read(reinterpret_cast<char *>(&compressed[0]),info.compressed_size);
+	}
+	if (in.fail())
+		throw ns_ex("ns_fast_lossless_reader::Could not read ") << filename << ns_file_io;
+	try{
+		if (info.compressed_size != size)
+			ns_fast_lossless_decompress(&compressed[0],info.compressed_size,&buffer[0],size);
+	}
+	catch(ns_ex & ex){
+		throw ns_ex("ns_fast_lossless_reader::") << filename << " is corrupt: " << ex.text() << ns_file_io;
+	}
+	ns_fast_lossless_filter(&buffer[0],lines,bytes_per_line,header,true);
+	if (ns_fast_lossless_checksum(&buffer[0],size) != info.checksum)
+		throw ns_ex("ns_fast_lossless_reader::") << filename << " is corrupt: checksum mismatch in lines " << first_line << "-" << (first_line+lines-1) << ns_file_io;
+	current_block = block;
+	block_loaded = true;
+}
+
+const ns_8_bit * ns_fast_lossless_reader::line(const unsigned long y){
+	if (y >= header.height)
+		throw ns_ex("ns_fast_lossless_reader::Requested line ") << y << " from an image with height " << header.height << ns_file_io;
+	const unsigned long block(y/header.rows_per_block);
+	if (!block_loaded || block != current_block)
+		load_block(block);
+	return &buffer[(y - block*header.rows_per_block)*bytes_per_line];
+}
+
+void ns_fast_lossless_reader::close(){
+	if (in.is_open())
+		in.close();
+	index.resize(0);
+	block_loaded = false;
+}
@@ -0,0 +1,173 @@
+#ifndef NS_FAST_LOSSLESS
+#define NS_FAST_LOSSLESS
+#include "ns_image.h"
+#include <fstream>
+#include <vector>
+
+///ns_fast_lossless files hold the images produced by intermediate processing steps,
+///which are written once and read back shortly afterwards by the next step.
+///For these images, encoding and decoding speed matter much more than file size.
+///
+///Images are split into row groups of roughly 256 kB. Each group is passed through a horizontal difference filter
+///and then compressed on its own with a byte-oriented LZ77 coder similar to LZ4.
+///The file consists of:
+///  a fixed header (ns_fast_lossless_header), followed by the image description;
+///  the compressed row groups;
+///  an index giving each row group's offset, compressed size, and the Adler-32 checksum of its pixels.
+///As in ns_image_mapped_file, values are stored in native byte order, and files written on a machine with a different byte order are rejected.
+struct ns_fast_lossless_header{
+	enum{current_version=1};
+	char magic[8];
+	unsigned int byte_order_mark,
+				 version,
+				 bytes_per_component,
+				 width,
+				 height,
+				 components,
+				 rows_per_block,
+				 number_of_blocks,
+				 description_length;
+	float resolution;
+	ns_64_bit index_offset;
+
+	static const char * magic_string(){return "NSFASTLL";}
+};
+
+struct ns_fast_lossless_block_info{
+	ns_64_bit offset;
+	//row groups that do not compress are stored as-is, in which case compressed_size equals the uncompressed size.
+	unsigned int compressed_size,
+				 checksum;
+};
+
+//LZ77 coding of a single block.
+void ns_fast_lossless_compress(const ns_8_bit * data, const unsigned long size, std::vector<ns_8_bit> & output);
+//throws an exception if the compressed data is corrupt or does not decompress to exactly output_size bytes
+void ns_fast_lossless_decompress(const ns_8_bit * data, const unsigned long size, ns_8_bit * output, const unsigned long output_size);
+//Replaces each value in the specified lines with its difference from the previous pixel, which makes images compress much better.
+//If undo is set, the original values are restored.
+void ns_fast_lossless_filter(ns_8_bit * data, const unsigned long lines, const unsigned long bytes_per_line, const unsigned long bytes_per_component, const unsigned long components, const bool undo);
+
+///ns_fast_lossless_writer handles the byte-level encoding of ns_fast_lossless files,
+///so that the implementation can be shared by images of all component types.
+class ns_fast_lossless_writer{
+public:
+	ns_fast_lossless_writer():bytes_per_line(0),lines_in_buffer(0),lines_written(0){}
+	void open(const std::string & filename, const ns_image_properties & properties, const unsigned long bytes_per_component);
+	//the buffer into which the next line of the image should be written
+	ns_8_bit * next_line(){return &buffer[lines_in_buffer*bytes_per_line];}
+	//called once the next line has been written to the buffer
+	void line_written(){
+		lines_in_buffer++;
+		if (lines_in_buffer == header.rows_per_block)
+			write_block();
+	}
+	//writes any remaining lines and the row group index
+	void close();
+private:
+	void write_block();
+	std::string filename;
+	std::ofstream out;
+	ns_fast_lossless_header header;
+	std::vector<ns_fast_lossless_block_info> index;
+	std::vector<ns_8_bit> buffer,
+						  compressed;
+	unsigned long bytes_per_line,
+				  lines_in_buffer,
+				  lines_written;
+};
+
+///ns_fast_lossless_reader decodes one row group of an ns_fast_lossless file at a time.
+class ns_fast_lossless_reader{
+public:
+	ns_fast_lossless_reader():bytes_per_line(0),current_block(0),block_loaded(false){}
+	void open(const std::string & filename, const unsigned long bytes_per_component, ns_image_properties & properties);
+	//returns line y of the image.  Lines can be requested in any order, but reading them in order is fastest.
+	const ns_8_bit * line(const unsigned long y);
+	void close();
+private:
+	void load_block(const unsigned long block);
+	std::string filename;
+	std::ifstream in;
+	ns_fast_lossless_header header;
+	std::vector<ns_fast_lossless_block_info> index;
+	std::vector<ns_8_bit> buffer,
+						  compressed;
+	unsigned long bytes_per_line,
+				  current_block;
+	bool block_loaded;
+};
+
+template<class ns_component>
+class ns_fast_lossless_image_input_file: public ns_image_input_file<ns_component>{
+public:
+	ns_fast_lossless_image_input_file():lines_read(0){}
+	~ns_fast_lossless_image_input_file(){close();}
+
+	void open_file(const std::string & filename){
+		reader.open(filename,sizeof(ns_component),ns_image_input_file<ns_component>::_properties);
+		lines_read = 0;
+	}
+	void open_mem(const void *){
+		throw ns_ex("ns_fast_lossless_image_input_file::Opening from memory is not supported.") << ns_file_io;
+	}
+	void close(){reader.close();}
+	void seek_to_beginning(){lines_read = 0;}
+
+	//read in a single line
+	bool read_line(ns_component * buffer){
+		if (lines_read == ns_image_input_file<ns_component>::_properties.height)
+			throw ns_ex("ns_fast_lossless_image_input_file::read_line()::Attempting to read too many lines from file: Requested line ") << (lines_read+1) << " from an image with height " << ns_image_input_file<ns_component>::_properties.height;
+		memcpy(buffer,reader.line(lines_read),sizeof(ns_component)*ns_image_input_file<ns_component>::_properties.width*ns_image_input_file<ns_component>::_properties.components);
+		lines_read++;
+		return true;
+	}
+	//read a position/component from the specified buffer.
+	ns_component * operator()(const unsigned long x, const  unsigned int component, ns_component * buffer)const{
+		return &(buffer[ns_image_input_file<ns_component>::_properties.components*x + component]);
+	}
+private:
+	ns_fast_lossless_reader reader;
+	unsigned long lines_read;
+};
+
+template<class ns_component>
+class ns_fast_lossless_image_output_file: public ns_image_output_file<ns_component>{
+public:
+	~ns_fast_lossless_image_output_file(){
+		try{close();}
+		catch(ns_ex & ex){
+			std::cerr << "~ns_fast_lossless_image_output_file() tried to throw an exception: " << ex.text() << "\n";
+		}
+		catch(...){
+			std::cerr << "~ns_fast_lossless_image_output_file() tried to throw an unknown exception\n";
+		}
+	}
+	void open_file(const std::string & filename, const ns_image_properties & properties){
+		ns_image_output_file<ns_component>::_properties = properties;
+		writer.open(filename,properties,sizeof(ns_component));
+	}
+	void open_mem(const void *, const ns_image_properties & properties){
+		throw ns_ex("ns_fast_lossless_image_output_file::Opening from memory is not supported.") << ns_file_io;
+	}
+	void close(){writer.close();}
+
+	//write a single line
+	bool write_line(const ns_component * buffer){
+		memcpy(writer.next_line(),buffer,sizeof(ns_component)*ns_image_output_file<ns_component>::_properties.width*ns_image_output_file<ns_component>::_properties.components);
+		writer.line_written();
+		return true;
+	}
+	void write_lines(const ns_component ** buffer,const unsigned int n){
+		for (unsigned int i = 0; i < n; i++)
+			write_line(buffer[i]);
+	}
+	//read a position/component from the specified buffer.
+	ns_component * operator()(const unsigned long x, const unsigned int component, ns_component * buffer)const{
+		return &(buffer[ns_image_output_file<ns_component>::_properties.components*x + component]);
+	}
+private:
+	ns_fast_lossless_writer writer;
+};
+
+#endif
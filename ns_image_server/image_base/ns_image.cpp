@@ -16,6 +16,8 @@ ns_image_type ns_image_type_from_filename(const string & filename){
 		return ns_tiff;
 	if (ext == "jp2" | ext == "jpk")
 		return ns_jp2k;
+	if (ext == "nsfl")
+		return ns_fast_lossless;
 	return ns_unknown;
 
 }
@@ -36,6 +38,7 @@ void ns_add_image_suffix(string & str, const ns_image_type & type){
 		case ns_tiff_lzw: str+=".tif"; return;
 		case ns_tiff_zip: str+=".tif"; return;
 		case ns_jp2k: str+=".jp2"; return;
+		case ns_fast_lossless: str+=".nsfl"; return;
 		default: throw ns_ex("ns_add_iamge_suffix: Unknown image type: ") << (unsigned int)type;
 	}
 }
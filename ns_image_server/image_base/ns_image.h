@@ -13,7 +13,7 @@ typedef enum{ns_delete_volatile,ns_delete_long_term,ns_delete_both_volatile_and_
 ///stored in main memory
 #define NS_IMAGE_WHOLE_MAXIMUM_AREA 2*1024.0*1024.0*1024.0
 
-typedef enum{ns_jpeg, ns_tiff, ns_tiff_lzw,ns_tiff_zip,ns_jp2k,ns_unknown} ns_image_type;
+typedef enum{ns_jpeg, ns_tiff, ns_tiff_lzw,ns_tiff_zip,ns_jp2k,ns_fast_lossless,ns_unknown} ns_image_type;
 void ns_add_image_suffix(std::string & str, const ns_image_type & type);
 
 ns_image_type ns_image_type_from_filename(const std::string & filename);
@@ -742,6 +742,11 @@ public:
 			throw ns_ex("ns_whole_image::Cannot allocate an image with ") << prop.width << "x" << prop.height << " dimentions.";
 
 		//cerr << "Resizing buffer to " << prop.width << "," << prop.height << "\n";
+		//new contents are never written into a file mapping
+		if (image_buffer.uses_mapped_memory()){
+			image_buffer.resize(ns_image_stream_buffer_properties(0,0));
+			resized = true;
+		}
 		if ( !(image_buffer.properties() == prop)){
 			if (image_buffer.properties().width != prop.width || image_buffer.properties().height != prop.height){
 				if (avoid_memory_reallocations)
@@ -963,6 +968,24 @@ public:
 		init(ns_image_properties(0,0,0));
 	}
 
+	///Replaces the image with one whose lines are stored in a memory mapped file (see ns_image_mapped_file.h).
+	///Line y begins data_offset + y*line_stride bytes into the file.
+	///The image takes ownership of the mapping, which is closed when the image is resized, cleared, or destroyed.
+	///Pixels can be modified, but changes are never written back to the file.
+	void use_mapped_memory(ns_memory_mapped_file * file, const ns_64_bit data_offset, const ns_64_bit line_stride, const ns_image_properties & properties){
+		if (properties.components != 1 && properties.components != 3){
+			delete file;
+			throw ns_ex("ns_whole_image::Invalid component specification: ") << properties.components;
+		}
+		image_buffer.use_mapped_memory(file,data_offset,line_stride,ns_image_stream_buffer_properties(properties.width*properties.components,properties.height));
+		NS_SR_PROPS = properties;
+		ns_image_stream_sender<ns_component, ns_image_whole<ns_component> >::_properties = properties;
+		lines_received = properties.height;
+		lines_sent = 0;
+		image_buffer.set_offset(0);
+	}
+	bool uses_mapped_memory() const{return image_buffer.uses_mapped_memory();}
+
 	///calculates the image's histogram, neglecting the value 0 which is used to represent
 	///pixels that are not part of the image.
 	ns_histogram<unsigned int, ns_component> histogram(){
@@ -4,6 +4,7 @@
 #include "ns_jpeg.h"
 #include "ns_tiff.h"
 #include "ns_ojp2k.h"
+#include "ns_fast_lossless.h"
 #include "ns_dir.h"
 
 template<class whole_image>
@@ -34,6 +35,13 @@ void ns_load_image(const std::string & filename, whole_image & image){
 		file_source.pump(image,128);
 		return;
 	}
+	if (extension == "nsfl"){
+		ns_fast_lossless_image_input_file<typename whole_image::component_type> fast_lossless_in;
+		fast_lossless_in.open_file(filename);
+		ns_image_stream_file_source<typename whole_image::component_type > file_source(fast_lossless_in);
+		file_source.pump(image,128);
+		return;
+	}
 	throw ns_ex("ns_load_image::Unknown file extension: ") << extension;
 }		
 
@@ -60,6 +68,12 @@ void ns_save_image(const std::string & filename, const ns_image_whole<ns_compone
 		image.pump(file_sink,1024);
 		return;
 	}
+	if (extension == "nsfl"){
+		ns_fast_lossless_image_output_file<ns_component> fast_lossless_out;
+		ns_image_stream_file_sink<ns_component> file_sink(filename,fast_lossless_out,1024);
+		image.pump(file_sink,1024);
+		return;
+	}
 	throw ns_ex("ns_save_image::Unknown file extension: ") << extension;
 }
 
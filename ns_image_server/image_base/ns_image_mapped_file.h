@@ -0,0 +1,147 @@
+#ifndef NS_IMAGE_MAPPED_FILE
+#define NS_IMAGE_MAPPED_FILE
+#include "ns_image.h"
+#include "ns_memory_mapped_file.h"
+#include "ns_dir.h"
+#include "ns_thread.h"
+#include <fstream>
+#include <string.h>
+
+///Mapped image files store uncompressed images in a layout that can be memory mapped directly into an ns_image_whole,
+///so that re-opening an image costs a few system calls rather than a full decode and copy.
+///Pixels are only read from disk as they are accessed.
+///
+///The file begins with a header padded to data_offset bytes, followed by image lines
+///each padded to a multiple of 64 bytes so that every line starts on a cache line boundary.
+///Values are stored in the native byte order; a file written on a machine with a different byte order is rejected.
+///The size and modification time of the file from which the image was loaded are recorded, so that a copy
+///can be recognized as out of date if the source is later rewritten, for example by another host.
+
+///Identifies the file from which a mapped image was made
+struct ns_image_mapped_file_source{
+	ns_image_mapped_file_source():size(0),modification_time(0){}
+	ns_64_bit size,
+			  modification_time;
+};
+
+struct ns_image_mapped_file_header{
+	enum{current_version=2,header_size=4096,line_alignment=64};
+
+	char magic[8];
+	unsigned int byte_order_mark,
+				 version,
+				 bytes_per_component,
+				 width,
+				 height,
+				 components;
+	float resolution;
+	ns_64_bit line_stride,
+			  data_offset;
+	unsigned int description_length;
+	ns_64_bit source_size,
+			  source_modification_time;
+	//the image description follows the header
+
+	static const char * magic_string(){return "NSIMGMAP";}
+	static unsigned int maximum_description_length(){return header_size - sizeof(ns_image_mapped_file_header);}
+
+	template<class ns_component>
+	void set(const ns_image_properties & p, const ns_image_mapped_file_source & source){
+		memcpy(magic,magic_string(),8);
+		byte_order_mark = 0x01020304;
+		version = current_version;
+		bytes_per_component = sizeof(ns_component);
+		width = p.width;
+		height = p.height;
+		components = p.components;
+		resolution = p.resolution;
+		const ns_64_bit line_length(((ns_64_bit)p.width)*p.components*sizeof(ns_component));
+		line_stride = ((line_length + line_alignment-1)/line_alignment)*line_alignment;
+		data_offset = header_size;
+		description_length = (p.description.size() > maximum_description_length())?maximum_description_length():(unsigned int)p.description.size();
+		source_size = source.size;
+		source_modification_time = source.modification_time;
+	}
+	template<class ns_component>
+	void check(const std::string & filename, const ns_64_bit file_size) const{
+		if (file_size < header_size || memcmp(magic,magic_string(),8) != 0)
+			throw ns_ex("ns_image_mapped_file::") << filename << " is not a mapped image file" << ns_file_io;
+		if (byte_order_mark != 0x01020304)
+			throw ns_ex("ns_image_mapped_file::") << filename << " was written on a machine with a different byte order" << ns_file_io;
+		if (version != current_version)
+			throw ns_ex("ns_image_mapped_file::") << filename << " has an unsupported version: " << version << ns_file_io;
+		if (bytes_per_component != sizeof(ns_component))
+			throw ns_ex("ns_image_mapped_file::") << filename << " contains a " << 8*bytes_per_component << " bit image, but a " << 8*sizeof(ns_component) << " bit image was requested" << ns_file_io;
+		if (description_length > maximum_description_length() || data_offset < header_size || line_stride < ((ns_64_bit)width)*components*bytes_per_component)
+			throw ns_ex("ns_image_mapped_file::") << filename << " has a corrupt header" << ns_file_io;
+		if (data_offset + line_stride*height > file_size)
+			throw ns_ex("ns_image_mapped_file::") << filename << " is truncated" << ns_file_io;
+	}
+};
+
+///Writes an image to a mapped image file.
+///The file is written under a temporary name and then renamed, so that other processes never map a partially written file.
+///The temporary name is unique to the writer, so several processes (or threads) writing the same image do not clobber each other.
+template<class ns_component>
+void ns_write_mapped_image_file(const ns_image_whole<ns_component> & image, const std::string & filename, const ns_image_mapped_file_source & source){
+	ns_image_mapped_file_header header;
+	header.set<ns_component>(image.properties(),source);
+
+	const std::string temp_filename(filename + ".partial=" + ns_to_string(ns_thread::ns_get_process_id()) + "=" + ns_to_string((ns_64_bit)(size_t)&image));
+	std::ofstream out(temp_filename.c_str(),std::ios::binary|std::ios::trunc);
+	if (out.fail())
+		throw ns_ex("ns_write_mapped_image_file()::Could not open ") << temp_filename << ns_file_io;
+	std::vector<char> padding((unsigned long)header.data_offset,0);
+	memcpy(&padding[0],&header,sizeof(header));
+	memcpy(&padding[sizeof(header)],image.properties().description.c_str(),header.description_length);
+	out.write(&padding[0],header.data_offset);
+
+	const ns_64_bit line_length(((ns_64_bit)header.width)*header.components*sizeof(ns_component));
+	padding.assign((unsigned long)(header.line_stride-line_length),0);
+	for (unsigned long y = 0; y < header.height; y++){
+		out.write(reinterpret_cast<const char *>(image[y]),line_length);
+		if (!padding.empty())
+			out.write(&padding[0],padding.size());
+	}
+	out.close();
+	if (out.fail()){
+		ns_dir::delete_file(temp_filename);
+		throw ns_ex("ns_write_mapped_image_file()::Could not write ") << temp_filename << ns_file_io;
+	}
+	ns_dir::delete_file(filename);
+	if (!ns_dir::move_file(temp_filename,filename)){
+		ns_dir::delete_file(temp_filename);
+		throw ns_ex("ns_write_mapped_image_file()::Could not rename ") << temp_filename << " to " << filename << ns_file_io;
+	}
+}
+
+///Replaces the contents of image with a memory mapping of the specified mapped image file.
+///An exception is thrown if the file was made from a source other than the one specified.
+template<class ns_component>
+void ns_map_image_file(const std::string & filename, ns_image_whole<ns_component> & image, const ns_image_mapped_file_source & source){
+	ns_memory_mapped_file * file(new ns_memory_mapped_file);
+	ns_image_properties prop;
+	ns_image_mapped_file_header header;
+	try{
+		file->open(filename);
+		if (file->size() < sizeof(header))
+			throw ns_ex("ns_image_mapped_file::") << filename << " is not a mapped image file" << ns_file_io;
+		memcpy(&header,file->data(),sizeof(header));
+		header.check<ns_component>(filename,file->size());
+		if (header.source_size != source.size || header.source_modification_time != source.modification_time)
+			throw ns_ex("ns_image_mapped_file::") << filename << " is out of date" << ns_file_io;
+		prop.width = header.width;
+		prop.height = header.height;
+		prop.components = header.components;
+		prop.resolution = header.resolution;
+		prop.description.assign(file->data()+sizeof(header),header.description_length);
+	}
+	catch(...){
+		delete file;
+		throw;
+	}
+	//use_mapped_memory() takes ownership of the file, even if it throws.
+	image.use_mapped_memory(file,header.data_offset,header.line_stride,prop);
+}
+
+#endif
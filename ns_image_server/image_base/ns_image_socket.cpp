@@ -1,4 +1,10 @@
 #include "ns_image_socket.h"
+#include "ns_fast_lossless.h"
+#include "ns_thread.h"
+#include "ns_high_precision_timer.h"
+#include <string.h>
+#include <stdlib.h>
+#include <iomanip>
 
 using namespace std;
 
@@ -66,3 +72,134 @@ ns_image_properties ns_char_to_image_properties(const char * buf,const int heade
 	return p;
 
 }
+
+void ns_image_socket_write_capabilities(ns_socket_connection & connection, const ns_image_socket_capabilities & capabilities){
+	const unsigned int buf[3] = {capabilities.version,capabilities.flags,capabilities.window};
+	connection.write(reinterpret_cast<const char *>(buf),sizeof(buf));
+}
+ns_image_socket_capabilities ns_image_socket_read_capabilities(ns_socket_connection & connection){
+	unsigned int buf[3];
+	connection.read(reinterpret_cast<char *>(buf),sizeof(buf));
+	ns_image_socket_capabilities c;
+	c.version = buf[0];
+	c.flags = buf[1];
+	c.window = buf[2];
+	return c;
+}
+
+void ns_image_socket_send_block(ns_socket_connection & connection, std::vector<ns_8_bit> & block, const unsigned long lines, const unsigned long bytes_per_line,
+								const unsigned long bytes_per_component, const unsigned long components, const bool compress, std::vector<ns_8_bit> & compressed){
+	ns_image_socket_block_header header;
+	header.lines = lines;
+	header.raw_size = lines*bytes_per_line;
+	header.stored_size = header.raw_size;
+	const ns_8_bit * data(&block[0]);
+	if (compress && header.raw_size > 0){
+		ns_fast_lossless_filter(&block[0],lines,bytes_per_line,bytes_per_component,components,false);
+		ns_fast_lossless_compress(&block[0],header.raw_size,compressed);
+		if (compressed.size() < header.raw_size){
+			header.stored_size = (unsigned int)compressed.size();
+			data = &compressed[0];
+		}
+		else ns_fast_lossless_filter(&block[0],lines,bytes_per_line,bytes_per_component,components,true);
+	}
+	connection.write(reinterpret_cast<const char *>(&header),sizeof(header));
+	if (header.stored_size > 0)
+		connection.write(reinterpret_cast<const char *>(data),header.stored_size);
+}
+
+unsigned long ns_image_socket_recieve_block(ns_socket_connection & connection, std::vector<ns_8_bit> & block, const unsigned long bytes_per_line,
+											const unsigned long bytes_per_component, const unsigned long components, std::vector<ns_8_bit> & compressed){
+	ns_image_socket_block_header header;
+	connection.read(reinterpret_cast<char *>(&header),sizeof(header));
+	if (header.lines == 0 || header.raw_size != header.lines*bytes_per_line || header.stored_size > header.raw_size)
+		throw ns_ex("ns_image_socket_recieve_block()::Recieved an invalid block header") << ns_network_io;
+	block.resize(header.raw_size);
+	if (header.stored_size == header.raw_size){
+		connection.read(reinterpret_cast<char *>(&block[0]),header.raw_size);
+		return header.lines;
+	}
+	compressed.resize(header.stored_size);
+	connection.read(reinterpret_cast<char *>(&compressed[0]),header.stored_size);
+	ns_fast_lossless_decompress(&compressed[0],header.stored_size,&block[0],header.raw_size);
+	ns_fast_lossless_filter(&block[0],header.lines,bytes_per_line,bytes_per_component,components,true);
+	return header.lines;
+}
+
+struct ns_image_socket_benchmark_sender{
+	ns_image_socket_benchmark_sender():image(0),protocol(ns_image_socket_protocol_1),compress(false),port(0),error_occurred(false){}
+	ns_image_standard * image;
+	ns_image_socket_protocol_version protocol;
+	bool compress;
+	unsigned int port;
+	bool error_occurred;
+	ns_ex error;
+
+	static ns_thread_return_type run(void * s){
+		ns_image_socket_benchmark_sender * sender(static_cast<ns_image_socket_benchmark_sender *>(s));
+		try{
+			ns_socket socket;
+			ns_socket_connection connection(socket.connect("127.0.0.1",sender->port));
+			ns_image_socket_sender<ns_8_bit> image_sender(512,sender->protocol);
+			image_sender.set_protocol(sender->protocol,sender->compress);
+			image_sender.bind_socket(connection);
+			sender->image->pump(image_sender,512);
+			connection.close();
+		}
+		catch(ns_ex & ex){
+			sender->error = ex;
+			sender->error_occurred = true;
+		}
+		return 0;
+	}
+};
+
+void ns_benchmark_image_socket_protocols(const unsigned int port, std::ostream & out){
+	//a grayscale image with a smooth background and noise, similar to a captured image
+	const ns_image_properties properties(5000,8000,1);
+	ns_image_standard image;
+	image.init(properties);
+	srand(0);
+	for (unsigned int y = 0; y < properties.height; y++)
+		for (unsigned int x = 0; x < properties.width; x++)
+			image[y][x] = (ns_8_bit)((x+y)/64 + 64 + rand()%8);
+	const double megabytes(((double)properties.width*properties.height)/(1024*1024));
+
+	ns_socket listen_socket;
+	listen_socket.listen(port,16);
+
+	const char * names[3] = {"Version 1","Version 2, uncompressed","Version 2, compressed"};
+	const ns_image_socket_protocol_version protocols[3] = {ns_image_socket_protocol_1,ns_image_socket_protocol_2,ns_image_socket_protocol_2};
+	const bool compress[3] = {false,false,true};
+	for (unsigned int i = 0; i < 3; i++){
+		ns_image_socket_benchmark_sender sender;
+		sender.image = &image;
+		sender.protocol = protocols[i];
+		sender.compress = compress[i];
+		sender.port = port;
+
+		ns_high_precision_timer timer;
+		timer.start();
+		ns_thread thread(ns_image_socket_benchmark_sender::run,&sender);
+		ns_socket_connection connection(listen_socket.accept());
+		ns_image_standard recieved;
+		ns_image_socket_reciever<ns_8_bit> reciever;
+		reciever.bind_socket(connection);
+		reciever.pump(recieved,512);
+		const ns_64_bit microseconds(timer.stop());
+		thread.block_on_finish();
+		thread.close();
+		connection.close();
+		if (sender.error_occurred)
+			throw sender.error;
+
+		if (recieved.properties() != properties)
+			throw ns_ex("ns_benchmark_image_socket_protocols()::") << names[i] << " recieved an image of the wrong size";
+		for (unsigned int y = 0; y < properties.height; y++)
+			if (memcmp(recieved[y],image[y],properties.width) != 0)
+				throw ns_ex("ns_benchmark_image_socket_protocols()::") << names[i] << " corrupted line " << y;
+
+		out << names[i] << ": " << std::fixed << std::setprecision(1) << megabytes/(microseconds/(1000.0*1000.0)) << " MB/s\n";
+	}
+	listen_socket.close_socket();
+}
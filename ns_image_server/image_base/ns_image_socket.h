@@ -21,6 +21,50 @@ unsigned int ns_image_properties_to_char(const ns_image_properties & p, char *&
 ///after transmission over a socket
 ns_image_properties ns_char_to_image_properties(const char * buf,const int header_length);
 
+///Image socket protocol versions.
+///Version 1 sends each line of an image uncompressed, as soon as it is received.
+///Version 2 begins with a capability handshake, after which lines are sent in blocks.  If compression is requested, each block is passed through
+///the difference filter and LZ77 coder used by ns_fast_lossless, and is sent uncompressed only if it does not shrink.
+///Compression is done on the sending thread, at roughly 60 MB/s, so it is off unless requested and is worth requesting only on slow links.
+///The reciever acknowledges blocks as it reads them, and the sender waits for an acknowledgement only once a configurable
+///number of blocks are in flight, so the sender does not wait on a round trip as long as the reciever keeps up.
+///Recievers accept either version.  Recievers built before version 2 existed cannot read it, so senders use version 1
+///unless version 2 is explicitly requested, which should be done only once every reciever on the cluster has been upgraded
+///(see the image_socket_protocol_version cluster constant).
+typedef enum{ns_image_socket_protocol_1=1,ns_image_socket_protocol_2=2} ns_image_socket_protocol_version;
+
+///The features requested by a version 2 sender, and those accepted by the reciever in reply.
+struct ns_image_socket_capabilities{
+	enum{ns_compression=1};
+	ns_image_socket_capabilities():version(ns_image_socket_protocol_2),flags(0),window(8){}
+	unsigned int version,
+				 flags,
+				 //the number of blocks that may be sent before an acknowledgement is received.  If zero, blocks are not acknowledged.
+				 window;
+	//Version 1 transmissions begin with the (positive) length of the image header, so a negative value marks a version 2 handshake
+	static int handshake_marker(){return -2;}
+};
+void ns_image_socket_write_capabilities(ns_socket_connection & connection, const ns_image_socket_capabilities & capabilities);
+ns_image_socket_capabilities ns_image_socket_read_capabilities(ns_socket_connection & connection);
+
+struct ns_image_socket_block_header{
+	unsigned int lines,
+				 raw_size,
+				 //blocks that do not compress are sent as-is, in which case stored_size equals raw_size
+				 stored_size;
+};
+///Sends a contiguous block of lines as a version 2 block, filtering and compressing it if requested.
+///block is used as scratch space and does not hold the original data afterwards.
+void ns_image_socket_send_block(ns_socket_connection & connection, std::vector<ns_8_bit> & block, const unsigned long lines, const unsigned long bytes_per_line,
+								const unsigned long bytes_per_component, const unsigned long components, const bool compress, std::vector<ns_8_bit> & compressed);
+///Recieves a version 2 block into block, returning the number of lines it contains.
+unsigned long ns_image_socket_recieve_block(ns_socket_connection & connection, std::vector<ns_8_bit> & block, const unsigned long bytes_per_line,
+											const unsigned long bytes_per_component, const unsigned long components, std::vector<ns_8_bit> & compressed);
+
+///Sends a synthetic image over a loopback connection on the specified port using each protocol version,
+///and reports the throughput of each.
+void ns_benchmark_image_socket_protocols(const unsigned int port, std::ostream & out);
+
 
 #pragma warning(disable: 4355)
 ///Sends an image stream over a socket
@@ -29,14 +73,20 @@ template<class ns_component>
 class ns_image_socket_sender: public ns_image_stream_reciever<ns_image_stream_static_buffer<ns_component> >{
 public:
 	
-	ns_image_socket_sender(const long max_line_block_height)
-		:socket_connection(0),byte_resize_factor(sizeof(ns_component)/sizeof(char)),ns_image_stream_reciever<ns_image_stream_static_buffer<ns_component> >(max_line_block_height,this){}
+	ns_image_socket_sender(const long max_line_block_height, const ns_image_socket_protocol_version protocol_version=ns_image_socket_protocol_1)
+		:socket_connection(0),byte_resize_factor(sizeof(ns_component)/sizeof(char)),protocol(protocol_version),blocks_sent(0),blocks_acknowledged(0),ns_image_stream_reciever<ns_image_stream_static_buffer<ns_component> >(max_line_block_height,this){}
 	#pragma warning(default: 4355)
 
 	void bind_socket(ns_socket_connection & connection){
 		socket_connection = &connection;
 
 	}
+	///compression and window are requested from version 2 recievers, which may decline them.
+	void set_protocol(const ns_image_socket_protocol_version protocol_version, const bool compress=false, const unsigned int window=8){
+		protocol = protocol_version;
+		requested_capabilities.flags = compress?ns_image_socket_capabilities::ns_compression:0;
+		requested_capabilities.window = window;
+	}
 
 	///prepare to send an image over the socket.
 	bool init(const ns_image_properties & properties){
@@ -48,6 +98,15 @@ public:
 		bprop.width = properties.width*properties.components;
 		bool resized(buffer.resize(bprop));
 
+		if (protocol == ns_image_socket_protocol_2){
+			const int marker(ns_image_socket_capabilities::handshake_marker());
+			socket_connection->write(reinterpret_cast<const char *>(&marker), sizeof(marker));
+			ns_image_socket_write_capabilities(*socket_connection,requested_capabilities);
+			capabilities = ns_image_socket_read_capabilities(*socket_connection);
+			blocks_sent = 0;
+			blocks_acknowledged = 0;
+		}
+
 		//inform the reciever of the size of the image.
 		char * buf;
 		int len = ns_image_properties_to_char(properties, buf);
@@ -56,6 +115,7 @@ public:
 		socket_connection->write(buf, len);
 		delete buf;
 		my_lines_sent = 0;
+		components = properties.components;
 		return resized;
 	}
 	
@@ -69,6 +129,24 @@ public:
 		//bitmaps have a template specialization to handle them.
 		//cerr << "Sending line " << height <<" lines...\n";
 		//XXX
+		if (protocol == ns_image_socket_protocol_2){
+			//recievers reject empty blocks
+			if (height == 0)
+				return;
+			const unsigned long bytes_per_line(buffer.properties().width*byte_resize_factor);
+			block.resize(height*bytes_per_line);
+			for (unsigned int i = 0; i < height; i++)
+				memcpy(&block[i*bytes_per_line],buffer[i],bytes_per_line);
+			ns_image_socket_send_block(*socket_connection,block,height,bytes_per_line,sizeof(ns_component),components,
+										(capabilities.flags & ns_image_socket_capabilities::ns_compression) != 0,compressed);
+			blocks_sent++;
+			my_lines_sent += height;
+			if (capabilities.window != 0){
+				while(blocks_sent - blocks_acknowledged >= capabilities.window)
+					wait_for_acknowledgement();
+			}
+			return;
+		}
 		for (unsigned int i = 0; i < height; i++){
 			//cerr << "Sending " << buffer.properties().width*byte_resize_factor << " bytes.\n";
 			socket_connection->write(reinterpret_cast<const char *>(buffer[i]), buffer.properties().width*byte_resize_factor);
@@ -77,14 +155,36 @@ public:
 		//cerr << my_lines_sent << " lines sent.\n";
 		//XXX
 	}
-	void finish_recieving_image(){}
+	void finish_recieving_image(){
+		//make sure the whole image has arrived
+		if (protocol == ns_image_socket_protocol_2 && capabilities.window != 0){
+			while(blocks_acknowledged < blocks_sent)
+				wait_for_acknowledgement();
+		}
+	}
 protected:
+	void wait_for_acknowledgement(){
+		unsigned int acknowledged;
+		socket_connection->read(reinterpret_cast<char *>(&acknowledged),sizeof(acknowledged));
+		if (acknowledged <= blocks_acknowledged || acknowledged > blocks_sent)
+			throw ns_ex("ns_image_socket_sender::Recieved an invalid acknowledgement: ") << acknowledged << ns_network_io;
+		blocks_acknowledged = acknowledged;
+	}
 	ns_socket_connection * socket_connection;
 	ns_image_stream_static_buffer<ns_component> buffer;
 		//if we're sending images whose size are larger than a single byte, we'll need to send a correspondingly
 		//larger number of bytes per line.
 	char byte_resize_factor;
 	unsigned long my_lines_sent;
+
+	ns_image_socket_protocol_version protocol;
+	ns_image_socket_capabilities requested_capabilities,
+								 capabilities;
+	unsigned int blocks_sent,
+				 blocks_acknowledged;
+	unsigned long components;
+	std::vector<ns_8_bit> block,
+						  compressed;
 };
 
 //specialization for bitmaps
@@ -100,7 +200,7 @@ template<class ns_component>
 class ns_image_socket_reciever : public ns_image_stream_sender< ns_component, ns_image_socket_reciever< ns_component > >{
 public:
 	
-	ns_image_socket_reciever():socket_connection(0),byte_resize_factor(sizeof(ns_component)/sizeof(char)),ns_image_stream_sender<ns_component, ns_image_socket_reciever<ns_component> >(ns_image_properties(0,0,0), this){}
+	ns_image_socket_reciever():socket_connection(0),byte_resize_factor(sizeof(ns_component)/sizeof(char)),protocol(ns_image_socket_protocol_1),ns_image_stream_sender<ns_component, ns_image_socket_reciever<ns_component> >(ns_image_properties(0,0,0), this){}
 	
 #pragma warning(default:4355)
 	void bind_socket(ns_socket_connection & connection){
@@ -116,6 +216,21 @@ public:
 		if (sizeof(header_length) != socket_connection->read(reinterpret_cast<char *>(&header_length),sizeof(header_length))){
 			throw ns_ex("Read improper length header!");
 		}
+		protocol = ns_image_socket_protocol_1;
+		if (header_length == ns_image_socket_capabilities::handshake_marker()){
+			//accept whatever the sender requests that we support
+			capabilities = ns_image_socket_read_capabilities(*socket_connection);
+			if (capabilities.version < ns_image_socket_protocol_2)
+				throw ns_ex("ns_image_socket_reciever::Sender requested an unknown protocol version: ") << capabilities.version << ns_network_io;
+			capabilities.version = ns_image_socket_protocol_2;
+			capabilities.flags &= ns_image_socket_capabilities::ns_compression;
+			ns_image_socket_write_capabilities(*socket_connection,capabilities);
+			protocol = ns_image_socket_protocol_2;
+			if (sizeof(header_length) != socket_connection->read(reinterpret_cast<char *>(&header_length),sizeof(header_length)))
+				throw ns_ex("Read improper length header!");
+		}
+		if (header_length <= 0)
+			throw ns_ex("ns_image_socket_reciever::Read an invalid header length: ") << header_length << ns_network_io;
 
 		char * buf = new char[header_length];
 		socket_connection->read(buf,header_length);
@@ -127,24 +242,27 @@ public:
 		bprop.width = ns_image_stream_sender< ns_component, ns_image_socket_reciever< ns_component > >::_properties.width*ns_image_stream_sender< ns_component, ns_image_socket_reciever< ns_component > >::_properties.components;
 		buffer.resize(bprop);
 		my_lines_received = 0;
-
+		lines_in_block = 0;
+		current_line_in_block = 0;
+		blocks_received = 0;
+		lines_in_blocks_received = 0;
 	}
 	template<class write_buffer>
 	 void send_lines(write_buffer & lines, unsigned int count){
-		//recieve in chunks of 512 lines
-		unsigned long lines_received_so_far = 0;
-		while (lines_received_so_far < count){
-			unsigned long lines_to_recieve = count - lines_received_so_far;
-			if (lines_to_recieve > 512)
-				lines_to_recieve = 512;
-
-			char * buf;
-			for (unsigned int i = 0; i < lines_to_recieve; i++){
-				buf = reinterpret_cast<char *>(lines[i]);
-				//cerr << "Recieving " << buffer.properties().width*byte_resize_factor << " bytes.\n";
-				socket_connection->read(&buf[lines_received_so_far],buffer.properties().width*byte_resize_factor);
+		const unsigned long bytes_per_line(buffer.properties().width*byte_resize_factor);
+		if (protocol == ns_image_socket_protocol_2){
+			for (unsigned int i = 0; i < count; i++){
+				if (current_line_in_block == lines_in_block)
+					recieve_block(bytes_per_line);
+				memcpy(lines[i],&block[current_line_in_block*bytes_per_line],bytes_per_line);
+				current_line_in_block++;
 			}
-			lines_received_so_far += lines_to_recieve;
+			my_lines_received += count;
+			return;
+		}
+		for (unsigned int i = 0; i < count; i++){
+			//cerr << "Recieving " << buffer.properties().width*byte_resize_factor << " bytes.\n";
+			socket_connection->read(reinterpret_cast<char *>(lines[i]),bytes_per_line);
 		}
 		my_lines_received += count;
 		//std::cerr << "received " << my_lines_received << " lines.\n";
@@ -155,6 +273,31 @@ public:
 	ns_socket_connection * socket_connection;
 	char byte_resize_factor;
 	unsigned long my_lines_received;
+private:
+	void recieve_block(const unsigned long bytes_per_line){
+		const ns_image_properties & p(ns_image_stream_sender< ns_component, ns_image_socket_reciever< ns_component > >::_properties);
+		lines_in_block = ns_image_socket_recieve_block(*socket_connection,block,bytes_per_line,sizeof(ns_component),p.components,compressed);
+		current_line_in_block = 0;
+		lines_in_blocks_received += lines_in_block;
+		if (lines_in_blocks_received > p.height)
+			throw ns_ex("ns_image_socket_reciever::The sender sent more lines than the image contains") << ns_network_io;
+		blocks_received++;
+		//Acknowledgements are cumulative, so they are sent only every half window to keep the sender's window open
+		//without sending many small messages, and once the last block of the image has arrived.
+		if (capabilities.window != 0){
+			const unsigned int acknowledgement_interval((capabilities.window+1)/2);
+			if (blocks_received % acknowledgement_interval == 0 || lines_in_blocks_received == p.height)
+				socket_connection->write(reinterpret_cast<const char *>(&blocks_received),sizeof(blocks_received));
+		}
+	}
+	ns_image_socket_protocol_version protocol;
+	ns_image_socket_capabilities capabilities;
+	std::vector<ns_8_bit> block,
+						  compressed;
+	unsigned long lines_in_block,
+				  current_line_in_block,
+				  lines_in_blocks_received;
+	unsigned int blocks_received;
 };
 
 //specialization for bitmaps
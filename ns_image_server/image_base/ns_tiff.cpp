@@ -1,7 +1,10 @@
 #include "ns_tiff.h"
 #include <fstream>
+#include <string.h>
+#include "zlib.h"
 
 #include "ns_xmp_encoder.h"
+#include "ns_thread_pool.h"
 
 void ns_throw_exception(const ns_ex & ex){
 	throw ns_ex(ex.text());
@@ -111,15 +114,459 @@ ns_tiff_compression_type ns_get_tiff_compression_type(const ns_image_type & type
 	return ns_tiff_compression_lzw;;
 }
 
-template<>
-unsigned int ns_tiff_image_input_file<ns_8_bit>::readEncodedStrip(TIFF * image, const unsigned int current_strip, ns_8_bit * comp_buf,const unsigned int length){
-	
-	unsigned int r(TIFFReadEncodedStrip(image,current_strip,comp_buf,length));
-	if (client_data.exception_thrown()){
-		cerr << "12";
-			ns_throw_exception(client_data.ex());
+unsigned long ns_tiff_threads_per_file(1);
+void ns_set_tiff_number_of_threads(const unsigned long number_of_threads){
+	ns_tiff_threads_per_file = (number_of_threads == 0)?1:number_of_threads;
+}
+unsigned long ns_tiff_number_of_threads(){
+	return ns_tiff_threads_per_file;
+}
+
+//A single strip or tile to be decoded by an ns_tiff_chunk_reader, or encoded by an ns_tiff_chunk_writer
+class ns_tiff_chunk_job : public ns_thread_pool_job{
+public:
+	ns_tiff_chunk_job(ns_tiff_chunk_reader * r, ns_tiff_chunk_writer * w, const unsigned long chunk_, const unsigned long tile_):reader(r),writer(w),chunk(chunk_),tile(tile_){}
+	void run(const unsigned long thread_id){
+		if (reader != 0)
+			reader->decode(chunk,tile,thread_id);
+		else writer->encode(chunk,tile,thread_id);
+	}
+private:
+	ns_tiff_chunk_reader * reader;
+	ns_tiff_chunk_writer * writer;
+	unsigned long chunk,
+				  tile;
+};
+
+void ns_run_tiff_chunk_jobs(std::vector<ns_tiff_chunk_job> & jobs, ns_thread_pool & pool){
+	std::vector<ns_thread_pool_job *> job_pointers(jobs.size());
+	for (unsigned int i = 0; i < jobs.size(); i++)
+		job_pointers[i] = &jobs[i];
+	pool.run(job_pointers);
+}
+
+void ns_throw_stored_tiff_error(ns_safe_tiff_client_data & client_data){
+	if (!client_data.exception_thrown())
+		return;
+	ns_ex ex(client_data.ex());
+	client_data.clear();
+	throw ex;
+}
+
+//Each worker thread of an ns_tiff_chunk_reader reads from its own libtiff handle
+struct ns_tiff_chunk_reader_handle{
+	ns_tiff_chunk_reader_handle():image(0),client_data(0){}
+	TIFF * image;
+	ns_safe_tiff_client_data * client_data;
+	//client data for handles opened by the chunk reader itself
+	ns_safe_tiff_client_data own_client_data;
+	std::vector<ns_8_bit> tile_buffer;
+};
+
+ns_tiff_chunk_reader::ns_tiff_chunk_reader():height(0),bytes_per_line(0),bytes_per_pixel(0),rows_per_chunk(0),tiles_per_chunk(0),number_of_chunks(0),
+	chunks_per_batch(0),first_buffered_chunk(0),buffered_chunks(0),pool(0){}
+
+void ns_tiff_chunk_reader::open(const std::string & filename_, TIFF * image, ns_safe_tiff_client_data * client_data, const ns_tiff_info & info_, const ns_image_properties & properties, const unsigned long bytes_per_component){
+	close();
+	filename = filename_;
+	info = info_;
+	height = properties.height;
+	bytes_per_pixel = properties.components*bytes_per_component;
+	bytes_per_line = properties.width*bytes_per_pixel;
+	if (info.tiled){
+		rows_per_chunk = info.tile_height;
+		tiles_per_chunk = (properties.width + info.tile_width-1)/info.tile_width;
+	}
+	else{
+		rows_per_chunk = info.rows_per_strip;
+		tiles_per_chunk = 1;
+	}
+	//the rows per strip of single-strip images is often left at its maximum value
+	if (rows_per_chunk > height)
+		rows_per_chunk = height;
+	number_of_chunks = (height + rows_per_chunk-1)/rows_per_chunk;
+
+	pool = new ns_thread_pool(ns_tiff_number_of_threads());
+	chunks_per_batch = pool->number_of_threads();
+	if (chunks_per_batch > number_of_chunks)
+		chunks_per_batch = number_of_chunks;
+
+	handles.resize(pool->number_of_threads());
+	for (unsigned int i = 0; i < handles.size(); i++)
+		handles[i] = new ns_tiff_chunk_reader_handle;
+	handles[0]->image = image;
+	handles[0]->client_data = client_data;
+
+	buffer.resize(chunks_per_batch*rows_per_chunk*bytes_per_line);
+	first_buffered_chunk = 0;
+	buffered_chunks = 0;
+}
+
+const ns_8_bit * ns_tiff_chunk_reader::line(const unsigned long y){
+	const unsigned long chunk(y/rows_per_chunk);
+	if (chunk < first_buffered_chunk || chunk >= first_buffered_chunk + buffered_chunks)
+		decode_chunks(chunk);
+	return &buffer[(y - first_buffered_chunk*rows_per_chunk)*bytes_per_line];
+}
+
+void ns_tiff_chunk_reader::decode_chunks(const unsigned long first_chunk){
+	buffered_chunks = 0;
+	first_buffered_chunk = first_chunk;
+	unsigned long chunks(number_of_chunks - first_chunk);
+	if (chunks > chunks_per_batch)
+		chunks = chunks_per_batch;
+
+	if (chunks*tiles_per_chunk == 1)
+		decode(first_chunk,0,0);
+	else{
+		std::vector<ns_tiff_chunk_job> jobs;
+		jobs.reserve(chunks*tiles_per_chunk);
+		for (unsigned long c = 0; c < chunks; c++)
+			for (unsigned long t = 0; t < tiles_per_chunk; t++)
+				jobs.push_back(ns_tiff_chunk_job(this,0,first_chunk+c,t));
+		ns_run_tiff_chunk_jobs(jobs,*pool);
+	}
+	buffered_chunks = chunks;
+}
+
+void ns_tiff_chunk_reader::decode(const unsigned long chunk, const unsigned long tile, const unsigned long thread_id){
+	ns_tiff_chunk_reader_handle & h(*handles[thread_id]);
+	if (h.image == 0){
+		h.client_data = &h.own_client_data;
+		h.own_client_data.data.store_errors = true;
+		h.image = ns_tiff_open(filename.c_str(),&h.own_client_data.data,"r");
+		ns_throw_stored_tiff_error(h.own_client_data);
+		if (h.image == 0)
+			throw ns_ex("ns_tiff_chunk_reader::Could not open ") << filename << ns_file_io;
+	}
+
+	ns_8_bit * dest(&buffer[(chunk-first_buffered_chunk)*rows_per_chunk*bytes_per_line]);
+	unsigned long rows(height - chunk*rows_per_chunk);
+	if (rows > rows_per_chunk)
+		rows = rows_per_chunk;
+
+	if (!info.tiled){
+		const tsize_t bytes_read(TIFFReadEncodedStrip(h.image,chunk,dest,rows*bytes_per_line));
+		ns_throw_stored_tiff_error(*h.client_data);
+		if (bytes_read == -1)
+			throw ns_ex("ns_tiff_chunk_reader::Could not read strip ") << chunk << ns_file_io;
+		return;
+	}
+
+	const unsigned long tile_line_length(info.tile_width*bytes_per_pixel);
+	h.tile_buffer.resize(tile_line_length*info.tile_height);
+	const tsize_t bytes_read(TIFFReadEncodedTile(h.image,chunk*tiles_per_chunk+tile,&h.tile_buffer[0],h.tile_buffer.size()));
+	ns_throw_stored_tiff_error(*h.client_data);
+	if (bytes_read == -1)
+		throw ns_ex("ns_tiff_chunk_reader::Could not read tile ") << chunk*tiles_per_chunk+tile << ns_file_io;
+
+	//tiles on the right and bottom edges of the image are padded.
+	const unsigned long x_offset(tile*tile_line_length);
+	unsigned long length(bytes_per_line - x_offset);
+	if (length > tile_line_length)
+		length = tile_line_length;
+	for (unsigned long y = 0; y < rows; y++)
+		memcpy(dest + y*bytes_per_line + x_offset,&h.tile_buffer[y*tile_line_length],length);
+}
+
+void ns_tiff_chunk_reader::close(){
+	for (unsigned int i = 0; i < handles.size(); i++){
+		//the first handle belongs to the caller
+		if (handles[i]->image != 0 && handles[i]->client_data == &handles[i]->own_client_data)
+			TIFFClose(handles[i]->image);
+		delete handles[i];
+	}
+	handles.resize(0);
+	if (pool != 0){
+		delete pool;
+		pool = 0;
+	}
+	std::vector<ns_8_bit>().swap(buffer);
+	buffered_chunks = 0;
+}
+
+//Produces the same code stream as libtiff's LZWEncode() and LZWPostEncode().
+//The string table is indexed using libtiff's open addressing hash,
+//and is reset whenever libtiff's would be, so that files are identical to those produced by libtiff.
+class ns_tiff_lzw_encoder{
+public:
+	ns_tiff_lzw_encoder():table(hash_size){}
+	void encode(const ns_8_bit * data, const unsigned long size, std::vector<ns_8_bit> & output){
+		out = &output;
+		out->resize(0);
+		out->reserve(size/2+16);
+		next_data = 0;
+		next_bits = 0;
+		nbits = bits_min;
+		output_count = 0;
+		reset();
+		long input_count(1),
+			 checkpoint(check_gap),
+			 ratio(0);
+		int ent(data[0]);
+		for (unsigned long i = 1; i < size; i++){
+			const int c(data[i]);
+			input_count++;
+			const long fcode((((long)c) << bits_max) + ent);
+			long h((c << hash_shift) ^ ent);
+			if (table[h].hash == fcode){
+				ent = table[h].code;
+				continue;
+			}
+			if (table[h].hash >= 0){
+				//primary hash failed; probe the secondary hash.
+				const long displacement((h == 0)?1:(hash_size - h));
+				bool found(false);
+				do{
+					if ((h -= displacement) < 0)
+						h += hash_size;
+					if (table[h].hash == fcode){
+						ent = table[h].code;
+						found = true;
+						break;
+					}
+				}
+				while(table[h].hash >= 0);
+				if (found)
+					continue;
+			}
+			//new string: emit the code for its prefix and add it to the table
+			put(ent);
+			ent = c;
+			table[h].code = free_ent++;
+			table[h].hash = fcode;
+			if (free_ent == code_max-1){
+				//table is full
+				input_count = 0;
+				ratio = 0;
+				reset();
+			}
+			else if (free_ent > maxcode){
+				nbits++;
+				maxcode = (1 << nbits)-1;
+			}
+			else if (input_count >= checkpoint){
+				//reset the table if the compression ratio has started to decrease
+				checkpoint = input_count + check_gap;
+				long r;
+				if (input_count > 0x007fffff){
+					r = output_count >> 8;
+					r = (r == 0)?0x7fffffff:(input_count/r);
+				}
+				else r = (input_count << 8)/output_count;
+				if (r <= ratio){
+					input_count = 0;
+					ratio = 0;
+					reset();
+				}
+				else ratio = r;
+			}
+		}
+		put(ent);
+		put(code_eoi);
+		if (next_bits > 0)
+			out->push_back((ns_8_bit)(next_data << (8-next_bits)));
+	}
+private:
+	enum{bits_min=9,bits_max=12,code_clear=256,code_eoi=257,code_first=258,code_max=4095,hash_size=9001,hash_shift=13-8,check_gap=10000};
+	struct ns_hash_entry{
+		long hash;
+		unsigned short code;
+	};
+	//clears the string table and tells the decoder to do the same
+	void reset(){
+		for (unsigned int i = 0; i < table.size(); i++)
+			table[i].hash = -1;
+		output_count = 0;
+		free_ent = code_first;
+		put(code_clear);
+		nbits = bits_min;
+		maxcode = (1 << bits_min)-1;
+	}
+	void put(const int code){
+		next_data = (next_data << nbits) | code;
+		next_bits += nbits;
+		while (next_bits >= 8){
+			out->push_back((ns_8_bit)(next_data >> (next_bits-8)));
+			next_bits -= 8;
+		}
+		output_count += nbits;
+	}
+	std::vector<ns_hash_entry> table;
+	std::vector<ns_8_bit> * out;
+	unsigned long next_data;
+	long next_bits,
+		 output_count;
+	int nbits,
+		maxcode,
+		free_ent;
+};
+
+template<class ns_component>
+void ns_tiff_horizontal_difference(ns_component * data, const unsigned long row_length, const unsigned long number_of_rows, const unsigned long components){
+	for (unsigned long y = 0; y < number_of_rows; y++){
+		ns_component * row(data + y*row_length);
+		for (unsigned long x = row_length-1; x >= components; x--)
+			row[x] -= row[x-components];
 	}
-	return r;
+}
+
+ns_tiff_chunk_writer::ns_tiff_chunk_writer():image(0),client_data(0),compression(ns_tiff_compression_lzw),use_libtiff_encoder(false),byte_swapped(false),
+	height(0),bytes_per_line(0),bytes_per_pixel(0),bytes_per_component(0),components(0),rows_per_chunk(0),tile_size(0),tiles_per_chunk(0),
+	chunks_per_batch(0),lines_in_buffer(0),first_buffered_chunk(0),pool(0){}
+
+void ns_tiff_chunk_writer::open(TIFF * image_, ns_safe_tiff_client_data * client_data_, const ns_tiff_compression_type & compression_, const ns_image_properties & properties,
+								const unsigned long bytes_per_component_,const unsigned long rows_per_strip, const unsigned long tile_size_){
+	close();
+	image = image_;
+	client_data = client_data_;
+	compression = compression_;
+	height = properties.height;
+	components = properties.components;
+	bytes_per_component = bytes_per_component_;
+	bytes_per_pixel = components*bytes_per_component;
+	bytes_per_line = properties.width*bytes_per_pixel;
+	tile_size = tile_size_;
+	if (tile_size == 0){
+		rows_per_chunk = rows_per_strip;
+		tiles_per_chunk = 1;
+	}
+	else{
+		rows_per_chunk = tile_size;
+		tiles_per_chunk = (properties.width + tile_size-1)/tile_size;
+	}
+	use_libtiff_encoder = compression == ns_tiff_compression_jp2000 || (bytes_per_component != 1 && bytes_per_component != 2);
+	byte_swapped = TIFFIsByteSwapped(image) != 0;
+
+	//libtiff's encoders write directly to the file, and so must be run serially.
+	pool = new ns_thread_pool(use_libtiff_encoder?1:ns_tiff_number_of_threads());
+	const unsigned long number_of_chunks((height + rows_per_chunk-1)/rows_per_chunk);
+	chunks_per_batch = pool->number_of_threads();
+	if (chunks_per_batch > number_of_chunks)
+		chunks_per_batch = number_of_chunks;
+
+	buffer.resize(chunks_per_batch*rows_per_chunk*bytes_per_line);
+	encoded.resize(chunks_per_batch*tiles_per_chunk);
+	chunk_scratch.resize(pool->number_of_threads());
+	lines_in_buffer = 0;
+	first_buffered_chunk = 0;
+}
+
+void ns_tiff_chunk_writer::write_buffered_chunks(){
+	const unsigned long chunks((lines_in_buffer + rows_per_chunk-1)/rows_per_chunk);
+	try{
+		std::vector<ns_tiff_chunk_job> jobs;
+		jobs.reserve(chunks*tiles_per_chunk);
+		for (unsigned long c = 0; c < chunks; c++)
+			for (unsigned long t = 0; t < tiles_per_chunk; t++)
+				jobs.push_back(ns_tiff_chunk_job(0,this,first_buffered_chunk+c,t));
+		ns_run_tiff_chunk_jobs(jobs,*pool);
+
+		if (!use_libtiff_encoder){
+			//write out the compressed chunks in order
+			for (unsigned long i = 0; i < jobs.size(); i++){
+				const unsigned long id(first_buffered_chunk*tiles_per_chunk + i);
+				std::vector<ns_8_bit> & data(encoded[i]);
+				const tsize_t bytes_written((tile_size == 0)?
+					TIFFWriteRawStrip(image,id,&data[0],data.size()):
+					TIFFWriteRawTile(image,id,&data[0],data.size()));
+				ns_throw_stored_tiff_error(*client_data);
+				if (bytes_written != (tsize_t)data.size())
+					throw ns_ex("ns_tiff_chunk_writer::Could not write ") << (unsigned long)data.size() << " bytes to tiff file; " << (long)bytes_written << " were written." << ns_file_io;
+			}
+		}
+	}
+	catch(...){
+		lines_in_buffer = 0;
+		throw;
+	}
+	first_buffered_chunk += chunks;
+	lines_in_buffer = 0;
+}
+
+void ns_tiff_chunk_writer::encode(const unsigned long chunk, const unsigned long tile, const unsigned long thread_id){
+	const unsigned long batch_chunk(chunk - first_buffered_chunk);
+	ns_8_bit * source(&buffer[batch_chunk*rows_per_chunk*bytes_per_line]);
+	unsigned long rows(lines_in_buffer - batch_chunk*rows_per_chunk);
+	if (rows > rows_per_chunk)
+		rows = rows_per_chunk;
+
+	ns_8_bit * data;
+	unsigned long row_length,
+				  number_of_rows;
+	if (tile_size == 0){
+		//strips are encoded in place
+		data = source;
+		row_length = bytes_per_line;
+		number_of_rows = rows;
+	}
+	else{
+		//tiles on the right and bottom edges of the image are padded with zeros
+		row_length = tile_size*bytes_per_pixel;
+		number_of_rows = tile_size;
+		std::vector<ns_8_bit> & tile_buffer(chunk_scratch[thread_id]);
+		tile_buffer.assign(row_length*number_of_rows,0);
+		const unsigned long x_offset(tile*row_length);
+		unsigned long length(bytes_per_line - x_offset);
+		if (length > row_length)
+			length = row_length;
+		for (unsigned long y = 0; y < rows; y++)
+			memcpy(&tile_buffer[y*row_length],source + y*bytes_per_line + x_offset,length);
+		data = &tile_buffer[0];
+	}
+	const unsigned long size(row_length*number_of_rows);
+
+	if (use_libtiff_encoder){
+		const tsize_t bytes_written((tile_size == 0)?
+			TIFFWriteEncodedStrip(image,chunk,data,size):
+			TIFFWriteEncodedTile(image,chunk*tiles_per_chunk+tile,data,size));
+		ns_throw_stored_tiff_error(*client_data);
+		if (bytes_written != (tsize_t)size)
+			throw ns_ex("ns_tiff_chunk_writer::Could not write ") << size << " bytes to tiff file; " << (long)bytes_written << " were written." << ns_file_io;
+		return;
+	}
+
+	//libtiff only applies the predictor to compressed images
+	if (compression != ns_tiff_compression_none){
+		if (bytes_per_component == 1)
+			ns_tiff_horizontal_difference(data,row_length,number_of_rows,components);
+		else ns_tiff_horizontal_difference(reinterpret_cast<ns_16_bit *>(data),row_length/2,number_of_rows,components);
+	}
+	if (byte_swapped && bytes_per_component == 2)
+		TIFFSwabArrayOfShort(reinterpret_cast<uint16 *>(data),size/2);
+
+	std::vector<ns_8_bit> & output(encoded[batch_chunk*tiles_per_chunk + tile]);
+	switch(compression){
+		case ns_tiff_compression_none:
+			output.assign(data,data+size);
+			break;
+		case ns_tiff_compression_lzw:{
+			ns_tiff_lzw_encoder lzw;
+			lzw.encode(data,size,output);
+			break;
+		}
+		case ns_tiff_compression_zip:{
+			uLongf compressed_size(compressBound(size));
+			output.resize(compressed_size);
+			if (compress2(&output[0],&compressed_size,data,size,Z_DEFAULT_COMPRESSION) != Z_OK)
+				throw ns_ex("ns_tiff_chunk_writer::Could not deflate tile ") << chunk*tiles_per_chunk+tile << ns_file_io;
+			output.resize(compressed_size);
+			break;
+		}
+		default: throw ns_ex("ns_tiff_chunk_writer::Unknown compression format requested!");
+	}
+}
+
+void ns_tiff_chunk_writer::close(){
+	if (pool != 0){
+		delete pool;
+		pool = 0;
+	}
+	std::vector<ns_8_bit>().swap(buffer);
+	encoded.resize(0);
+	chunk_scratch.resize(0);
+	lines_in_buffer = 0;
+	image = 0;
 }
 template<class T>
 void ns_set_tiff_field(TIFF * im,const long field,T val){
@@ -200,7 +647,7 @@ public:
 	}
 };
 
-void ns_set_default_tiff_parameters(const ns_image_properties & p,const ns_tiff_compression_type & t,const unsigned long bits_per_sample, const unsigned long rows_per_strip,TIFF * image){
+void ns_set_default_tiff_parameters(const ns_image_properties & p,const ns_tiff_compression_type & t,const unsigned long bits_per_sample, const unsigned long rows_per_strip,const unsigned long tile_size,TIFF * image){
 	
 	ns_set_tiff_field(image, TIFFTAG_IMAGEWIDTH, p.width);
 	ns_set_tiff_field(image, TIFFTAG_IMAGELENGTH, p.height);
@@ -218,7 +665,12 @@ void ns_set_default_tiff_parameters(const ns_image_properties & p,const ns_tiff_
 	ns_set_tiff_field(image, TIFFTAG_RESOLUTIONUNIT, RESUNIT_INCH);
 
 
-	ns_set_tiff_field(image, TIFFTAG_ROWSPERSTRIP, rows_per_strip);
+	if (tile_size == 0)
+		ns_set_tiff_field(image, TIFFTAG_ROWSPERSTRIP, rows_per_strip);
+	else{
+		ns_set_tiff_field(image, TIFFTAG_TILEWIDTH, (uint32)tile_size);
+		ns_set_tiff_field(image, TIFFTAG_TILELENGTH, (uint32)tile_size);
+	}
 
 	switch(t){
 		case ns_tiff_compression_none:		ns_set_tiff_field(image, TIFFTAG_COMPRESSION, COMPRESSION_NONE); break;
@@ -229,7 +681,9 @@ void ns_set_default_tiff_parameters(const ns_image_properties & p,const ns_tiff_
 		default: ns_throw_exception(ns_ex("ns_tiff_image_output_file::Unknown compression format requested!"));
 	}
 	
-	ns_set_tiff_field(image, TIFFTAG_PREDICTOR, PREDICTOR_HORIZONTAL);
+	//the predictor tag is only defined for compressed images
+	if (t != ns_tiff_compression_none)
+		ns_set_tiff_field(image, TIFFTAG_PREDICTOR, PREDICTOR_HORIZONTAL);
 	switch(p.components){
 		case 1: ns_set_tiff_field(image, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
 			break;
@@ -309,7 +763,19 @@ void ns_get_default_tiff_parameters(const unsigned char component_size, ns_image
 	if (TIFFGetField(image, TIFFTAG_PHOTOMETRIC, &photometric) == 0)
 		ns_throw_exception(ns_ex("ns_tiff_image_input_stream::Image does not specify it's photometric.")<< ns_file_io);
 
-	if (TIFFGetField(image, TIFFTAG_ROWSPERSTRIP, &tiff_info.rows_per_strip) == 0)
+	tiff_info.tiled = TIFFIsTiled(image) != 0;
+	tiff_info.tile_width = 0;
+	tiff_info.tile_height = 0;
+	if (tiff_info.tiled){
+		uint32 tile_width(0),tile_height(0);
+		if (TIFFGetField(image, TIFFTAG_TILEWIDTH, &tile_width) == 0 || TIFFGetField(image, TIFFTAG_TILELENGTH, &tile_height) == 0 ||
+			tile_width == 0 || tile_height == 0)
+			ns_throw_exception(ns_ex("ns_tiff_image_input_stream::Image does not specify its tile dimensions.")<< ns_file_io);
+		tiff_info.tile_width = tile_width;
+		tiff_info.tile_height = tile_height;
+		tiff_info.rows_per_strip = 0;
+	}
+	else if (TIFFGetField(image, TIFFTAG_ROWSPERSTRIP, &tiff_info.rows_per_strip) == 0)
 		ns_throw_exception(ns_ex("ns_tiff_image_input_stream::Image does not specify the number of rows per strip.")<< ns_file_io);
 	//else cerr << "Rows per strip: " << tiff_info.rows_per_strip << "\n";
 
@@ -327,17 +793,14 @@ void ns_get_default_tiff_parameters(const unsigned char component_size, ns_image
 	tiff_info.stripsize = TIFFStripSize(image);
 	tiff_info.number_of_strips = TIFFNumberOfStrips(image);
 
-	unsigned long tiles = 0;
-	
-    if (TIFFGetField(image, TIFFTAG_TILEWIDTH, &tiles) != 0 && tiles != 0)
-		ns_throw_exception(ns_ex("ns_tiff_image_input_stream::Image is stored as tiles.")<< ns_file_io);
-
 	switch(photometric){
 		case PHOTOMETRIC_RGB: properties.components = 3; break;
 		case PHOTOMETRIC_MINISWHITE: properties.components = 1; break;
 		case PHOTOMETRIC_MINISBLACK: properties.components = 1; break;
 		default:ns_throw_exception(ns_ex("ns_tiff_image_input_stream::Image posesses unknown photometric.")<< ns_file_io);
 	}	
+	if (tiff_info.tiled)
+		return;
 	if (tiff_info.stripsize < properties.width*properties.components*component_size)
 		ns_throw_exception(ns_ex("Strip size is smaller than a single line!")<< ns_file_io);
 	if (tiff_info.stripsize % (properties.width*properties.components*component_size) != 0)
@@ -5,6 +5,7 @@
 #include "tiffio.h"
 #include "ns_libtiff_interface.h"
 #include "ns_image.h"
+#include <vector>
 
 #define NS_DEFAULT_TIFF_LINES_PER_STRIP 50
 
@@ -14,6 +15,10 @@ struct ns_tiff_info{
 	unsigned int stripsize,
 				 number_of_strips,
 				 rows_per_strip;
+	//information about tile dimensions, for tiled images
+	bool tiled;
+	unsigned int tile_width,
+				 tile_height;
 	//information used during strip reading.
 	unsigned int current_strip,
 				 strip_pos,
@@ -61,13 +66,114 @@ void ns_initialize_libtiff();
 
 TIFF* TIFFOpen(const char* name, ns_tiff_client_data * client_data,const char* mode);
 
+typedef enum {ns_tiff_compression_none,ns_tiff_compression_lzw,ns_tiff_compression_zip,ns_tiff_compression_jp2000} ns_tiff_compression_type;
+
+///The number of threads used to compress or decompress each tiff file.
+///By default each file is handled by a single thread.
+void ns_set_tiff_number_of_threads(const unsigned long number_of_threads);
+unsigned long ns_tiff_number_of_threads();
+
+class ns_thread_pool;
+struct ns_tiff_chunk_reader_handle;
+class ns_tiff_chunk_job;
+
+///A tiff file is divided into independently compressed chunks: either strips, or rows of tiles.
+///ns_tiff_chunk_reader decompresses several consecutive chunks at once on a thread pool
+///and hands out their lines in order.
+///libtiff handles cannot be shared between threads, so each worker thread opens its own handle to the file.
+///Memory use is bounded by the number of chunks decompressed at once.
+class ns_tiff_chunk_reader{
+public:
+	ns_tiff_chunk_reader();
+	~ns_tiff_chunk_reader(){close();}
+	//image and client_data are the handle through which the file was opened, which is used by the first worker thread.
+	void open(const std::string & filename, TIFF * image, ns_safe_tiff_client_data * client_data, const ns_tiff_info & info, const ns_image_properties & properties, const unsigned long bytes_per_component);
+	//returns line y of the image.  Lines must be requested in increasing order.
+	const ns_8_bit * line(const unsigned long y);
+	void close();
+private:
+	void decode_chunks(const unsigned long first_chunk);
+	void decode(const unsigned long chunk, const unsigned long tile, const unsigned long thread_id);
+
+	std::string filename;
+	ns_tiff_info info;
+	unsigned long height,
+				  bytes_per_line,
+				  bytes_per_pixel,
+				  rows_per_chunk,
+				  tiles_per_chunk,
+				  number_of_chunks,
+				  chunks_per_batch,
+				  first_buffered_chunk,
+				  buffered_chunks;
+	std::vector<ns_8_bit> buffer;
+	std::vector<ns_tiff_chunk_reader_handle *> handles;
+	ns_thread_pool * pool;
+	friend class ns_tiff_chunk_job;
+};
+
+///ns_tiff_chunk_writer collects image lines into strips, or rows of tiles, and compresses a batch of chunks at once on a thread pool.
+///Compressed chunks are written to the file in order as raw strips or tiles once the whole batch has finished,
+///so memory use is bounded by the batch size regardless of the image size.
+///Uncompressed, LZW, and deflate chunks are encoded by ns_tiff_chunk_writer itself; JPEG 2000 is left to libtiff.
+///Unlike libtiff 3.8's encoder, the horizontal predictor is applied before 16 bit values are byte swapped,
+///so 16 bit images written on little-endian machines can be read back correctly.
+class ns_tiff_chunk_writer{
+public:
+	ns_tiff_chunk_writer();
+	~ns_tiff_chunk_writer(){close();}
+	void open(TIFF * image, ns_safe_tiff_client_data * client_data, const ns_tiff_compression_type & compression, const ns_image_properties & properties,
+			  const unsigned long bytes_per_component,const unsigned long rows_per_strip, const unsigned long tile_size);
+	//the buffer into which the next line of the image should be written
+	ns_8_bit * next_line(){return &buffer[lines_in_buffer*bytes_per_line];}
+	//called once the next line has been written to the buffer
+	void line_written(){
+		lines_in_buffer++;
+		if (lines_in_buffer == rows_per_chunk*chunks_per_batch)
+			write_buffered_chunks();
+	}
+	//writes out any lines remaining in the buffer
+	void finish(){
+		if (lines_in_buffer > 0)
+			write_buffered_chunks();
+	}
+	void close();
+private:
+	void write_buffered_chunks();
+	void encode(const unsigned long chunk, const unsigned long tile, const unsigned long thread_id);
+
+	TIFF * image;
+	ns_safe_tiff_client_data * client_data;
+	ns_tiff_compression_type compression;
+	bool use_libtiff_encoder,
+		 byte_swapped;
+	unsigned long height,
+				  bytes_per_line,
+				  bytes_per_pixel,
+				  bytes_per_component,
+				  components,
+				  rows_per_chunk,
+				  tile_size,
+				  tiles_per_chunk,
+				  chunks_per_batch,
+				  lines_in_buffer,
+				  first_buffered_chunk;
+	std::vector<ns_8_bit> buffer;
+	//one entry per strip or tile in the batch
+	std::vector<std::vector<ns_8_bit> > encoded;
+	//scratch space for each worker thread
+	std::vector<std::vector<ns_8_bit> > chunk_scratch;
+	ns_thread_pool * pool;
+	friend class ns_tiff_chunk_job;
+};
+
 template<class ns_component>
 class ns_tiff_image_input_file: public ns_image_input_file<ns_component>{
 	ns_safe_tiff_client_data client_data;
 	
 public:
 
-	ns_tiff_image_input_file():strip_buffer(0){ns_initialize_libtiff();}
+	ns_tiff_image_input_file():image(0){ns_initialize_libtiff();}
 	//~ns_image_input_file(){close();}
 	//open and close files
 
@@ -108,12 +214,7 @@ public:
 						<< ns_image_input_file<ns_component>::_properties.components << ")");
 			}
 
-			strip_buffer = (ns_component *)_TIFFmalloc(sizeof(ns_component)*tiff_info.stripsize);
-			
-			if (client_data.exception_thrown()){
-				std::cerr << "4";
-				ns_throw_exception(client_data.ex());
-			}
+			chunk_reader.open(filename,image,&client_data,tiff_info,ns_image_input_file<ns_component>::_properties,sizeof(ns_component));
 			opened_filename = filename;
 			lines_read = 0;
 		}
@@ -143,55 +244,12 @@ public:
 
 	//read in a single line
 	bool read_line(ns_component * buffer){
-		try{
-			if (lines_read == ns_image_input_file<ns_component>::_properties.height)
-				ns_throw_exception(ns_ex("ns_tiff::read_line()::Attempting to read too many lines from file: Requested line ") << (lines_read+1) << " from an image with height " << ns_image_input_file<ns_component>::_properties.height);
-			
-			unsigned int bytes_read;
-			//read in another strip when strip buffer is empty
-			if (tiff_info.rows_read_from_current_strip == tiff_info.rows_per_strip){
-				bytes_read = TIFFReadEncodedStrip(image,tiff_info.current_strip,strip_buffer,tiff_info.stripsize);
-				tiff_info.current_strip++;
-				tiff_info.rows_read_from_current_strip = 0;
-				//cerr << "Read in strip" << tiff_info.current_strip << "\n";
-			}
-			
-			if (client_data.exception_thrown()){
-				std::cerr << "5";
-				ns_throw_exception(client_data.ex());
-			}
-
-		//	std::cerr << "Outputting line " << tiff_info.rows_read_from_current_strip << " from buffered strip " << tiff_info.current_strip << "\n";
-			//read from the buffer
-			memcpy(buffer,&(strip_buffer[tiff_info.rows_read_from_current_strip*ns_image_input_file<ns_component>::_properties.width*ns_image_input_file<ns_component>::_properties.components]),
-				ns_image_input_file<ns_component>::_properties.width*ns_image_input_file<ns_component>::_properties.components*sizeof(ns_component));
-			tiff_info.rows_read_from_current_strip++;
-			lines_read++;
-			return true;
-
-		}
-		catch(ns_ex & ex){
-			try{
-			_TIFFfree(strip_buffer);
-			}
-			catch(...){
-				std::cerr << "An error occurred freeing the strip buffer.\n";
-			}
-			strip_buffer = 0;
-			ns_throw_exception(ex);
-		}
-		catch(...){
-			try{
-				_TIFFfree(strip_buffer);
-			}
-			catch(...){
-				std::cerr << "An error occurred freeing the strip buffer.\n";
-			}
-	
-			strip_buffer = 0;
-			throw;
-		}
-		return false;
+		if (lines_read == ns_image_input_file<ns_component>::_properties.height)
+			ns_throw_exception(ns_ex("ns_tiff::read_line()::Attempting to read too many lines from file: Requested line ") << (lines_read+1) << " from an image with height " << ns_image_input_file<ns_component>::_properties.height);
+		memcpy(buffer,chunk_reader.line(lines_read),
+			ns_image_input_file<ns_component>::_properties.width*ns_image_input_file<ns_component>::_properties.components*sizeof(ns_component));
+		lines_read++;
+		return true;
 	}
 
 	//read a position/component from the specified buffer.
@@ -206,61 +264,55 @@ public:
 	}
 private:
 
-	//instantiated for different component size specifications
-	unsigned int readEncodedStrip(TIFF * image, const unsigned int current_strip, ns_component * comp_buf,const unsigned int length);
-
 	TIFF *image;
 	ns_tiff_info tiff_info;
-	ns_component * strip_buffer;
+	ns_tiff_chunk_reader chunk_reader;
 	std::string opened_filename;
 
 	unsigned long lines_read;
 
 	void close_file(){
-		if (strip_buffer != 0){
+		if (image != 0){
 			try{
+				chunk_reader.close();
 				TIFFClose(image);
-				_TIFFfree(strip_buffer);
-				strip_buffer = 0;
+				image = 0;
 			}
 			catch(ns_ex & ex){
-				strip_buffer = 0;
+				image = 0;
 				std::cerr << "ns_tiff_image_input_file::close_file wants to throw an exception, but cannot: " << ex.text();
 			}
 			catch(std::exception e){
-				strip_buffer = 0;
+				image = 0;
 				ns_ex ex(e);
 				std::cerr << "ns_tiff_image_input_file::close_file wants to throw an exception, but cannot: " << ex.text();
 			}
 			catch(...){
-				strip_buffer = 0;
+				image = 0;
 				std::cerr << "ns_tiff_image_input_file::close_file wants to throw an exception, but cannot: Unknown Error!";
 			}
 		}
 	}
 };
 
-typedef enum {ns_tiff_compression_none,ns_tiff_compression_lzw,ns_tiff_compression_zip,ns_tiff_compression_jp2000} ns_tiff_compression_type;
 template<class ns_component>
 class ns_tiff_image_output_file;
 
 ns_tiff_compression_type ns_get_tiff_compression_type(const ns_image_type & type);
 
-void ns_set_default_tiff_parameters(const ns_image_properties & p, const ns_tiff_compression_type & t,const unsigned long bits_per_sample, const unsigned long rows_per_strip,TIFF * file);
+//if tile_size is non-zero, the image is stored as square tiles of that size rather than as strips
+void ns_set_default_tiff_parameters(const ns_image_properties & p, const ns_tiff_compression_type & t,const unsigned long bits_per_sample, const unsigned long rows_per_strip,const unsigned long tile_size,TIFF * file);
 
 #define NS_TIFF_WIDTH ns_image_output_file<ns_component>::_properties.width*ns_image_output_file<ns_component>::_properties.components
 
-//A NOTABLE BUG:
-//Somewhere in either ns_image.h, ns_image_storage.h, or here, writing of 16 bit tiffs is broken.
-//The images seem to be garbled in such a way that only the left half of the image can be read correctly
+//Images are written as strips by default.  Specifying a tile_size (a multiple of 16) stores the image as tiles instead.
 template<class ns_component>
 class ns_tiff_image_output_file : public ns_image_output_file<ns_component>{
 	ns_safe_tiff_client_data client_data;
 public:
-	ns_tiff_image_output_file(const ns_tiff_compression_type ctype=ns_tiff_compression_lzw):
-	  	output_buffer_height(0),current_output_strip(0),output_buf(0),image(0),
-		  lines_received(0),rows_per_strip(NS_DEFAULT_TIFF_LINES_PER_STRIP),
-		  compression_type(ctype){ns_initialize_libtiff();}
+	ns_tiff_image_output_file(const ns_tiff_compression_type ctype=ns_tiff_compression_lzw, const unsigned long tile_size_=0):
+	  	rows_per_strip(NS_DEFAULT_TIFF_LINES_PER_STRIP),tile_size(tile_size_),
+		  compression_type(ctype),image(0),lines_received(0){ns_initialize_libtiff();}
 
 	~ns_tiff_image_output_file(){
 		try{close();}
@@ -288,28 +340,28 @@ public:
 				ns_throw_exception(ns_ex("Cannot create an image with 0 width!"));
 			if (properties.components == 0)
 				ns_throw_exception(ns_ex("Cannot create an image with 0 pixel components!"));
+			if (tile_size % 16 != 0)
+				ns_throw_exception(ns_ex("Tile sizes must be a multiple of 16: ") << tile_size);
 			rows_per_strip = 512*1024/(sizeof(ns_component)*NS_TIFF_WIDTH);
 			if (rows_per_strip == 0)
 				rows_per_strip = 1;
 			if (rows_per_strip > properties.height)
 				rows_per_strip = properties.height;
 
-			ns_set_default_tiff_parameters(properties,compression_type,sizeof(ns_component)*8,rows_per_strip,image);
+			ns_set_default_tiff_parameters(properties,compression_type,sizeof(ns_component)*8,rows_per_strip,tile_size,image);
 
 			if (client_data.exception_thrown()){
 				std::cerr << "7";
 				throw client_data.ex();
 			}
 
-			output_buf = (ns_component *)_TIFFmalloc(sizeof(ns_component)*rows_per_strip*NS_TIFF_WIDTH);
+			chunk_writer.open(image,&client_data,compression_type,properties,sizeof(ns_component),rows_per_strip,tile_size);
 			
 			if (client_data.exception_thrown()){
 				std::cerr << "8";
 				throw client_data.ex();
 			}
-
-			output_buffer_height = 0;
-			current_output_strip = 0;
+			lines_received = 0;
 		}
 		catch(ns_ex & ex){
 			throw ns_ex("ns_tiff_image_output_file::open_file()::") << ex.text() << "::\"" << ns_file_io << filename.c_str() << "\"";
@@ -322,22 +374,17 @@ public:
 
 	void close(){
 		try{
-			if (output_buf != 0){
-				if (output_buffer_height != 0){
-					//std::cerr  << "Flusing out remaining " << output_buffer_height <<" lines into strip " << current_output_strip << "\n";
-					long ret = TIFFWriteEncodedStrip(image,current_output_strip,output_buf,sizeof(ns_component)*NS_TIFF_WIDTH*output_buffer_height);
-					
-						if (client_data.exception_thrown())
-							std::cerr << "ns_tiff_image_output_file::close_file() wants to throw an exception, but cannot: " << client_data.ex().text() << "\n";
-					if (ret != sizeof(ns_component)*NS_TIFF_WIDTH*output_buffer_height){
-						std::cerr << "ns_tiff_image_output_file::close_file() wants to throw an exception, but cannot: Could not write ";
-						std::cerr << sizeof(ns_component)*NS_TIFF_WIDTH*output_buffer_height << " bytes to tiff file; " << ret << " were written.";
-					}
+			if (image != 0){
+				try{
+					//write out any lines remaining in the last strip
+					chunk_writer.finish();
 				}
+				catch(ns_ex & ex){
+					std::cerr << "ns_tiff_image_output_file::close_file() wants to throw an exception, but cannot: " << ex.text() << "\n";
+				}
+				chunk_writer.close();
 				TIFFClose(image);
-				_TIFFfree(output_buf);
-				output_buf = 0;
-				output_buffer_height = 0;
+				image = 0;
 			}
 		}
 		catch(ns_ex & ex){
@@ -350,23 +397,9 @@ public:
 
 	//write a single line
 	bool write_line(const ns_component * buffer){
-		for (unsigned int i = 0; i < NS_TIFF_WIDTH; i++)
-			output_buf[output_buffer_height*NS_TIFF_WIDTH + i] = buffer[i];
-		//memcpy(&(output_buf[output_buffer_height*NS_TIFF_WIDTH]),buffer,sizeof(ns_component)*NS_TIFF_WIDTH);
-		output_buffer_height++;
+		memcpy(chunk_writer.next_line(),buffer,sizeof(ns_component)*NS_TIFF_WIDTH);
 		lines_received++;
-		if (output_buffer_height == rows_per_strip){
-		//	cerr << "Writing out strip " << current_output_strip << "\n";
-			long ret = TIFFWriteEncodedStrip(image,current_output_strip,output_buf,sizeof(ns_component)*NS_TIFF_WIDTH*output_buffer_height);
-			if (client_data.exception_thrown()){
-				std::cerr << "10";
-				throw client_data.ex();
-			}
-			if (ret != sizeof(ns_component)*NS_TIFF_WIDTH*output_buffer_height)
-				throw ns_ex("Could not write ") << sizeof(ns_component)*NS_TIFF_WIDTH*output_buffer_height << " bytes to tiff file; " << ret << " were written.";
-			output_buffer_height = 0;
-			current_output_strip++;
-		}
+		chunk_writer.line_written();
 		return true;
 	}
 	void write_lines(const ns_component ** buffer,const unsigned int n){
@@ -379,23 +412,14 @@ public:
 		return &(buffer[ns_image_output_file<ns_component>::_properties.components*x + component]);
 	}
 	private:
-	friend void ns_set_default_tiff_parameters(const ns_image_properties & p, const ns_tiff_compression_type & t,const unsigned long bits_per_sample, const unsigned long rows_per_strip,TIFF * file);
+	friend void ns_set_default_tiff_parameters(const ns_image_properties & p, const ns_tiff_compression_type & t,const unsigned long bits_per_sample, const unsigned long rows_per_strip,const unsigned long tile_size,TIFF * file);
 
-	unsigned long rows_per_strip;
+	unsigned long rows_per_strip,
+				  tile_size;
 	ns_tiff_compression_type compression_type;
 	TIFF *image;
-	ns_component * output_buf;
-	unsigned int output_buffer_height;
-	unsigned int current_output_strip;
+	ns_tiff_chunk_writer chunk_writer;
 	unsigned int lines_received;
 };
 
-
-template<>
-unsigned int ns_tiff_image_input_file<ns_8_bit>::readEncodedStrip(TIFF * image, const unsigned int current_strip, ns_8_bit * comp_buf,const unsigned int length);
-/*
-unsigned int ns_tiff_image_input_stream<ns_16_bit>::readEncodedStrip(TIFF * image, const unsigned int current_strip, ns_16_bit * comp_buf,const unsigned int length){
-	ns_8_bit * byte_buffer = reinterpret_cast<ns_8_bit *>(comp_buf);
-	return TIFFReadEncodedStrip(image,current_strip,byte_buffer,length*2);
-}*/
 #endif
@@ -127,7 +127,8 @@ public:
 	ns_segment_path_possible_solution_hash(){}
 	ns_segment_path_possible_solution_hash(const ns_segment_path_possible_solution & sol){
 		unsigned int pos(0);
-		sorted_solutions_temp.resize(sol.worms.size());
+		//worm detection solves many objects' segment clusters at once, so this is kept local to each call
+		std::vector<const ns_segment_cluster_solution * > sorted_solutions_temp(sol.worms.size());
 		for (unsigned int i = 0; i < sol.worms.size(); i++)
 			sorted_solutions_temp[i] = &sol.worms[i];
 		//cerr << "*";
@@ -163,10 +164,7 @@ public:
 		}
 	}
 	ns_segment * path[512];
-private:
-	static vector<const ns_segment_cluster_solution * > sorted_solutions_temp;
 };
-vector<const ns_segment_cluster_solution * > ns_segment_path_possible_solution_hash::sorted_solutions_temp;
 
 ostream & operator << (ostream & o, const ns_segment_path_possible_solution_hash & h){
 	h.out_debug(o);
@@ -222,40 +222,11 @@ public:
 		objects.resize(0);
 	}
 
-	void convert_bitmaps_into_node_graphs(const float resolution, const std::string & debug_filename){
-	//	unsigned long start_time = ns_current_time();
-		if (resolution <= 1201){
-			for (unsigned int i = 0; i < objects.size(); i++){
-				objects[i]->calculate_edges();
-				objects[i]->node_topology.build_via_delauny_method(objects[i]->edge_coordinates,objects[i]->edge_list,
-																			objects[i]->holes,debug_filename + "_" + ns_to_string(i));
-			}
-			remove_empty_spines();
-		}
-		else{
-			for (unsigned int i = 0; i < objects.size(); i++){
-				objects[i]->remove_small_holes();
-				objects[i]->node_topology.build_via_zhang_thinning(objects[i]->bitmap());
-			}
-		}
+	///Objects are processed independently of each other, in parallel.
+	///Each object's results are stored in the object itself, so they do not depend on the order in which objects are processed.
+	void convert_bitmaps_into_node_graphs(const float resolution, const std::string & debug_filename);
 
-	}
-
-	void calculate_segment_topologies_from_node_graphs(const bool do_multiple_worm_disambiguation){
-		//unsigned long start_time = ns_current_time();
-		//std::cerr << "Reducing node graphs: ";
-		std::cerr << "Fitting Splines...";
-		ns_progress_reporter pr(objects.size(),5);
-		for (unsigned int i = 0; i < objects.size(); i++){
-			pr(i);
-			//cerr << "WRITING DEBUG bitmap\n";
-			//ns_save_image("c:\\tt\\current_bitmap.tif",objects[i]->bitmap());
-			objects[i]->segment_cluster.compile(objects[i]->node_topology);
-			objects[i]->segment_cluster_solutions.calculate(objects[i]->segment_cluster,objects[i]->bitmap().properties().resolution,do_multiple_worm_disambiguation);
-		}
-		pr(objects.size());
-		//cerr << "Calculated segment topologies: " << ns_current_time() - start_time << "\n";
-	}
+	void calculate_segment_topologies_from_node_graphs(const bool do_multiple_worm_disambiguation);
 private:
 	///removes all regions whose delauny triangular mesh did not produce a valid spine
 	void remove_empty_spines();
@@ -4,6 +4,8 @@
 #include "ns_graph.h"
 #include "ns_spine_drawer.h"
 #include "ns_progress_reporter.h"
+#include "ns_thread_pool.h"
+#include "ns_svm_batch_classifier.h"
 
 using namespace std;
 
@@ -1392,6 +1394,52 @@ bool ns_detected_worm_info::is_a_worm(const ns_svm_model_specification & model){
 	#endif
 }
 
+void ns_detected_worm_info::classify_worms(const std::vector<ns_detected_worm_info *> & worms, const ns_svm_model_specification & model){
+	#if defined(NS_USE_MACHINE_LEARNING) && !defined(NS_USE_TINYSVM) && !defined(ALLOW_ALL_SPINE_PERMUTATIONS)
+		if (worms.empty())
+			return;
+		ns_svm_batch_classifier classifier;
+		classifier.set_model(model.model);
+		classifier.reserve((unsigned long)worms.size());
+		std::vector<ns_detected_worm_info *> worms_to_classify;
+		worms_to_classify.reserve(worms.size());
+
+		//handle objects whose status is known without running the SVM, exactly as is_a_worm(model) does
+		ns_detected_worm_stats stats;
+		for (unsigned int i = 0; i < worms.size(); i++){
+			ns_detected_worm_info & worm(*worms[i]);
+			stats = worm.generate_stats();
+			stats.specifiy_model(model);
+			if (stats.not_a_worm)
+				worm.is_a_worm_ = false;
+			else if (worm.must_be_a_worm)
+				worm.is_a_worm_ = true;
+			else if (worm.must_not_be_a_worm){
+				worm.is_a_worm_ = false;
+				worm.failure_reason << "Manual Override";
+			}
+			else{
+				stats.produce_dense_vector(classifier.add_object());
+				worms_to_classify.push_back(&worm);
+			}
+			worm.is_a_worm_set = true;
+		}
+
+		std::vector<double> decisions;
+		classifier.classify(decisions);
+		for (unsigned int i = 0; i < worms_to_classify.size(); i++){
+			worms_to_classify[i]->is_a_worm_ = (decisions[i] > 0);
+			if (!worms_to_classify[i]->is_a_worm_)
+				worms_to_classify[i]->failure_reason << "Failed SVM";
+		}
+	#else
+		for (unsigned int i = 0; i < worms.size(); i++){
+			worms[i]->is_a_worm_ = worms[i]->is_a_worm(model);
+			worms[i]->is_a_worm_set = true;
+		}
+	#endif
+}
+
 template<class image_type>
 inline void ns_fill_circle(const ns_vector_2d & center, const double &radius, image_type & out){
 	const unsigned int w(out.properties().width),
@@ -2341,6 +2389,33 @@ svm_node * ns_detected_worm_stats::produce_vector() const{
 
 		return node;
 	}
+
+void ns_detected_worm_stats::produce_dense_vector(double * vec) const{
+	if (_model->pca_spec.pc_vectors.size() == 0){
+		for (unsigned int i = 0; i < (unsigned int)ns_stat_number_of_stats;i++){
+			if (_model->included_statistics[i] == 0) continue;
+			vec[i] = scaled_statistic((ns_detected_worm_classifier)i);
+		}
+		return;
+	}
+	//Every principal component is calculated from the same normalized features,
+	//so they are normalized once here rather than once per component as in transformed_statistic().
+	double normalized[ns_stat_number_of_stats];
+	for (unsigned int i = 0; i < (unsigned int)ns_stat_number_of_stats; i++){
+		normalized[i] = statistics[i]-_model->statistics_ranges[i].avg;
+		if (_model->statistics_ranges[i].std != 0)
+			normalized[i] /=_model->statistics_ranges[i].std;
+	}
+	for (unsigned int i = 0; i < (unsigned int)ns_stat_number_of_stats;i++){
+		if (_model->included_statistics[i] == 0) continue;
+		if (!_model->statistics_ranges[i].specified)
+			throw ns_ex("ns_detected_worm_stats::Using unspecified range:") << i;
+		double value = 0;
+		for (unsigned int j = 0; j < (unsigned int)ns_stat_number_of_stats; j++)
+			value += _model->pca_spec.pc_vectors[i][j]*normalized[j];
+		vec[i] = value;
+	}
+}
 	#endif
 #endif
 
@@ -2791,6 +2866,36 @@ for (unsigned int i = 0; i < objects.size(); i++){
 	}
 	return number_of_worms;
 }
+
+//the number of putative worms ns_detected_worm_info::from_segment_cluster_solution() will produce from the object
+unsigned long ns_number_of_worms_produced_from_detected_object(const ns_detected_object & object){
+	const std::vector<ns_segment_cluster_solution_group> & groups(object.segment_cluster_solutions.mutually_exclusive_solution_groups);
+	if (groups.size() == 0 || groups[0].size() == 0)
+		return 0;
+	unsigned long number_of_worms(0);
+	for (unsigned int i = 0; i < groups.size(); i++)
+		number_of_worms+=(unsigned long)groups[i].size();
+	return number_of_worms;
+}
+
+///Converts the segment cluster solutions of one detected object into putative worms.
+///Each job writes to its own range of putative worms, so objects can be processed in parallel
+///while producing the same output order as processing them one after another.
+class ns_segment_cluster_solution_job : public ns_thread_pool_job{
+public:
+	ns_segment_cluster_solution_job():object(0),putative_worms(0),offset(0),mutually_exclusive_worm_groups(0),relative_grayscale_source(0),absolute_grayscale_source(0),visualization_type(ns_detected_worm_info::ns_vis_none){}
+	void run(const unsigned long thread_id){
+		ns_detected_worm_info::from_segment_cluster_solution(*object,*putative_worms,offset,*mutually_exclusive_worm_groups,*relative_grayscale_source,*absolute_grayscale_source,ns_detected_worm_info::ns_large_source_grayscale_images_provided,visualization_type);
+	}
+	ns_detected_object * object;
+	std::vector<ns_detected_worm_info> * putative_worms;
+	unsigned long offset;
+	std::vector<std::vector<ns_detected_worm_info *> > * mutually_exclusive_worm_groups;
+	const ns_image_standard * relative_grayscale_source,
+							* absolute_grayscale_source;
+	ns_detected_worm_info::ns_visualization_type visualization_type;
+};
+
 void ns_image_worm_detection_results::process_segment_cluster_solutions(std::vector<ns_detected_object *> & objects, const ns_image_standard &relative_grayscale_source, const ns_image_standard &absolute_grayscale_source, const ns_detected_worm_info::ns_visualization_type visualization_type, const unsigned long maximum_number_of_putative_worms){
 
 	//first we count the maximum number of worms that our algorithm could produce
@@ -2801,17 +2906,27 @@ void ns_image_worm_detection_results::process_segment_cluster_solutions(std::vec
 
 	//then we convert the detected objects to worms
 
-	cerr << "Solving segment clusters: ";
-	ns_progress_reporter pr(number_of_worms,5);
-
+	cerr << "Solving segment clusters...";
+	std::vector<ns_segment_cluster_solution_job> jobs(objects.size());
+	std::vector<ns_thread_pool_job *> job_pointers(objects.size());
 	unsigned long worms_found = 0;
 	for (unsigned long i = 0; i < (unsigned long)objects.size(); i++){
-		pr(worms_found);
-		worms_found+=ns_detected_worm_info::from_segment_cluster_solution(*objects[i],putative_worms,worms_found,mutually_exclusive_worm_groups[i],relative_grayscale_source,absolute_grayscale_source,ns_detected_worm_info::ns_large_source_grayscale_images_provided,visualization_type);
-		if (maximum_number_of_putative_worms != 0 && worms_found > maximum_number_of_putative_worms)
-			throw ns_ex("ns_image_worm_detection_results::process_segment_cluster_solutions()::The specified maximum number of putative worms (") << maximum_number_of_putative_worms << ") has been exceeded.";
-	}
-	pr(worms_found);
+		jobs[i].object = objects[i];
+		jobs[i].putative_worms = &putative_worms;
+		jobs[i].offset = worms_found;
+		jobs[i].mutually_exclusive_worm_groups = &mutually_exclusive_worm_groups[i];
+		jobs[i].relative_grayscale_source = &relative_grayscale_source;
+		jobs[i].absolute_grayscale_source = &absolute_grayscale_source;
+		jobs[i].visualization_type = visualization_type;
+		job_pointers[i] = &jobs[i];
+		worms_found+=ns_number_of_worms_produced_from_detected_object(*objects[i]);
+	}
+	if (maximum_number_of_putative_worms != 0 && worms_found > maximum_number_of_putative_worms)
+		throw ns_ex("ns_image_worm_detection_results::process_segment_cluster_solutions()::The specified maximum number of putative worms (") << maximum_number_of_putative_worms << ") has been exceeded.";
+
+	ns_thread_pool pool(ns_thread_pool::number_of_processors_per_process());
+	pool.run(job_pointers);
+	cerr << "Done.\n";
 
 	for (unsigned int i = 0; i < objects.size(); i++)
 		delete objects[i];
@@ -2879,6 +2994,13 @@ void ns_image_worm_detection_results::sort_putative_worms(const ns_svm_model_spe
 	actual_worms.reserve(putative_worms.size());
 	not_worms.reserve(putative_worms.size());	
 
+	//classify every candidate in the image at once
+	std::vector<ns_detected_worm_info *> candidates;
+	for (unsigned int i = 0; i < mutually_exclusive_worm_groups.size(); i++)
+		for (unsigned int g = 0; g < mutually_exclusive_worm_groups[i].size(); g++)
+			candidates.insert(candidates.end(),mutually_exclusive_worm_groups[i][g].begin(),mutually_exclusive_worm_groups[i][g].end());
+	ns_detected_worm_info::classify_worms(candidates,model);
+
 	for (unsigned int i = 0; i < mutually_exclusive_worm_groups.size(); i++){
 		std::vector<unsigned int> number_of_worms_in_exclusive_group;
 		std::vector<double> total_length_of_worms_in_exclusive_group;
@@ -2894,7 +3016,7 @@ void ns_image_worm_detection_results::sort_putative_worms(const ns_svm_model_spe
 		for (unsigned int g = 0; g < mutually_exclusive_worms.size(); g++){
 			for (unsigned int w = 0; w < mutually_exclusive_worms[g].size(); w++){
 				
-				mutually_exclusive_worms[g][w]->hand_annotations.identified_as_a_worm_by_machine = mutually_exclusive_worms[g][w]->is_a_worm(model);
+				mutually_exclusive_worms[g][w]->hand_annotations.identified_as_a_worm_by_machine = mutually_exclusive_worms[g][w]->is_a_worm();
 				if (mutually_exclusive_worms[g][w]->hand_annotations.identified_as_a_worm_by_machine){
 					total_length_of_worms_in_exclusive_group[g]+= mutually_exclusive_worms[g][w]->worm_shape.length;
 					number_of_worms_in_exclusive_group[g]++;
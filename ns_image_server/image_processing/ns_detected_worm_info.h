@@ -137,6 +137,9 @@ public:
 	svm_node * produce_vector() const;
 	///Deallocates memory allocated by produce_vector()
 	static void delete_vector(svm_node * node){delete[] node;}
+	///Writes the same features as produce_vector() into a dense array, such that element i holds
+	///the value of feature index i+1.  Elements of excluded features are left unchanged.
+	void produce_dense_vector(double * vec) const;
 	#endif
 	#endif
 
@@ -340,6 +343,9 @@ public:
 	///Using the specified machine learning model, returns true if the region is classified as a worm, false if it is not.
 	bool is_a_worm(const ns_svm_model_specification & model);
 	bool is_a_worm();
+	///Classifies each worm in the list, with the same result as calling is_a_worm(model) on each,
+	///but with the SVM run on all worms at once.
+	static void classify_worms(const std::vector<ns_detected_worm_info *> & worms, const ns_svm_model_specification & model);
 
 
 
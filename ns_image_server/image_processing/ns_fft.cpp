@@ -0,0 +1,139 @@
+#include "ns_fft.h"
+using namespace std;
+
+unsigned long ns_fft::largest_power_of_two_not_exceeding(const unsigned long n){
+	if (n == 0)
+		return 0;
+	unsigned long p(1);
+	while (p <= n/2)
+		p*=2;
+	return p;
+}
+
+void ns_fft::transform(ns_complex * data, const unsigned long n, const bool inverse){
+	if (!is_power_of_two(n))
+		throw ns_ex("ns_fft::transform()::Transform length must be a power of two: ") << n;
+	//reorder the input by bit-reversed index
+	for (unsigned long i = 1, j = 0; i < n; i++){
+		unsigned long bit(n >> 1);
+		for (; j & bit; bit >>= 1)
+			j ^= bit;
+		j ^= bit;
+		if (i < j)
+			swap(data[i],data[j]);
+	}
+	//combine transforms of length len/2 into transforms of length len
+	const double sign(inverse?1:-1);
+	for (unsigned long len = 2; len <= n; len <<= 1){
+		const double angle(sign*2*ns_pi/len);
+		const ns_complex w_len(cos(angle),sin(angle));
+		for (unsigned long i = 0; i < n; i+=len){
+			ns_complex w(1,0);
+			for (unsigned long k = 0; k < len/2; k++){
+				const ns_complex u(data[i+k]),
+								 v(data[i+k+len/2]*w);
+				data[i+k] = u+v;
+				data[i+k+len/2] = u-v;
+				w*=w_len;
+			}
+		}
+	}
+	if (inverse){
+		for (unsigned long i = 0; i < n; i++)
+			data[i]/=(double)n;
+	}
+}
+
+void ns_fft::transform_2d(std::vector<ns_complex> & data, const unsigned long width, const unsigned long height, const bool inverse){
+	if (data.size() != width*height)
+		throw ns_ex("ns_fft::transform_2d()::Data size does not match dimensions");
+	for (unsigned long y = 0; y < height; y++)
+		transform(&data[y*width],width,inverse);
+	std::vector<ns_complex> column(height);
+	for (unsigned long x = 0; x < width; x++){
+		for (unsigned long y = 0; y < height; y++)
+			column[y] = data[y*width+x];
+		transform(&column[0],height,inverse);
+		for (unsigned long y = 0; y < height; y++)
+			data[y*width+x] = column[y];
+	}
+}
+
+void ns_phase_correlation::calculate_spectrum(const std::vector<double> & tile, const unsigned long width, const unsigned long height, ns_phase_correlation_spectrum & spectrum){
+	if (tile.size() != width*height)
+		throw ns_ex("ns_phase_correlation::calculate_spectrum()::Tile size does not match dimensions");
+	double mean(0);
+	for (unsigned long i = 0; i < tile.size(); i++)
+		mean+=tile[i];
+	mean/=tile.size();
+
+	spectrum.width = width;
+	spectrum.height = height;
+	spectrum.spectrum.resize(width*height);
+	std::vector<double> x_window(width);
+	for (unsigned long x = 0; x < width; x++)
+		x_window[x] = 0.5*(1-cos(2*ns_pi*x/(double)(width-1)));
+	for (unsigned long y = 0; y < height; y++){
+		const double y_window(0.5*(1-cos(2*ns_pi*y/(double)(height-1))));
+		for (unsigned long x = 0; x < width; x++)
+			spectrum.spectrum[y*width+x] = ns_complex((tile[y*width+x]-mean)*x_window[x]*y_window,0);
+	}
+	ns_fft::transform_2d(spectrum.spectrum,width,height,false);
+}
+
+//finds the sub-pixel location of a peak from its height and that of its two neighbors, by fitting a parabola
+inline double ns_parabolic_peak_offset(const double left, const double center, const double right){
+	const double denominator(left - 2*center + right);
+	if (denominator >= 0)
+		return 0;
+	double d(0.5*(left-right)/denominator);
+	if (d > 0.5) d = 0.5;
+	if (d < -0.5) d = -0.5;
+	return d;
+}
+
+ns_vector_2d ns_phase_correlation::estimate_translation(const ns_phase_correlation_spectrum & reference, const ns_phase_correlation_spectrum & subject, const ns_vector_2i & max_offset, double & peak_height){
+	if (reference.width != subject.width || reference.height != subject.height)
+		throw ns_ex("ns_phase_correlation::estimate_translation()::Spectra have different dimensions: ")
+			<< reference.width << "x" << reference.height << " vs " << subject.width << "x" << subject.height;
+	const long w(reference.width),
+			   h(reference.height);
+	if (w == 0 || h == 0)
+		throw ns_ex("ns_phase_correlation::estimate_translation()::Empty spectrum");
+
+	std::vector<ns_complex> correlation(w*h);
+	for (long i = 0; i < w*h; i++){
+		const ns_complex c(subject.spectrum[i]*conj(reference.spectrum[i]));
+		const double magnitude(abs(c));
+		correlation[i] = (magnitude > 1e-12)?(c/magnitude):ns_complex(0,0);
+	}
+	ns_fft::transform_2d(correlation,w,h,true);
+
+	//translations are stored modulo the tile size, with negative translations wrapping around to the end.
+	long max_x(max_offset.x),
+		 max_y(max_offset.y);
+	if (max_x > w/2-1) max_x = w/2-1;
+	if (max_y > h/2-1) max_y = h/2-1;
+	if (max_x < 0) max_x = 0;
+	if (max_y < 0) max_y = 0;
+	long best_dx(0),
+		 best_dy(0);
+	double best(-1);
+	for (long dy = -max_y; dy <= max_y; dy++){
+		const ns_complex * row(&correlation[((dy+h)%h)*w]);
+		for (long dx = -max_x; dx <= max_x; dx++){
+			const double v(row[(dx+w)%w].real());
+			if (v > best){
+				best = v;
+				best_dx = dx;
+				best_dy = dy;
+			}
+		}
+	}
+	peak_height = best;
+	#define NS_CORRELATION(dx,dy) correlation[(((dy)+h)%h)*w + (((dx)+w)%w)].real()
+	const double sub_x(ns_parabolic_peak_offset(NS_CORRELATION(best_dx-1,best_dy),best,NS_CORRELATION(best_dx+1,best_dy))),
+				 sub_y(ns_parabolic_peak_offset(NS_CORRELATION(best_dx,best_dy-1),best,NS_CORRELATION(best_dx,best_dy+1)));
+	#undef NS_CORRELATION
+	return ns_vector_2d(best_dx+sub_x,best_dy+sub_y);
+}
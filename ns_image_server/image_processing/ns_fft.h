@@ -0,0 +1,51 @@
+#ifndef NS_FFT
+#define NS_FFT
+#include "ns_ex.h"
+#include "ns_vector.h"
+#include <vector>
+#include <complex>
+
+typedef std::complex<double> ns_complex;
+
+///A self-contained radix-2 fast Fourier transform.
+class ns_fft{
+public:
+	static bool is_power_of_two(const unsigned long n){return n != 0 && (n & (n-1)) == 0;}
+	static unsigned long largest_power_of_two_not_exceeding(const unsigned long n);
+
+	//in-place transform of n values, where n must be a power of two.
+	//The inverse transform is scaled by 1/n so that a forward and inverse transform returns the original data.
+	static void transform(ns_complex * data, const unsigned long n, const bool inverse);
+
+	//in-place transform of a row-major array of width x height values.  Both dimensions must be powers of two.
+	static void transform_2d(std::vector<ns_complex> & data, const unsigned long width, const unsigned long height, const bool inverse);
+};
+
+///The windowed Fourier transform of an image tile, as compared by ns_phase_correlation.
+struct ns_phase_correlation_spectrum{
+	ns_phase_correlation_spectrum():width(0),height(0),origin(0,0){}
+	unsigned long width,
+				  height;
+	//the position of the tile's top left corner in the image from which it was taken
+	ns_vector_2i origin;
+	std::vector<ns_complex> spectrum;
+
+	bool empty() const{return spectrum.empty();}
+	void clear(){width = height = 0; origin = ns_vector_2i(0,0); spectrum.resize(0);}
+};
+
+///Estimates the translation between two images by phase correlation:
+///the normalized cross-power spectrum of two translated images is the transform of a delta function located at the translation.
+class ns_phase_correlation{
+public:
+	//Calculates the spectrum of a row-major width x height tile of pixels, whose dimensions must be powers of two.
+	//The tile's mean is removed and a Hann window is applied so that the tile edges do not produce spurious correlation peaks.
+	static void calculate_spectrum(const std::vector<double> & tile, const unsigned long width, const unsigned long height, ns_phase_correlation_spectrum & spectrum);
+
+	//Returns the sub-pixel translation d for which subject(x+d) best matches reference(x), considering only |d| <= max_offset.
+	//peak_height is set to the height of the correlation peak, which approaches 1 for a perfect match
+	//and 0 for tiles with nothing in common.
+	static ns_vector_2d estimate_translation(const ns_phase_correlation_spectrum & reference, const ns_phase_correlation_spectrum & subject, const ns_vector_2i & max_offset, double & peak_height);
+};
+
+#endif
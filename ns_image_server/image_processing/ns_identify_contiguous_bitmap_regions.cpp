@@ -3,206 +3,269 @@
 #include "ns_image_easy_io.h"
 
 using namespace std;
-unsigned long ns_connected_component_analyzer::get_new_plabel(){
-	unsigned long s = (unsigned long)labels.size();//indicies start at 1 to allow 0 to indicate null 
-	labels.resize(s+1);
-	eq_classes.resize(s+1);
-	return s;
+
+void ns_find_runs_in_8_bit_row(const ns_8_bit * row, const unsigned long width, const unsigned long y, std::vector<ns_rle_run> & runs){
+	bool state(false);
+	unsigned long start_x(0),
+				  x(0);
+	#if defined(NS_CONNECTED_COMPONENT_USE_AVX2) || defined(NS_CONNECTED_COMPONENT_USE_SSE2)
+	#if defined(NS_CONNECTED_COMPONENT_USE_AVX2)
+	const unsigned long block_width(32);
+	const unsigned int all_set(0xFFFFFFFF);
+	const __m256i zero(_mm256_setzero_si256());
+	#else
+	const unsigned long block_width(16);
+	const unsigned int all_set(0xFFFF);
+	const __m128i zero(_mm_setzero_si128());
+	#endif
+	for (; x+block_width <= width; x+=block_width){
+		//bit i is set if pixel x+i is non-zero
+		#if defined(NS_CONNECTED_COMPONENT_USE_AVX2)
+		const unsigned int set(~(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(row+x)),zero)));
+		#else
+		const unsigned int set((~(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(row+x)),zero))) & all_set);
+		#endif
+		//most blocks lie entirely inside or outside a run.
+		if (set == (state?all_set:0))
+			continue;
+		//otherwise, find each transition in turn
+		unsigned long i(0);
+		while(i < block_width){
+			const unsigned int remaining((state?(~set & all_set):set) >> i);
+			if (remaining == 0)
+				break;
+			i += ns_lowest_set_bit(remaining);
+			if (state)
+				runs.push_back(ns_rle_run(y,start_x,x+i-1,0));
+			else start_x = x+i;
+			state = !state;
+		}
+	}
+	#endif
+	for (; x < width; x++){
+		if (!state && row[x]){
+			state = true;
+			start_x = x;
+		}
+		else if (state && !row[x]){
+			state = false;
+			runs.push_back(ns_rle_run(y,start_x,x-1,0));
+		}
+	}
+	if (state)
+		runs.push_back(ns_rle_run(y,start_x,width-1,0));
 }
 
+//union-find in which the root of each set is its smallest member.
+//This keeps labels ordered by first appearance, and lets the whole table be flattened in one forward pass.
+inline unsigned long ns_cc_find(vector<unsigned long> & parent, unsigned long i){
+	while(parent[i] != i){
+		parent[i] = parent[parent[i]];
+		i = parent[i];
+	}
+	return i;
+}
+inline void ns_cc_join(vector<unsigned long> & parent, const unsigned long a, const unsigned long b){
+	const unsigned long ra(ns_cc_find(parent,a)),
+						rb(ns_cc_find(parent,b));
+	if (ra < rb) parent[rb] = ra;
+	else if (rb < ra) parent[ra] = rb;
+}
+//replaces each entry in parent with the index of its set, where sets are numbered in order of their smallest member.
+//returns the number of sets
+inline unsigned long ns_cc_flatten(vector<unsigned long> & parent){
+	unsigned long number_of_sets(0);
+	for (unsigned long i = 0; i < parent.size(); i++){
+		if (parent[i] == i)
+			parent[i] = number_of_sets++;
+		else parent[i] = parent[parent[i]];
+	}
+	return number_of_sets;
+}
 
-void ns_connected_component_analyzer::generate_objects_from_equivalency_table(const ns_image_properties & default_prop, vector<ns_detected_object *> & output){
-	unsigned long number_of_regions(0);
-	//allocate objects and find bounding rectangles
-	vector<ns_detected_object *> regs(runs.size(),0);
-	for (unsigned int r = 0; r < runs.size(); r++){
-		unsigned int i = runs[r].perm_label;
-		if (i == 0) continue;
-		if (regs[i] == 0){
-			number_of_regions++;
-			regs[i] = new ns_detected_object();
-			regs[i]->offset_in_source_image.x = runs[r].start_col;
-			regs[i]->size.x = runs[r].end_col-runs[r].start_col+1;
-
-			regs[i]->offset_in_source_image.y= runs[r].row;
-			regs[i]->size.y=1;
-		}
-		else{
-			if (runs[r].start_col < regs[i]->offset_in_source_image.x){
-				regs[i]->size.x += regs[i]->offset_in_source_image.x - runs[r].start_col;
-				regs[i]->offset_in_source_image.x = runs[r].start_col;
-			}
-			if (runs[r].end_col > regs[i]->offset_in_source_image.x + regs[i]->size.x-1)
-				regs[i]->size.x = runs[r].end_col-regs[i]->offset_in_source_image.x+1;
+//calls join(p,q) for each pair of 4-connected runs p in [p,p_last) and q in [q,q_last), where the two ranges hold adjacent rows.
+template<class join_function>
+inline void ns_cc_for_each_overlap(const vector<ns_rle_run> & p_runs, unsigned long p, const unsigned long p_last, 
+								   const vector<ns_rle_run> & q_runs, unsigned long q, const unsigned long q_last, join_function & join){
+	for (; p < p_last && q < q_last; p++){
+		while (q < q_last && q_runs[q].end_col < p_runs[p].start_col)
+			q++;
+		for (unsigned long k = q; k < q_last && q_runs[k].start_col <= p_runs[p].end_col; k++)
+			join(p,k);
+	}
+}
+
+struct ns_cc_local_join{
+	ns_cc_local_join(vector<ns_rle_run> & runs_, vector<unsigned long> & parent_):runs(runs_),parent(parent_){}
+	void operator()(const unsigned long p, const unsigned long q){
+		if (runs[p].perm_label == 0)
+			runs[p].perm_label = runs[q].perm_label;
+		else ns_cc_join(parent,runs[p].perm_label,runs[q].perm_label);
+	}
+	vector<ns_rle_run> & runs;
+	vector<unsigned long> & parent;
+};
 
-			if (runs[r].row < regs[i]->offset_in_source_image.y){
-				regs[i]->size.y += regs[i]->offset_in_source_image.y - runs[r].row;
-				regs[i]->offset_in_source_image.y = runs[r].row;
+void ns_connected_component_band::label_runs(){
+	//provisional labels start at 1 so that 0 can indicate an unlabeled run
+	vector<unsigned long> parent(1,0);
+	parent.reserve(runs.size()+1);
+	ns_cc_local_join join(runs,parent);
+	for (unsigned long i = 0; i < number_of_rows; i++){
+		if (i > 0)
+			ns_cc_for_each_overlap(runs,row_starts[i],row_starts[i+1],runs,row_starts[i-1],row_starts[i],join);
+		for (unsigned long p = row_starts[i]; p < row_starts[i+1]; p++){
+			if (runs[p].perm_label == 0){
+				runs[p].perm_label = (unsigned long)parent.size();
+				parent.push_back(runs[p].perm_label);
 			}
-			if (runs[r].row > regs[i]->offset_in_source_image.y + regs[i]->size.y-1)
-				regs[i]->size.y = runs[r].row - regs[i]->offset_in_source_image.y + 1;
 		}
 	}
-	//copy over the regions to the output vector and allocate images
-	output.resize(number_of_regions);
-	unsigned long cur_reg(0);
-	for (unsigned long i = 0; i < regs.size(); i++){
-		if (regs[i] == 0) continue;
-	//	regs[i]->offset_in_bitmap = ns_vector_2i(0,0);
-		//copy to output vector
-		output[cur_reg] = regs[i];
-		cur_reg++;
-		//allocate bitmap
-		ns_image_properties prop(default_prop);
-		prop.width = regs[i]->size.x;
-		prop.height= regs[i]->size.y;
-		regs[i]->bitmap().init(prop);
-		for (unsigned int y = 0; y < prop.height; y++)
-			for (unsigned int x = 0; x < prop.width; x++)
-				regs[i]->bitmap()[y][x] = 0;
-	}
-	
-	//copy over pixels
-	for (unsigned int r = 0; r < runs.size(); r++){
-		unsigned int i = runs[r].perm_label;
-		if (regs[i] == 0) continue;
-		for (unsigned int x = runs[r].start_col; x <= runs[r].end_col; x++){
-//			if (runs[r].row - regs[i]->offset_in_source_image.y >= regs[i]->bitmap().properties().height || 
-//				x - regs[i]->offset_in_source_image.x >= regs[i]->bitmap().properties().width)
-//				throw ns_ex("YIKES");
-			regs[i]->bitmap()[runs[r].row - regs[i]->offset_in_source_image.y][x - regs[i]->offset_in_source_image.x] = 1;
+	const unsigned long number_of_components(ns_cc_flatten(parent)-1);
+	components.resize(number_of_components);
+	vector<char> found(number_of_components,0);
+	for (unsigned long p = 0; p < runs.size(); p++){
+		runs[p].perm_label = parent[runs[p].perm_label]-1;
+		if (found[runs[p].perm_label])
+			components[runs[p].perm_label].include(ns_connected_component_extent(runs[p]));
+		else{
+			components[runs[p].perm_label] = ns_connected_component_extent(runs[p]);
+			found[runs[p].perm_label] = 1;
 		}
-		regs[i]->area += runs[r].end_col +1 - runs[r].start_col;
 	}
+}
 
+void ns_connected_component_analyzer::divide_into_bands(const unsigned long height){
+	//very small bands are not worth the overhead of handling their seams
+	const unsigned long minimum_rows_per_band(64);
+	unsigned long number_of_bands(height/minimum_rows_per_band);
+	if (number_of_bands > number_of_threads)
+		number_of_bands = number_of_threads;
+	if (number_of_bands == 0)
+		number_of_bands = 1;
+	bands.resize(number_of_bands);
+	for (unsigned long i = 0; i < number_of_bands; i++){
+		bands[i].clear();
+		bands[i].first_row = (i*height)/number_of_bands;
+		bands[i].number_of_rows = ((i+1)*height)/number_of_bands - bands[i].first_row;
+	}
+}
 
+void ns_connected_component_analyzer::run_band_jobs(std::vector<ns_thread_pool_job *> & jobs){
+	ns_thread_pool pool(bands.size());
+	pool.run(jobs);
 }
 
-void ns_connected_component_analyzer::calculate_equivalency_table(){
-	if (runs.size() == 0)
-		return;
-	//do a downward pass through the data
-	for (unsigned long l = 0; l < row_boundaries.size(); l++){
-		unsigned long p = row_boundaries[l].start,
-					  p_last =  row_boundaries[l].stop;
-		unsigned long q,q_last;
-		if (l == 0){
-			q = 0;
-			q_last = 0;
-		}
-		else{
-			q =  row_boundaries[l-1].start;
-			q_last =  row_boundaries[l-1].stop;
-		}
-		if (p == q) continue;
+struct ns_cc_seam_join{
+	ns_cc_seam_join(const vector<ns_rle_run> & p_runs_, const unsigned long p_offset_, const vector<ns_rle_run> & q_runs_, const unsigned long q_offset_, vector<unsigned long> & parent_):
+		p_runs(p_runs_),p_offset(p_offset_),q_runs(q_runs_),q_offset(q_offset_),parent(parent_){}
+	void operator()(const unsigned long p, const unsigned long q){
+		ns_cc_join(parent,p_offset+p_runs[p].perm_label,q_offset+q_runs[q].perm_label);
+	}
+	const vector<ns_rle_run> & p_runs;
+	const unsigned long p_offset;
+	const vector<ns_rle_run> & q_runs;
+	const unsigned long q_offset;
+	vector<unsigned long> & parent;
+};
 
-		while(p < p_last && q < q_last){
-			if (runs[p].end_col < runs[q].start_col){
-				if (runs[q].end_col < runs[p].start_col)q++;
-				p++;
-			}
-			else if (runs[q].end_col < runs[p].start_col)
-				q++;
-			else{
-				if (!(runs[p].end_col < runs[q].start_col || runs[q].end_col < runs[p].start_col)){
-					//there is some overlap
-					if(runs[p].perm_label == 0)
-						runs[p].perm_label = runs[q].perm_label;
-					else if (runs[p].perm_label != runs[q].perm_label)
-						make_equivalent(runs[p].perm_label,runs[q].perm_label);
-				}
-				if (runs[p].end_col > runs[q].end_col) q++;
-				else if (runs[p].end_col < runs[q].end_col) p++;
-				else if (runs[p].end_col == runs[q].end_col){q++; p++;}
-			}
+///copies each run in a band into the bitmap of the object to which it belongs.
+///Bands cover disjoint rows, so they can all be written at once.
+class ns_connected_component_bitmap_job : public ns_thread_pool_job{
+public:
+	ns_connected_component_bitmap_job(const ns_connected_component_band & band_, std::vector<ns_detected_object *> & objects_):band(&band_),objects(&objects_){}
+	void run(const unsigned long thread_id){
+		//clear the rows of each object that fall within this band
+		for (unsigned long c = 0; c < band->components.size(); c++){
+			ns_detected_object & object(*(*objects)[band->objects[c]]);
+			for (unsigned long y = band->components[c].min_y; y <= band->components[c].max_y; y++)
+				memset(object.bitmap()[y-object.offset_in_source_image.y],0,sizeof(ns_bit)*object.bitmap().properties().width);
 		}
-		for (p = row_boundaries[l].start; p < p_last; p++){
-			if (runs[p].perm_label == 0)
-				runs[p].perm_label = get_new_plabel();
-			else if (labels[runs[p].perm_label].label !=0)
-				runs[p].perm_label = labels[runs[p].perm_label].label;
+		for (unsigned long r = 0; r < band->runs.size(); r++){
+			const ns_rle_run & run(band->runs[r]);
+			ns_detected_object & object(*(*objects)[band->objects[run.perm_label]]);
+			ns_bit * row(object.bitmap()[run.row - object.offset_in_source_image.y]);
+			for (unsigned long x = run.start_col; x <= run.end_col; x++)
+				row[x - object.offset_in_source_image.x] = 1;
 		}
 	}
-	//do an upward pass through the data
-	for (long l = (long)row_boundaries.size()-1; l > 0; l--){
-		unsigned long p = row_boundaries[l].start,
-					  p_last =  row_boundaries[l].stop;
-		unsigned long q,q_last;
-		if (l == (long)row_boundaries.size()-1){
-			q = 0;
-			q_last = 0;
-		}
-		else{
-			q =  row_boundaries[l+1].start;
-			q_last =  row_boundaries[l+1].stop;
-		}
-		if (p == q) continue;
-		while(p < p_last && q < q_last){
-			if (runs[p].end_col < runs[q].start_col){
-				if (runs[q].end_col < runs[p].start_col) q++;
-				p++;
-			}
-			else if (runs[q].end_col < runs[p].start_col)
-				q++;
+private:
+	const ns_connected_component_band * band;
+	std::vector<ns_detected_object *> * objects;
+};
+
+void ns_connected_component_analyzer::merge_bands_and_generate_objects(const ns_image_properties & default_prop, vector<ns_detected_object *> & output){
+	//give each band-local component a global index.  As bands are in order, and local components
+	//are numbered in order of first appearance, global indices are ordered by first appearance as well.
+	vector<unsigned long> band_offsets(bands.size()+1,0);
+	for (unsigned long b = 0; b < bands.size(); b++)
+		band_offsets[b+1] = band_offsets[b] + (unsigned long)bands[b].components.size();
+	vector<unsigned long> parent(band_offsets[bands.size()]);
+	for (unsigned long i = 0; i < parent.size(); i++)
+		parent[i] = i;
+
+	//join components that touch across the seam between each pair of bands
+	for (unsigned long b = 1; b < bands.size(); b++){
+		const ns_connected_component_band & above(bands[b-1]),
+										  & below(bands[b]);
+		if (above.number_of_rows == 0 || below.number_of_rows == 0)
+			continue;
+		ns_cc_seam_join join(below.runs,band_offsets[b],above.runs,band_offsets[b-1],parent);
+		ns_cc_for_each_overlap(below.runs,below.row_starts[0],below.row_starts[1],
+							   above.runs,above.row_starts[above.number_of_rows-1],above.row_starts[above.number_of_rows],join);
+	}
+	const unsigned long number_of_objects(ns_cc_flatten(parent));
+
+	//find the bounding box and area of each object
+	vector<ns_connected_component_extent> extents(number_of_objects);
+	vector<char> found(number_of_objects,0);
+	for (unsigned long b = 0; b < bands.size(); b++){
+		bands[b].objects.resize(bands[b].components.size());
+		for (unsigned long c = 0; c < bands[b].components.size(); c++){
+			const unsigned long i(parent[band_offsets[b]+c]);
+			bands[b].objects[c] = i;
+			if (found[i])
+				extents[i].include(bands[b].components[c]);
 			else{
-				if (!(runs[p].end_col < runs[q].start_col || runs[q].end_col < runs[p].start_col)){
-					//there is some overlap
-					if (runs[p].perm_label != runs[q].perm_label){
-						labels[runs[p].perm_label].label = runs[q].perm_label;
-						runs[p].perm_label = runs[q].perm_label;
-					}
-				}
-				if (runs[p].end_col > runs[q].end_col) q++;
-				else if (runs[p].end_col < runs[q].end_col) p++;
-				else if (runs[p].end_col == runs[q].end_col){q++; p++;}
+				extents[i] = bands[b].components[c];
+				found[i] = 1;
 			}
 		}
-		for (p = row_boundaries[l].start; p < p_last; p++){
-			if (labels[runs[p].perm_label].label != 0)
-				runs[p].perm_label = labels[runs[p].perm_label].label;
-		}
-	}
-}
-void ns_connected_component_analyzer::make_equivalent(const unsigned long l1,const unsigned long l2){
-	if (labels[l1].label == 0 && labels[l2].label==0){
-		labels[l1].label = l1;
-		labels[l2].label = l1;
-		labels[l1].next = l2;
-		labels[l2].next = 0;
-		if (eq_classes.size() <= l1)
-			eq_classes.resize(l1+1,l1);
-			eq_classes[l1] = l1;
-	}
-	else if (labels[l1].label == labels[l2].label)
-		return;
-	else if (labels[l1].label != 0 && labels[l2].label == 0){
-		unsigned long b = labels[l1].label;
-		labels[l2].label = b;
-		labels[l2].next = eq_classes[b];
-		if (eq_classes.size() <= b)
-			eq_classes.resize(b+1,l2);
-		else eq_classes[b] = l2;
 	}
-	else if (labels[l1].label == 0 && labels[l2].label != 0){
-		unsigned long b = labels[l2].label;
-		labels[l1].label = b;
-		labels[l1].next = eq_classes[b];
-		if (eq_classes.size() <= b)
-			eq_classes.resize(b+1,l1);
-		else eq_classes[b] = l1;
-	}
-	else{
-		unsigned long b = labels[l2].label;
-		unsigned long m = eq_classes[b];
-		unsigned long e = labels[l1].label;
-		while(labels[m].next != 0){
-			labels[m].label = e;
-			m = labels[m].next;
+
+	//allocate objects
+	output.reserve(output.size()+number_of_objects);
+	vector<ns_detected_object *> objects(number_of_objects,0);
+	try{
+		for (unsigned long i = 0; i < number_of_objects; i++){
+			objects[i] = new ns_detected_object();
+			objects[i]->offset_in_source_image.x = extents[i].min_x;
+			objects[i]->offset_in_source_image.y = extents[i].min_y;
+			objects[i]->size.x = extents[i].max_x - extents[i].min_x + 1;
+			objects[i]->size.y = extents[i].max_y - extents[i].min_y + 1;
+			objects[i]->area = extents[i].area;
+			ns_image_properties prop(default_prop);
+			prop.width = objects[i]->size.x;
+			prop.height= objects[i]->size.y;
+			objects[i]->bitmap().init(prop);
 		}
-		labels[m].label = e;
-		labels[m].next = eq_classes[e];
-		eq_classes[e] = eq_classes[b];
-		eq_classes[b] = 0;
+
+		//copy over pixels
+		vector<ns_connected_component_bitmap_job> jobs;
+		jobs.reserve(bands.size());
+		for (unsigned long b = 0; b < bands.size(); b++)
+			jobs.push_back(ns_connected_component_bitmap_job(bands[b],objects));
+		vector<ns_thread_pool_job *> job_pointers(jobs.size());
+		for (unsigned int i = 0; i < jobs.size(); i++)
+			job_pointers[i] = &jobs[i];
+		ns_thread_pool pool(bands.size());
+		pool.run(job_pointers);
 	}
+	catch(...){
+		for (unsigned long i = 0; i < objects.size(); i++)
+			delete objects[i];
+		throw;
+	}
+	output.insert(output.end(),objects.begin(),objects.end());
+	bands.clear();
 }
-
@@ -13,6 +13,7 @@
 #include "ns_vector_bitmap_interface.h"
 #include "ns_detected_object.h"
 #include "ns_detected_worm_info.h"
+#include "ns_thread_pool.h"
 
 #include "ns_tiff.h"
 
@@ -125,82 +126,149 @@ struct ns_rle_run{
 	ns_rle_run(const unsigned long r, const unsigned long s, const unsigned long e, const unsigned long l):row(r),start_col(s),end_col(e),perm_label(l){}
 	unsigned long row,start_col,end_col,perm_label;
 };
-struct ns_label_entry{
-	unsigned long label,next;
-};
-struct ns_row_boundaries{
-	ns_row_boundaries(){}
-	ns_row_boundaries(const unsigned long start_,const unsigned long stop_):start(start_),stop(stop_){}
-	unsigned long start,stop;
-};
 
-class ns_connected_component_analyzer{
-public:
-	ns_connected_component_analyzer():labels(1),eq_classes(1){}//indicies start at 1 to allow 0 to indicate null
+#if defined(__AVX2__)
+	#include <immintrin.h>
+	#define NS_CONNECTED_COMPONENT_USE_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#define NS_CONNECTED_COMPONENT_USE_SSE2
+#endif
+#ifdef _MSC_VER
+	#include <intrin.h>
+#endif
 
-	template<class ns_component>
-	void detect_objects(const ns_image_whole<ns_component> & im, std::vector<ns_detected_object *> & output){
-		populate_rle_table_from_image(im);
-		calculate_equivalency_table();
-		generate_objects_from_equivalency_table(im.properties(),output);
+///returns the index of the lowest set bit of a non-zero mask
+inline unsigned long ns_lowest_set_bit(const unsigned int mask){
+	#ifdef _MSC_VER
+	unsigned long i;
+	_BitScanForward(&i,mask);
+	return i;
+	#else
+	return (unsigned long)__builtin_ctz(mask);
+	#endif
+}
+
+///appends the runs of non-zero pixels found in a row of 8-bit pixels to runs.
+///Pixels are compared to zero 16 (SSE2) or 32 (AVX2) at a time, and blocks that
+///do not contain the end of a run are skipped without examining individual pixels.
+void ns_find_runs_in_8_bit_row(const ns_8_bit * row, const unsigned long width, const unsigned long y, std::vector<ns_rle_run> & runs);
+
+template<class ns_component>
+void ns_find_runs_in_row(const ns_component * row, const unsigned long width, const unsigned long y, std::vector<ns_rle_run> & runs){
+	if (sizeof(ns_component) == 1){
+		ns_find_runs_in_8_bit_row(reinterpret_cast<const ns_8_bit *>(row),width,y,runs);
+		return;
+	}
+	bool state(false);
+	unsigned long start_x(0);
+	for (unsigned long x = 0; x < width; x++){
+		if (!state && row[x]){
+			state = true;
+			start_x = x;
+		}
+		else if (state && !row[x]){
+			state = false;
+			runs.push_back(ns_rle_run(y,start_x,x-1,0));
+		}
 	}
+	if (state)
+		runs.push_back(ns_rle_run(y,start_x,width-1,0));
+}
 
-private:
-	std::vector<ns_row_boundaries> row_boundaries;
+///the bounding box and area of a set of runs
+struct ns_connected_component_extent{
+	ns_connected_component_extent(){}
+	ns_connected_component_extent(const ns_rle_run & r):min_x(r.start_col),max_x(r.end_col),min_y(r.row),max_y(r.row),area(r.end_col-r.start_col+1){}
+	void include(const ns_connected_component_extent & e){
+		if (e.min_x < min_x) min_x = e.min_x;
+		if (e.max_x > max_x) max_x = e.max_x;
+		if (e.min_y < min_y) min_y = e.min_y;
+		if (e.max_y > max_y) max_y = e.max_y;
+		area+=e.area;
+	}
+	unsigned long min_x,max_x,min_y,max_y,area;
+};
+
+///A horizontal band of the image, labeled independently of all other bands.
+///After label_runs() is called, the perm_label of each run holds the index of its
+///band-local component, and local components are numbered in the order in which
+///they first appear in a raster scan of the band.
+struct ns_connected_component_band{
+	ns_connected_component_band():first_row(0),number_of_rows(0){}
+	unsigned long first_row,
+				  number_of_rows;
 	std::vector<ns_rle_run> runs;
-	std::vector<ns_label_entry> labels;
-	std::vector<unsigned long> eq_classes;
+	//runs in row first_row+i are runs[row_starts[i]] to runs[row_starts[i+1]-1]
+	std::vector<unsigned long> row_starts;
+	std::vector<ns_connected_component_extent> components;
+	//the index of the output object each local component belongs to
+	std::vector<unsigned long> objects;
+
+	void label_runs();
+	void clear(){
+		runs.resize(0);
+		row_starts.resize(0);
+		components.resize(0);
+		objects.resize(0);
+	}
+};
 
-	unsigned long get_new_plabel();
-	void generate_objects_from_equivalency_table(const ns_image_properties & prop, std::vector<ns_detected_object *> & output);
-	void calculate_equivalency_table();
-	void make_equivalent(const unsigned long l1,const unsigned long l2);
+///ns_connected_component_analyzer finds all 4-connected regions of non-zero pixels in an image.
+///The image is cut into horizontal bands that are run-length encoded and labeled in parallel.
+///Components that touch across the seam between two bands are then joined using a union-find over the
+///band-local labels, and finally each band copies its runs into the bitmaps of the objects they belong to.
+///Objects are output in the order in which they first appear in a raster scan of the image,
+///independently of the number of bands used.
+class ns_connected_component_analyzer{
+public:
+	ns_connected_component_analyzer(const unsigned long number_of_threads_=1):number_of_threads(number_of_threads_){}
 
 	template<class ns_component>
-	void populate_rle_table_from_image(const ns_image_whole<ns_component> & im){
-		runs.reserve(im.properties().height/2);
-		labels.reserve(im.properties().height/2);
-		eq_classes.reserve(im.properties().height/2);
+	void detect_objects(const ns_image_whole<ns_component> & im, std::vector<ns_detected_object *> & output);
 
-		row_boundaries.resize(im.properties().height);
-
-		//do the run length encoding
-		for (unsigned int y = 0; y < im.properties().height; y++){
-			bool state(false);
-			unsigned long start_x;
+private:
+	unsigned long number_of_threads;
+	std::vector<ns_connected_component_band> bands;
 
-			unsigned long start_index_of_this_row((unsigned long)runs.size());
+	void divide_into_bands(const unsigned long height);
+	void run_band_jobs(std::vector<ns_thread_pool_job *> & jobs);
+	void merge_bands_and_generate_objects(const ns_image_properties & prop, std::vector<ns_detected_object *> & output);
+};
 
-			for (unsigned int x = 0; x < im.properties().width; x++){
-				if (!state && im[y][x]){
-					//we've found the start of a thresholded region
-					state = true;
-					start_x = x;
-				}
-				if (state && !im[y][x]){
-					//we've found the end of a thresholded region
-					state = false;
-					runs.push_back(ns_rle_run(y,start_x,x-1,0));
-				}
-			}
-			if (state)
-				runs.push_back(ns_rle_run(y,start_x,im.properties().width-1,0));
-			//record where each row of the image starts and stops in the run table
-			if (start_index_of_this_row == runs.size()){
-				row_boundaries[y].start = 0;
-				row_boundaries[y].stop = 0;
-			}
-			else{
-				row_boundaries[y].start = start_index_of_this_row;
-				row_boundaries[y].stop = (unsigned long)runs.size();
-			}
+template<class ns_component>
+class ns_connected_component_band_job : public ns_thread_pool_job{
+public:
+	ns_connected_component_band_job(const ns_image_whole<ns_component> & im_,ns_connected_component_band & band_):im(&im_),band(&band_){}
+	void run(const unsigned long thread_id){
+		const unsigned long width(im->properties().width);
+		band->row_starts.resize(band->number_of_rows+1);
+		for (unsigned long i = 0; i < band->number_of_rows; i++){
+			band->row_starts[i] = (unsigned long)band->runs.size();
+			ns_find_runs_in_row((*im)[band->first_row+i],width,band->first_row+i,band->runs);
 		}
+		band->row_starts[band->number_of_rows] = (unsigned long)band->runs.size();
+		band->label_runs();
 	}
-
-
-
+private:
+	const ns_image_whole<ns_component> * im;
+	ns_connected_component_band * band;
 };
 
+template<class ns_component>
+void ns_connected_component_analyzer::detect_objects(const ns_image_whole<ns_component> & im, std::vector<ns_detected_object *> & output){
+	divide_into_bands(im.properties().height);
+	std::vector<ns_connected_component_band_job<ns_component> > jobs;
+	jobs.reserve(bands.size());
+	for (unsigned int i = 0; i < bands.size(); i++)
+		jobs.push_back(ns_connected_component_band_job<ns_component>(im,bands[i]));
+	std::vector<ns_thread_pool_job *> job_pointers(jobs.size());
+	for (unsigned int i = 0; i < jobs.size(); i++)
+		job_pointers[i] = &jobs[i];
+	run_band_jobs(job_pointers);
+	merge_bands_and_generate_objects(im.properties(),output);
+}
+
 
 ///Provided with a bitmap image (usually obtained via thresholding a grayscale image), ns_contiguous_identifier generates
 ///a list of regions each representign a set of contiguous white pixels surrounded on all sides by black pixels.
@@ -209,18 +277,17 @@ private:
 
 
 template<class ns_component>
-void ns_identify_contiguous_bitmap_regions(const ns_image_whole<ns_component> & im,std::vector<ns_detected_object *> & output){
+void ns_identify_contiguous_bitmap_regions(const ns_image_whole<ns_component> & im,std::vector<ns_detected_object *> & output, const unsigned long number_of_threads=1){
 
 	if  (im.properties().width*im.properties().height == 0)
 		return;
 
-	ns_connected_component_analyzer cc;
+	ns_connected_component_analyzer cc(number_of_threads);
 	cc.detect_objects(im,output);
 
 	//And we're done!
 }
 
-
 /*
 class ns_detected_object_builder{
 public:
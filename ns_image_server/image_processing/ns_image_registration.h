@@ -3,7 +3,128 @@
 #include "ns_image.h"
 #include "ns_ex.h"
 #include "ns_image_registration_cache.h"
+#include "ns_thread_pool.h"
 #include <iostream>
+#include <algorithm>
+
+#if defined(__AVX2__)
+	#include <immintrin.h>
+	#define NS_IMAGE_REGISTRATION_USE_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#define NS_IMAGE_REGISTRATION_USE_SSE2
+#endif
+
+///returns the sum of absolute differences between two runs of n pixels
+inline ns_64_bit ns_sum_of_absolute_differences(const ns_8_bit * a, const ns_8_bit * b, const unsigned long n){
+	unsigned long i(0);
+	ns_64_bit sum(0);
+	#if defined(NS_IMAGE_REGISTRATION_USE_AVX2)
+		__m256i s(_mm256_setzero_si256());
+		for (; i+32 <= n; i+=32)
+			s = _mm256_add_epi64(s,_mm256_sad_epu8(_mm256_loadu_si256((const __m256i *)(a+i)),_mm256_loadu_si256((const __m256i *)(b+i))));
+		ns_64_bit partial_sums[4];
+		_mm256_storeu_si256((__m256i *)partial_sums,s);
+		sum = partial_sums[0]+partial_sums[1]+partial_sums[2]+partial_sums[3];
+	#elif defined(NS_IMAGE_REGISTRATION_USE_SSE2)
+		__m128i s(_mm_setzero_si128());
+		for (; i+16 <= n; i+=16)
+			s = _mm_add_epi64(s,_mm_sad_epu8(_mm_loadu_si128((const __m128i *)(a+i)),_mm_loadu_si128((const __m128i *)(b+i))));
+		ns_64_bit partial_sums[2];
+		_mm_storeu_si128((__m128i *)partial_sums,s);
+		sum = partial_sums[0]+partial_sums[1];
+	#endif
+	for (; i < n; i++)
+		sum+=(ns_64_bit)abs((int)a[i]-(int)b[i]);
+	return sum;
+}
+
+///Holds the pixels sampled by ns_image_registration::register_whole_images() from a block of consecutive lines.
+///Lines are stored subsampled by pixel_skip, with the aligned image stored once for each horizontal phase,
+///so that the pixels compared at any offset are contiguous in memory and can be compared 16 or 32 at a time.
+class ns_image_registration_block{
+public:
+	enum{maximum_number_of_lines=16};
+
+	ns_image_registration_block(const unsigned long pixel_skip_, const unsigned long x_start_, const unsigned long w, const ns_vector_2i & offset_minimums_, const ns_vector_2i & offset_maximums_):
+		pixel_skip(pixel_skip_),x_start(x_start_),
+		sample_width((w-2*x_start_ + pixel_skip_-1)/pixel_skip_),
+		phase_width((w+pixel_skip_-1)/pixel_skip_),
+		offset_minimums(offset_minimums_),offset_maximums(offset_maximums_),
+		number_of_lines(0),first_aligned_line(0),number_of_aligned_lines(0){
+		reference.resize(maximum_number_of_lines*sample_width);
+		reference_y.resize(maximum_number_of_lines);
+		aligned.resize(((maximum_number_of_lines-1)*pixel_skip + (offset_maximums.y - offset_minimums.y))*pixel_skip*phase_width);
+	}
+
+	//samples line y of the reference image and all lines of the aligned image that will be compared to it.
+	template<class random_access_image_type_1,class random_access_image_type_2>
+	void add_line(const unsigned long y, random_access_image_type_1 & r, random_access_image_type_2 & a){
+		if (number_of_lines == 0){
+			first_aligned_line = (long)y + offset_minimums.y;
+			number_of_aligned_lines = 0;
+		}
+		ns_8_bit * ref(&reference[number_of_lines*sample_width]);
+		for (unsigned long i = 0; i < sample_width; i++)
+			ref[i] = r[y][x_start + i*pixel_skip];
+		reference_y[number_of_lines] = y;
+		number_of_lines++;
+
+		const long last_aligned_line((long)y + offset_maximums.y);
+		for (;first_aligned_line + (long)number_of_aligned_lines < last_aligned_line; number_of_aligned_lines++){
+			const unsigned long line(first_aligned_line + number_of_aligned_lines);
+			for (unsigned long phase = 0; phase < pixel_skip; phase++){
+				ns_8_bit * dest(&aligned[(number_of_aligned_lines*pixel_skip + phase)*phase_width]);
+				unsigned long j(0);
+				for (unsigned long x = phase; x < phase_width*pixel_skip && x < a.properties().width; x+=pixel_skip,j++)
+					dest[j] = a[line][x];
+				for (; j < phase_width; j++)
+					dest[j] = 0;
+			}
+		}
+	}
+	//returns a pointer to the sampled pixels of the aligned image that are compared with sampled line i of the reference image
+	//at the specified offset.
+	inline const ns_8_bit * aligned_pixels(const unsigned long i, const int dx, const int dy) const{
+		const unsigned long line(reference_y[i] + dy - first_aligned_line),
+							x(x_start + dx);
+		return &aligned[(line*pixel_skip + x%pixel_skip)*phase_width + x/pixel_skip];
+	}
+	inline const ns_8_bit * reference_pixels(const unsigned long i) const{
+		return &reference[i*sample_width];
+	}
+	bool full() const{return number_of_lines == maximum_number_of_lines;}
+	void clear(){number_of_lines = 0;}
+
+	const unsigned long pixel_skip,
+						x_start,
+						sample_width,
+						phase_width;
+	const ns_vector_2i offset_minimums,
+					   offset_maximums;
+	unsigned long number_of_lines;
+private:
+	std::vector<ns_8_bit> reference,
+						  aligned;
+	std::vector<unsigned long> reference_y;
+	long first_aligned_line;
+	unsigned long number_of_aligned_lines;
+};
+
+///Accumulates the differences between the images at every horizontal offset, for a single vertical offset.
+struct ns_image_registration_offset_job : public ns_thread_pool_job{
+	const ns_image_registration_block * block;
+	int dy;
+	std::vector<ns_64_bit> * differences;
+	void run(const unsigned long thread_id){
+		for (unsigned long i = 0; i < block->number_of_lines; i++){
+			const ns_8_bit * ref(block->reference_pixels(i));
+			for (int dx = block->offset_minimums.x; dx < block->offset_maximums.x; dx++)
+				(*differences)[dx-block->offset_minimums.x]+=ns_sum_of_absolute_differences(ref,block->aligned_pixels(i,dx,dy),block->sample_width);
+		}
+	}
+};
+
 template<int thresh, class ns_component>
 class ns_image_registration{
 public:
@@ -13,6 +134,14 @@ public:
 		if (method == ns_full_registration){
 			return;
 		}
+		if (method == ns_fft_registration){
+			const ns_downsampling_sizes sizes(ns_image_registration_profile<profile_type>::calculate_downsampled_sizes(r.properties(),NS_FFT_REGISTRATION_DOWNSAMPLED_DIMENSION,downsampling_factor));
+			profile.downsampling_factor = sizes.downsample_factor;
+			profile.clear_spectra();
+			r.resample(sizes.downsampled,profile.downsampled_image);
+			r.pump(profile.whole_image,1024);
+			return;
+		}
 		profile.horizontal_profile.resize(0);
 		profile.vertical_profile.resize(0);
 		
@@ -89,6 +218,87 @@ public:
 		return register_whole_images<T1,T2,4>(r.whole_image,a.whole_image,downsampled_shift-downsample_v,downsampled_shift+downsample_v);
 
 	}
+	///Registers two images by phase correlation.  The translation is first estimated from the downsampled images,
+	///then refined on a grid of full resolution tiles positioned using that estimate.
+	///The reference profile caches its spectra, so repeated registrations against the same reference
+	///only need to transform the subject images.
+	///If subpixel_offset is specified, it is set to the sub-pixel estimate of the offset.
+	template<class T1, class T2>
+	static ns_vector_2i register_fft_images(ns_image_registration_profile<T1> & r , ns_image_registration_profile<T2> & a,  ns_vector_2i max_offset = ns_vector_2i(0,0), ns_vector_2d * subpixel_offset=0){
+		if (r.downsampling_factor != a.downsampling_factor)
+			throw ns_ex("Downsampling factor mismatch");
+		if (r.downsampling_factor == 0)
+			throw ns_ex("ns_image_registration::register_fft_images()::No downsampled images have been prepared");
+		if (max_offset == ns_vector_2i(0,0))
+			max_offset = ns_vector_2i(r.whole_image.properties().width/5,r.whole_image.properties().height/5);
+		const long downsampling_factor(r.downsampling_factor);
+
+		if (r.downsampled_spectrum.empty())
+			calculate_downsampled_spectrum(r.downsampled_image,r.downsampled_spectrum);
+		if (a.downsampled_spectrum.width != r.downsampled_spectrum.width || a.downsampled_spectrum.height != r.downsampled_spectrum.height)
+			calculate_downsampled_spectrum(a.downsampled_image,a.downsampled_spectrum,r.downsampled_spectrum.width,r.downsampled_spectrum.height);
+
+		std::cerr << "Running course alignment...  ";
+		double peak_height;
+		const ns_vector_2d downsampled_shift(ns_phase_correlation::estimate_translation(r.downsampled_spectrum,a.downsampled_spectrum,max_offset/downsampling_factor+ns_vector_2i(1,1),peak_height)
+											 + ns_vector_2d(a.downsampled_spectrum.origin.x - r.downsampled_spectrum.origin.x,a.downsampled_spectrum.origin.y - r.downsampled_spectrum.origin.y));
+		const ns_vector_2i shift((int)floor(downsampled_shift.x*downsampling_factor+.5),(int)floor(downsampled_shift.y*downsampling_factor+.5));
+		std::cerr << shift.x << "," << shift.y << " ";
+
+		unsigned long tile_size(NS_FFT_REGISTRATION_TILE_SIZE);
+		const unsigned long smallest_dimension(std::min(std::min(r.whole_image.properties().width,r.whole_image.properties().height),
+														std::min(a.whole_image.properties().width,a.whole_image.properties().height)));
+		if (tile_size > smallest_dimension/2)
+			tile_size = ns_fft::largest_power_of_two_not_exceeding(smallest_dimension/2);
+		if (tile_size < 16)
+			throw ns_ex("ns_image_registration::register_fft_images()::Images are too small to register: ") << smallest_dimension;
+
+		std::cerr << "Running full alignment...";
+		if (r.tile_spectra.empty() || !(r.tile_spectra_max_offset == max_offset) || r.tile_spectra[0].width != tile_size){
+			std::vector<ns_vector_2i> origins;
+			choose_fft_tile_origins(r.whole_image.properties(),max_offset + ns_vector_2i(downsampling_factor,downsampling_factor),tile_size,origins);
+			r.whole_image.seek_to_beginning();
+			calculate_tile_spectra(r.whole_image,origins,tile_size,r.tile_spectra);
+			r.tile_spectra_max_offset = max_offset;
+		}
+		//subject tiles are placed where the coarse alignment predicts the reference tiles will be found
+		std::vector<ns_vector_2i> subject_origins(r.tile_spectra.size());
+		for (unsigned int i = 0; i < r.tile_spectra.size(); i++){
+			subject_origins[i] = r.tile_spectra[i].origin + shift;
+			subject_origins[i].x = std::max(0,std::min(subject_origins[i].x,(int)(a.whole_image.properties().width - tile_size)));
+			subject_origins[i].y = std::max(0,std::min(subject_origins[i].y,(int)(a.whole_image.properties().height - tile_size)));
+		}
+		std::vector<ns_phase_correlation_spectrum> subject_tiles;
+		a.whole_image.seek_to_beginning();
+		calculate_tile_spectra(a.whole_image,subject_origins,tile_size,subject_tiles);
+
+		//Tiles containing little texture produce weak, unreliable peaks.
+		//The offset is taken as the median of the estimates from tiles whose peaks are comparable to the strongest.
+		std::vector<ns_vector_2d> estimates(subject_tiles.size());
+		std::vector<double> peak_heights(subject_tiles.size());
+		double maximum_peak_height(0);
+		for (unsigned int i = 0; i < subject_tiles.size(); i++){
+			estimates[i] = ns_phase_correlation::estimate_translation(r.tile_spectra[i],subject_tiles[i],ns_vector_2i(downsampling_factor+1,downsampling_factor+1),peak_heights[i])
+							+ ns_vector_2d(subject_tiles[i].origin.x - r.tile_spectra[i].origin.x,subject_tiles[i].origin.y - r.tile_spectra[i].origin.y);
+			if (peak_heights[i] > maximum_peak_height)
+				maximum_peak_height = peak_heights[i];
+		}
+		std::vector<double> x_estimates,
+							y_estimates;
+		for (unsigned int i = 0; i < estimates.size(); i++){
+			if (peak_heights[i] >= maximum_peak_height/2){
+				x_estimates.push_back(estimates[i].x);
+				y_estimates.push_back(estimates[i].y);
+			}
+		}
+		const ns_vector_2d offset(ns_median_of_estimates(x_estimates),ns_median_of_estimates(y_estimates));
+		if (subpixel_offset != 0)
+			*subpixel_offset = offset;
+		const ns_vector_2i full((int)floor(offset.x+.5),(int)floor(offset.y+.5));
+		std::cerr << full.x << "," << full.y << "\n";
+		return full;
+	}
+
 	template <class random_access_image_type_1,class random_access_image_type_2, int pixel_skip>
 	static ns_vector_2i register_whole_images(random_access_image_type_1 & r, random_access_image_type_2 & a, const ns_vector_2i offset_minimums,const ns_vector_2i offset_maximums,const std::string & debug=""){
 		
@@ -116,6 +326,22 @@ public:
 
 		if (offset_maximums.y - offset_minimums.y > NS_MAX_CAPTURED_IMAGE_REGISTRATION_VERTICAL_OFFSET)
 			throw ns_ex("Requested image alignment distance exceeds hard-coded maximum");
+		if (w <= 2*(unsigned long)x_distance_from_edge || h <= 2*(unsigned long)y_distance_from_edge)
+			throw ns_ex("ns_image_registration::Image (") << w << "x" << h << ") is too small to be aligned with offsets up to " << x_distance_from_edge << "," << y_distance_from_edge;
+
+		//Sampled lines are copied out of the (possibly disk-buffered) images a block at a time,
+		//so that the differences for each vertical offset can be accumulated on a separate thread.
+		ns_image_registration_block block(pixel_skip,x_distance_from_edge,w,offset_minimums,offset_maximums);
+		ns_thread_pool thread_pool(ns_thread_pool::number_of_processors_per_process());
+		std::vector<ns_image_registration_offset_job> offset_jobs(differences.size());
+		std::vector<ns_thread_pool_job *> jobs(differences.size());
+		for (unsigned int i = 0; i < differences.size(); i++){
+			offset_jobs[i].block = &block;
+			offset_jobs[i].dy = offset_minimums.y + i;
+			offset_jobs[i].differences = &differences[i];
+			jobs[i] = &offset_jobs[i];
+		}
+
 		unsigned long ten_percent((h-2*y_distance_from_edge)/(pixel_skip*5));
 		unsigned long count(0);
 		for (unsigned int y = y_distance_from_edge; y < h-y_distance_from_edge; y+=pixel_skip){
@@ -126,12 +352,10 @@ public:
 			count++;
 			r.make_line_available(y);
 			a.make_line_available(y+offset_maximums.y);
-			for (int dy = offset_minimums.y; dy < offset_maximums.y; dy++){
-				for (unsigned int x = x_distance_from_edge; x < w-x_distance_from_edge; x+=pixel_skip){
-					for (int dx = offset_minimums.x; dx < offset_maximums.x; dx++){
-						differences[dy-offset_minimums.y][dx-offset_minimums.x]+=(ns_64_bit)abs((int)r[y][x]-(int)a[y+dy][x+dx]);
-					}
-				}
+			block.add_line(y,r,a);
+			if (block.full() || y+pixel_skip >= h-y_distance_from_edge){
+				thread_pool.run(jobs);
+				block.clear();
 			}
 		}
 
@@ -152,10 +376,13 @@ public:
 		return minimum_offset;
 	}
 	template<class profile_storage_type_1,class profile_storage_type_2>
-	static ns_vector_2i register_profiles(const ns_image_registration_profile<profile_storage_type_1> & r , const ns_image_registration_profile<profile_storage_type_2> & a,  const ns_vector_2i max_offset = ns_vector_2i(0,0), const std::string & debug_name=""){
+	static ns_vector_2i register_profiles(ns_image_registration_profile<profile_storage_type_1> & r , ns_image_registration_profile<profile_storage_type_2> & a,  const ns_vector_2i max_offset = ns_vector_2i(0,0), const std::string & debug_name=""){
 		if (r.registration_method == ns_full_registration){
 			return register_full_images(r,a,max_offset);
 		}
+		if (r.registration_method == ns_fft_registration){
+			return register_fft_images(r,a,max_offset);
+		}
 		return ns_vector_2i(register_profile(r.horizontal_profile, a.horizontal_profile,r.registration_method,max_offset.x,r.average,a.average,debug_name+"_horiz"),
 						    register_profile(r.vertical_profile, a.vertical_profile,r.registration_method,   max_offset.y,r.average,a.average,debug_name+"_vert"));
 	
@@ -245,6 +472,87 @@ public:
 		return minimum_offset;
 	}
 
+	//Calculates the spectrum of a power-of-two sized tile taken from the center of a downsampled image.
+	//If tile_width or tile_height are zero, the largest tile that fits in the image is used.
+	static void calculate_downsampled_spectrum(const ns_image_standard & im, ns_phase_correlation_spectrum & spectrum, unsigned long tile_width=0, unsigned long tile_height=0){
+		const unsigned long w(im.properties().width),
+							h(im.properties().height);
+		if (tile_width == 0)
+			tile_width = ns_fft::largest_power_of_two_not_exceeding(w);
+		if (tile_height == 0)
+			tile_height = ns_fft::largest_power_of_two_not_exceeding(h);
+		if (tile_width == 0 || tile_height == 0 || tile_width > w || tile_height > h)
+			throw ns_ex("ns_image_registration::calculate_downsampled_spectrum()::Downsampled image (") << w << "x" << h << ") is too small";
+		const ns_vector_2i origin((w-tile_width)/2,(h-tile_height)/2);
+		std::vector<double> tile(tile_width*tile_height);
+		for (unsigned long y = 0; y < tile_height; y++)
+			for (unsigned long x = 0; x < tile_width; x++)
+				tile[y*tile_width+x] = im[y+origin.y][x+origin.x];
+		ns_phase_correlation::calculate_spectrum(tile,tile_width,tile_height,spectrum);
+		spectrum.origin = origin;
+	}
+
+	//places a 3x3 grid of tiles across the image, leaving the specified margin around its edges
+	static void choose_fft_tile_origins(const ns_image_properties & prop, const ns_vector_2i & margin, const unsigned long tile_size, std::vector<ns_vector_2i> & origins){
+		origins.resize(0);
+		const long w(prop.width),
+				   h(prop.height),
+				   t(tile_size);
+		for (long gy = 0; gy < 3; gy++){
+			for (long gx = 0; gx < 3; gx++){
+				ns_vector_2i o((w-t)/2,(h-t)/2);
+				if (w - 2*margin.x - t > 0)
+					o.x = margin.x + ((w - 2*margin.x - t)*gx)/2;
+				if (h - 2*margin.y - t > 0)
+					o.y = margin.y + ((h - 2*margin.y - t)*gy)/2;
+				if (std::find(origins.begin(),origins.end(),o) == origins.end())
+					origins.push_back(o);
+			}
+		}
+	}
+
+	//Calculates the spectra of square tiles at each of the specified origins.
+	//Lines are requested in increasing order, so that disk-buffered images can be read in a single pass.
+	template<class random_access_image_type>
+	static void calculate_tile_spectra(random_access_image_type & im, const std::vector<ns_vector_2i> & origins, const unsigned long tile_size, std::vector<ns_phase_correlation_spectrum> & spectra){
+		if (origins.empty())
+			throw ns_ex("ns_image_registration::calculate_tile_spectra()::No tiles specified");
+		long top(origins[0].y),
+			 bottom(origins[0].y);
+		for (unsigned int i = 0; i < origins.size(); i++){
+			if (origins[i].x < 0 || origins[i].y < 0 || origins[i].x + tile_size > im.properties().width || origins[i].y + tile_size > im.properties().height)
+				throw ns_ex("ns_image_registration::calculate_tile_spectra()::Tile at ") << origins[i].x << "," << origins[i].y << " lies outside the image";
+			top = std::min(top,(long)origins[i].y);
+			bottom = std::max(bottom,(long)origins[i].y);
+		}
+		bottom+=tile_size;
+		std::vector<std::vector<double> > tiles(origins.size(),std::vector<double>(tile_size*tile_size));
+		for (long y = top; y < bottom; y++){
+			im.make_line_available(y);
+			for (unsigned int i = 0; i < origins.size(); i++){
+				if (y < origins[i].y || y >= origins[i].y + (long)tile_size)
+					continue;
+				double * row(&tiles[i][(y-origins[i].y)*tile_size]);
+				for (unsigned long x = 0; x < tile_size; x++)
+					row[x] = im[y][origins[i].x+x];
+			}
+		}
+		spectra.resize(origins.size());
+		for (unsigned int i = 0; i < origins.size(); i++){
+			ns_phase_correlation::calculate_spectrum(tiles[i],tile_size,tile_size,spectra[i]);
+			spectra[i].origin = origins[i];
+		}
+	}
+
+	static double ns_median_of_estimates(std::vector<double> & v){
+		if (v.empty())
+			throw ns_ex("ns_image_registration::No estimates were made");
+		std::sort(v.begin(),v.end());
+		if (v.size()%2 == 1)
+			return v[v.size()/2];
+		return (v[v.size()/2-1] + v[v.size()/2])/2;
+	}
+
 	template<class profile_storage_type>
 	static void write_profile(const std::string & name, const ns_image_registration_profile<profile_storage_type> & profile, std::ostream & out){
 		for (unsigned long i = 0; i < profile.horizontal_profile.size();i++)
@@ -260,6 +568,7 @@ public:
 		case ns_sum_registration:	return "sum";
 		case ns_full_registration: return "full";
 		case ns_compound_registration: return "compound";
+		case ns_fft_registration: return "fft";
 		default: throw ns_ex("Unknown");
 		}
 	}
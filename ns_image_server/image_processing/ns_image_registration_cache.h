@@ -1,15 +1,22 @@
 #ifndef NS_IMAGE_REGISTRATION_CACHE
 #define NS_IMAGE_REGISTRATION_CACHE
 #include "ns_image.h"
+#include "ns_image_tools.h"
 #include "ns_buffered_random_access_image.h"
 #include "ns_image_storage_handler.h"
+#include "ns_fft.h"
 
 #define NS_MAX_CAPTURED_IMAGE_REGISTRATION_VERTICAL_OFFSET 200
 
 #define NS_SECONDARY_DOWNSAMPLE_FACTOR 4
 
+//the full-resolution tiles compared by ns_fft_registration are this many pixels on a side
+#define NS_FFT_REGISTRATION_TILE_SIZE 256
+//ns_image_registration::generate_profiles() downsamples images to approximately this size for ns_fft_registration
+#define NS_FFT_REGISTRATION_DOWNSAMPLED_DIMENSION 500
+
 typedef std::vector<ns_64_bit> ns_image_registation_profile_dimension;
-typedef enum {ns_no_registration,ns_threshold_registration,ns_sum_registration,ns_full_registration,ns_compound_registration} ns_registration_method;
+typedef enum {ns_no_registration,ns_threshold_registration,ns_sum_registration,ns_full_registration,ns_compound_registration,ns_fft_registration} ns_registration_method;
 	 
 struct ns_downsampling_sizes{
 	unsigned long downsample_factor,
@@ -39,6 +46,19 @@ struct ns_image_registration_profile{
 
 	 ns_image_standard downsampled_image;
 
+	 //ns_fft_registration caches the spectra of the downsampled image and of the full-resolution tiles
+	 //so that a reference image is only transformed once, however many images are registered against it.
+	 //The tiles used depend on the maximum offset requested.
+	 ns_phase_correlation_spectrum downsampled_spectrum;
+	 std::vector<ns_phase_correlation_spectrum> tile_spectra;
+	 ns_vector_2i tile_spectra_max_offset;
+
+	 void clear_spectra(){
+		 downsampled_spectrum.clear();
+		 tile_spectra.resize(0);
+		 tile_spectra_max_offset = ns_vector_2i(0,0);
+	 }
+
 	 unsigned long last_accessed_timestamp;
 
 	 static ns_downsampling_sizes calculate_downsampled_sizes(const ns_image_properties & whole_image_properties,const unsigned long max_average_dimention,const unsigned long spec_downsample_factor=0){
@@ -63,11 +83,14 @@ struct ns_image_registration_profile{
 	 }
 
 	 
-	static void ns_fast_downsample(ns_registration_disk_buffer & source,ns_image_standard & downsample_1, ns_image_storage_reciever_handle<ns_8_bit> & downsample_2,ns_image_storage_reciever_handle<ns_8_bit> &  whole_image_out, const unsigned long max_average_dimention, const unsigned long spec_downsample_factor=0){
+	//if additional_outputs is specified, the whole image is also sent to it, so that other consumers need not read the source image again.
+	static void ns_fast_downsample(ns_registration_disk_buffer & source,ns_image_standard & downsample_1, ns_image_storage_reciever_handle<ns_8_bit> & downsample_2,ns_image_storage_reciever_handle<ns_8_bit> &  whole_image_out, const unsigned long max_average_dimention, const unsigned long spec_downsample_factor=0,ns_image_stream_fan_out<ns_8_bit> * additional_outputs=0){
 		ns_downsampling_sizes sizes(ns_image_registration_profile<ns_8_bit>::calculate_downsampled_sizes(source.properties(),max_average_dimention,spec_downsample_factor));
 		downsample_1.init(sizes.downsampled);
 		downsample_2.output_stream().init(sizes.downsampled_2);
 		whole_image_out.output_stream().init(source.properties());
+		if (additional_outputs != 0)
+			additional_outputs->prepare_to_recieve_image(source.properties());
 		ns_image_stream_static_buffer<ns_8_bit> downsampled_2_buf(ns_image_stream_buffer_properties(sizes.downsampled_2.width,1024));
 		ns_image_stream_static_buffer<ns_8_bit> whole_buf(ns_image_stream_buffer_properties(source.properties().width,256));
 
@@ -101,6 +124,8 @@ struct ns_image_registration_profile{
 			whole_buf_height++;
 			if (whole_buf_height==whole_buf.properties().height){
 				whole_image_out.output_stream().recieve_lines(whole_buf,whole_buf_height);
+				if (additional_outputs != 0)
+					additional_outputs->recieve_lines(whole_buf,whole_buf_height);
 				whole_buf_lines_written+=whole_buf_height;
 				whole_buf_height = 0;
 			}
@@ -112,8 +137,12 @@ struct ns_image_registration_profile{
 		downsample_2.output_stream().finish_recieving_image();
 		if (whole_buf_height> 0){
 			whole_image_out.output_stream().recieve_lines(whole_buf,whole_buf_height);
+			if (additional_outputs != 0)
+				additional_outputs->recieve_lines(whole_buf,whole_buf_height);
 		}
 		whole_image_out.output_stream().finish_recieving_image();
+		if (additional_outputs != 0)
+			additional_outputs->finish_recieving_image();
 	}
 };
 
@@ -122,7 +151,8 @@ class ns_disk_buffered_image_registration_profile : public ns_image_registration
 public:
 	ns_disk_buffered_image_registration_profile():whole_image_source(0),
 													downsampled_image_2_source(0){}
-	void prepare_images(ns_image_server_image & im,const unsigned long max_average_dimention,ns_sql & sql,ns_image_storage_handler * image_storage,const unsigned long downsample_factor=0){
+	//the image read from storage is also sent to additional_outputs, if specified
+	void prepare_images(ns_image_server_image & im,const unsigned long max_average_dimention,ns_sql & sql,ns_image_storage_handler * image_storage,const unsigned long downsample_factor=0,ns_image_stream_fan_out<ns_8_bit> * additional_outputs=0){
 
 			ns_image_storage_source_handle<ns_8_bit> source(image_storage->request_from_storage(im,&sql));
 			ns_registration_disk_buffer whole_image_long_term_storage;
@@ -144,7 +174,7 @@ public:
 				ns_image_storage_reciever_handle<ns_8_bit> whole_image_out(image_storage->request_local_cache_storage(whole_filename,256,false));
 				ns_image_storage_reciever_handle<ns_8_bit> downsample_2_out(image_storage->request_local_cache_storage(downsampled_filename,1024,false));
 				//no need to do linear interpolation.  Nobody sees these images and any aliasing will be handled by comparrison between the less downsampled copies
-				ns_fast_downsample(whole_image_long_term_storage,downsampled_image,downsample_2_out,whole_image_out,max_average_dimention,downsample_factor);
+				ns_fast_downsample(whole_image_long_term_storage,downsampled_image,downsample_2_out,whole_image_out,max_average_dimention,downsample_factor,additional_outputs);
 				//ns_save_image("c:\\server\\downsample_1.tif",downsampled_image);
 				//ns_save_image("c:\\server\\downsample_2.tif",downsampled_2);
 			}
@@ -158,6 +188,7 @@ public:
 			downsampled_image_2.assign_buffer_source(downsampled_image_2_source.input_stream(),NS_MAX_CAPTURED_IMAGE_REGISTRATION_VERTICAL_OFFSET,1024);
 	}
 	void cleanup(ns_image_storage_handler * image_storage){
+		clear_spectra();
 		downsampled_image.clear();
 		downsampled_image_2.clear();
 		downsampled_image_2_source.clear();
@@ -186,7 +217,7 @@ public:
 			whole_image.resample(downsampling_sizes.downsampled,downsampled_image);
 			whole_image.resample(downsampling_sizes.downsampled_2,downsampled_image_2);
 	}
-	void cleanup(ns_image_storage_handler * image_storage){whole_image.clear();downsampled_image.clear();downsampled_image_2.clear();}
+	void cleanup(ns_image_storage_handler * image_storage){clear_spectra();whole_image.clear();downsampled_image.clear();downsampled_image_2.clear();}
 };
 
 
@@ -288,6 +288,129 @@ private:
 	reciever2_t* output_2;
 };
 
+///An output of an ns_image_stream_fan_out, which hides the type of the reciever to which lines are sent.
+template<class ns_component>
+class ns_image_stream_fan_out_output{
+public:
+	virtual ~ns_image_stream_fan_out_output(){}
+	virtual void prepare_to_recieve_image(const ns_image_properties & properties)=0;
+	virtual void recieve_lines(const ns_image_stream_static_buffer<ns_component> & lines, const unsigned long height)=0;
+	virtual void finish_recieving_image()=0;
+};
+
+template<class ns_component, class reciever_t>
+class ns_image_stream_fan_out_binding : public ns_image_stream_fan_out_output<ns_component>{
+public:
+	ns_image_stream_fan_out_binding(reciever_t & reciever_):reciever(reciever_),line_width(0){}
+	void prepare_to_recieve_image(const ns_image_properties & properties){
+		line_width = properties.width*properties.components;
+		reciever.prepare_to_recieve_image(properties);
+	}
+	void recieve_lines(const ns_image_stream_static_buffer<ns_component> & lines, const unsigned long height){
+		const ns_image_stream_buffer_properties bufp(line_width,height);
+		reciever.output_buffer = reciever.provide_buffer(bufp);
+		for (unsigned long y = 0; y < height; y++)
+			memcpy((*reciever.output_buffer)[y],lines[y],sizeof(ns_component)*bufp.width);
+		reciever.recieve_lines(*reciever.output_buffer,height);
+	}
+	void finish_recieving_image(){reciever.finish_recieving_image();}
+private:
+	reciever_t & reciever;
+	unsigned long line_width;
+};
+
+///An output of an ns_image_stream_fan_out whose failure does not interrupt the others.
+///The first exception thrown by the reciever is recorded, after which it is sent nothing more.
+template<class ns_component, class reciever_t>
+class ns_image_stream_fan_out_optional_binding : public ns_image_stream_fan_out_output<ns_component>{
+public:
+	ns_image_stream_fan_out_optional_binding(reciever_t & reciever_, ns_ex & error_, bool & error_occurred_):binding(reciever_),error(&error_),error_occurred(&error_occurred_){}
+	void prepare_to_recieve_image(const ns_image_properties & properties){
+		if (*error_occurred) return;
+		try{binding.prepare_to_recieve_image(properties);}
+		catch(ns_ex & ex){record(ex);}
+		catch(std::exception & ex){record(ns_ex(ex));}
+	}
+	void recieve_lines(const ns_image_stream_static_buffer<ns_component> & lines, const unsigned long height){
+		if (*error_occurred) return;
+		try{binding.recieve_lines(lines,height);}
+		catch(ns_ex & ex){record(ex);}
+		catch(std::exception & ex){record(ns_ex(ex));}
+	}
+	void finish_recieving_image(){
+		if (*error_occurred) return;
+		try{binding.finish_recieving_image();}
+		catch(ns_ex & ex){record(ex);}
+		catch(std::exception & ex){record(ns_ex(ex));}
+	}
+private:
+	void record(const ns_ex & ex){
+		*error = ex;
+		*error_occurred = true;
+	}
+	ns_image_stream_fan_out_binding<ns_component,reciever_t> binding;
+	ns_ex * error;
+	bool * error_occurred;
+};
+
+///Recieves an image and sends each block of lines to any number of recievers, so that
+///a single read of an image can feed several consumers.
+///Unlike ns_image_stream_splitter, the recievers may be of any type and any number.
+///Recievers are sent lines in the order in which they were added.
+template<class ns_component>
+class ns_image_stream_fan_out : public ns_image_stream_reciever<ns_image_stream_static_buffer<ns_component> >{
+public:
+	typedef ns_image_stream_static_buffer<ns_component> storage_type;
+	ns_image_stream_fan_out(const long max_line_block_height):ns_image_stream_reciever<ns_image_stream_static_buffer<ns_component> >(max_line_block_height,this){}
+	~ns_image_stream_fan_out(){clear_outputs();}
+
+	template<class reciever_t>
+	void add_output(reciever_t & reciever){
+		outputs.push_back(new ns_image_stream_fan_out_binding<ns_component,reciever_t>(reciever));
+	}
+	///Any exception thrown by the reciever is stored in error, and error_occurred set, rather than interrupting the other outputs
+	template<class reciever_t>
+	void add_optional_output(reciever_t & reciever, ns_ex & error, bool & error_occurred){
+		outputs.push_back(new ns_image_stream_fan_out_optional_binding<ns_component,reciever_t>(reciever,error,error_occurred));
+	}
+	void clear_outputs(){
+		for (unsigned int i = 0; i < outputs.size(); i++)
+			delete outputs[i];
+		outputs.resize(0);
+	}
+	bool empty() const{return outputs.empty();}
+
+	bool init(const ns_image_properties & properties){
+		ns_image_stream_buffer_properties bufp;
+		bufp.height = ns_image_stream_reciever<ns_image_stream_static_buffer<ns_component> >::_max_line_block_height;
+		bufp.width = properties.width*properties.components;
+		in_buffer.resize(bufp);
+		for (unsigned int i = 0; i < outputs.size(); i++)
+			outputs[i]->prepare_to_recieve_image(properties);
+		return true;
+	}
+
+	ns_image_stream_static_buffer<ns_component> * provide_buffer(const ns_image_stream_buffer_properties & p){
+		if (p.height > in_buffer.properties().height || p.width != in_buffer.properties().width)
+			in_buffer.resize(p);
+		return &in_buffer;
+	}
+
+	void recieve_lines(const ns_image_stream_static_buffer<ns_component> & lines, const unsigned long height){
+		for (unsigned int i = 0; i < outputs.size(); i++)
+			outputs[i]->recieve_lines(lines,height);
+	}
+
+	void finish_recieving_image(){
+		for (unsigned int i = 0; i < outputs.size(); i++)
+			outputs[i]->finish_recieving_image();
+	}
+
+private:
+	ns_image_stream_static_buffer<ns_component> in_buffer;
+	std::vector<ns_image_stream_fan_out_output<ns_component> *> outputs;
+};
+
 
 ///Using the specified pixel value, outputs a thresholded copy of the image.
 template<class ns_component>
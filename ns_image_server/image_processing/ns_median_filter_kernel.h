@@ -0,0 +1,377 @@
+#ifndef NS_MEDIAN_FILTER_KERNEL
+#define NS_MEDIAN_FILTER_KERNEL
+#include "ns_ex.h"
+#include <vector>
+#include <string.h>
+
+//Median filter kernels based on two-level ("coarse" and "fine") histograms.
+//Reference: S. Perreault and P. Hebert, "Median Filtering in Constant Time",
+//IEEE Transactions on Image Processing, September 2007.
+//
+//ns_median_filter_kernel<ns_8_bit> keeps one 16x16 bin histogram per image column and
+//slides a window histogram across each row, exactly as in external_libraries/ctmf.
+//All histogram additions and subtractions are done 16 bins at a time using AVX2 or SSE2 if available.
+//
+//ns_median_filter_kernel<ns_16_bit> uses a single three-level (256, 4096 and 65536 bin) window histogram,
+//which avoids the 128kb-per-column memory cost of per-column 16-bit histograms.
+//The coarser levels let the median be located by scanning a few dozen bins rather than 65536.
+//
+//Both kernels treat pixels outside the image as copies of the nearest edge pixel,
+//and write the true median of the (2r+1)x(2r+1) window to dst.
+
+#if defined(__AVX2__)
+	#include <immintrin.h>
+	#define NS_MEDIAN_FILTER_USE_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#define NS_MEDIAN_FILTER_USE_SSE2
+#endif
+
+///arithmetic on 16-bin histogram segments
+struct ns_median_histogram_segment{
+	enum{number_of_bins=16};
+	//y+=x
+	static inline void add(const ns_16_bit * x, ns_16_bit * y){
+		#if defined(NS_MEDIAN_FILTER_USE_AVX2)
+			_mm256_storeu_si256((__m256i *)y,_mm256_add_epi16(_mm256_loadu_si256((const __m256i *)y),_mm256_loadu_si256((const __m256i *)x)));
+		#elif defined(NS_MEDIAN_FILTER_USE_SSE2)
+			_mm_storeu_si128((__m128i *)y,_mm_add_epi16(_mm_loadu_si128((const __m128i *)y),_mm_loadu_si128((const __m128i *)x)));
+			_mm_storeu_si128((__m128i *)(y+8),_mm_add_epi16(_mm_loadu_si128((const __m128i *)(y+8)),_mm_loadu_si128((const __m128i *)(x+8))));
+		#else
+			for (unsigned int i = 0; i < number_of_bins; i++)
+				y[i]+=x[i];
+		#endif
+	}
+	//y-=x
+	static inline void subtract(const ns_16_bit * x, ns_16_bit * y){
+		#if defined(NS_MEDIAN_FILTER_USE_AVX2)
+			_mm256_storeu_si256((__m256i *)y,_mm256_sub_epi16(_mm256_loadu_si256((const __m256i *)y),_mm256_loadu_si256((const __m256i *)x)));
+		#elif defined(NS_MEDIAN_FILTER_USE_SSE2)
+			_mm_storeu_si128((__m128i *)y,_mm_sub_epi16(_mm_loadu_si128((const __m128i *)y),_mm_loadu_si128((const __m128i *)x)));
+			_mm_storeu_si128((__m128i *)(y+8),_mm_sub_epi16(_mm_loadu_si128((const __m128i *)(y+8)),_mm_loadu_si128((const __m128i *)(x+8))));
+		#else
+			for (unsigned int i = 0; i < number_of_bins; i++)
+				y[i]-=x[i];
+		#endif
+	}
+	//y+=a*x
+	static inline void multiply_add(const ns_16_bit a, const ns_16_bit * x, ns_16_bit * y){
+		#if defined(NS_MEDIAN_FILTER_USE_AVX2)
+			const __m256i m(_mm256_set1_epi16((short)a));
+			_mm256_storeu_si256((__m256i *)y,_mm256_add_epi16(_mm256_loadu_si256((const __m256i *)y),_mm256_mullo_epi16(m,_mm256_loadu_si256((const __m256i *)x))));
+		#elif defined(NS_MEDIAN_FILTER_USE_SSE2)
+			const __m128i m(_mm_set1_epi16((short)a));
+			_mm_storeu_si128((__m128i *)y,_mm_add_epi16(_mm_loadu_si128((const __m128i *)y),_mm_mullo_epi16(m,_mm_loadu_si128((const __m128i *)x))));
+			_mm_storeu_si128((__m128i *)(y+8),_mm_add_epi16(_mm_loadu_si128((const __m128i *)(y+8)),_mm_mullo_epi16(m,_mm_loadu_si128((const __m128i *)(x+8)))));
+		#else
+			for (unsigned int i = 0; i < number_of_bins; i++)
+				y[i]+=a*x[i];
+		#endif
+	}
+};
+
+///A hierarchical histogram of pixel values, used to find the median of a sliding window.
+///Each pixel value is counted in a fine bin, in the middle bin containing it, and in the coarse bin containing that.
+///The coarse bin in which the last median was found is remembered, along with the number of pixels below it,
+///so that successive medians of a slowly-changing window can be found after scanning only a few coarse bins,
+///then at most 2^(fine_bits/2) middle bins and 2^(fine_bits/2) fine bins.
+template<class ns_component>
+class ns_hierarchical_histogram{
+public:
+	enum{fine_bits = 4*sizeof(ns_component),
+		 middle_bits = fine_bits/2,
+		 number_of_coarse_bins = 1<<(8*sizeof(ns_component)-fine_bits),
+		 number_of_middle_bins = 1<<(8*sizeof(ns_component)-middle_bits),
+		 number_of_bins = 1<<(8*sizeof(ns_component)),
+		 bins_per_level = 1<<middle_bits};
+
+	ns_hierarchical_histogram():coarse(number_of_coarse_bins,0),middle(number_of_middle_bins,0),fine(number_of_bins,0),N(0),current_coarse_bin(0),pixels_below_current_coarse_bin(0){}
+
+	void clear(){
+		for (unsigned int i = 0; i < coarse.size(); i++)
+			coarse[i] = 0;
+		for (unsigned int i = 0; i < middle.size(); i++)
+			middle[i] = 0;
+		for (unsigned int i = 0; i < fine.size(); i++)
+			fine[i] = 0;
+		N = 0;
+		current_coarse_bin = 0;
+		pixels_below_current_coarse_bin = 0;
+	}
+	inline void add(const ns_component v){
+		const unsigned long c(v>>fine_bits);
+		coarse[c]++;
+		middle[v>>middle_bits]++;
+		fine[v]++;
+		N++;
+		//written without a branch, which would be unpredictable for noisy images
+		pixels_below_current_coarse_bin+=(c < current_coarse_bin);
+	}
+	inline void subtract(const ns_component v){
+		const unsigned long c(v>>fine_bits);
+		coarse[c]--;
+		middle[v>>middle_bits]--;
+		fine[v]--;
+		N--;
+		pixels_below_current_coarse_bin-=(c < current_coarse_bin);
+	}
+	inline unsigned long number_of_pixels() const{return N;}
+
+	///returns the value of the pixel with the specified rank (0 is the smallest pixel in the histogram)
+	inline ns_component value_of_rank(const unsigned long rank){
+		if (rank >= N)
+			throw ns_ex("ns_hierarchical_histogram::Requesting rank ") << rank << " of a histogram containing " << N << " pixels";
+		//move the coarse bin down or up until it contains the requested rank
+		while (pixels_below_current_coarse_bin > rank){
+			current_coarse_bin--;
+			pixels_below_current_coarse_bin-=coarse[current_coarse_bin];
+		}
+		while (pixels_below_current_coarse_bin + coarse[current_coarse_bin] <= rank){
+			pixels_below_current_coarse_bin+=coarse[current_coarse_bin];
+			current_coarse_bin++;
+		}
+		unsigned long sum(pixels_below_current_coarse_bin),
+					  m(current_coarse_bin<<(fine_bits-middle_bits));
+		for (unsigned long i = 0; i < bins_per_level; i++,m++){
+			if (sum + middle[m] > rank)
+				break;
+			sum+=middle[m];
+		}
+		unsigned long f(m<<middle_bits);
+		for (unsigned long i = 0; i < bins_per_level; i++,f++){
+			sum+=fine[f];
+			if (sum > rank)
+				return (ns_component)f;
+		}
+		throw ns_ex("ns_hierarchical_histogram::Histogram is inconsistent");
+	}
+	inline ns_component median(){
+		if (N == 0)
+			return 0;
+		return value_of_rank((N-1)/2);
+	}
+	///The median of all pixels with non-zero values.
+	inline ns_component median_ignoring_zero(){
+		const unsigned long number_of_zeros(fine[0]);
+		if (N == number_of_zeros)
+			return 0;
+		return value_of_rank(number_of_zeros + (N-number_of_zeros-1)/2);
+	}
+
+private:
+	//counts are 32 bit so that the 16 bit fine histogram (256kb) stays within the L2 cache
+	std::vector<unsigned int> coarse,
+							  middle,
+							  fine;
+	unsigned long N;
+	unsigned long current_coarse_bin,
+				  pixels_below_current_coarse_bin;
+};
+
+template<class ns_component>
+class ns_median_filter_kernel;
+
+///Constant time median filter for 8 bit images.
+template<>
+class ns_median_filter_kernel<ns_8_bit>{
+public:
+	//the filter processes the image in vertical stripes, each narrow enough for its column histograms to fit in this many bytes of cache.
+	enum{cache_size = 512*1024};
+
+	static void run(const ns_8_bit * src, ns_8_bit * dst, const long width, const long height, const long src_step, const long dst_step, const long r){
+		check_dimensions(width,height,r);
+		//each stripe overlaps its neighbors by 2r columns so that every output pixel has its full window within one stripe.
+		const long histograms_in_cache((long)(cache_size/(sizeof(ns_16_bit)*(16+256))));
+		long number_of_stripes(1);
+		if (histograms_in_cache > 2*r+1)
+			number_of_stripes = (width - 2*r + (histograms_in_cache-2*r) - 1)/(histograms_in_cache - 2*r);
+		if (number_of_stripes < 1)
+			number_of_stripes = 1;
+		const long stripe_width((width + number_of_stripes*2*r - 2*r + number_of_stripes-1)/number_of_stripes);
+
+		for (long i = 0; i < width; i += stripe_width - 2*r){
+			long stripe(stripe_width);
+			if (i + stripe_width - 2*r >= width || width - (i + stripe_width - 2*r) < 2*r+1)
+				stripe = width - i;
+			run_stripe(src + i,dst + i,stripe,height,src_step,dst_step,r,i == 0,stripe == width - i);
+			if (stripe == width - i)
+				break;
+		}
+	}
+private:
+	static void check_dimensions(const long width, const long height, const long r){
+		if (r < 0)
+			throw ns_ex("ns_median_filter_kernel::Invalid radius: ") << r;
+		if (width < 2*r+1 || height < 2*r+1)
+			throw ns_ex("ns_median_filter_kernel::Image (") << width << "x" << height << ") is smaller than the filter window (" << 2*r+1 << ")";
+		if ((2*r+1)*(2*r+1) > 65535)
+			throw ns_ex("ns_median_filter_kernel::Radius is too large for 16 bit histograms: ") << r;
+	}
+
+	struct ns_window_histogram{
+		ns_16_bit coarse[16];
+		ns_16_bit fine[16][16];
+	};
+
+	//pad_left and pad_right are set if the stripe lies on the edge of the image, in which case
+	//the edge column is replicated.  Otherwise, the stripe contains 2r columns of overlap with its neighbors.
+	static void run_stripe(const ns_8_bit * src, ns_8_bit * dst, const long n, const long m, const long src_step, const long dst_step, const long r, const bool pad_left, const bool pad_right){
+		std::vector<ns_16_bit> column_coarse_buffer(16*n,0),
+							   column_fine_buffer(16*16*n,0);
+		ns_16_bit * column_coarse(&column_coarse_buffer[0]),
+				  * column_fine(&column_fine_buffer[0]);
+		#define NS_COLUMN_OP(j,x,op) \
+			column_coarse[16*(j) + ((x)>>4)] op; \
+			column_fine[16*(n*((x)>>4) + (j)) + ((x) & 0xF)] op;
+
+		//the top edge row is replicated r+1 times
+		for (long j = 0; j < n; j++){
+			NS_COLUMN_OP(j,src[j],+= r+1);
+		}
+		for (long i = 0; i < r; i++){
+			for (long j = 0; j < n; j++){
+				NS_COLUMN_OP(j,src[src_step*i+j],++);
+			}
+		}
+		ns_window_histogram H;
+		long last_update_column[16];
+		const ns_16_bit median_rank(2*r*r + 2*r);
+
+		for (long i = 0; i < m; i++){
+			//slide the column histograms down one row
+			const ns_8_bit * p(src + src_step*(i-r-1 > 0 ? i-r-1 : 0));
+			for (long j = 0; j < n; j++){
+				NS_COLUMN_OP(j,p[j],--);
+			}
+			p = src + src_step*(i+r < m-1 ? i+r : m-1);
+			for (long j = 0; j < n; j++){
+				NS_COLUMN_OP(j,p[j],++);
+			}
+
+			//initialize the window histogram at the left edge of the stripe
+			memset(&H,0,sizeof(H));
+			for (unsigned int k = 0; k < 16; k++)
+				last_update_column[k] = 0;
+			if (pad_left)
+				ns_median_histogram_segment::multiply_add((ns_16_bit)r,&column_coarse[0],H.coarse);
+			for (long j = 0; j < (pad_left ? r : 2*r); j++)
+				ns_median_histogram_segment::add(&column_coarse[16*j],H.coarse);
+			for (unsigned int k = 0; k < 16; k++)
+				ns_median_histogram_segment::multiply_add((ns_16_bit)(2*r+1),&column_fine[16*n*k],H.fine[k]);
+
+			for (long j = pad_left ? 0 : r; j < (pad_right ? n : n-r); j++){
+				ns_median_histogram_segment::add(&column_coarse[16*(j+r < n-1 ? j+r : n-1)],H.coarse);
+
+				//find the coarse bin containing the median
+				ns_16_bit sum(0);
+				unsigned int k;
+				for (k = 0; k < 16; k++){
+					sum+=H.coarse[k];
+					if (sum > median_rank){
+						sum-=H.coarse[k];
+						break;
+					}
+				}
+				if (k == 16)
+					throw ns_ex("ns_median_filter_kernel::Corrupt coarse histogram");
+
+				//fine histograms are only updated when they are needed, so bring this one up to date.
+				ns_16_bit * fine_k(&column_fine[16*n*k]);
+				if (last_update_column[k] <= j-r){
+					//if it is far out of date, rebuild it from scratch
+					memset(H.fine[k],0,sizeof(H.fine[k]));
+					for (last_update_column[k] = j-r; last_update_column[k] < (j+r+1 < n ? j+r+1 : n); last_update_column[k]++)
+						ns_median_histogram_segment::add(&fine_k[16*last_update_column[k]],H.fine[k]);
+					if (last_update_column[k] < j+r+1){
+						ns_median_histogram_segment::multiply_add((ns_16_bit)(j+r+1-n),&fine_k[16*(n-1)],H.fine[k]);
+						last_update_column[k] = j+r+1;
+					}
+				}
+				else{
+					for (; last_update_column[k] < j+r+1; last_update_column[k]++){
+						const long old_column(last_update_column[k]-2*r-1);
+						ns_median_histogram_segment::subtract(&fine_k[16*(old_column > 0 ? old_column : 0)],H.fine[k]);
+						ns_median_histogram_segment::add(&fine_k[16*(last_update_column[k] < n-1 ? last_update_column[k] : n-1)],H.fine[k]);
+					}
+				}
+
+				ns_median_histogram_segment::subtract(&column_coarse[16*(j-r > 0 ? j-r : 0)],H.coarse);
+
+				//find the median within the coarse bin
+				unsigned int b;
+				for (b = 0; b < 16; b++){
+					sum+=H.fine[k][b];
+					if (sum > median_rank){
+						dst[dst_step*i + j] = (ns_8_bit)(16*k + b);
+						break;
+					}
+				}
+				if (b == 16)
+					throw ns_ex("ns_median_filter_kernel::Corrupt fine histogram");
+			}
+		}
+		#undef NS_COLUMN_OP
+	}
+};
+
+///Median filter for 16 bit images.
+template<>
+class ns_median_filter_kernel<ns_16_bit>{
+public:
+	static void run(const ns_16_bit * src, ns_16_bit * dst, const long width, const long height, const long src_step, const long dst_step, const long r){
+		if (r < 0)
+			throw ns_ex("ns_median_filter_kernel::Invalid radius: ") << r;
+		if (width < 2*r+1 || height < 2*r+1)
+			throw ns_ex("ns_median_filter_kernel::Image (") << width << "x" << height << ") is smaller than the filter window (" << 2*r+1 << ")";
+		const unsigned long median_rank(2*r*r + 2*r);
+		ns_hierarchical_histogram<ns_16_bit> hist;
+
+		//the window visits the image in a serpentine order (left to right, down one line, right to left, ...)
+		//so that the histogram never has to be rebuilt from scratch.
+		//Rows and columns outside the image are copies of the nearest edge.
+		for (long dy = -r; dy <= r; dy++){
+			const ns_16_bit * row(src + src_step*clamp(dy,height));
+			for (long dx = -r; dx <= r; dx++)
+				hist.add(row[clamp(dx,width)]);
+		}
+		std::vector<const ns_16_bit *> rows(2*r+1);
+		for (long i = 0; i < height; i++){
+			for (long dy = -r; dy <= r; dy++)
+				rows[dy+r] = src + src_step*clamp(i+dy,height);
+			const bool left_to_right(i%2 == 0);
+			const long start(left_to_right?0:width-1),
+					   step(left_to_right?1:-1);
+			for (long j = start;;j+=step){
+				dst[dst_step*i + j] = hist.value_of_rank(median_rank);
+				if (j + step < 0 || j + step >= width)
+					break;
+				const long old_column(clamp(j - step*r,width)),
+						   new_column(clamp(j + step*(r+1),width));
+				for (long k = 0; k <= 2*r; k++){
+					hist.subtract(rows[k][old_column]);
+					hist.add(rows[k][new_column]);
+				}
+			}
+			if (i+1 == height)
+				break;
+			//slide the window down one line
+			const ns_16_bit * old_row(src + src_step*clamp(i-r,height)),
+							* new_row(src + src_step*clamp(i+r+1,height));
+			const long j(left_to_right?width-1:0);
+			for (long dx = -r; dx <= r; dx++){
+				hist.subtract(old_row[clamp(j+dx,width)]);
+				hist.add(new_row[clamp(j+dx,width)]);
+			}
+		}
+	}
+private:
+	static inline long clamp(const long i, const long size){
+		if (i < 0)
+			return 0;
+		if (i >= size)
+			return size-1;
+		return i;
+	}
+};
+
+#endif
@@ -24,6 +24,7 @@
 
 #include "ns_image_tools.h"
 #include "ns_image_statistics.h"
+#include "ns_thread.h"
 
 
 
@@ -533,6 +534,145 @@ private:
 };
 
 
+///ns_image_mask_region_writer sends the lines of one masked region to the region's storage reciever from a thread of its own,
+///so that the compression and storage of each region proceeds in parallel with that of the others.
+///Lines are handed to the writer through a small ring of line blocks: the thread splitting the image fills one block while
+///the writer empties another, and the splitting thread waits only if the writer falls a full ring behind.
+template<class ns_component>
+class ns_image_mask_region_writer{
+public:
+	enum{number_of_blocks=4};
+	ns_image_mask_region_writer():reciever(0),running(false),free_blocks(number_of_blocks),fill_index(0),write_index(0),lines_in_fill_block(0),holding_fill_block(false),error_occurred(false){}
+	~ns_image_mask_region_writer(){abandon();}
+
+	///starts a thread that writes lines of the specified width (in components) to the reciever.
+	///prepare_to_recieve_image() must already have been called on the reciever.
+	void start(ns_image_storage_reciever<ns_component> & reciever_, const unsigned long line_width, const unsigned long lines_per_block){
+		abandon();
+		reciever = &reciever_;
+		for (unsigned int i = 0; i < number_of_blocks; i++){
+			blocks[i].lines.resize(ns_image_stream_buffer_properties(line_width,lines_per_block));
+			blocks[i].height = 0;
+		}
+		lines_in_fill_block = 0;
+		holding_fill_block = false;
+		error_occurred = false;
+		thread.run(run_writer,this);
+		running = true;
+	}
+
+	///returns storage for the next line, which is sent to the reciever after end_line() is called
+	ns_component * begin_line(){
+		if (!holding_fill_block){
+			free_blocks.wait();
+			holding_fill_block = true;
+		}
+		return blocks[fill_index].lines[lines_in_fill_block];
+	}
+	void end_line(){
+		lines_in_fill_block++;
+		if (lines_in_fill_block == blocks[fill_index].lines.properties().height)
+			submit_fill_block();
+	}
+
+	///waits for all lines to be written and stops the thread.
+	///Errors encountered by the thread are thrown here.
+	void finish(){
+		if (!running)
+			return;
+		if (lines_in_fill_block > 0)
+			submit_fill_block();
+		stop_thread();
+		if (error_occurred)
+			throw error;
+	}
+
+	///stops the thread without reporting errors; lines not yet handed to the writer are discarded.
+	///This may be called after an exception interrupted a line between begin_line() and end_line().
+	void abandon(){
+		if (!running)
+			return;
+		//a block already held by this thread, even if no lines were finished in it, can carry the request to stop
+		lines_in_fill_block = 0;
+		stop_thread(holding_fill_block);
+	}
+
+private:
+	struct ns_block{
+		ns_image_stream_static_buffer<ns_component> lines;
+		unsigned long height;
+	};
+	void submit_fill_block(){
+		blocks[fill_index].height = lines_in_fill_block;
+		fill_index = (fill_index+1)%number_of_blocks;
+		lines_in_fill_block = 0;
+		holding_fill_block = false;
+		filled_blocks.signal();
+	}
+	void stop_thread(const bool holding_a_block=false){
+		//an empty block tells the thread to stop
+		if (!holding_a_block)
+			free_blocks.wait();
+		submit_fill_block();
+		thread.block_on_finish();
+		running = false;
+	}
+
+	static ns_thread_return_type run_writer(void * writer){
+		static_cast<ns_image_mask_region_writer<ns_component> *>(writer)->write_blocks();
+		return 0;
+	}
+	void write_blocks(){
+		while(true){
+			filled_blocks.wait();
+			const ns_block & block(blocks[write_index]);
+			write_index = (write_index+1)%number_of_blocks;
+			if (block.height == 0){
+				free_blocks.signal();
+				return;
+			}
+			//after an error, blocks are still accepted so that the splitting thread is never left waiting
+			if (!error_occurred){
+				try{
+					const ns_image_stream_buffer_properties bufp(block.lines.properties().width,block.height);
+					ns_image_stream_static_buffer<ns_component> * buf(reciever->provide_buffer(bufp));
+					for (unsigned int y = 0; y < block.height; y++)
+						memcpy((*buf)[y],block.lines[y],sizeof(ns_component)*bufp.width);
+					reciever->recieve_lines(*buf,block.height);
+				}
+				catch(ns_ex & ex){
+					error = ex;
+					error_occurred = true;
+				}
+				catch(std::exception & ex){
+					error = ns_ex(ex);
+					error_occurred = true;
+				}
+				catch(...){
+					error = ns_ex("ns_image_mask_region_writer::An unknown error occurred while writing a region");
+					error_occurred = true;
+				}
+			}
+			free_blocks.signal();
+		}
+	}
+
+	ns_image_storage_reciever<ns_component> * reciever;
+	ns_thread thread;
+	bool running;
+	ns_block blocks[number_of_blocks];
+	ns_semaphore free_blocks,
+				 filled_blocks;
+	//fill_index, lines_in_fill_block and holding_fill_block are used only by the splitting thread; write_index, error, and error_occurred only by the writer thread
+	//until it has been stopped.
+	unsigned long fill_index,
+				  write_index,
+				  lines_in_fill_block;
+	bool holding_fill_block;
+	ns_ex error;
+	bool error_occurred;
+};
+
 ///this class recieves an image and splits it into multiple files using
 ///the specified mask image as a reference.
 ///specifiy_mask() must be called prior to recieving the first image
@@ -542,9 +682,11 @@ class ns_image_stream_mask_splitter: public ns_image_stream_reciever<ns_image_st
 	public:
 	ns_image_stream_mask_splitter(const long max_line_block_height):ns_image_stream_reciever<ns_image_stream_static_buffer<ns_component> >(max_line_block_height,this),
 		mask(0),registration_offset(0,0),resize_factor(10),stats(0){}
+	~ns_image_stream_mask_splitter(){delete_writers();}
 
 #pragma warning(default: 4355)
-	ns_image_mask_info<ns_component> * mask_info(){return &_mask_info;}
+	//the recievers in the mask info may be replaced by the caller, so any writers left running by an image that was not finished are stopped first
+	ns_image_mask_info<ns_component> * mask_info(){abandon_writers();return &_mask_info;}
 
 	void specify_mask(const ns_image_standard & _mask){mask = &_mask;}
 	void specificy_sample_image_statistics(ns_image_statistics & stats_){stats = &stats_;}
@@ -576,7 +718,9 @@ class ns_image_stream_mask_splitter: public ns_image_stream_reciever<ns_image_st
 
 		y = 0;
 
-
+		abandon_writers();
+		if (writers.size() < _mask_info.size())
+			writers.resize(_mask_info.size(),0);
 
 		//initialize all desired outputs
 		for (unsigned int i = 0; i < _mask_info.size(); i++){
@@ -603,6 +747,13 @@ class ns_image_stream_mask_splitter: public ns_image_stream_reciever<ns_image_st
 
 				_mask_info[i]->reciever.output_stream().prepare_to_recieve_image(_mask_info[i]->reciever_image_properties);
 				_mask_info[i]->lines_sent_to_reciever = 0;
+
+				if (writers[i] == 0)
+					writers[i] = new ns_image_mask_region_writer<ns_component>;
+				//small blocks keep the memory held by the writers' queues modest
+				writers[i]->start(_mask_info[i]->reciever.output_stream(),
+					_mask_info[i]->reciever_image_properties.width*properties.components,
+					(_max_line_block_height < 128)?_max_line_block_height:128);
 			}
 		}
 		
@@ -612,26 +763,7 @@ class ns_image_stream_mask_splitter: public ns_image_stream_reciever<ns_image_st
 			int underlap_height(registration_offset.y - (int)_mask_info[i]->stats.y_min);
 			//cerr << "R"<<i<< " underlap_height: " << underlap_height << "\n";
 			if (underlap_height > 0){
-				long width = (_mask_info[i]->stats.x_max-_mask_info[i]->stats.x_min+1)*_properties.components;
-				long lines_sent = 0;
-
-				while(lines_sent < underlap_height){
-					long lines_to_send = underlap_height - lines_sent;
-					if (lines_to_send > (long)_max_line_block_height)
-						lines_to_send = (long)_max_line_block_height;
-
-					ns_image_stream_buffer_properties bufp;
-					bufp.height = lines_to_send;
-					bufp.width = width;
-					ns_image_stream_static_buffer<ns_component> * buf = _mask_info[i]->reciever.output_stream().provide_buffer(bufp);
-
-					for (unsigned int y = 0; y < bufp.height; y++)
-						for (unsigned int x = 0; x < bufp.width; x++)
-							(*buf)[y][x] = 0;
-					_mask_info[i]->reciever.output_stream().recieve_lines(*buf,lines_to_send);
-					_mask_info[i]->lines_sent_to_reciever+=lines_to_send;
-					lines_sent+=lines_to_send;
-				}
+				send_blank_lines(i,underlap_height);
 				//cerr << "R"<<i<< " sent: " << lines_sent << "\n";
 			}
 		}
@@ -647,8 +779,6 @@ class ns_image_stream_mask_splitter: public ns_image_stream_reciever<ns_image_st
 				}
 			}
 		}
-		ns_image_stream_buffer_properties bufp;
-
 		for (long _y = 0; _y < (long)height; _y++){
 			if ((_y + y + registration_offset.y) < 0
 			 || (_y + y + registration_offset.y) >= (long)mask->properties().height*(long)resize_factor)
@@ -659,9 +789,8 @@ class ns_image_stream_mask_splitter: public ns_image_stream_reciever<ns_image_st
 					&& (_y + y) >= (int)_mask_info[i]->stats.y_min - registration_offset.y
 					&& (_y + y) <= (int)_mask_info[i]->stats.y_max - registration_offset.y){
 
-					bufp.width = (_mask_info[i]->stats.x_max-_mask_info[i]->stats.x_min+1)*_properties.components;
-					bufp.height = 1;
-					ns_image_stream_static_buffer<ns_component> * buf = _mask_info[i]->reciever.output_stream().provide_buffer(bufp);
+					const unsigned long width((_mask_info[i]->stats.x_max-_mask_info[i]->stats.x_min+1)*_properties.components);
+					ns_component * line(writers[i]->begin_line());
 
 					unsigned char i_c = ns_image_stream_reciever<ns_image_stream_static_buffer<ns_component> >::_properties.components,
 						m_c = mask->properties().components;
@@ -680,27 +809,27 @@ class ns_image_stream_mask_splitter: public ns_image_stream_reciever<ns_image_st
 						source_x_offset = -registration_offset.x;
 						destination_x_offset = 0;
 						for (int x = 0; x < registration_offset.x; x++){
-							(*buf)[0][x]=0;
+							line[x]=0;
 							_mask_info[i]->image_stats.histogram[0]++;
 						}
  					}
 					//write out the current line, multipled by the mask
-					for (unsigned int x = abs(registration_offset.x); x < bufp.width; x++){
+					for (unsigned int x = abs(registration_offset.x); x < width; x++){
 
 					//	(*buf)[0][x]  = lines[_y][((*mask_info)[i].stats.x_min+x)]* (ns_component)((*mask)[y+_y][(*mask_info)[i].stats.x_min+x] == i);
-						(*buf)[0][x+destination_x_offset] = 
+						line[x+destination_x_offset] = 
 								lines[_y][i_c*(_mask_info[i]->stats.x_min+source_x_offset)+x]* 
 									(ns_component)((*mask)[(y+_y + registration_offset.y)/resize_factor][(m_c*(_mask_info[i]->stats.x_min+destination_x_offset)+(x*m_c)/i_c)/resize_factor] == i);
 						//update image statistics for each region
-						_mask_info[i]->image_stats.histogram[(*buf)[0][x+destination_x_offset]]++;
+						_mask_info[i]->image_stats.histogram[line[x+destination_x_offset]]++;
 					}
 					if (registration_offset.x < 0){
-						for (int x = bufp.width+registration_offset.x; x < (long)bufp.width; x++){
-							(*buf)[0][x]=0;
+						for (int x = width+registration_offset.x; x < (long)width; x++){
+							line[x]=0;
 							_mask_info[i]->image_stats.histogram[0]++;
 						}
  					}
-					_mask_info[i]->reciever.output_stream().recieve_lines(*buf,1);
+					writers[i]->end_line();
 					_mask_info[i]->lines_sent_to_reciever++;
 				}
 		}
@@ -717,30 +846,28 @@ class ns_image_stream_mask_splitter: public ns_image_stream_reciever<ns_image_st
 //				cerr << "R"<<i<< " sent: " << _mask_info[i]->lines_sent_to_reciever << "\n";
 				const long overlap_height((long)_mask_info[i]->stats.y_max - source_image_properties.height -(long)registration_offset.y+1);
 //				cerr << "R"<<i<< " overlap: "<< overlap_height << "\n";
-				if (overlap_height > 0){
-					long width = (_mask_info[i]->stats.x_max-_mask_info[i]->stats.x_min+1)*_properties.components;
-					long lines_sent = 0;
-					while(lines_sent < overlap_height){
-						long lines_to_send = overlap_height - lines_sent;
-						if (lines_to_send > (long)_max_line_block_height)
-							lines_to_send = (long)_max_line_block_height;
-
-						ns_image_stream_buffer_properties bufp;
-						bufp.height = lines_to_send;
-						bufp.width = width;
-						ns_image_stream_static_buffer<ns_component> * buf = _mask_info[i]->reciever.output_stream().provide_buffer(bufp);
-
-						for (unsigned int y = 0; y < bufp.height; y++)
-							for (unsigned int x = 0; x < bufp.width; x++)
-								(*buf)[y][x] = 0;
-						_mask_info[i]->reciever.output_stream().recieve_lines(*buf,bufp.height);
-						lines_sent+=lines_to_send;
-						_mask_info[i]->lines_sent_to_reciever+=lines_to_send;
-					}
-				}
+				if (overlap_height > 0)
+					send_blank_lines(i,overlap_height);
 			}
 		}
 
+		//wait for all regions to be written.  Every writer is stopped before any error is reported.
+		bool write_error_occurred(false);
+		ns_ex write_error;
+		for (unsigned int i = 0; i < _mask_info.size(); i++){
+			if (_mask_info[i]->stats.pixel_count == 0)
+				continue;
+			try{
+				writers[i]->finish();
+			}
+			catch(ns_ex & ex){
+				if (!write_error_occurred)
+					write_error = ex;
+				write_error_occurred = true;
+			}
+		}
+		if (write_error_occurred)
+			throw write_error;
 
 		//close output files.
 		for (unsigned int i = 0; i < _mask_info.size(); i++)
@@ -760,13 +887,41 @@ class ns_image_stream_mask_splitter: public ns_image_stream_reciever<ns_image_st
 			throw ex;
 	}
 
+	///Stops every region's writer thread, discarding any lines not yet written.
+	///This must be called after an image could not be finished, before its regions' output is cleaned up.
+	void abandon(){abandon_writers();}
+
 	void clear_heap(){
+		delete_writers();
 		_mask_info.clear_heap();
 		in_buffer.resize(ns_image_stream_buffer_properties(0,0));
 		//mask is ignored, as memory management is handled by mask creator.
 	}
 
 private:
+	void send_blank_lines(const unsigned long region, const unsigned long number_of_lines){
+		const unsigned long width((_mask_info[region]->stats.x_max-_mask_info[region]->stats.x_min+1)*_properties.components);
+		for (unsigned long i = 0; i < number_of_lines; i++){
+			ns_component * line(writers[region]->begin_line());
+			for (unsigned long x = 0; x < width; x++)
+				line[x] = 0;
+			writers[region]->end_line();
+		}
+		_mask_info[region]->lines_sent_to_reciever+=number_of_lines;
+	}
+	void abandon_writers(){
+		for (unsigned int i = 0; i < writers.size(); i++)
+			if (writers[i] != 0)
+				writers[i]->abandon();
+	}
+	void delete_writers(){
+		for (unsigned int i = 0; i < writers.size(); i++)
+			ns_safe_delete(writers[i]);
+		writers.resize(0);
+	}
+	//one writer for each region of the mask, indexed by mask value
+	std::vector<ns_image_mask_region_writer<ns_component> *> writers;
+
 	ns_image_properties source_image_properties;
 	ns_image_mask_info<ns_component> _mask_info;
 	ns_image_stream_static_buffer<ns_component> in_buffer;
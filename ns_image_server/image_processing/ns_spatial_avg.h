@@ -24,9 +24,16 @@
 //   This is 40 times (7sec vs 280 sec!) faster than option 1, but requires the allocation of 3 times the memory requirement of the entire image.
 //	 TBA: It should be possible to make this 1x the memory requirement of the entire image but care must be taken
 //   to get the CPU caching to work right.
+//3) The same constant-time algorithm run on horizontal tiles of the image as they are streamed in.
+//   Each tile overlaps its neighbors by the kernal radius and is filtered on its own worker thread,
+//   so peak memory is proportional to (number of threads x tile height x image width) rather than to the entire image.
+//   Because the filter window never crosses a tile's overlap, the output is identical to that of option 2.
+//   Tiles are filtered by ns_median_filter_kernel, which handles 16 bit images at full depth.
 //if NS_OPTIMIZE_SPEED_OVER_MEMORY is defined, the second algorithm is used.
+//if NS_SPATIAL_MEDIAN_USE_TILES is also defined, the third algorithm is used.
 
 #define NS_OPTIMIZE_SPEED_OVER_MEMORY
+#define NS_SPATIAL_MEDIAN_USE_TILES
 
 template<class ns_component, bool calculate_difference>
 class ns_spatial_median_calculator_operation_calc{
@@ -43,7 +50,271 @@ public:
 	}
 };
 
-#ifdef NS_OPTIMIZE_SPEED_OVER_MEMORY
+#if defined(NS_OPTIMIZE_SPEED_OVER_MEMORY) && defined(NS_SPATIAL_MEDIAN_USE_TILES)
+
+#include "ns_median_filter_kernel.h"
+#include "ns_thread_pool.h"
+
+//Tiles are at least this many output lines tall, so that the kernal overlap recomputed between neighboring tiles stays small.
+#define NS_SPATIAL_MEDIAN_MINIMUM_TILE_HEIGHT 512
+
+///Runs the median filter on one horizontal tile of the image.
+template<class ns_component>
+struct ns_spatial_median_tile_job : public ns_thread_pool_job{
+	const ns_component * src;
+	ns_component * dst;
+	long width,
+		 height,
+		 radius;
+	void run(const unsigned long thread_id){
+		ns_median_filter_kernel<ns_component>::run(src,dst,width,height,width,width,radius);
+	}
+};
+
+///Calculates the spatial median filter output of an image
+///Implemented to allow streaming (ie the entire image never needs to be loaded into memory)
+///Incoming lines are buffered until enough have arrived to fill one tile per worker thread.
+///The tiles are then filtered in parallel and their output is sent to the reciever in order.
+#pragma warning(disable: 4355)
+template<class ns_component, bool calculate_difference>
+class ns_spatial_median_calculator : public ns_image_stream_processor<ns_spatial_median_calculator<ns_component, calculate_difference> >{
+public:
+	typedef  ns_image_stream_static_offset_buffer<ns_component> storage_type;
+
+	typedef ns_component component_type;
+
+	//if number_of_threads is zero, one thread is used for each of this process's share of the machine's processors.
+	ns_spatial_median_calculator(const long max_line_block_height, const long kernal_height_, const unsigned long number_of_threads=0):
+	  kernal_height(2*(kernal_height_/2)+1),
+	  kernal_radius(kernal_height_/2),
+	  //for consistency with previous results, the constant time filter is run with twice the specified radius.
+	  filter_radius(2*(kernal_height_/2)),
+	  thread_pool((number_of_threads == 0)?ns_thread_pool::number_of_processors_per_process():number_of_threads),
+		ns_image_stream_processor<ns_spatial_median_calculator<ns_component,calculate_difference> >(max_line_block_height, this){
+
+		 if (kernal_radius <= 0)
+			 throw ns_ex("ns_spatial_median_calculator::Cannot set kernal radius to zero");
+		 tile_height = NS_SPATIAL_MEDIAN_MINIMUM_TILE_HEIGHT;
+		 if (tile_height < 8*filter_radius)
+			 tile_height = 8*filter_radius;
+	  }
+
+	#pragma warning(default: 4355)
+	  template<class reciever_t>
+	  inline void prepare_to_recieve_image(const ns_image_properties & properties, reciever_t & reciever){
+			this->default_prepare_to_recieve_image(properties,reciever);
+	  }
+
+	 bool init(const ns_image_properties & properties){
+		 if (properties.width != 0 && properties.height != 0){
+			 if (properties.width < (unsigned long)kernal_height)
+				 throw ns_ex("ns_spatial_median_calculator::Attempting to run a median filter on an image whose width is smaller than the kernal height::Width ")
+				 			<< properties.width << " vs. kernal height " << kernal_height;
+			 if (properties.height< (unsigned long)kernal_height)
+				 throw ns_ex("ns_spatial_median_calculator::Attempting to run a median filter on an image whose height is smaller than the kernal height::Width ")
+				 			<< properties.height << " vs. kernal height " << kernal_height;
+			 if (properties.components != 1)
+				 throw ns_ex("ns_spatial_median_calculator::Only grayscale images can be median filtered");
+			 if (properties.width < (unsigned long)(2*filter_radius+1) || properties.height < (unsigned long)(2*filter_radius+1))
+				 throw ns_ex("ns_spatial_median_calculator::Attempting to run a median filter on an image smaller than the filter window: ")
+							<< properties.width << "x" << properties.height << " vs. " << 2*filter_radius+1;
+		 }
+		lines_received = 0;
+		lines_sent = 0;
+		pending_first_line = 0;
+		pending_height = 0;
+
+		const unsigned long w(properties.width);
+		//Enough lines to filter one tile per thread, plus the kernal overlap above the first tile,
+		//plus space for a newly received block of lines.
+		pending.resize((thread_pool.number_of_threads()*tile_height + 2*filter_radius + this->_max_line_block_height)*w);
+		tile_output.resize(thread_pool.number_of_threads());
+		for (unsigned int i = 0; i < tile_output.size(); i++)
+			tile_output[i].resize((tile_height + 2*filter_radius)*w);
+
+		#ifdef NS_SPATIAL_AVG_TRACK_TIME
+		computation_time_spent = 0;
+		output_time_spent = 0;
+		#endif
+		return true;
+	}
+
+	~ns_spatial_median_calculator(){
+	}
+	template<class reciever_t>
+	ns_image_stream_static_offset_buffer<ns_component> * provide_buffer(const ns_image_stream_buffer_properties & p, reciever_t & reciever){
+		in_buffer.wasteful_resize(p);
+		in_buffer.set_offset(0);
+		return &in_buffer;
+	}
+	template<class reciever_t>
+	void recieve_and_send_lines(const ns_image_stream_static_offset_buffer<ns_component> & lines, const unsigned long height, reciever_t & output_reciever){
+		const unsigned long w(this->_properties.width);
+		if ((pending_height + height)*w > pending.size())
+			pending.resize((pending_height + height)*w);
+		for (unsigned long y = 0; y < height; y++){
+			ns_component * p(&pending[(pending_height+y)*w]);
+			for (unsigned long x = 0; x < w; x++)
+				p[x] = lines[y][x];
+		}
+		pending_height += height;
+		lines_received += height;
+
+		process_pending_lines(output_reciever,false);
+	}
+
+	template<class reciever_t>
+	void finish_recieving_image(reciever_t & output_reciever){
+		if (lines_received != this->_properties.height)
+			throw ns_ex("ns_spatial_median_calculator::Recieved ") << lines_received << " lines of an image with height " << this->_properties.height;
+		process_pending_lines(output_reciever,true);
+
+		#ifdef NS_SPATIAL_AVG_TRACK_TIME
+		std::cerr << "\nComputation time: " << computation_time_spent << "s, Output time: " << output_time_spent << "s\n";
+		#endif
+		output_reciever.finish_recieving_image();
+	}
+
+private:
+
+	//filters all lines whose kernal is completely contained within the received lines.
+	//Lines are filtered in batches of one tile per thread, unless the entire image has been received
+	//in which case all remaining lines are filtered.
+	template<class reciever_t>
+	void process_pending_lines(reciever_t & output_reciever, const bool flush){
+		const unsigned long w(this->_properties.width),
+							h(this->_properties.height),
+							batch_height(thread_pool.number_of_threads()*tile_height);
+		while(lines_sent < h){
+			unsigned long last_available_line(h);
+			if (!flush){
+				if (pending_first_line + pending_height < lines_sent + filter_radius + batch_height)
+					return;
+				last_available_line = pending_first_line + pending_height - filter_radius;
+			}
+			unsigned long lines_in_batch(last_available_line - lines_sent);
+			if (lines_in_batch > batch_height)
+				lines_in_batch = batch_height;
+
+			#ifdef NS_SPATIAL_AVG_TRACK_TIME
+			unsigned long start_time = ns_current_time();
+			#endif
+			//divide the batch into tiles, each with enough overlap that the filter window of every output line
+			//lies entirely within the tile.  The filter also requires at least 2*radius+1 lines per tile.
+			jobs.resize(0);
+			tiles.resize(0);
+			for (unsigned long tile_start = lines_sent; tile_start < lines_sent+lines_in_batch; tile_start+=tile_height){
+				ns_spatial_median_tile tile;
+				tile.output_start = tile_start;
+				tile.output_stop = tile_start + tile_height;
+				if (tile.output_stop > lines_sent + lines_in_batch)
+					tile.output_stop = lines_sent + lines_in_batch;
+				tile.input_stop = tile.output_stop + filter_radius;
+				if (tile.input_stop > h)
+					tile.input_stop = h;
+				long input_start((long)tile.output_start - filter_radius);
+				if (input_start > (long)tile.input_stop - (2*filter_radius+1))
+					input_start = (long)tile.input_stop - (2*filter_radius+1);
+				if (input_start < (long)pending_first_line)
+					input_start = pending_first_line;
+				tile.input_start = input_start;
+				tiles.push_back(tile);
+			}
+			tile_jobs.resize(tiles.size());
+			for (unsigned int i = 0; i < tiles.size(); i++){
+				tile_jobs[i].src = &pending[(tiles[i].input_start-pending_first_line)*w];
+				tile_jobs[i].dst = &(tile_output[i][0]);
+				tile_jobs[i].width = w;
+				tile_jobs[i].height = tiles[i].input_stop - tiles[i].input_start;
+				tile_jobs[i].radius = filter_radius;
+				jobs.push_back(&tile_jobs[i]);
+			}
+			thread_pool.run(jobs);
+
+			#ifdef NS_SPATIAL_AVG_TRACK_TIME
+			unsigned long output_start_time = ns_current_time();
+			computation_time_spent += output_start_time - start_time;
+			#endif
+
+			//send the filtered tiles to the reciever, in order, in blocks no larger than it expects.
+			ns_image_stream_buffer_properties buf_prop;
+			buf_prop.width = w;
+			for (unsigned int i = 0; i < tiles.size(); i++){
+				for (unsigned long y = tiles[i].output_start; y < tiles[i].output_stop;){
+					unsigned long lines_to_send = tiles[i].output_stop - y;
+					if (lines_to_send > this->_max_line_block_height)
+						lines_to_send = this->_max_line_block_height;
+					buf_prop.height = lines_to_send;
+					output_reciever.output_buffer = output_reciever.provide_buffer(buf_prop);
+					for (unsigned long dy = 0; dy < lines_to_send; dy++){
+						const ns_component * in(&pending[(y+dy-pending_first_line)*w]),
+										   * median(&(tile_output[i][(y+dy-tiles[i].input_start)*w]));
+						for (unsigned long x = 0; x < w; x++){
+							if (in[x]==0) //values outside the mask should remain so after the median filter
+								(*output_reciever.output_buffer)[dy][x] = 0;
+							else
+								(*output_reciever.output_buffer)[dy][x] = desired_sub.run(in[x],median[x]);
+						}
+					}
+					output_reciever.recieve_lines(*output_reciever.output_buffer,lines_to_send);
+					y+=lines_to_send;
+				}
+			}
+			lines_sent += lines_in_batch;
+
+			#ifdef NS_SPATIAL_AVG_TRACK_TIME
+			output_time_spent += ns_current_time() - output_start_time;
+			#endif
+
+			//discard all lines that will not be needed as overlap for the next batch
+			unsigned long new_first_line(0);
+			if (lines_sent > (unsigned long)(2*filter_radius))
+				new_first_line = lines_sent - 2*filter_radius;
+			if (new_first_line > pending_first_line){
+				const unsigned long lines_to_discard(new_first_line - pending_first_line);
+				std::copy(pending.begin() + lines_to_discard*w,pending.begin() + pending_height*w,pending.begin());
+				pending_height -= lines_to_discard;
+				pending_first_line = new_first_line;
+			}
+		}
+	}
+
+	struct ns_spatial_median_tile{
+		unsigned long input_start,
+					  input_stop,
+					  output_start,
+					  output_stop;
+	};
+
+	ns_spatial_median_calculator_operation_calc<ns_component,calculate_difference> desired_sub;
+	const long kernal_height,
+			   kernal_radius,
+			   filter_radius;
+	unsigned long tile_height;
+
+	unsigned long lines_received,
+				  lines_sent;
+
+	ns_image_stream_static_offset_buffer<ns_component> in_buffer;
+
+	//the lines received but not yet discarded, starting with image line pending_first_line
+	std::vector<ns_component> pending;
+	unsigned long pending_first_line,
+				  pending_height;
+
+	std::vector<ns_spatial_median_tile> tiles;
+	std::vector<ns_spatial_median_tile_job<ns_component> > tile_jobs;
+	std::vector<ns_thread_pool_job *> jobs;
+	std::vector<std::vector<ns_component> > tile_output;
+	ns_thread_pool thread_pool;
+
+	#ifdef NS_SPATIAL_AVG_TRACK_TIME
+	unsigned long computation_time_spent,
+				  output_time_spent;
+	#endif
+};
+
+#elif defined(NS_OPTIMIZE_SPEED_OVER_MEMORY)
 
 #include "ctmf.h"
 
@@ -210,7 +481,7 @@ private:
 
 
 #else
-
+#include "ns_median_filter_kernel.h"
 
 ///Calculates the spatial median filter output of an image
 ///Implemented to allow streaming (ie the entire image never needs to be loaded into memory)
@@ -233,12 +504,11 @@ public:
 	#pragma warning(default: 4355)
 	  template<class reciever_t>
 	  inline void prepare_to_recieve_image(const ns_image_properties & properties, reciever_t & reciever){
-			default_prepare_to_recieve_image(properties,reciever);
+			this->default_prepare_to_recieve_image(properties,reciever);
 	  }
 
 	 bool init(const ns_image_properties & properties){
 		input_buffer_height = 0;
-		rep.set_max(properties.height);
 		lines_received = 0;
 		lines_processed = 0;
 		ns_image_stream_buffer_properties bufp;
@@ -251,7 +521,7 @@ public:
 		computation_time_spent = 0;
 		output_time_spent = 0;
 		#endif
-
+		return true;
 	}
 
 	~ns_spatial_median_calculator(){
@@ -358,32 +628,31 @@ public:
 
 		//std::cerr << "Buffer = " << (unsigned long)(in_buffer[0]) << " " << hex << (unsigned long)(in_buffer[0]) << "\n";
 		//init histogram
-		ns_histogram<unsigned int, ns_component> hist;
-		hist.set_number_of_pixels(kernal_height*kernal_height);
+		ns_hierarchical_histogram<ns_component> hist;
 		for (int dy = -kernal_radius; dy <= kernal_radius; dy++)
 			for (int x = -kernal_radius; x <= kernal_radius; x++)
-				hist[in_buffer[dy][x]]++;
+				hist.add(in_buffer[dy][x]);
 
 		for (long y = 0;;){
 
 			//caculate first line by sliding the histogram to the right
 			for (unsigned int x = 0; x < bufp.width-1; x++){
 
-				(*output_reciever.output_buffer)[y][x] = desired_sub.run(in_buffer[y][x],hist.median_from_histogram_ignore_zero());
+				(*output_reciever.output_buffer)[y][x] = desired_sub.run(in_buffer[y][x],hist.median_ignoring_zero());
 
 				//desired_sub.run(in_buffer[y+kernal_half_height][x],;//);
 				for (int dky = -kernal_radius; dky <= kernal_radius; dky++){
 
-					hist[ in_buffer[y+dky][x - kernal_radius] ]--;
-					hist[ in_buffer[y+dky][x + kernal_radius+1] ]++;
+					hist.subtract(in_buffer[y+dky][x - kernal_radius]);
+					hist.add(in_buffer[y+dky][x + kernal_radius+1]);
 				}
 			}
-			(*output_reciever.output_buffer)[y][bufp.width-1] = desired_sub.run(in_buffer[y][bufp.width-1],hist.median_from_histogram_ignore_zero());
+			(*output_reciever.output_buffer)[y][bufp.width-1] = desired_sub.run(in_buffer[y][bufp.width-1],hist.median_ignoring_zero());
 
 			//shift the histogram a step down
 			for (int dkx = -kernal_radius; dkx <= kernal_radius; dkx++){
-					hist[ in_buffer[y-kernal_radius][bufp.width-1+dkx] ]--;
-					hist[ in_buffer[y+kernal_radius+1][bufp.width-1+dkx] ]++;
+					hist.subtract(in_buffer[y-kernal_radius][bufp.width-1+dkx]);
+					hist.add(in_buffer[y+kernal_radius+1][bufp.width-1+dkx]);
 			}
 			y++;
 			if (!(y < (long)lines_to_process))
@@ -391,20 +660,20 @@ public:
 			//calculate the second line by sliding the histogram to the left
 			for (int x = bufp.width-1; x > 0; x--){
 
-				(*output_reciever.output_buffer)[y][x] = desired_sub.run(in_buffer[y][x],hist.median_from_histogram_ignore_zero());
+				(*output_reciever.output_buffer)[y][x] = desired_sub.run(in_buffer[y][x],hist.median_ignoring_zero());
 
 
 				for (int dky = -kernal_radius; dky <= kernal_radius; dky++){
-					hist[ in_buffer[y+dky][x + kernal_radius] ]--;
-					hist[ in_buffer[y+dky][x - kernal_radius-1] ]++;
+					hist.subtract(in_buffer[y+dky][x + kernal_radius]);
+					hist.add(in_buffer[y+dky][x - kernal_radius-1]);
 				}
 			}
-			(*output_reciever.output_buffer)[y][0] = desired_sub.run(in_buffer[y][0],hist.median_from_histogram_ignore_zero());
+			(*output_reciever.output_buffer)[y][0] = desired_sub.run(in_buffer[y][0],hist.median_ignoring_zero());
 
 			//shift the histogram down a step in y
 			for (int dkx = -kernal_radius; dkx <= kernal_radius; dkx++){
-					hist[ in_buffer[y-kernal_radius][dkx] ]--;
-					hist[ in_buffer[y+kernal_radius+1][dkx] ]++;
+					hist.subtract(in_buffer[y-kernal_radius][dkx]);
+					hist.add(in_buffer[y+kernal_radius+1][dkx]);
 			}
 			y++;
 			if (!(y < (long)lines_to_process))
@@ -464,7 +733,6 @@ private:
 
 	//used to store initial lines as kernal_height lines must be read in before processing can start.
 	ns_image_stream_safe_sliding_offset_buffer<ns_component> in_buffer;
-	ns_report_status rep;
 	#ifdef NS_SPATIAL_AVG_TRACK_TIME
 	unsigned long computation_time_spent,
 				  output_time_spent;
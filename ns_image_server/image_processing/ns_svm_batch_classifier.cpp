@@ -0,0 +1,186 @@
+#include "ns_svm_batch_classifier.h"
+#include "ns_ex.h"
+#include <math.h>
+#include <string.h>
+
+#if defined(NS_USE_MACHINE_LEARNING) && !defined(NS_USE_TINYSVM)
+
+//identical to the function of the same name in libsvm
+static inline double ns_svm_powi(double base, int times){
+	double tmp = base, ret = 1.0;
+	for(int t=times; t>0; t/=2){
+		if(t%2==1) ret*=tmp;
+		tmp = tmp * tmp;
+	}
+	return ret;
+}
+
+void ns_svm_batch_classifier::set_model(const svm_model * model_){
+	model = model_;
+	number_of_objects = 0;
+	features.resize(0);
+	if (model == 0)
+		throw ns_ex("ns_svm_batch_classifier::No model was specified");
+	if (model->param.kernel_type == PRECOMPUTED)
+		throw ns_ex("ns_svm_batch_classifier::Models with precomputed kernels cannot be used to classify objects");
+
+	//the table must hold every feature used by either the objects or the support vectors
+	dimension_ = (unsigned long)ns_stat_number_of_stats;
+	for (int s = 0; s < model->l; s++)
+		for (const svm_node * n = model->SV[s]; n->index != -1; n++){
+			if (n->index < 1)
+				throw ns_ex("ns_svm_batch_classifier::Invalid feature index in support vector ") << s << ": " << n->index;
+			if ((unsigned long)n->index > dimension_)
+				dimension_ = n->index;
+		}
+
+	number_of_support_vector_blocks = (model->l + ns_block_width-1)/ns_block_width;
+	//features missing from a support vector are zero, as in libsvm.  Extra room is left to align the table.
+	support_vector_storage.resize(0);
+	support_vector_storage.resize(number_of_support_vector_blocks*dimension_*ns_block_width + 4,0);
+	double * sv(support_vectors());
+	for (int s = 0; s < model->l; s++){
+		double * block(sv + (s/ns_block_width)*dimension_*ns_block_width + s%ns_block_width);
+		for (const svm_node * n = model->SV[s]; n->index != -1; n++)
+			block[(n->index-1)*ns_block_width] = n->value;
+	}
+	kernel_values.resize(number_of_support_vector_blocks*ns_block_width);
+	votes.resize(model->nr_class);
+	class_starts.resize(model->nr_class);
+}
+
+double * ns_svm_batch_classifier::add_object(){
+	if (model == 0)
+		throw ns_ex("ns_svm_batch_classifier::Objects cannot be added until a model is specified");
+	const unsigned long start(number_of_objects*dimension_);
+	number_of_objects++;
+	if (features.size() < start + dimension_)
+		features.resize(start + dimension_);
+	double * x(&features[start]);
+	memset(x,0,sizeof(double)*dimension_);
+	return x;
+}
+
+void ns_svm_batch_classifier::classify(std::vector<double> & decisions){
+	decisions.resize(number_of_objects);
+	for (unsigned long i = 0; i < number_of_objects; i++)
+		decisions[i] = predict(&features[i*dimension_]);
+}
+
+void ns_svm_batch_classifier::calculate_kernel_values(const double * x){
+	const double * sv(support_vectors());
+	const bool rbf(model->param.kernel_type == RBF);
+	//for rbf kernels, accumulate the squared distance between the object and each support vector.
+	//Otherwise, accumulate their dot product.
+	for (unsigned long b = 0; b < number_of_support_vector_blocks; b++){
+		const double * block(sv + b*dimension_*ns_block_width);
+		double * sums(&kernel_values[b*ns_block_width]);
+		#if defined(NS_SVM_BATCH_USE_AVX)
+		__m256d acc(_mm256_setzero_pd());
+		if (rbf){
+			for (unsigned long f = 0; f < dimension_; f++){
+				const __m256d d(_mm256_sub_pd(_mm256_set1_pd(x[f]),_mm256_load_pd(block+f*ns_block_width)));
+				acc = _mm256_add_pd(acc,_mm256_mul_pd(d,d));
+			}
+		}
+		else{
+			for (unsigned long f = 0; f < dimension_; f++)
+				acc = _mm256_add_pd(acc,_mm256_mul_pd(_mm256_set1_pd(x[f]),_mm256_load_pd(block+f*ns_block_width)));
+		}
+		_mm256_storeu_pd(sums,acc);
+		#elif defined(NS_SVM_BATCH_USE_SSE2)
+		__m128d acc_0(_mm_setzero_pd()),
+				acc_1(_mm_setzero_pd());
+		if (rbf){
+			for (unsigned long f = 0; f < dimension_; f++){
+				const __m128d v(_mm_set1_pd(x[f])),
+							  d_0(_mm_sub_pd(v,_mm_load_pd(block+f*ns_block_width))),
+							  d_1(_mm_sub_pd(v,_mm_load_pd(block+f*ns_block_width+2)));
+				acc_0 = _mm_add_pd(acc_0,_mm_mul_pd(d_0,d_0));
+				acc_1 = _mm_add_pd(acc_1,_mm_mul_pd(d_1,d_1));
+			}
+		}
+		else{
+			for (unsigned long f = 0; f < dimension_; f++){
+				const __m128d v(_mm_set1_pd(x[f]));
+				acc_0 = _mm_add_pd(acc_0,_mm_mul_pd(v,_mm_load_pd(block+f*ns_block_width)));
+				acc_1 = _mm_add_pd(acc_1,_mm_mul_pd(v,_mm_load_pd(block+f*ns_block_width+2)));
+			}
+		}
+		_mm_storeu_pd(sums,acc_0);
+		_mm_storeu_pd(sums+2,acc_1);
+		#else
+		for (unsigned int k = 0; k < ns_block_width; k++)
+			sums[k] = 0;
+		for (unsigned long f = 0; f < dimension_; f++){
+			for (unsigned int k = 0; k < ns_block_width; k++){
+				const double d(rbf?(x[f]-block[f*ns_block_width+k]):(x[f]*block[f*ns_block_width+k]));
+				sums[k] += rbf?(d*d):d;
+			}
+		}
+		#endif
+	}
+
+	const svm_parameter & param(model->param);
+	for (int s = 0; s < model->l; s++){
+		switch(param.kernel_type){
+			case LINEAR: break;
+			case POLY: kernel_values[s] = ns_svm_powi(param.gamma*kernel_values[s]+param.coef0,param.degree); break;
+			case RBF: kernel_values[s] = exp(-param.gamma*kernel_values[s]); break;
+			case SIGMOID: kernel_values[s] = tanh(param.gamma*kernel_values[s]+param.coef0); break;
+		}
+	}
+}
+
+//follows svm_predict_values()
+double ns_svm_batch_classifier::predict(const double * x){
+	calculate_kernel_values(x);
+	if (model->param.svm_type == ONE_CLASS ||
+		model->param.svm_type == EPSILON_SVR ||
+		model->param.svm_type == NU_SVR){
+		const double * sv_coef(model->sv_coef[0]);
+		double sum(0);
+		for (int i = 0; i < model->l; i++)
+			sum += sv_coef[i]*kernel_values[i];
+		sum -= model->rho[0];
+		if (model->param.svm_type == ONE_CLASS)
+			return (sum > 0)?1:-1;
+		return sum;
+	}
+
+	const int nr_class(model->nr_class);
+	class_starts[0] = 0;
+	for (int i = 1; i < nr_class; i++)
+		class_starts[i] = class_starts[i-1] + model->nSV[i-1];
+	for (int i = 0; i < nr_class; i++)
+		votes[i] = 0;
+	int p(0);
+	for (int i = 0; i < nr_class; i++){
+		for (int j = i+1; j < nr_class; j++){
+			double sum(0);
+			const int si(class_starts[i]),
+					  sj(class_starts[j]),
+					  ci(model->nSV[i]),
+					  cj(model->nSV[j]);
+			const double * coef1(model->sv_coef[j-1]),
+						 * coef2(model->sv_coef[i]);
+			for (int k = 0; k < ci; k++)
+				sum += coef1[si+k]*kernel_values[si+k];
+			for (int k = 0; k < cj; k++)
+				sum += coef2[sj+k]*kernel_values[sj+k];
+			sum -= model->rho[p];
+			if (sum > 0)
+				++votes[i];
+			else
+				++votes[j];
+			p++;
+		}
+	}
+	int vote_max_idx(0);
+	for (int i = 1; i < nr_class; i++)
+		if (votes[i] > votes[vote_max_idx])
+			vote_max_idx = i;
+	return model->label[vote_max_idx];
+}
+
+#endif
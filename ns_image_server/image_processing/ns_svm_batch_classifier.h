@@ -0,0 +1,68 @@
+#ifndef NS_SVM_BATCH_CLASSIFIER
+#define NS_SVM_BATCH_CLASSIFIER
+#include "ns_svm_model_specification.h"
+#include <vector>
+
+#if defined(__AVX__)
+	#include <immintrin.h>
+	#define NS_SVM_BATCH_USE_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#define NS_SVM_BATCH_USE_SSE2
+#endif
+
+#if defined(NS_USE_MACHINE_LEARNING) && !defined(NS_USE_TINYSVM)
+
+///ns_svm_batch_classifier evaluates a libsvm model on all the objects found in an image at once.
+///libsvm stores each support vector as a sparse list of index/value pairs, and svm_predict() walks
+///every one of those lists for every object it classifies.  Here, the support vectors are instead copied once
+///into a dense, 32-byte aligned table holding blocks of four support vectors, feature by feature, so that the kernel
+///between an object and four support vectors can be computed together using SIMD instructions.
+///
+///Within each support vector, kernel sums are accumulated in the same order as libsvm's sparse loops,
+///and decision values are accumulated in the same order as svm_predict_values(),
+///so ns_svm_batch_classifier produces exactly the same results as svm_predict().
+class ns_svm_batch_classifier{
+public:
+	ns_svm_batch_classifier():model(0),dimension_(0),number_of_support_vector_blocks(0),number_of_objects(0){}
+
+	void set_model(const svm_model * model);
+
+	///the number of values in each object's feature vector.  Element i holds the value of libsvm feature index i+1
+	unsigned long dimension() const{return dimension_;}
+
+	///removes all objects, without freeing any memory
+	void clear_objects(){number_of_objects = 0;}
+	///allocates space for n objects
+	void reserve(const unsigned long n){features.reserve(n*dimension_);}
+
+	///adds an object to the batch, returning its feature vector, which is initialized to zero.
+	///The pointer is only valid until the next object is added.
+	double * add_object();
+
+	///decisions[i] is set to the value svm_predict() would return for object i
+	void classify(std::vector<double> & decisions);
+private:
+	enum{ns_block_width=4};
+	const svm_model * model;
+	unsigned long dimension_,
+				  number_of_support_vector_blocks,
+				  number_of_objects;
+	//support vector s, feature f is stored at support_vectors()[(s/ns_block_width)*dimension_*ns_block_width + f*ns_block_width + s%ns_block_width]
+	std::vector<double> support_vector_storage;
+	double * support_vectors(){
+		return support_vector_storage.empty()?0:(double *)((((size_t)&support_vector_storage[0]) + 31) & ~((size_t)31));
+	}
+	std::vector<double> features;
+
+	//scratch space, reused for each object
+	std::vector<double> kernel_values;
+	std::vector<int> votes,
+					 class_starts;
+
+	double predict(const double * x);
+	void calculate_kernel_values(const double * x);
+};
+
+#endif
+#endif
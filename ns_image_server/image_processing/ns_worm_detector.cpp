@@ -1,9 +1,75 @@
 #include "ns_worm_detector.h"
 #include "ns_image_easy_io.h"
 #include "ns_node_topology.h"
+#include "ns_thread_pool.h"
 
 
 using namespace std;
+
+///Runs one step of worm detection on a single detected object.
+class ns_detected_object_job : public ns_thread_pool_job{
+public:
+	typedef enum{ns_delauny_node_graph,ns_zhang_thinning_node_graph,ns_segment_topology} ns_step;
+
+	ns_detected_object_job():object(0),step(ns_delauny_node_graph),do_multiple_worm_disambiguation(true){}
+	ns_detected_object_job(ns_detected_object & object_,const ns_step step_):object(&object_),step(step_),do_multiple_worm_disambiguation(true){}
+
+	void run(const unsigned long thread_id){
+		switch(step){
+			case ns_delauny_node_graph:
+				object->calculate_edges();
+				object->node_topology.build_via_delauny_method(object->edge_coordinates,object->edge_list,object->holes,debug_filename);
+				break;
+			case ns_zhang_thinning_node_graph:
+				object->remove_small_holes();
+				object->node_topology.build_via_zhang_thinning(object->bitmap());
+				break;
+			case ns_segment_topology:
+				object->segment_cluster.compile(object->node_topology);
+				object->segment_cluster_solutions.calculate(object->segment_cluster,object->bitmap().properties().resolution,do_multiple_worm_disambiguation);
+				break;
+		}
+	}
+	ns_detected_object * object;
+	ns_step step;
+	std::string debug_filename;
+	bool do_multiple_worm_disambiguation;
+};
+
+void ns_run_detected_object_jobs(std::vector<ns_detected_object_job> & jobs){
+	std::vector<ns_thread_pool_job *> job_pointers(jobs.size());
+	for (unsigned int i = 0; i < jobs.size(); i++)
+		job_pointers[i] = &jobs[i];
+	ns_thread_pool pool(ns_thread_pool::number_of_processors_per_process());
+	pool.run(job_pointers);
+}
+
+void ns_detected_object_manager::convert_bitmaps_into_node_graphs(const float resolution, const std::string & debug_filename){
+	const ns_detected_object_job::ns_step step((resolution <= 1201)?ns_detected_object_job::ns_delauny_node_graph:ns_detected_object_job::ns_zhang_thinning_node_graph);
+	std::vector<ns_detected_object_job> jobs;
+	jobs.reserve(objects.size());
+	for (unsigned int i = 0; i < objects.size(); i++){
+		jobs.push_back(ns_detected_object_job(*objects[i],step));
+		//objects are processed simultaneously, so each needs its own debug file
+		if (!debug_filename.empty())
+			jobs.rbegin()->debug_filename = debug_filename + "_" + ns_to_string(i);
+	}
+	ns_run_detected_object_jobs(jobs);
+	if (step == ns_detected_object_job::ns_delauny_node_graph)
+		remove_empty_spines();
+}
+
+void ns_detected_object_manager::calculate_segment_topologies_from_node_graphs(const bool do_multiple_worm_disambiguation){
+	std::cerr << "Fitting Splines...";
+	std::vector<ns_detected_object_job> jobs;
+	jobs.reserve(objects.size());
+	for (unsigned int i = 0; i < objects.size(); i++){
+		jobs.push_back(ns_detected_object_job(*objects[i],ns_detected_object_job::ns_segment_topology));
+		jobs.rbegin()->do_multiple_worm_disambiguation = do_multiple_worm_disambiguation;
+	}
+	ns_run_detected_object_jobs(jobs);
+	std::cerr << "Done.\n";
+}
 void ns_detected_object_manager::remove_largest_images(double percent_cutoff){
 
 	//remove unusally large objects
@@ -2,6 +2,7 @@
 #define NS_WORM_DETECTOR
 #include "ns_identify_contiguous_bitmap_regions.h"
 #include "ns_detected_object.h"
+#include "ns_thread_pool.h"
 
 
 
@@ -19,7 +20,7 @@ public:
 	ns_image_worm_detection_results * run(const unsigned long region_info_id,const unsigned long capture_time,const whole_image & unprocessed_image,const whole_image & thresholded_image, const whole_image & spatial_median_image, const ns_image_standard * static_mask, const unsigned int & minimum_region_area, const unsigned int &maximum_region_area, const unsigned int &maximum_region_diagonal, const ns_svm_model_specification & model, const unsigned long maximum_number_of_objects, const std::string & spine_debug_filename_output="", const ns_detected_worm_info::ns_visualization_type visualization_type=ns_detected_worm_info::ns_vis_raster,ns_whole_image_region_stats image_region_stats = ns_whole_image_region_stats::null(),const bool do_multiple_worm_disambiguation=true){
 		ns_detected_object_manager object_manager;
 		//std::cerr << "Identifying objects";
-		ns_identify_contiguous_bitmap_regions(thresholded_image,object_manager.objects);
+		ns_identify_contiguous_bitmap_regions(thresholded_image,object_manager.objects,ns_thread_pool::number_of_processors_per_process());
 		unsigned long init_object_count((unsigned long)object_manager.objects.size());
 		object_manager.constrain_region_area(minimum_region_area,maximum_region_area,maximum_region_diagonal);
 		std::cerr << object_manager.objects.size() << "/" << init_object_count << " objects fall within size limits.\n";
@@ -1,5 +1,6 @@
 #include "ns_worm_training_set_image.h"
 #include "ns_xml.h"
+#include "ns_image_simple_cache.h"
 using namespace std;
 
 void ns_worm_training_set_image::generate_check_box(const ns_color_8 & check_color, ns_image_standard & out){
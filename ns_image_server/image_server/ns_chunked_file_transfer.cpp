@@ -0,0 +1,375 @@
+#include "ns_chunked_file_transfer.h"
+#include "ns_dir.h"
+#include "zlib.h"
+#include <algorithm>
+#include <string.h>
+#ifdef _WIN32
+	#include <windows.h>
+	#include <malloc.h>
+#else
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <errno.h>
+	#include <stdio.h>
+#endif
+using namespace std;
+
+///Reads and writes blocks at arbitrary offsets, so that several threads can each work on their own part of a file.
+class ns_random_access_file{
+public:
+	typedef enum{ns_read,ns_write,
+				 //reads bypass the local file cache, so that data is read back from the disk (or file server) rather than from memory
+				 ns_uncached_read} ns_mode;
+	#ifdef _WIN32
+	ns_random_access_file():handle(INVALID_HANDLE_VALUE),mode(ns_read){}
+	#else
+	ns_random_access_file():file_descriptor(-1),mode(ns_read){}
+	#endif
+	~ns_random_access_file(){close();}
+
+	void open(const std::string & filename_, const ns_mode mode_){
+		close();
+		filename = filename_;
+		mode = mode_;
+		#ifdef _WIN32
+		handle = CreateFile(filename.c_str(),(mode==ns_write)?(GENERIC_READ|GENERIC_WRITE):GENERIC_READ,FILE_SHARE_READ|FILE_SHARE_WRITE,NULL,(mode==ns_write)?OPEN_ALWAYS:OPEN_EXISTING,
+							(mode==ns_uncached_read)?FILE_FLAG_NO_BUFFERING:FILE_ATTRIBUTE_NORMAL,NULL);
+		if (handle == INVALID_HANDLE_VALUE)
+			throw ns_ex("ns_random_access_file::Could not open ") << filename << ns_file_io;
+		#else
+		file_descriptor = ::open(filename.c_str(),(mode==ns_write)?(O_RDWR|O_CREAT):O_RDONLY,0666);
+		if (file_descriptor == -1)
+			throw ns_ex("ns_random_access_file::Could not open ") << filename << ": " << strerror(errno) << ns_file_io;
+		#ifdef __APPLE__
+		if (mode == ns_uncached_read)
+			fcntl(file_descriptor,F_NOCACHE,1);
+		#endif
+		#endif
+	}
+	bool is_open() const{
+		#ifdef _WIN32
+		return handle != INVALID_HANDLE_VALUE;
+		#else
+		return file_descriptor != -1;
+		#endif
+	}
+	void close(){
+		#ifdef _WIN32
+		if (handle != INVALID_HANDLE_VALUE)
+			CloseHandle(handle);
+		handle = INVALID_HANDLE_VALUE;
+		#else
+		if (file_descriptor != -1)
+			::close(file_descriptor);
+		file_descriptor = -1;
+		#endif
+	}
+	ns_64_bit size() const{
+		#ifdef _WIN32
+		LARGE_INTEGER s;
+		if (!GetFileSizeEx(handle,&s))
+			throw ns_ex("ns_random_access_file::Could not determine the size of ") << filename << ns_file_io;
+		return s.QuadPart;
+		#else
+		struct stat s;
+		if (fstat(file_descriptor,&s) != 0)
+			throw ns_ex("ns_random_access_file::Could not determine the size of ") << filename << ": " << strerror(errno) << ns_file_io;
+		return s.st_size;
+		#endif
+	}
+	void resize(const ns_64_bit size){
+		#ifdef _WIN32
+		LARGE_INTEGER s;
+		s.QuadPart = size;
+		if (!SetFilePointerEx(handle,s,NULL,FILE_BEGIN) || !SetEndOfFile(handle))
+			throw ns_ex("ns_random_access_file::Could not resize ") << filename << ns_file_io;
+		#else
+		if (ftruncate(file_descriptor,(off_t)size) != 0)
+			throw ns_ex("ns_random_access_file::Could not resize ") << filename << ": " << strerror(errno) << ns_file_io;
+		#endif
+	}
+	void read(char * buffer, const ns_64_bit offset, const unsigned long length){
+		#ifdef _WIN32
+		if (mode == ns_uncached_read){
+			read_unbuffered(buffer,offset,length);
+			return;
+		}
+		#elif !defined(__APPLE__)
+		//Pages that are already cached (and have been flushed, so are clean) are discarded, so they must be read again.
+		if (mode == ns_uncached_read)
+			posix_fadvise(file_descriptor,(off_t)offset,(off_t)length,POSIX_FADV_DONTNEED);
+		#endif
+		unsigned long pos(0);
+		while(pos < length){
+			#ifdef _WIN32
+			OVERLAPPED o;
+			memset(&o,0,sizeof(o));
+			o.Offset = (DWORD)((offset+pos) & 0xFFFFFFFF);
+			o.OffsetHigh = (DWORD)((offset+pos) >> 32);
+			DWORD r(0);
+			if (!ReadFile(handle,buffer+pos,length-pos,&r,&o) || r == 0)
+				throw ns_ex("ns_random_access_file::Could not read from ") << filename << ns_file_io;
+			#else
+			const ssize_t r(pread(file_descriptor,buffer+pos,length-pos,(off_t)(offset+pos)));
+			if (r <= 0)
+				throw ns_ex("ns_random_access_file::Could not read from ") << filename << ": " << ((r==0)?"Unexpected end of file":strerror(errno)) << ns_file_io;
+			#endif
+			pos+=(unsigned long)r;
+		}
+	}
+	void write(const char * buffer, const ns_64_bit offset, const unsigned long length){
+		unsigned long pos(0);
+		while(pos < length){
+			#ifdef _WIN32
+			OVERLAPPED o;
+			memset(&o,0,sizeof(o));
+			o.Offset = (DWORD)((offset+pos) & 0xFFFFFFFF);
+			o.OffsetHigh = (DWORD)((offset+pos) >> 32);
+			DWORD w(0);
+			if (!WriteFile(handle,buffer+pos,length-pos,&w,&o) || w == 0)
+				throw ns_ex("ns_random_access_file::Could not write to ") << filename << ns_file_io;
+			#else
+			const ssize_t w(pwrite(file_descriptor,buffer+pos,length-pos,(off_t)(offset+pos)));
+			if (w <= 0)
+				throw ns_ex("ns_random_access_file::Could not write to ") << filename << ": " << strerror(errno) << ns_file_io;
+			#endif
+			pos+=(unsigned long)w;
+		}
+	}
+	//blocks until everything written has reached the disk
+	void sync(){
+		#ifdef _WIN32
+		if (!FlushFileBuffers(handle))
+			throw ns_ex("ns_random_access_file::Could not flush ") << filename << ns_file_io;
+		#else
+		if (fsync(file_descriptor) != 0)
+			throw ns_ex("ns_random_access_file::Could not flush ") << filename << ": " << strerror(errno) << ns_file_io;
+		#endif
+	}
+private:
+	#ifdef _WIN32
+	//Unbuffered reads must start and end on sector boundaries and be made into sector-aligned memory,
+	//so whole pages are read into an aligned buffer and the requested range copied out.
+	void read_unbuffered(char * buffer, const ns_64_bit offset, const unsigned long length){
+		const ns_64_bit alignment(4096),
+						aligned_offset(offset - offset%alignment);
+		const unsigned long aligned_length((unsigned long)(((offset+length-aligned_offset)+alignment-1)/alignment*alignment));
+		char * aligned_buffer((char *)_aligned_malloc(aligned_length,(size_t)alignment));
+		if (aligned_buffer == 0)
+			throw ns_ex("ns_random_access_file::Could not allocate a read buffer") << ns_memory_allocation;
+		unsigned long pos(0);
+		const unsigned long needed((unsigned long)(offset+length-aligned_offset));
+		while(pos < needed){
+			OVERLAPPED o;
+			memset(&o,0,sizeof(o));
+			o.Offset = (DWORD)((aligned_offset+pos) & 0xFFFFFFFF);
+			o.OffsetHigh = (DWORD)((aligned_offset+pos) >> 32);
+			DWORD r(0);
+			//reads end early at the end of the file
+			if (!ReadFile(handle,aligned_buffer+pos,aligned_length-pos,&r,&o) || r == 0){
+				_aligned_free(aligned_buffer);
+				throw ns_ex("ns_random_access_file::Could not read from ") << filename << ns_file_io;
+			}
+			pos+=r;
+		}
+		memcpy(buffer,aligned_buffer+(offset-aligned_offset),length);
+		_aligned_free(aligned_buffer);
+	}
+	#endif
+	std::string filename;
+	#ifdef _WIN32
+	HANDLE handle;
+	#else
+	int file_descriptor;
+	#endif
+	ns_mode mode;
+};
+
+inline unsigned int ns_chunk_checksum(const char * data, const unsigned long size){
+	return (unsigned int)crc32(crc32(0,Z_NULL,0),reinterpret_cast<const Bytef *>(data),(uInt)size);
+}
+
+//the files and buffers used by one transfer thread
+struct ns_chunked_file_transfer_thread_state{
+	ns_random_access_file source,
+						  destination,
+						  verification;
+	std::vector<char> buffer,
+					  verification_buffer;
+};
+
+///Copies one chunk, unless a previous transfer already did so, and later verifies it once it has been flushed to disk.
+class ns_chunked_file_transfer_job : public ns_thread_pool_job{
+public:
+	ns_chunked_file_transfer_job():threads(0),previous_checksum(0),has_previous_checksum(false),verifying(false),finished(false),written(false),copied(false){}
+	void run(const unsigned long thread_id){
+		ns_chunked_file_transfer_thread_state & s((*threads)[thread_id]);
+		if (verifying)
+			verify(s);
+		else copy(s);
+	}
+	void copy(ns_chunked_file_transfer_thread_state & s){
+		if (!s.source.is_open())
+			s.source.open(*source_filename,ns_random_access_file::ns_read);
+		s.buffer.resize(chunk.chunk_size);
+		const ns_64_bit offset(((ns_64_bit)chunk.chunk)*chunk.chunk_size);
+		const unsigned long length((unsigned long)std::min((ns_64_bit)chunk.chunk_size,chunk.file_size-offset));
+		if (length == 0){
+			finished = true;
+			return;
+		}
+		s.source.read(&s.buffer[0],offset,length);
+		chunk.checksum = ns_chunk_checksum(&s.buffer[0],length);
+		//The partial file may have been changed since the chunk was recorded (for example by a later attempt that failed part way through)
+		//so a chunk is skipped only if what is actually in the partial file still matches the source.
+		if (has_previous_checksum && previous_checksum == chunk.checksum){
+			if (!s.verification.is_open())
+				s.verification.open(*destination_filename,ns_random_access_file::ns_uncached_read);
+			s.verification_buffer.resize(chunk.chunk_size);
+			s.verification.read(&s.verification_buffer[0],offset,length);
+			if (ns_chunk_checksum(&s.verification_buffer[0],length) == chunk.checksum){
+				finished = true;
+				return;
+			}
+		}
+		if (!s.destination.is_open())
+			s.destination.open(*destination_filename,ns_random_access_file::ns_write);
+		s.destination.write(&s.buffer[0],offset,length);
+		written = true;
+	}
+	//Reading back through the descriptor used to write would be served from the local file cache and prove nothing
+	//about what reached the file server, so the chunk is read through a separate, uncached descriptor.
+	void verify(ns_chunked_file_transfer_thread_state & s){
+		if (!written)
+			return;
+		if (!s.verification.is_open())
+			s.verification.open(*destination_filename,ns_random_access_file::ns_uncached_read);
+		const ns_64_bit offset(((ns_64_bit)chunk.chunk)*chunk.chunk_size);
+		const unsigned long length((unsigned long)std::min((ns_64_bit)chunk.chunk_size,chunk.file_size-offset));
+		s.verification_buffer.resize(chunk.chunk_size);
+		s.verification.read(&s.verification_buffer[0],offset,length);
+		if (ns_chunk_checksum(&s.verification_buffer[0],length) != chunk.checksum)
+			throw ns_ex("ns_chunked_file_transfer::Chunk ") << chunk.chunk << " of " << *destination_filename << " did not match its source after it was written" << ns_file_io;
+		copied = true;
+		finished = true;
+	}
+	std::vector<ns_chunked_file_transfer_thread_state> * threads;
+	const std::string * source_filename,
+					  * destination_filename;
+	ns_file_transfer_chunk chunk;
+	unsigned int previous_checksum;
+	bool has_previous_checksum,
+		 verifying,
+		 finished,
+		 written,	//written, but not yet verified
+		 copied;	//written and verified
+};
+
+ns_chunked_file_transfer::ns_chunked_file_transfer(const unsigned long chunk_size_in_bytes, const unsigned long number_of_threads):
+	chunk_size_(chunk_size_in_bytes),pool(number_of_threads),bytes_copied_(0),bytes_resumed_(0){
+	if (chunk_size_ == 0)
+		throw ns_ex("ns_chunked_file_transfer::The chunk size must be greater than zero");
+}
+
+void ns_chunked_file_transfer::transfer(const std::string & source, const std::string & destination,
+										const std::vector<ns_file_transfer_chunk> & previously_verified_chunks, ns_chunked_file_transfer_log & log){
+	bytes_copied_ = bytes_resumed_ = 0;
+	const std::string partial(partial_filename(destination));
+	ns_64_bit file_size;
+	{
+		ns_random_access_file s;
+		s.open(source,ns_random_access_file::ns_read);
+		file_size = s.size();
+	}
+	const unsigned long number_of_chunks((unsigned long)((file_size+chunk_size_-1)/chunk_size_));
+
+	//Earlier verified chunks can be used only if the partial file they were written to is still present
+	std::vector<ns_chunked_file_transfer_job> jobs(number_of_chunks);
+	{
+		const bool partial_file_exists(ns_dir::file_exists(partial));
+		ns_random_access_file d;
+		d.open(partial,ns_random_access_file::ns_write);
+		if (partial_file_exists && d.size() == file_size){
+			for (unsigned long i = 0; i < previously_verified_chunks.size(); i++){
+				const ns_file_transfer_chunk & c(previously_verified_chunks[i]);
+				if (c.chunk < number_of_chunks && c.chunk_size == chunk_size_ && c.file_size == file_size){
+					jobs[c.chunk].previous_checksum = c.checksum;
+					jobs[c.chunk].has_previous_checksum = true;
+				}
+			}
+		}
+		else d.resize(file_size);
+	}
+
+	std::vector<ns_chunked_file_transfer_thread_state> threads(pool.number_of_threads());
+	for (unsigned long i = 0; i < number_of_chunks; i++){
+		jobs[i].threads = &threads;
+		jobs[i].source_filename = &source;
+		jobs[i].destination_filename = &partial;
+		jobs[i].chunk.chunk = i;
+		jobs[i].chunk.chunk_size = chunk_size_;
+		jobs[i].chunk.file_size = file_size;
+	}
+
+	//Chunks are copied in batches.  Each batch is flushed to disk, read back and verified,
+	//and then logged, so that little work is lost if the transfer is interrupted.
+	const unsigned long batch_size(pool.number_of_threads()*4);
+	for (unsigned long first = 0; first < number_of_chunks; first += batch_size){
+		const unsigned long last(std::min(first+batch_size,number_of_chunks));
+		std::vector<ns_thread_pool_job *> batch;
+		batch.reserve(last-first);
+		for (unsigned long i = first; i < last; i++)
+			batch.push_back(&jobs[i]);
+		ns_ex error;
+		bool error_occurred(false);
+		try{
+			pool.run(batch);
+			for (unsigned long i = 0; i < threads.size(); i++){
+				if (threads[i].destination.is_open())
+					threads[i].destination.sync();
+			}
+			for (unsigned long i = first; i < last; i++)
+				jobs[i].verifying = true;
+			pool.run(batch);
+		}
+		catch(ns_ex & ex){
+			error = ex;
+			error_occurred = true;
+		}
+		std::vector<ns_file_transfer_chunk> verified;
+		for (unsigned long i = first; i < last; i++){
+			const ns_64_bit length(std::min((ns_64_bit)chunk_size_,file_size-((ns_64_bit)i)*chunk_size_));
+			if (jobs[i].copied){
+				verified.push_back(jobs[i].chunk);
+				bytes_copied_ += length;
+			}
+			else if (jobs[i].finished)
+				bytes_resumed_ += length;
+		}
+		if (!verified.empty())
+			log.record_verified_chunks(verified);
+		if (error_occurred)
+			throw error;
+	}
+	//close each thread's files before the partial file is committed
+	threads.clear();
+
+	ns_random_access_file d;
+	d.open(partial,ns_random_access_file::ns_write);
+	d.sync();
+	d.close();
+	#ifdef _WIN32
+	if (!MoveFileEx(partial.c_str(),destination.c_str(),MOVEFILE_REPLACE_EXISTING|MOVEFILE_WRITE_THROUGH))
+		throw ns_ex("ns_chunked_file_transfer::Could not rename ") << partial << " to " << destination << ns_file_io;
+	#else
+	if (rename(partial.c_str(),destination.c_str()) != 0)
+		throw ns_ex("ns_chunked_file_transfer::Could not rename ") << partial << " to " << destination << ": " << strerror(errno) << ns_file_io;
+	//the rename itself is not durable until the directory has been flushed
+	const int directory(::open(ns_dir::extract_path(destination).c_str(),O_RDONLY));
+	if (directory != -1){
+		fsync(directory);
+		::close(directory);
+	}
+	#endif
+}
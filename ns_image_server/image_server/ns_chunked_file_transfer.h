@@ -0,0 +1,56 @@
+#ifndef NS_CHUNKED_FILE_TRANSFER
+#define NS_CHUNKED_FILE_TRANSFER
+#include "ns_ex.h"
+#include "ns_thread_pool.h"
+#include <vector>
+#include <string>
+
+///A block of a file that has been copied to its destination and read back with a matching CRC-32.
+struct ns_file_transfer_chunk{
+	ns_file_transfer_chunk():chunk(0),chunk_size(0),file_size(0),checksum(0){}
+	unsigned long chunk,
+				  chunk_size;
+	ns_64_bit file_size;
+	unsigned int checksum;
+};
+
+///Receives each batch of chunks as it is verified, so that an interrupted transfer can later be resumed
+///without copying them again.  It is only called from the thread that called ns_chunked_file_transfer::transfer().
+class ns_chunked_file_transfer_log{
+public:
+	virtual void record_verified_chunks(const std::vector<ns_file_transfer_chunk> & chunks)=0;
+	virtual ~ns_chunked_file_transfer_log(){}
+};
+
+///ns_chunked_file_transfer copies a file to a (usually networked) destination in fixed-size chunks, several at a time.
+///Once written, each chunk is flushed to disk, read back from the destination bypassing the local file cache,
+///and compared with the CRC-32 of the source.
+///Data is written to a partial file next to the destination, which is flushed to disk and renamed
+///over the destination only once every chunk has been verified, so a reader never sees an incomplete file.
+///
+///If a transfer is interrupted, the partial file is left in place.  A later transfer of the same source can be given the
+///chunks recorded by the log, and skips any whose checksum still matches both the source and the chunk read back from the partial file,
+///so only the missing chunks are copied.
+class ns_chunked_file_transfer{
+public:
+	//if number_of_threads is zero, one thread is used for each processor on the machine
+	ns_chunked_file_transfer(const unsigned long chunk_size_in_bytes=4*1024*1024, const unsigned long number_of_threads=4);
+
+	///previously_verified_chunks are those recorded by the log during earlier attempts to transfer the same source.
+	void transfer(const std::string & source, const std::string & destination,
+				  const std::vector<ns_file_transfer_chunk> & previously_verified_chunks, ns_chunked_file_transfer_log & log);
+
+	static std::string partial_filename(const std::string & destination){return destination + ".partial";}
+
+	unsigned long chunk_size() const{return chunk_size_;}
+	//statistics for the last call to transfer()
+	ns_64_bit bytes_copied() const{return bytes_copied_;}
+	ns_64_bit bytes_resumed() const{return bytes_resumed_;}
+private:
+	unsigned long chunk_size_;
+	ns_thread_pool pool;
+	ns_64_bit bytes_copied_,
+			  bytes_resumed_;
+};
+
+#endif
@@ -4,6 +4,7 @@
 #include "ns_barcode.h"
 #include "ns_socket.h"
 #include "ns_thread.h"
+#include "ns_thread_pool.h"
 #include "ns_image_server_message.h"
 
 #ifndef NS_MINIMAL_SERVER_BUILD
@@ -579,6 +580,11 @@ string ns_image_server::get_cluster_constant_value(const string & key, const str
 
 }
 
+void ns_image_server::get_image_socket_protocol(ns_image_socket_protocol_version & version, bool & compress, ns_image_server_sql * sql){
+	version = (get_cluster_constant_value("image_socket_protocol_version","1",sql) == "2")?ns_image_socket_protocol_2:ns_image_socket_protocol_1;
+	compress = get_cluster_constant_value("image_socket_compression","0",sql) == "1";
+}
+
 void ns_image_server::set_cluster_constant_value(const string & key, const string & value, ns_image_server_sql * sql, const int time_stamp){
 	if (get_cluster_constant_value(key,value,sql) == value)
 		return;
@@ -913,6 +919,34 @@ bool ns_image_server::upgrade_tables(ns_sql & sql,const bool just_test_if_needed
 
 		changes_made = true;
 	}
+	if (!ns_sql_column_exists("processing_job_queue","claim_token",sql)){
+		if (just_test_if_needed)
+			return true;
+		cout << "Adding job claim columns to processing_job_queue\n";
+		sql << "ALTER TABLE processing_job_queue "
+			   "ADD COLUMN `claim_token` BIGINT UNSIGNED NOT NULL DEFAULT '0' AFTER `paused`, "
+			   "ADD COLUMN `claim_expiration_time` INT UNSIGNED NOT NULL DEFAULT '0' AFTER `claim_token`, "
+			   "ADD INDEX `claim_index` (`claim_token`)";
+		sql.send_query();
+		changes_made = true;
+	}
+	sql << "SHOW TABLES LIKE 'image_transfer_chunks'";
+	sql.get_rows(res);
+	if (res.empty()){
+		if (just_test_if_needed)
+			return true;
+		cout << "Adding image_transfer_chunks table\n";
+		sql << "CREATE TABLE `image_transfer_chunks` ("
+			   "`image_id` BIGINT UNSIGNED NOT NULL DEFAULT '0', "
+			   "`chunk` INT UNSIGNED NOT NULL DEFAULT '0', "
+			   "`chunk_size` INT UNSIGNED NOT NULL DEFAULT '0', "
+			   "`file_size` BIGINT UNSIGNED NOT NULL DEFAULT '0', "
+			   "`checksum` INT UNSIGNED NOT NULL DEFAULT '0', "
+			   "PRIMARY KEY (`image_id`,`chunk`)"
+			   ") ENGINE=InnoDB DEFAULT CHARSET=latin1";
+		sql.send_query();
+		changes_made = true;
+	}
 	if (!changes_made && !just_test_if_needed){
 		cout << "The database appears up-to-date; no changes were made.\n";
 	}
@@ -1892,6 +1926,8 @@ void ns_image_server::load_constants(const ns_image_server::ns_image_server_exec
 	constants.add_field("server_timeout_interval","300","How long should a server wait before giving up on a dead network connection (in seconds)");
 	constants.add_field("log_filename","image_server_log.txt","Image acquisition and image processing servers keep a log file in the central SQL database.  However, to help diagnose crashes, a text file containing the same log information is stored on the local machine.  The log file is stored in the directory specified by the volatile_storage_directory option (described above), and its filename is specified by here.");
 	constants.add_field("maximum_memory_allocation_in_mb","3840","Movement analaysis benefits from access to multiple gigabytes of RAM.  This value should be set to approximately the size of system memory.  Larger values will cause sporadic crashes during movement analysis.");
+	constants.add_field("image_registration_method","full","How should image processing servers align each captured image to the first image of its sample?  full compares the images pixel by pixel at several resolutions.  fft uses phase correlation, which is much faster and more robust on low-contrast plates. (full / fft)");
+	constants.add_field("intermediate_image_format","tiff","In what format should image processing servers store the spatially averaged and thresholded images that are read back by later processing steps?  tiff produces LZW-compressed tiff files that can be opened by other software.  fast_lossless uses a simpler compression scheme that takes up somewhat more disk space but is written and read several times faster. (tiff / fast_lossless)");
 
 	ns_ini terminal_constants;
 	terminal_constants.reject_incorrect_fields(reject_incorrect_fields);
@@ -2010,6 +2046,9 @@ void ns_image_server::load_constants(const ns_image_server::ns_image_server_exec
 		base_host_name			= constants["host_name"];
 		host_name				= opt.host_name(base_host_name);
 		number_of_node_processes_per_machine_ = atol(constants["nodes_per_machine"].c_str());
+		//each node compresses and decompresses tiff files, and runs its thread pools, using its share of the machine's processors
+		ns_thread_pool::set_number_of_processes_per_machine(number_of_node_processes_per_machine_);
+		ns_set_tiff_number_of_threads(ns_thread_pool::number_of_processors_per_process());
 		volatile_storage_directory	= opt.volatile_storage(ns_dir::format_path(constants["volatile_storage_directory"]));
 		_dispatcher_port		= opt.port(atoi(constants["dispatcher_port"].c_str()));
 		_act_as_an_image_capture_server = ( ns_to_bool(constants["act_as_image_capture_server"]) && opt.manage_capture_devices);
@@ -2022,6 +2061,24 @@ void ns_image_server::load_constants(const ns_image_server::ns_image_server_exec
 			if (_maximum_memory_allocation_in_mb < 1024)
 				throw ns_ex("maximum_memory_allocation_in_mb is set to an extremely low value: 1024.  The lifespan machine will not function properly with less than one GB of RAM.");
 		}else _maximum_memory_allocation_in_mb = 1024*4;
+		_image_registration_method = ns_full_registration;
+		if (constants.field_specified("image_registration_method")){
+			const std::string method(constants["image_registration_method"]);
+			if (method == "fft")
+				_image_registration_method = ns_fft_registration;
+			else if (method != "full")
+				throw ns_ex("image_registration_method must be set to either full or fft, not ") << method;
+		}
+		ns_image_type intermediate_image_type(ns_tiff);
+		if (constants.field_specified("intermediate_image_format")){
+			const std::string format(constants["intermediate_image_format"]);
+			if (format == "fast_lossless")
+				intermediate_image_type = ns_fast_lossless;
+			else if (format != "tiff")
+				throw ns_ex("intermediate_image_format must be set to either tiff or fast_lossless, not ") << format;
+		}
+		image_storage.set_processing_step_image_type(ns_process_spatial,intermediate_image_type);
+		image_storage.set_processing_step_image_type(ns_process_threshold,intermediate_image_type);
 
 
 		_capture_command		= constants["device_capture_command"];
@@ -2822,6 +2879,12 @@ ns_image_server_results_file ns_image_server_results_storage::time_path_image_an
 		}
 	}
 
+ns_image_server_results_file ns_image_server_results_storage::time_path_image_analysis_optimization_matrix(ns_image_server_results_subject & spec, const bool store_in_results_directory,ns_sql & sql){
+	ns_image_server_results_file f(time_path_image_analysis_quantification(spec,"optimization_matrix",store_in_results_directory,sql));
+	f.filename = f.filename.substr(0,f.filename.size()-3) + "col";
+	return f;
+}
+
 
 
 //global server object
@@ -380,6 +380,12 @@ public:
 	std::string get_cluster_constant_value(const std::string & key, const std::string & default_value, ns_image_server_sql * sql);
 	std::string get_cluster_constant_value_locked(const std::string & key, const std::string & default_value,ns_image_server_sql * sql);
 	void set_cluster_constant_value(const std::string & key, const std::string & value, ns_image_server_sql * sql, const int time_stamp=-1);
+
+	///Images are sent over sockets using version 1 of the image socket protocol unless the image_socket_protocol_version
+	///cluster constant is set to 2, which should be done only once every node on the cluster can read version 2.
+	///Version 2 blocks are compressed only if the image_socket_compression cluster constant is set to 1.
+	///Compression runs on the sending thread at roughly 60 MB/s, so it only helps on links slower than that.
+	void get_image_socket_protocol(ns_image_socket_protocol_version & version, bool & compress, ns_image_server_sql * sql);
 	void get_cluster_constant_lock(ns_image_server_sql * sql);
 	void release_cluster_constant_lock(ns_image_server_sql * sql);
 	
@@ -437,6 +443,7 @@ public:
 	inline bool verbose_debug_output() const {return _verbose_debug_output;}
 	inline double & terminal_window_scale_factor() {return _terminal_window_scale_factor;}
 	inline const unsigned long & maximum_memory_allocation_in_mb(){return  _maximum_memory_allocation_in_mb;}
+	inline const ns_registration_method & image_registration_method() const{return _image_registration_method;}
 
 	ns_process_priority process_priority;
 private:
@@ -481,6 +488,7 @@ private:
 		_cache_subdirectory;
 
 	unsigned long _maximum_memory_allocation_in_mb; 
+	ns_registration_method _image_registration_method;
 
 	unsigned long next_scan_for_problems_time;
 	unsigned int _dispatcher_port;
@@ -669,7 +669,7 @@ ns_multiprocess_control_options ns_spawn_new_nodes(	const unsigned int & count,
 typedef enum {ns_none,ns_start, ns_stop, ns_help, ns_restart, ns_status, ns_hotplug,
 			  ns_reset_devices,ns_reload_models,ns_submit_experiment,ns_test_email,ns_test_alert, ns_test_rate_limited_alert,ns_wrap_m4v,
 			  ns_restarting_after_a_crash,ns_trigger_segfault_in_main_thread,ns_trigger_segfault_in_dispatcher_thread, ns_run_pending_image_transfers,
-	      ns_clear_local_db_buffer_cleanly,ns_clear_local_db_buffer_dangerously,ns_simulate_central_db_connection_error,ns_fix_orphaned_captured_images,ns_update_sql,ns_output_image_buffer_info,ns_stop_checking_central_db,ns_start_checking_central_db} ns_cl_command;
+	      ns_clear_local_db_buffer_cleanly,ns_clear_local_db_buffer_dangerously,ns_simulate_central_db_connection_error,ns_fix_orphaned_captured_images,ns_update_sql,ns_output_image_buffer_info,ns_stop_checking_central_db,ns_start_checking_central_db,ns_benchmark_job_claiming,ns_benchmark_image_socket,ns_benchmark_movement_quantification_kernel} ns_cl_command;
 
 ns_image_server_sql * ns_connect_to_available_sql_server(){
 		try{
@@ -688,6 +688,7 @@ ns_image_server_sql * ns_connect_to_available_sql_server(){
 }
 #include "ns_ojp2k.h"
 #include "ns_image_registration.h"
+#include "ns_time_path_image_analyzer.h"
 #ifdef _WIN32 
 int APIENTRY WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nCmdShow){
 	int argc;
@@ -778,6 +779,9 @@ int main(int argc, char * argv[]){
 	commands["start_checking_central_db"] = ns_start_checking_central_db;
 	commands["stop_checking_central_db"] = ns_stop_checking_central_db;
 	commands["update_sql"] = ns_update_sql;
+	commands["benchmark_job_queue_claims"] = ns_benchmark_job_claiming;
+	commands["benchmark_image_socket"] = ns_benchmark_image_socket;
+	commands["benchmark_movement_quantification"] = ns_benchmark_movement_quantification_kernel;
 	bool is_master_node(false);
 	try{
 		
@@ -862,7 +866,10 @@ int main(int argc, char * argv[]){
 						<< "output_image_buffer_info: Output information about the state of each scanner's locally buffered images.\n"
 						<< "stop_checking_central_db: Cease attempting to connect to the central db.\n"
 						<< "start_checking_central_db: Restart attempts to connect to the central db.\n"
-						<< "upgrade_sql: upgrade the sql database schema to match the most recent version. No changes are made if the schema is already up-to-data.\n";
+						<< "upgrade_sql: upgrade the sql database schema to match the most recent version. No changes are made if the schema is already up-to-data.\n"
+						<< "benchmark_job_queue_claims: Measure how quickly simultaneous connections can claim jobs, using a temporary job queue in the local database.\n"
+						<< "benchmark_image_socket: Measure how quickly images can be sent over a local connection using each version of the image socket protocol.\n"
+						<< "benchmark_movement_quantification: Check that the movement quantification kernel matches the calculation it replaced, and measure the speed of each.\n";
 					#ifndef _WIN32
 					ex << "daemon: run as a background process\n";
 					#endif
@@ -1032,11 +1039,19 @@ int main(int argc, char * argv[]){
 				if (!image_server.send_message_to_running_server(NS_CLEAR_DB_BUF_DIRTY))
 					throw ns_ex("No image server found running at ") << image_server.dispatcher_ip() << ":" << image_server.dispatcher_port() << ".";	
 				return 0;
+			case ns_benchmark_image_socket:
+				//use a port next to the dispatcher's so the benchmark can run alongside a running server
+				ns_benchmark_image_socket_protocols(image_server.dispatcher_port()+1,cout);
+				return 0;
+			case ns_benchmark_movement_quantification_kernel:
+				ns_benchmark_movement_quantification(cout);
+				return 0;
 
 			//all of these require access to the sql database and will be handled
 			//a little later in the startup process
 			case ns_fix_orphaned_captured_images:
 			case ns_update_sql:
+			case ns_benchmark_job_claiming:
 			case ns_test_email:
 			case ns_test_alert:
 			case ns_test_rate_limited_alert:
@@ -1194,6 +1209,10 @@ int main(int argc, char * argv[]){
 				sql.release();
 				return 0;
 			}
+			case ns_benchmark_job_claiming:{
+				ns_benchmark_job_queue_claims(20,20000,4,cout);
+				return 0;
+			}
 			case ns_test_email:{
 				std::string text("Image server node ");
 				text += image_server.host_name_out();
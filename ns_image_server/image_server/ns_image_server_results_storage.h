@@ -60,10 +60,10 @@ class ns_image_server_results_subject{
 class ns_image_server_results_file{
 	public:
 	ns_image_server_results_file(const std::string & d,const std::string & f):directory(d),filename(f){}
-	std::ostream * output(){
+	std::ostream * output(const bool binary=false){
 
 		ns_dir::create_directory_recursive(directory);
-		std::ofstream * o(new std::ofstream(path().c_str()));
+		std::ofstream * o(new std::ofstream(path().c_str(),binary?(std::ios::out | std::ios::binary):std::ios::out));
 		if (o->fail()){
 			delete o;
 			throw ns_ex("ns_image_server_results_file::output()::Could not open ") << filename;
@@ -187,6 +187,8 @@ public:
 	}
 
 	ns_image_server_results_file time_path_image_analysis_quantification(ns_image_server_results_subject & spec,const std::string & type, const bool store_in_results_directory,ns_sql & sql, bool abbreviated_time_series=false);
+	//the death times found by an ns_death_time_parameter_sweep, stored as a columnar file.  Should be opened with output(true).
+	ns_image_server_results_file time_path_image_analysis_optimization_matrix(ns_image_server_results_subject & spec, const bool store_in_results_directory,ns_sql & sql);
 
 	ns_image_server_results_file movement_timeseries_plot(ns_image_server_results_subject & spec,const std::string & type, ns_sql & sql){	
 		spec.get_names(sql);
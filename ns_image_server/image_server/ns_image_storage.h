@@ -7,6 +7,7 @@
 #include "ns_jpeg.h"
 #include "ns_tiff.h"
 #include "ns_ojp2k.h"
+#include "ns_fast_lossless.h"
 #include "ns_dir.h"
 #include "ns_image_server_images.h"
 #include "ns_thread.h"
@@ -44,7 +45,7 @@ public:
 ns_image_type ns_get_image_type(const std::string & filename);
 
 template<class image_t>
-image_t & ns_choose_image_source(const ns_image_type & type, image_t & jpeg, image_t & tif, image_t & jp2k){
+image_t & ns_choose_image_source(const ns_image_type & type, image_t & jpeg, image_t & tif, image_t & jp2k, image_t & fast_lossless){
 	switch(type){
 		case ns_jpeg: return jpeg;
 		case ns_tiff:
@@ -53,6 +54,8 @@ image_t & ns_choose_image_source(const ns_image_type & type, image_t & jpeg, ima
 			return tif;
 		case ns_jp2k:
 			return jp2k;
+		case ns_fast_lossless:
+			return fast_lossless;
 		default: throw ns_ex("No image type specified!");
 	}
 }
@@ -62,7 +65,7 @@ class ns_image_storage_reciever_to_disk: public ns_image_storage_reciever<ns_com
 public:
 	ns_image_storage_reciever_to_disk(const unsigned long max_block_height, const std::string & filename,const ns_image_type & type,ns_performance_statistics_analyzer * performance_analyzer_,const bool volatile_file_=false):
 	  ns_image_storage_reciever<ns_component>(max_block_height),pa(performance_analyzer_),volatile_file(volatile_file_),total(0),
-		  file_sink(filename,ns_choose_image_source<ns_image_output_file<ns_component> >(type,jpeg_out,tiff_out,jp2k_out),max_block_height),tiff_out(ns_get_tiff_compression_type(type))
+		  file_sink(filename,ns_choose_image_source<ns_image_output_file<ns_component> >(type,jpeg_out,tiff_out,jp2k_out,fast_lossless_out),max_block_height),tiff_out(ns_get_tiff_compression_type(type))
 	  {}
 
     ns_image_stream_static_buffer<ns_component> * provide_buffer(const ns_image_stream_buffer_properties & buffer_properties)
@@ -93,6 +96,7 @@ private:
 	ns_jpeg_image_output_file<ns_component> jpeg_out;
 	ns_tiff_image_output_file<ns_component> tiff_out;
 	ns_ojp2k_image_output_file<ns_component> jp2k_out;
+	ns_fast_lossless_image_output_file<ns_component> fast_lossless_out;
 
 	ns_image_stream_file_sink<ns_component> file_sink;
 
@@ -113,9 +117,9 @@ private:
 template<class ns_component>
 class ns_image_storage_reciever_to_net: public ns_image_storage_reciever<ns_component>{
 public:
-	ns_image_storage_reciever_to_net(const unsigned long max_block_height, ns_socket_connection & socket_connection, ns_lock & network_lock):
+	ns_image_storage_reciever_to_net(const unsigned long max_block_height, ns_socket_connection & socket_connection, ns_lock & network_lock, const ns_image_socket_protocol_version protocol=ns_image_socket_protocol_1):
 		ns_image_storage_reciever<ns_component>(max_block_height),
-		_connection(socket_connection), image_socket(max_block_height), release_when_finished(network_lock){}
+		_connection(socket_connection), image_socket(max_block_height,protocol), release_when_finished(network_lock){}
 
     ns_image_stream_static_buffer<ns_component> * provide_buffer(const ns_image_stream_buffer_properties & buffer_properties){
 		return image_socket.provide_buffer(buffer_properties);
@@ -173,10 +177,10 @@ class ns_image_storage_source_from_disk : public ns_image_storage_source<ns_comp
 public:
 	ns_image_storage_source_from_disk(const std::string & filename,ns_performance_statistics_analyzer * performance_analyzer_,const bool volatile_file_=false):
 	  pa(performance_analyzer_),volatile_file(volatile_file_),total(0),
-		_source( ns_choose_image_source<ns_image_input_file<ns_component> >(ns_get_image_type(filename),jpeg_in,tiff_in,jp2k_in) ),
+		_source( ns_choose_image_source<ns_image_input_file<ns_component> >(ns_get_image_type(filename),jpeg_in,tiff_in,jp2k_in,fast_lossless_in) ),
 		ns_image_storage_source<ns_component>(ns_image_properties(0,0,0)){
 
-		target = &(ns_choose_image_source<ns_image_input_file<ns_component> >(ns_get_image_type(filename),jpeg_in,tiff_in,jp2k_in));
+		target = &(ns_choose_image_source<ns_image_input_file<ns_component> >(ns_get_image_type(filename),jpeg_in,tiff_in,jp2k_in,fast_lossless_in));
 		target->open_file(filename);
 		ns_image_storage_source<ns_component>::_properties = target->properties();
 	}
@@ -202,6 +206,7 @@ private:
 	ns_jpeg_image_input_file<ns_component> jpeg_in;
 	ns_tiff_image_input_file<ns_component> tiff_in;
 	ns_ojp2k_image_input_file<ns_component> jp2k_in;
+	ns_fast_lossless_image_input_file<ns_component> fast_lossless_in;
 	ns_image_stream_file_source<ns_component> _source;
 	ns_image_input_file<ns_component> * target;
 	inline void mark_pa_started(){ 
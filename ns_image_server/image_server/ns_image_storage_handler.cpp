@@ -291,6 +291,8 @@ ns_image_type ns_get_image_type(const std::string & filename){
 		return ns_tiff_lzw;
 	if (extension == "jp2" || extension == "jpk")
 		return ns_jp2k;
+	if (extension == "nsfl")
+		return ns_fast_lossless;
 	throw ns_ex("ns_image_storage_handler_to_disk: Could not deduce image format from filename: '") << filename << "'";
 
 }
@@ -322,6 +324,64 @@ ns_image_storage_reciever_handle<ns_image_storage_handler::ns_component> ns_imag
 	return request_storage(image, image_type, max_line_length, sql,had_to_use_local_storage,false,allow_volatile_storage);
 }
 
+void ns_image_storage_handler::transfer_volatile_file_to_storage_ci(const std::string & volatile_filename, ns_image_server_captured_image & captured_image, const ns_image_type & image_type,
+																	 ns_chunked_file_transfer & transfer, const std::vector<ns_file_transfer_chunk> & previously_verified_chunks, ns_chunked_file_transfer_log & log,
+																	 ns_image_server_sql * sql, bool & had_to_use_local_storage, const bool allow_volatile_storage){
+	ns_image_server_image image;
+	image.filename = captured_image.filename(sql);
+	image.path = captured_image.directory(sql);
+	image.partition = get_partition_for_experiment(captured_image.experiment_id,sql);
+	ns_file_location_specification file_location(look_up_image_location(image,sql,image_type));
+	//any mapped copy of the previous contents is now out of date
+	delete_mapped_image(file_location);
+
+	std::string source(volatile_storage_directory + DIR_CHAR_STR + ns_image_server_scratch_directory() + DIR_CHAR_STR + volatile_filename);
+	ns_dir::convert_slashes(source);
+
+	if (long_term_storage_directory.size() != 0 && long_term_storage_is_accessible(file_location,__FILE__,__LINE__)){
+		ns_dir::create_directory_recursive(file_location.absolute_long_term_directory());
+		if (verbosity >= ns_verbose)
+			ns_image_handler_register_server_event(ns_image_server_event("ns_image_storage_handler::Transferring ") << source << " to LT " << file_location.absolute_long_term_filename() << ns_ts_minor_event,sql);
+		transfer.transfer(source,file_location.absolute_long_term_filename(),previously_verified_chunks,log);
+		ns_dir::delete_file(source);
+		had_to_use_local_storage = false;
+		return;
+	}
+
+	if (!allow_volatile_storage)
+		throw ns_ex("ns_image_storage_handler::transfer_volatile_file_to_storage_ci()::Could not access long term storage and volatile storage was forbidden") << ns_network_io;
+	ns_dir::create_directory_recursive(file_location.absolute_volatile_directory());
+	if (ns_dir::file_exists(file_location.absolute_volatile_filename()))
+		ns_dir::delete_file(file_location.absolute_volatile_filename());
+	if (!ns_dir::move_file(source,file_location.absolute_volatile_filename())){
+		ns_image_handler_submit_alert(ns_alert::ns_volatile_storage_error,
+			"Could not access volatile storage.", 
+			std::string("ns_image_storage_handler::transfer_volatile_file_to_storage_ci::Could not access volatile storage when attempting to write ") + file_location.relative_directory + DIR_CHAR_STR + file_location.filename,
+			sql);
+		throw ns_ex("ns_image_storage_handler::transfer_volatile_file_to_storage_ci()::Could not move ") << source << " to " << file_location.absolute_volatile_filename() << ns_file_io;
+	}
+	if (verbosity >= ns_standard)
+		ns_image_handler_register_server_event(ns_image_server_event("ns_image_storage_handler::Forced to store ") << file_location.absolute_volatile_filename() << " in VT.",sql);
+	had_to_use_local_storage = true;
+}
+
+void ns_image_storage_handler::delete_partial_transfer_ci(ns_image_server_captured_image & captured_image, ns_image_server_sql * sql){
+	if (long_term_storage_directory.size() == 0)
+		return;
+	//captured images are transferred either uncompressed or, if they are split into regions as they are transferred, compressed
+	const ns_image_type types[2] = {ns_tiff,ns_tiff_zip};
+	for (unsigned int i = 0; i < 2; i++){
+		ns_image_server_image image;
+		image.filename = captured_image.filename(sql);
+		image.path = captured_image.directory(sql);
+		image.partition = get_partition_for_experiment(captured_image.experiment_id,sql);
+		ns_file_location_specification file_location(look_up_image_location(image,sql,types[i]));
+		const std::string partial(ns_chunked_file_transfer::partial_filename(file_location.absolute_long_term_filename()));
+		if (ns_dir::file_exists(partial))
+			ns_dir::delete_file(partial);
+	}
+}
+
 bool ns_image_storage_handler::long_term_storage_was_recently_writeable(const unsigned long time_cutoff_in_seconds) const{
 	if (time_cutoff_in_seconds == 0 || last_check_showed_write_access_to_long_term_storage)
 		return last_check_showed_write_access_to_long_term_storage;
@@ -447,6 +507,20 @@ ifstream * ns_image_storage_handler::request_metadata_from_disk(ns_image_server_
 	return i;
 }
 
+std::string ns_image_storage_handler::request_metadata_filename(ns_image_server_image & image,ns_image_server_sql * sql){
+	if (image.filename.size() == 0 || image.path.size() == 0 || image.partition.size() == 0) image.load_from_db(image.id,sql);
+
+	ns_file_location_specification spec(look_up_image_location(image,sql));
+	if (long_term_storage_directory.size() == 0 || !ns_dir::file_exists(spec.long_term_directory)){
+		ns_image_handler_submit_alert(ns_alert::ns_long_term_storage_error,
+			"Could not access long term storage.",
+			std::string("ns_image_storage_handler::request_metadata_filename()::Could not access long term storage while attempting to read") + spec.relative_directory + DIR_CHAR_STR + spec.filename,
+			sql);
+		throw ns_ex("ns_image_storage_handler::request_metadata_filename()::Could not access long term storage at ") << spec.long_term_directory << ns_network_io;
+	}
+	return spec.absolute_long_term_filename();
+}
+
 ofstream * ns_image_storage_handler::request_metadata_output(ns_image_server_image & image, const std::string & extension, const bool binary,ns_image_server_sql * sql){
 
 	if (image.filename.size() == 0 || image.path.size() == 0 || image.partition.size() == 0) image.load_from_db(image.id,sql);
@@ -495,6 +569,8 @@ ofstream * ns_image_storage_handler::request_metadata_output(ns_image_server_ima
 ns_image_storage_reciever_handle<ns_image_storage_handler::ns_component> ns_image_storage_handler::request_storage(ns_image_server_image & image, const ns_image_type & image_type, const unsigned long max_line_length, ns_image_server_sql * sql, bool & had_to_use_local_storage, const bool report_to_db, const bool allow_volatile_storage){
 	ns_ex stored_error[3];
 	ns_file_location_specification file_location(look_up_image_location(image,sql,image_type));
+	//any mapped copy of the previous contents is now out of date
+	delete_mapped_image(file_location);
 
 	//try to store image in long-term storage
 	if (long_term_storage_directory.size() != 0 && long_term_storage_is_accessible(file_location,__FILE__,__LINE__)){
@@ -942,6 +1018,7 @@ bool ns_image_storage_handler::delete_from_storage(ns_image_server_image & image
 
 	bool successfully_deleted(false);
 	ns_file_location_specification file_location(look_up_image_location(image,sql));
+	delete_mapped_image(file_location);
 	if (type == ns_delete_volatile || type == ns_delete_both_volatile_and_long_term){
 		if (verbosity >= ns_deletion_events)
 			image_server.register_server_event(ns_image_server_event("ns_image_storage_handler::delete_from_storage(ns_image_server_image & image)::Deleting ") << file_location.absolute_volatile_filename(),sql);
@@ -1288,6 +1365,77 @@ ns_file_location_specification ns_image_storage_handler::look_up_image_location(
 }
 
 
+std::string ns_image_storage_handler::mapped_image_filename(const ns_file_location_specification & spec) const{
+	//flatten the image's location into a single filename, ignoring the extension
+	//so that the copy is found regardless of the format in which the image was stored.
+	std::string name(spec.par() + spec.relative_directory + DIR_CHAR_STR + ns_dir::extract_filename_without_extension(spec.filename));
+	ns_dir::convert_slashes(name);
+	for (unsigned int i = 0; i < name.size(); i++){
+		if (name[i] == DIR_CHAR || name[i] == ':')
+			name[i] = '=';
+	}
+	std::string filename(volatile_storage_directory + DIR_CHAR_STR + ns_image_server_cache_directory() + DIR_CHAR_STR + "mapped=" + name + ".nsmap");
+	ns_dir::convert_slashes(filename);
+	return filename;
+}
+
+void ns_image_storage_handler::delete_mapped_image(const ns_file_location_specification & spec) const{
+	const std::string filename(mapped_image_filename(spec));
+	if (ns_dir::file_exists(filename))
+		ns_dir::delete_file(filename);
+}
+
+bool ns_image_storage_handler::get_mapped_image_source(const ns_file_location_specification & spec, ns_image_mapped_file_source & source) const{
+	//volatile storage is checked first, as it is when images are loaded
+	if (volatile_storage_directory.size() != 0 &&
+		ns_dir::get_file_size_and_modification_time(spec.absolute_volatile_filename(),source.size,source.modification_time))
+		return true;
+	return long_term_storage_directory.size() != 0 &&
+		ns_dir::get_file_size_and_modification_time(spec.absolute_long_term_filename(),source.size,source.modification_time);
+}
+
+struct ns_mapped_image_file_info{
+	std::string filename;
+	ns_64_bit size,
+			  modification_time;
+	bool operator<(const ns_mapped_image_file_info & r) const{return modification_time < r.modification_time;}
+};
+
+void ns_image_storage_handler::clean_up_mapped_images() const{
+	std::string path(volatile_storage_directory + DIR_CHAR_STR + ns_image_server_cache_directory());
+	ns_dir::convert_slashes(path);
+	ns_dir dir;
+	dir.load(path);
+	const ns_64_bit current_time(ns_current_time());
+	std::vector<ns_mapped_image_file_info> files;
+	ns_64_bit total_size(0);
+	for (unsigned long i = 0; i < dir.files.size(); i++){
+		if (dir.files[i].find("mapped=") != 0)
+			continue;
+		ns_mapped_image_file_info f;
+		f.filename = path + DIR_CHAR_STR + dir.files[i];
+		if (!ns_dir::get_file_size_and_modification_time(f.filename,f.size,f.modification_time))
+			continue;
+		const bool temporary_file(dir.files[i].find(".partial=") != std::string::npos);
+		//temporary files are only left behind by writers that failed part way through
+		if (current_time > f.modification_time + (temporary_file?60*60:maximum_mapped_image_age_in_seconds())){
+			ns_dir::delete_file(f.filename);
+			continue;
+		}
+		if (temporary_file)
+			continue;
+		files.push_back(f);
+		total_size+=f.size;
+	}
+	std::sort(files.begin(),files.end());
+	const ns_64_bit maximum_size(((ns_64_bit)maximum_mapped_image_cache_size_in_mb())*1024*1024);
+	for (unsigned long i = 0; i < files.size() && total_size > maximum_size; i++){
+		//processes that have already mapped a copy can keep using it (on Windows, the deletion fails and the copy is kept)
+		ns_dir::delete_file(files[i].filename);
+		total_size-=files[i].size;
+	}
+}
+
 ns_file_location_specification ns_image_storage_handler::compile_absolute_paths_from_relative(const std::string & rel_path, const std::string & partition, const std::string & filename) const{
 	ns_file_location_specification spec;
 	spec.long_term_directory = long_term_storage_directory;
@@ -5,9 +5,11 @@
 #include <algorithm>
 #include <map>
 #include <fstream>
-#include "ns_image_simple_cache.h"
+#include "ns_image_cache.h"
+#include "ns_image_mapped_file.h"
 #include "ns_image_server_alerts.h"
 #include "ns_file_location_specification.h"
+#include "ns_chunked_file_transfer.h"
 
 #include "ns_image_server_sql.h"
 
@@ -54,11 +56,17 @@ public:
 	ns_image_storage_handler():network_lock("ns_ish::network"),
 		request_storage_lock("ns_ish::storage"),
 		experiment_partition_cache_lock("ns_ish::partition"),
-		cache(this,512*1024),experiment_partition_cache_update_period(5*60),last_check_showed_write_access_to_long_term_storage(false),time_of_last_successful_write_check(0),
-		experiment_partition_cache_last_update_time(0),verbosity(ns_standard){}
+		cache(this,512*1024,2*1024*1024),experiment_partition_cache_update_period(5*60),last_check_showed_write_access_to_long_term_storage(false),time_of_last_successful_write_check(0),
+		experiment_partition_cache_last_update_time(0),verbosity(ns_standard),
+		processing_step_image_types((unsigned long)ns_process_last_task_marker,ns_tiff){}
 
 	void set_directories(const std::string & _volatile_storage_directory, const std::string & _long_term_storage_directory);
 
+	//the format in which the output of each processing step is stored.
+	//Intermediate images that are read back by later steps can be stored as ns_fast_lossless to save encoding and decoding time.
+	ns_image_type processing_step_image_type(const ns_processing_task & task) const{return processing_step_image_types[task];}
+	void set_processing_step_image_type(const ns_processing_task & task, const ns_image_type & type){processing_step_image_types[task] = type;}
+
 	ns_image_storage_reciever_handle<ns_component> request_storage(ns_image_server_captured_image_region & captured_image_region, const ns_image_type & image_type, const unsigned long max_line_length, ns_image_server_sql * sql, const bool allow_volatile_storage);
 	ns_image_storage_reciever_handle<ns_component> request_storage_ci(ns_image_server_captured_image & captured_image, const ns_image_type & image_type, const unsigned long max_line_length, ns_image_server_sql * sql, bool & had_to_use_local_storage, const bool allow_volatile_storage);
 
@@ -70,6 +78,8 @@ public:
 
 	bool assign_unique_filename(ns_image_server_image & image, ns_image_server_sql * sql);
 	std::ifstream * request_metadata_from_disk(ns_image_server_image & image,const bool binary,ns_image_server_sql * sql);
+	//returns the absolute path of the metadata file in long term storage, so that it can be memory mapped rather than read as a stream
+	std::string request_metadata_filename(ns_image_server_image & image,ns_image_server_sql * sql);
 
 	void fix_orphaned_captured_images(ns_image_server_sql * sql);
 
@@ -92,8 +102,9 @@ public:
 
 	std::ofstream * request_volatile_binary_output(const std::string & filename);
 
+	//if no image type is specified, it is deduced from the filename
 	template<class ns_bit_depth>
-	ns_image_storage_reciever_handle<ns_bit_depth>  request_volatile_storage(const std::string & filename, const unsigned long max_line_length, const bool report_to_db = true){
+	ns_image_storage_reciever_handle<ns_bit_depth>  request_volatile_storage(const std::string & filename, const unsigned long max_line_length, const bool report_to_db = true, const ns_image_type & image_type = ns_unknown){
 		std::string dir = volatile_storage_directory + DIR_CHAR_STR + ns_image_server_scratch_directory();
 
 		std::string fname = dir + DIR_CHAR_STR + filename;
@@ -108,9 +119,18 @@ public:
 
 		if (verbosity >= ns_verbose)
 			ns_image_handler_register_server_event_to_central_db(ns_image_server_event("ns_image_storage_handler::Opening ") << fname << " for output.");
-		return ns_image_storage_reciever_handle<ns_bit_depth>(new ns_image_storage_reciever_to_disk<ns_bit_depth>(max_line_length, fname,ns_get_image_type(fname),&performance_statistics(),true));
+		return ns_image_storage_reciever_handle<ns_bit_depth>(new ns_image_storage_reciever_to_disk<ns_bit_depth>(max_line_length, fname,(image_type==ns_unknown)?ns_get_image_type(fname):image_type,&performance_statistics(),true));
 	}
 
+	///Copies a file written by request_volatile_storage() to the location of the captured image in long term storage using the specified transfer,
+	///after which the volatile copy is deleted.  previously_verified_chunks are the chunks recorded by the log during earlier, interrupted attempts.
+	///If long term storage cannot be reached and allow_volatile_storage is set, the file is instead moved to the captured image's location in volatile storage.
+	void transfer_volatile_file_to_storage_ci(const std::string & volatile_filename, ns_image_server_captured_image & captured_image, const ns_image_type & image_type,
+											  ns_chunked_file_transfer & transfer, const std::vector<ns_file_transfer_chunk> & previously_verified_chunks, ns_chunked_file_transfer_log & log,
+											  ns_image_server_sql * sql, bool & had_to_use_local_storage, const bool allow_volatile_storage);
+
+	///Deletes any partial file left in long term storage by an interrupted transfer_volatile_file_to_storage_ci() of the captured image
+	void delete_partial_transfer_ci(ns_image_server_captured_image & captured_image, ns_image_server_sql * sql);
 	
 
 	std::ifstream * request_from_volatile_storage_raw(const std::string & filename);
@@ -224,8 +244,49 @@ public:
 		throw ns_ex("ns_image_storage_handler::request_from_storage_n_bis()::file ") << image.filename << " could not be opened for reading: File does not exist in " << file_location_string(location) << ":" << image.path << ns_file_io;
 	}
 	
+	///Loads an image from storage.  The first time an image is requested, an uncompressed copy is written to the local cache.
+	///Later requests memory map this copy directly into output, so that the image is neither decoded nor copied
+	///and pixels are read from disk only as they are accessed.
+	///Copies are discarded whenever the image is written to or deleted from storage by this host, and are not used if the
+	///size or modification time of the stored image no longer matches, as happens when another host rewrites it.
+	template<class ns_comp>
+	void request_mapped_image_from_storage(ns_image_server_image & image, ns_image_whole<ns_comp> & output, ns_image_server_sql * sql){
+		const ns_file_location_specification file_location(look_up_image_location(image,sql,ns_tiff_lzw));
+		const std::string mapped_filename(mapped_image_filename(file_location));
+		ns_image_mapped_file_source source;
+		const bool source_found(get_mapped_image_source(file_location,source));
+		if (source_found && ns_dir::file_exists(mapped_filename)){
+			try{
+				ns_map_image_file(mapped_filename,output,source);
+				return;
+			}
+			catch(ns_ex & ex){
+				ns_image_handler_register_server_event(ns_image_server_event("ns_image_storage_handler::Discarding unusable mapped image: ") << ex.text() << ns_ts_minor_event,sql);
+				ns_dir::delete_file(mapped_filename);
+			}
+		}
+		ns_image_storage_source_handle<ns_comp> in(request_from_storage_n_bits<ns_comp>(image,sql,ns_volatile_and_long_term_storage));
+		in.input_stream().pump(output,512);
+		//a copy can only be checked against its source later if we know what the source was
+		if (!source_found)
+			return;
+		//make sure there is room for the copy, leaving space for everything else that uses volatile storage
+		const ns_64_bit size_in_mb((((ns_64_bit)output.properties().width)*output.properties().height*output.properties().components*sizeof(ns_comp))/(1024*1024));
+		if (free_space_in_volatile_storage_in_mb() < 4*size_in_mb + 1024)
+			return;
+		try{
+			ns_dir::create_directory_recursive(ns_dir::extract_path(mapped_filename));
+			ns_write_mapped_image_file(output,mapped_filename,source);
+			clean_up_mapped_images();
+		}
+		catch(ns_ex & ex){
+			//the copy is an optimization; we can do without it.
+			ns_image_handler_register_server_event(ns_image_server_event("ns_image_storage_handler::Could not write mapped image: ") << ex.text() << ns_ts_minor_event,sql);
+		}
+	}
+
 	///Cache frequently used masks in memory so they aren't reloaded each time over the network.
-	ns_image_simple_cache<ns_component> cache;
+	ns_image_cache<ns_component> cache;
 
 	inline std::string get_partition_for_experiment(const ns_64_bit experiment_id,ns_image_server_sql * sql,bool request_from_db_on_miss=true){
 		return get_partition_for_experiment_int(experiment_id,sql,request_from_db_on_miss,true);
@@ -290,6 +351,17 @@ private:
 
 	ns_file_location_specification look_up_image_location(ns_image_server_image & image,ns_image_server_sql * sql,const ns_image_type & image_type = ns_tiff_lzw) const;
 	ns_file_location_specification compile_absolute_paths_from_relative(const std::string & rel_path, const std::string & partition, const std::string & filename) const ;
+
+	//the name of the uncompressed copy of an image kept in the local cache by request_mapped_image_from_storage()
+	std::string mapped_image_filename(const ns_file_location_specification & spec) const;
+	void delete_mapped_image(const ns_file_location_specification & spec) const;
+	//finds the size and modification time of the file that request_from_storage_n_bits() would read for the specified image
+	bool get_mapped_image_source(const ns_file_location_specification & spec, ns_image_mapped_file_source & source) const;
+	//Removes mapped copies that have not been rewritten within maximum_mapped_image_age_in_seconds(), and then the oldest copies
+	//until the total size of those remaining is below maximum_mapped_image_cache_size_in_mb().
+	void clean_up_mapped_images() const;
+	static unsigned long maximum_mapped_image_cache_size_in_mb(){return 16*1024;}
+	static unsigned long maximum_mapped_image_age_in_seconds(){return 7*24*60*60;}
 	
 	void refresh_experiment_partition_cache_int(ns_image_server_sql * sql,const bool get_lock = true) const;
 
@@ -316,6 +388,8 @@ private:
 			du_path;
 	bool last_check_showed_write_access_to_long_term_storage;
 	unsigned long time_of_last_successful_write_check;
+
+	std::vector<ns_image_type> processing_step_image_types;
 };
 #pragma warning(default: 4355) 
 #endif
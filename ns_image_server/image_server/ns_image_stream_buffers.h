@@ -2,6 +2,8 @@
 #define NS_IMAGE_STREAM_BUFFERS
 
 #include <vector>
+#include <string.h>
+#include "ns_memory_mapped_file.h"
 
 //#define NS_TRACK_PERFORMANCE_STATISTICS
 #ifdef NS_TRACK_PERFORMANCE_STATISTICS
@@ -127,11 +129,13 @@ protected:
 ///a buffer that stores pixel info on the heap.  To facilitate image streaming,
 ///an "offset" can be declared such that pixels written to image[y][x] are actually
 ///written to image[y+offet][x].
+///Alternately, the buffer's lines can point into a memory mapped file (see use_mapped_memory()),
+///in which case pixels are only read from disk as they are accessed.
 template <class ns_component>
 class ns_image_stream_static_offset_buffer {//: public ns_image_stream_buffer<ns_component>{
 public:
-	ns_image_stream_static_offset_buffer(const ns_image_stream_buffer_properties & p):content_properties(p),memory_properties(p),buffer(0),offset(0){create_buffer(p);}
-	ns_image_stream_static_offset_buffer():buffer(0),offset(0),content_properties(ns_image_stream_buffer_properties(0,0)),memory_properties(ns_image_stream_buffer_properties(0,0)){}
+	ns_image_stream_static_offset_buffer(const ns_image_stream_buffer_properties & p):content_properties(p),memory_properties(p),buffer(0),offset(0),mapping(0){create_buffer(p);}
+	ns_image_stream_static_offset_buffer():buffer(0),offset(0),mapping(0),content_properties(ns_image_stream_buffer_properties(0,0)),memory_properties(ns_image_stream_buffer_properties(0,0)){}
 
 	void wasteful_resize(const ns_image_stream_buffer_properties & p){
 		//reallocate everything if we need a bigger image.
@@ -152,12 +156,7 @@ public:
 		ns_high_precision_timer tp;
 		tp.start();
 		#endif
-		if (buffer != 0){
-		//	cerr << "Deleting old buffer...\n";
-			for (unsigned int i = 0; i < memory_properties.height; i++)
-				delete[] buffer[i];
-			delete[] buffer;
-		}
+		delete_buffer();
 		#ifdef NS_TRACK_PERFORMANCE_STATISTICS
 		ns_image_allocation_performance_stats.register_job_duration(ns_performance_statistics_analyzer::ns_image_deallocation,tp.stop());
 		#endif
@@ -166,6 +165,8 @@ public:
 	void increase_size(const ns_image_stream_buffer_properties & p){
 		if (buffer == 0)
 			throw ns_ex("ns_image_stream_static_offset_buffer::Cannot increase the size of an unallocated buffer!");
+		//new lines can't be added to a file mapping, so the existing lines are first moved to the heap.
+		copy_mapped_memory_to_heap();
 		if (memory_properties.width < p.width)
 			throw ns_ex("ns_image_stream_static_offset_buffer:: Cannot in situ increase the width of a buffer!");
 		ns_component ** temp = new ns_component *[p.height];
@@ -193,6 +194,51 @@ public:
 	void set_offset(const long i) const {offset = i;}
 	inline const ns_image_stream_buffer_properties & properties() const {return content_properties;}
 
+	///Replaces the buffer's contents with p.height lines of p.width pixels stored in a memory mapped file.
+	///Line y begins data_offset + y*line_stride bytes into the file.
+	///The buffer takes ownership of the mapping and closes it when the buffer is resized or destroyed.
+	void use_mapped_memory(ns_memory_mapped_file * file, const ns_64_bit data_offset, const ns_64_bit line_stride, const ns_image_stream_buffer_properties & p){
+		if (data_offset + line_stride*(p.height==0?0:p.height-1) + sizeof(ns_component)*p.width > file->size()){
+			ns_ex ex("ns_image_stream_static_offset_buffer::Mapped file ");
+			ex << file->filename() << " is too small to contain the specified image" << ns_file_io;
+			delete file;
+			throw ex;
+		}
+		delete_buffer();
+		mapping = file;
+		memory_properties = content_properties = p;
+		buffer = new ns_component *[p.height];
+		for (unsigned long i = 0; i < p.height; i++)
+			buffer[i] = reinterpret_cast<ns_component *>(mapping->data() + data_offset + i*line_stride);
+	}
+	bool uses_mapped_memory() const{return mapping != 0;}
+	ns_memory_mapped_file * mapped_memory(){return mapping;}
+
+	///Moves the contents of a buffer stored in a memory mapped file onto the heap
+	void copy_mapped_memory_to_heap(){
+		if (mapping == 0)
+			return;
+		ns_component ** temp = new ns_component *[memory_properties.height];
+		for (unsigned long i = 0; i < memory_properties.height; i++)
+			temp[i] = 0;
+		try{
+			for (unsigned long i = 0; i < memory_properties.height; i++){
+				temp[i] = new ns_component[memory_properties.width];
+				memcpy(temp[i],buffer[i],sizeof(ns_component)*memory_properties.width);
+			}
+		}
+		catch(...){
+			for (unsigned long i = 0; i < memory_properties.height; i++)
+				delete[] temp[i];
+			delete[] temp;
+			throw;
+		}
+		delete[] buffer;
+		delete mapping;
+		mapping = 0;
+		buffer = temp;
+	}
+
 	//transfers the contents of one buffer to another, emptying the first.
 	void give_buffer_to_new_object(ns_image_stream_static_offset_buffer<ns_component> & n){
 
@@ -201,11 +247,13 @@ public:
 
 		//transfer the new buffer
 		n.buffer = buffer;
+		n.mapping = mapping;
 		n.memory_properties = memory_properties;
 		n.content_properties = content_properties;
 
 		//remove previous reference to new buffer
 		buffer = 0;
+		mapping = 0;
 		memory_properties = content_properties = ns_image_stream_buffer_properties(0,0);
 	}
 	~ns_image_stream_static_offset_buffer(){
@@ -214,9 +262,7 @@ public:
 			ns_high_precision_timer tp;
 			tp.start();
 			#endif
-			for (unsigned int i = 0; i < memory_properties.height; i++)
-				delete[] buffer[i];
-			delete[] buffer;
+			delete_buffer();
 			#ifdef NS_TRACK_PERFORMANCE_STATISTICS
 			ns_image_allocation_performance_stats.register_job_duration(ns_performance_statistics_analyzer::ns_image_deallocation,tp.stop());
 			#endif
@@ -225,6 +271,7 @@ public:
 
 	ns_image_stream_static_offset_buffer(const ns_image_stream_static_offset_buffer & buf){
 		buffer = 0;
+		mapping = 0;
 		create_buffer(buf.content_properties);
 		for (unsigned int y = 0; y < buf.content_properties.height; y++)
 			for (unsigned int x = 0; x < buf.content_properties.width; x++)
@@ -235,6 +282,21 @@ public:
 private:
 	ns_component ** buffer;
 	mutable long offset;
+	//if non-zero, lines point into this file rather than to individual heap allocations
+	ns_memory_mapped_file * mapping;
+
+	void delete_buffer(){
+		if (buffer == 0)
+			return;
+		if (mapping == 0){
+			for (unsigned int i = 0; i < memory_properties.height; i++)
+				delete[] buffer[i];
+		}
+		delete[] buffer;
+		buffer = 0;
+		delete mapping;
+		mapping = 0;
+	}
 protected:
 	ns_image_stream_buffer_properties content_properties,memory_properties;
 	void create_buffer(const ns_image_stream_buffer_properties & p){
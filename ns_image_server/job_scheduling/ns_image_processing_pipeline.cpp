@@ -673,10 +673,10 @@ void ns_image_processing_pipeline::process_region(const ns_image_server_captured
 				
 
 					//output an uncompressed spatially averaged copy to disk.
-					ns_image_server_image output_image = region_image.create_storage_for_processed_image(ns_process_spatial,ns_tiff,&sql);
+					ns_image_server_image output_image = region_image.create_storage_for_processed_image(ns_process_spatial,image_server.image_storage.processing_step_image_type(ns_process_spatial),&sql);
 					ns_image_storage_reciever_handle<ns_component> r = image_server.image_storage.request_storage(
 																output_image,
-																ns_tiff, _image_chunk_size,&sql,
+																image_server.image_storage.processing_step_image_type(ns_process_spatial), _image_chunk_size,&sql,
 																had_to_use_volatile_storage,
 																report_file_activity_to_db,
 																allow_use_of_volatile_storage);
@@ -800,10 +800,10 @@ void ns_image_processing_pipeline::process_region(const ns_image_server_captured
 
 				threshold_manager.run( region_image,spatial_average,thresholded,sql,_image_chunk_size);
 			
-				ns_image_server_image output_image =  region_image.create_storage_for_processed_image(ns_process_threshold,ns_tiff,&sql);
+				ns_image_server_image output_image =  region_image.create_storage_for_processed_image(ns_process_threshold,image_server.image_storage.processing_step_image_type(ns_process_threshold),&sql);
 				ns_image_storage_reciever_handle<ns_component> r = image_server.image_storage.request_storage(
 															output_image,
-															ns_tiff, _image_chunk_size,&sql,
+															image_server.image_storage.processing_step_image_type(ns_process_threshold), _image_chunk_size,&sql,
 																had_to_use_volatile_storage,
 																report_file_activity_to_db,
 																allow_use_of_volatile_storage);
@@ -830,10 +830,12 @@ void ns_image_processing_pipeline::process_region(const ns_image_server_captured
 				tm.start();
 			
 				const ns_image_standard * static_mask(0);
+				ns_image_cache<ns_component>::read_handle static_mask_handle;
 				ns_image_server_image static_mask_image( region_image.request_processed_image(ns_process_static_mask,sql));
 				if (static_mask_image.id != 0){
 					cout << "Using a static mask.\n";
-					static_mask = &image_server.image_storage.cache.get_for_read(static_mask_image,sql);
+					static_mask_handle = image_server.image_storage.cache.get_for_read(static_mask_image,sql);
+					static_mask = &static_mask_handle();
 				}
 
 				ns_worm_detector<ns_image_standard> worm_detector;
@@ -1297,7 +1299,7 @@ float ns_image_processing_pipeline::analyze_mask(ns_image_server_image & image,
 	///used for debugging; frees all memory stored on the heap.
 void ns_image_processing_pipeline::clear_heap(){
 	ns_image_properties null(0,0,0);
-	mask_splitter.clear_heap();
+	mask_regions.clear_heap();
 	spatial_averager.init(null);
 
 	dynamic_stretch.init(null);
@@ -1836,26 +1838,14 @@ void ns_image_processing_pipeline::resize_sample_image(ns_image_server_captured_
 	try{
 		captured_image.load_from_db(captured_image.captured_images_id,&sql);
 
-		ns_image_server_image small_image(captured_image.make_small_image_storage(&sql));
-		bool had_to_use_volatile_storage;
-		ns_image_storage_reciever_handle<ns_8_bit> small_image_output(image_server.image_storage.request_storage(small_image,ns_jpeg,1024,&sql,had_to_use_volatile_storage,false,false));
-		
-
-		ns_resampler<ns_8_bit> resampler(_image_chunk_size);
-		resampler.set_maximum_dimentions(ns_image_server_captured_image::small_image_maximum_dimensions());
-		
-		ns_image_stream_binding< ns_resampler<ns_8_bit>, ns_image_storage_reciever<ns_8_bit> > 
-			resampler_binding(resampler,small_image_output.output_stream(),_image_chunk_size);
+		ns_sample_image_thumbnail thumbnail(captured_image,_image_chunk_size,sql);
 		
 		ns_image_server_image source_image;
 		source_image.id = captured_image.capture_images_image_id;
 		ns_image_storage_source_handle<ns_component> source(image_server.image_storage.request_from_storage(source_image,&sql));
-		source.input_stream().pump(resampler_binding,_image_chunk_size);
+		source.input_stream().pump(thumbnail.input(),_image_chunk_size);
 
-		
-		small_image.save_to_db(0,&sql);
-		sql << "UPDATE captured_images SET small_image_id = " << small_image.id << " WHERE id = " << captured_image.captured_images_id;
-		sql.send_query();
+		thumbnail.save(captured_image,sql);
 
 		image_server.performance_statistics.finished_job(ns_process_thumbnail);
 	}
@@ -1866,7 +1856,7 @@ void ns_image_processing_pipeline::resize_sample_image(ns_image_server_captured_
 }
 
 
-void ns_image_processing_pipeline::resize_region_image(ns_image_server_captured_image_region & region_image,ns_sql & sql){
+void ns_captured_image_region_splitter::resize_region_image(ns_image_server_captured_image_region & region_image,ns_sql & sql){
 	region_image.load_from_db(region_image.region_images_id,&sql);
 	//ns_image_server_event ev("ns_image_processing_pipeline::Creating resized region image ");
 
@@ -1893,6 +1883,216 @@ void ns_image_processing_pipeline::resize_region_image(ns_image_server_captured_
 	small_image.mark_as_finished_processing(&sql);
 
 }
+bool ns_captured_image_region_splitter::load_mask_application(ns_image_server_captured_image & captured_image, ns_mask_application & mask_application, ns_sql & sql){
+	captured_image.load_from_db(captured_image.captured_images_id,&sql);
+	mask_application.start_time = ns_current_time();
+	//get mask info from db
+	sql << "SELECT capture_samples.mask_id, image_masks.image_id, capture_samples.apply_vertical_image_registration,image_masks.resize_factor FROM capture_samples LEFT JOIN image_masks ON image_masks.id = capture_samples.mask_id WHERE capture_samples.id = " << captured_image.sample_id;
+	ns_sql_result res;
+	sql.get_rows(res);
+	if (res.size() == 0)
+		throw ns_ex("ns_image_processing_pipeline::Specified sample does not exist in database during mask application.");
+	if (res[0][0] == "" || res[0][0] == "0" || res[0][1] == "")
+		return false;
+	mask_application.mask_id = ns_atoi64(res[0][0].c_str());
+	mask_application.mask_image_id = ns_atoi64(res[0][1].c_str());
+	mask_application.apply_vertical_image_registration = atol(res[0][2].c_str()) != 0;
+//	if (apply_vertical_image_registration)
+//		cerr << "Vertical registration requested\n";
+//	else "Vertical registration not requested\n";
+	mask_application.resize_factor = atol(res[0][3].c_str());
+	//cerr << "Using Resize Factor " << resize_factor << "\n";
+
+	mask_application.delete_captured_image = false;
+	sql << "SELECT delete_captured_images_after_mask FROM experiments WHERE id = " << captured_image.experiment_id;
+	sql.get_rows(res);
+	if(res.size() != 1)
+		throw ns_ex("ns_image_processing_pipeline::apply_mask()::Could not load experiment data from db (") <<  captured_image.experiment_id << ")";
+	mask_application.delete_captured_image = res[0][0] != "0";
+	if (mask_application.delete_captured_image){
+		sql << "SELECT first_frames_are_protected FROM capture_samples WHERE id=" << captured_image.sample_id;
+		sql.get_rows(res);
+
+		if (res.size() == 0)
+			throw ns_ex("ns_image_processing_pipeline::apply_mask()::Could not find sample for specified captured image!") << captured_image.sample_id;
+		
+		if (res[0][0] == "0"){
+			mask_application.delete_captured_image = false;
+			image_server.register_server_event(ns_image_server_event("ns_image_processing_pipeline::apply_mask()::Since no images in this sample have been protected from deletion, this capture image will not be deleted."),&sql);
+		}
+		if (captured_image.never_delete_image){
+			mask_application.delete_captured_image = false;
+			image_server.register_server_event(ns_image_server_event("ns_image_processing_pipeline::apply_mask()::Because this capture image is marked \"Never Delete\", it will not be deleted."),&sql);
+		}
+	}
+	return true;
+}
+
+void ns_captured_image_region_splitter::prepare_region_outputs(ns_image_server_captured_image & captured_image, vector<ns_image_server_captured_image_region> & output_regions, ns_mask_application & mask_application, const ns_vector_2i & registration_offset, ns_sql & sql){
+	output_regions.resize(0);
+	mask_application.output_images.resize(0);
+	mask_splitter.set_resize_factor(mask_application.resize_factor);
+	mask_splitter.mask_info()->load_from_db(mask_application.mask_id,sql);
+	
+	ns_image_server_image mask_image_info;
+	if (!mask_image_info.load_from_db(mask_application.mask_image_id,&sql))
+		throw ns_ex("ns_image_processing_pipeline::Mask ") << mask_application.mask_id << " has no image specified when applying mask.";
+
+	mask_application.mask_image = image_server.image_storage.cache.get_for_read(mask_image_info,sql);
+
+	//obtain output streams for split regions.
+	sql << "SELECT sample_region_image_info.id, sample_region_image_info.name, image_mask_regions.id, image_mask_regions.mask_value FROM image_mask_regions, sample_region_image_info WHERE sample_region_image_info.mask_region_id = image_mask_regions.id AND image_mask_regions.mask_id= '" << mask_application.mask_id << "'";
+	ns_sql_result res;
+	sql.get_rows(res);
+	//the record in the sample_region_image table for each new masked region
+
+	//the record in the images table for each masked region
+	vector<ns_image_server_image> & output_images(mask_application.output_images);
+	const int apply_vertical_image_registration(mask_application.apply_vertical_image_registration?1:0);
+	unsigned long mask_info_size = mask_splitter.mask_info()->size();
+	for (unsigned int i = 0; i < res.size(); i++){
+		unsigned int	mask_region_info_id =	atol(res[i][0].c_str());
+		unsigned int 	mask_region_id =		atol(res[i][2].c_str());
+		int				mask_region_value =		atol(res[i][3].c_str()); // if it could accidentally be < 0 (see below) it ought to be an int
+		string			mask_region_name = res[i][1];
+
+		if (mask_region_value < 0 || mask_region_value > mask_info_size)
+			throw ns_ex("ns_image_processing_pipeline::Invalid mask value specified in mask.");
+		output_regions.resize(output_regions.size()+1);
+		ns_image_server_captured_image_region & new_region_image(output_regions[output_regions.size()-1]);
+
+		sql.send_query("BEGIN");
+		//see if the region has already been created;
+		sql << "SELECT id, image_id FROM sample_region_images WHERE region_info_id = '" << mask_region_info_id << "' AND capture_time = '" << captured_image.capture_time << "'";
+		ns_sql_result out;
+		sql.get_rows(out);
+		ns_image_server_image output_image;
+		output_image.id = 0;
+		//if a record in the sample_region_images table exists, and if so, whether a record in the images table exists as well.
+		if (out.size() != 0){
+			//delete the previous file
+			output_image.id = atol(out[0][1].c_str());
+		//	if (output_image.id != 0)
+		//			image_server.image_storage.delete_from_storage(output_image,sql);
+			//we can use the old image; its filename must be correct.
+			//we can also use the existing region_image record.
+			new_region_image.region_images_id = atol(out[0][0].c_str());
+			new_region_image.region_images_image_id = output_image.id;
+			new_region_image.region_info_id = mask_region_info_id;
+			new_region_image.capture_time = captured_image.capture_time;
+			new_region_image.mask_color = mask_region_value;
+			sql << "UPDATE sample_region_images SET last_modified=" << ns_current_time() << 
+				", capture_sample_image_id = " << captured_image.captured_images_id << ", currently_under_processing=1, vertical_image_registration_applied = " << apply_vertical_image_registration << " WHERE id=" << new_region_image.region_images_id;
+			sql.send_query();
+			//XXX NOTE: Here we might want to delete all previously calculated processing jobs from the record
+			
+		}
+		//create new record in the sample region images table
+		else{
+			
+			sql << "INSERT INTO sample_region_images SET region_info_id = '" << mask_region_info_id << 
+				"', capture_time = '" << captured_image.capture_time << "', last_modified=" << ns_current_time() <<", " <<
+				" capture_sample_image_id = " << captured_image.captured_images_id << ", currently_under_processing=1, vertical_image_registration_applied = " << apply_vertical_image_registration << " ";
+
+			new_region_image.region_images_id = sql.send_query_get_id();
+			sql.send_query("COMMIT");
+		}
+		new_region_image.region_info_id = mask_region_info_id;
+		new_region_image.captured_images_id = captured_image.captured_images_id;
+		new_region_image.sample_id = captured_image.sample_id;
+		new_region_image.experiment_id = captured_image.experiment_id;
+		new_region_image.capture_images_image_id = captured_image.capture_images_image_id;
+		new_region_image.capture_time = captured_image.capture_time;
+		new_region_image.sample_name = captured_image.sample_name;
+		new_region_image.device_name = captured_image.device_name;
+		new_region_image.experiment_name = captured_image.experiment_name;
+		new_region_image.mask_color = mask_region_value;
+
+		//if a record in the images table hasn't been made, make it.
+		if (output_image.id == 0){
+			//create a new image for the region_image image
+			output_image.partition = image_server.image_storage.get_partition_for_experiment(new_region_image.experiment_id,&sql);
+			output_image.path = new_region_image.directory(&sql);
+			output_image.filename = new_region_image.filename(&sql) + ".tif";
+			sql << "INSERT INTO images SET filename = '" << sql.escape_string(output_image.filename) << "', path = '" << sql.escape_string(output_image.path) 
+				<< "', creation_time=" << captured_image.capture_time << ", host_id = " << image_server.host_id() << ", `partition` = '" << output_image.partition << "' ";
+			output_image.id = sql.send_query_get_id();
+			new_region_image.region_images_image_id = output_image.id;
+			sql << "UPDATE sample_region_images SET image_id = " << output_image.id << " WHERE id= " << new_region_image.region_images_id ;
+			sql.send_query();
+			sql.send_query("COMMIT");
+		}
+		//get storage for the output image.
+		bool had_to_use_volatile_storage;
+		(*mask_splitter.mask_info())[mask_region_value]->reciever = image_server.image_storage.request_storage(output_image,ns_tiff,_image_chunk_size,&sql,had_to_use_volatile_storage,false,false);
+		(*mask_splitter.mask_info())[mask_region_value]->reciever_provided = true;
+		output_images.push_back(output_image);
+	}
+	sql.send_query("COMMIT");
+	mask_splitter.specify_mask(mask_application.mask_image());
+	//if the whole image is shifted down in relation to the reference image
+	//we need to shift the mask up to compensate!
+	mask_splitter.specify_registration_offset(registration_offset*-1);
+	//we collect image statistics, such as average intensity, from the images
+	mask_splitter.specificy_sample_image_statistics(mask_application.sample_image_statistics);
+}
+
+void ns_captured_image_region_splitter::finish_applying_mask(ns_image_server_captured_image & captured_image, vector<ns_image_server_captured_image_region> & output_regions, ns_mask_application & mask_application, ns_sql & sql){
+	//mark all regions as processed.
+	for (unsigned int i = 0; i < output_regions.size(); i++){
+		(*mask_splitter.mask_info())[output_regions[i].mask_color]->image_stats.calculate_statistics_from_histogram();
+		ns_64_bit image_stats_db_id(0);
+		(*mask_splitter.mask_info())[output_regions[i].mask_color]->image_stats.submit_to_db(image_stats_db_id,sql,true,false);
+		sql << "UPDATE sample_region_images SET currently_under_processing=0, image_statistics_id=" << image_stats_db_id << " WHERE id= " << output_regions[i].region_images_id ;
+		sql.send_query();
+	}
+	//update movement records to include the new regions
+	//ns_movement_database_maintainer m;
+	//m.create_movement_tables_for_masked_region_images(captured_image,output_regions,sql);
+
+	if (mask_application.delete_captured_image){
+		image_server.image_storage.delete_from_storage(captured_image,ns_delete_long_term,&sql);
+		sql << "UPDATE captured_images SET image_id = 0 WHERE id = " << captured_image.captured_images_id;
+		sql.send_query();
+		sql << "DELETE FROM images WHERE id = " << captured_image.capture_images_image_id;
+		sql.send_query();
+	}
+	
+	//make region thumbnails
+	for (unsigned int i = 0; i < output_regions.size(); i++){
+		try{
+			resize_region_image(output_regions[i],sql);
+		}
+		catch(ns_ex & ex){
+			unsigned long ev(image_server.register_server_event(ex,&sql));
+			output_regions[i].mark_as_problem(&sql,ev);
+		}
+	}
+
+	//once the files are written, mark them as so in the db
+	for (unsigned int i = 0; i < mask_application.output_images.size(); i++)
+		mask_application.output_images[i].mark_as_finished_processing(&sql);
+
+	mask_application.sample_image_statistics.calculate_statistics_from_histogram();
+	ns_64_bit sample_stats_db_id(0);
+	mask_application.sample_image_statistics.submit_to_db(sample_stats_db_id,sql);
+	sql << "UPDATE captured_images SET mask_applied=1, image_statistics_id=" << sample_stats_db_id << " WHERE id= " << captured_image.captured_images_id;
+	sql.send_query();
+	sql.send_query("COMMIT");
+	mask_application.mask_image.release();
+}
+
+void ns_captured_image_region_splitter::remove_region_images(const vector<ns_image_server_captured_image_region> & output_regions, ns_sql & sql){
+	mask_splitter.abandon();
+	for (unsigned int i = 0; i < output_regions.size(); i++){
+		sql << "DELETE images FROM images, sample_region_images WHERE sample_region_images.id= " << output_regions[i].region_images_id << " AND sample_region_images.image_id = images.id";
+		sql.send_query();
+		sql << "DELETE from sample_region_images WHERE id= " << output_regions[i].region_images_id ;
+		sql.send_query();
+	}
+	sql.send_query("COMMIT");
+}
+
 void ns_image_processing_pipeline::apply_mask(ns_image_server_captured_image & captured_image, 
 		vector<ns_image_server_captured_image_region> & output_regions, ns_sql & sql){
 
@@ -1906,68 +2106,9 @@ void ns_image_processing_pipeline::apply_mask(ns_image_server_captured_image & c
 		ev.specify_processing_job_operation(ns_process_apply_mask);
 		unsigned long event_id = image_server.register_server_event(ev,&sql);
 			
-		captured_image.load_from_db(captured_image.captured_images_id,&sql);
-		bool delete_captured_image(false);
-		{
-			sql << "SELECT delete_captured_images_after_mask FROM experiments WHERE id = " << captured_image.experiment_id;
-			ns_sql_result res;
-			sql.get_rows(res);
-			if(res.size() != 1)
-				throw ns_ex("ns_image_processing_pipeline::apply_mask()::Could not load experiment data from db (") <<  captured_image.experiment_id << ")";
-			delete_captured_image = res[0][0] != "0";
-			if (delete_captured_image){
-				sql << "SELECT first_frames_are_protected FROM capture_samples WHERE id=" << captured_image.sample_id;
-				sql.get_rows(res);
-
-				if (res.size() == 0)
-					throw ns_ex("ns_image_processing_pipeline::apply_mask()::Could not find sample for specified captured image!") << captured_image.sample_id;
-				
-				if (res[0][0] == "0"){
-					delete_captured_image = false;
-					image_server.register_server_event(ns_image_server_event("ns_image_processing_pipeline::apply_mask()::Since no images in this sample have been protected from deletion, this capture image will not be deleted."),&sql);
-				}
-				if (delete_captured_image && captured_image.capture_images_small_image_id == 0){
-					image_server.register_server_event(ns_image_server_event("ns_image_processing_pipeline::apply_mask()::Attempting to create a small resized copy of the image before masking"),&sql);
-					try{
-						resize_sample_image(captured_image,sql);
-					}
-					catch(ns_ex & ex_){
-						delete_captured_image = false;
-						throw ns_ex("While masking::") << ex_.text() << ex_.type();
-					}
-					catch(...){
-						delete_captured_image = false;
-						throw;
-					}
-				}
-				if (captured_image.never_delete_image){
-					delete_captured_image = false;
-					image_server.register_server_event(ns_image_server_event("ns_image_processing_pipeline::apply_mask()::Because this capture image is marked \"Never Delete\", it will not be deleted."),&sql);
-				}
-			}
-		}
-
-		
-		unsigned long start_time = ns_current_time();
-		//get mask info from db
-		sql << "SELECT capture_samples.mask_id, image_masks.image_id, capture_samples.apply_vertical_image_registration,image_masks.resize_factor FROM capture_samples, image_masks WHERE image_masks.id = capture_samples.mask_id AND capture_samples.id = " << captured_image.sample_id;
-		ns_sql_result res;
-		sql.get_rows(res);
-		if (res.size() == 0)
-			throw ns_ex("ns_image_processing_pipeline::Specified sample does not exist in database during mask application.");
-		if (res[0][0] == "" || res[0][0] == "0")
+		ns_mask_application mask_application;
+		if (!mask_regions.load_mask_application(captured_image,mask_application,sql))
 			throw ns_ex("ns_image_processing_pipeline::Specified sample '") << captured_image.sample_name << "'(" << captured_image.sample_id << ") does have mask set.";
-		unsigned long mask_id = atol(res[0][0].c_str()),
-					  mask_image_id = atol(res[0][1].c_str()),
-					  apply_vertical_image_registration = atol(res[0][2].c_str());
-	//	if (apply_vertical_image_registration)
-	//		cerr << "Vertical registration requested\n";
-	//	else "Vertical registration not requested\n";
-		unsigned long resize_factor = atol(res[0][3].c_str());
-
-		//cerr << "Using Resize Factor " << resize_factor << "\n";
-		mask_splitter.set_resize_factor(resize_factor);
-		
 
 		//load captured image that will be masked
 		//ns_image_whole<ns_component> source_im;
@@ -1976,14 +2117,37 @@ void ns_image_processing_pipeline::apply_mask(ns_image_server_captured_image & c
 		ns_image_server_image source_image;
 		source_image.id = captured_image.capture_images_image_id;
 		
-
+		//The captured image is read from long term storage only once.  Every consumer of the image--
+		//registration, the small image, the region images, and the image statistics--is fed from that single read.
+		//The small image is made in the same pass if one does not already exist.
+		//A failure to make the small image does not stop the image from being masked, but the image is then kept.
+		ns_acquire_for_scope<ns_sample_image_thumbnail> thumbnail;
+		ns_ex thumbnail_error;
+		bool thumbnail_failed(false);
+		if (captured_image.capture_images_small_image_id == 0){
+			try{
+				thumbnail.attach(new ns_sample_image_thumbnail(captured_image,_image_chunk_size,sql));
+			}
+			catch(ns_ex & ex){
+				thumbnail_error = ex;
+				thumbnail_failed = true;
+			}
+		}
+		ns_image_stream_fan_out<ns_component> additional_outputs(_image_chunk_size);
+		if (thumbnail.is_null() == false)
+			additional_outputs.add_optional_output(thumbnail().input(),thumbnail_error,thumbnail_failed);
 		
 		ns_vector_2i offset = ns_vector_2i(0,0);
 		ns_disk_buffered_image_registration_profile *profile(0);
-		bool delete_registration_profile_after_use;
-		if (apply_vertical_image_registration){
-			offset = get_vertical_registration(captured_image,source_image,sql,&profile,delete_registration_profile_after_use);
+		bool delete_registration_profile_after_use(false);
+		if (mask_application.apply_vertical_image_registration)
+			offset = get_vertical_registration(captured_image,source_image,sql,&profile,delete_registration_profile_after_use,&additional_outputs);
+		
+		//if the image was read to calculate its registration, the additional outputs have already recieved it.
+		if (delete_registration_profile_after_use)
+			additional_outputs.clear_outputs();
 
+		if (profile != 0){
 			//we don't need to load the image again from long term storage--we have a cached version here!
 			//profile->whole_image.seek_to_beginning();
 			source_im = &profile->whole_image;
@@ -1999,141 +2163,19 @@ void ns_image_processing_pipeline::apply_mask(ns_image_server_captured_image & c
 			source_im = &new_image_buffer();
 		}
 		
-		mask_splitter.mask_info()->load_from_db(mask_id,sql);
-		
-		ns_image_server_image mask_image_info;
-		if (!mask_image_info.load_from_db(mask_image_id,&sql))
-			throw ns_ex("ns_image_processing_pipeline::Mask ") << mask_id << " has no image specified when applying mask.";
-
-	
-		const ns_image_whole<ns_component> &mask_image(image_server.image_storage.cache.get_for_read(mask_image_info,sql));
-	
-		//obtain output streams for split regions.
-		sql << "SELECT sample_region_image_info.id, sample_region_image_info.name, image_mask_regions.id, image_mask_regions.mask_value FROM image_mask_regions, sample_region_image_info WHERE sample_region_image_info.mask_region_id = image_mask_regions.id AND image_mask_regions.mask_id= '" << mask_id << "'";
-		sql.get_rows(res);
-		//the record in the sample_region_image table for each new masked region
-
-		//the record in the images table for each masked region
-		vector<ns_image_server_image> output_images;
-		unsigned long mask_info_size = mask_splitter.mask_info()->size();
-		for (unsigned int i = 0; i < res.size(); i++){
-			unsigned int	mask_region_info_id =	atol(res[i][0].c_str());
-			unsigned int 	mask_region_id =		atol(res[i][2].c_str());
-			int				mask_region_value =		atol(res[i][3].c_str()); // if it could accidentally be < 0 (see below) it ought to be an int
-			string			mask_region_name = res[i][1];
-
-			if (mask_region_value < 0 || mask_region_value > mask_info_size)
-				throw ns_ex("ns_image_processing_pipeline::Invalid mask value specified in mask.");
-			output_regions.resize(output_regions.size()+1);
-			ns_image_server_captured_image_region & new_region_image(output_regions[output_regions.size()-1]);
-
-			sql.send_query("BEGIN");
-			//see if the region has already been created;
-			sql << "SELECT id, image_id FROM sample_region_images WHERE region_info_id = '" << mask_region_info_id << "' AND capture_time = '" << captured_image.capture_time << "'";
-			ns_sql_result out;
-			sql.get_rows(out);
-			ns_image_server_image output_image;
-			output_image.id = 0;
-			//if a record in the sample_region_images table exists, and if so, whether a record in the images table exists as well.
-			if (out.size() != 0){
-				//delete the previous file
-				output_image.id = atol(out[0][1].c_str());
-			//	if (output_image.id != 0)
-			//			image_server.image_storage.delete_from_storage(output_image,sql);
-				//we can use the old image; its filename must be correct.
-				//we can also use the existing region_image record.
-				new_region_image.region_images_id = atol(out[0][0].c_str());
-				new_region_image.region_images_image_id = output_image.id;
-				new_region_image.region_info_id = mask_region_info_id;
-				new_region_image.capture_time = captured_image.capture_time;
-				new_region_image.mask_color = mask_region_value;
-				sql << "UPDATE sample_region_images SET last_modified=" << ns_current_time() << 
-					", capture_sample_image_id = " << captured_image.captured_images_id << ", currently_under_processing=1, vertical_image_registration_applied = " << apply_vertical_image_registration << " WHERE id=" << new_region_image.region_images_id;
-				sql.send_query();
-				//XXX NOTE: Here we might want to delete all previously calculated processing jobs from the record
-				
-			}
-			//create new record in the sample region images table
-			else{
-				
-				sql << "INSERT INTO sample_region_images SET region_info_id = '" << mask_region_info_id << 
-					"', capture_time = '" << captured_image.capture_time << "', last_modified=" << ns_current_time() <<", " <<
-					" capture_sample_image_id = " << captured_image.captured_images_id << ", currently_under_processing=1, vertical_image_registration_applied = " << apply_vertical_image_registration << " ";
-
-				new_region_image.region_images_id = sql.send_query_get_id();
-				sql.send_query("COMMIT");
-			}
-			new_region_image.region_info_id = mask_region_info_id;
-			new_region_image.captured_images_id = captured_image.captured_images_id;
-			new_region_image.sample_id = captured_image.sample_id;
-			new_region_image.experiment_id = captured_image.experiment_id;
-			new_region_image.capture_images_image_id = captured_image.capture_images_image_id;
-			new_region_image.capture_time = captured_image.capture_time;
-			new_region_image.sample_name = captured_image.sample_name;
-			new_region_image.device_name = captured_image.device_name;
-			new_region_image.experiment_name = captured_image.experiment_name;
-			new_region_image.mask_color = mask_region_value;
-
-			//if a record in the images table hasn't been made, make it.
-			if (output_image.id == 0){
-				//create a new image for the region_image image
-				output_image.partition = image_server.image_storage.get_partition_for_experiment(new_region_image.experiment_id,&sql);
-				output_image.path = new_region_image.directory(&sql);
-				output_image.filename = new_region_image.filename(&sql) + ".tif";
-				sql << "INSERT INTO images SET filename = '" << sql.escape_string(output_image.filename) << "', path = '" << sql.escape_string(output_image.path) 
-					<< "', creation_time=" << captured_image.capture_time << ", host_id = " << image_server.host_id() << ", `partition` = '" << output_image.partition << "' ";
-				output_image.id = sql.send_query_get_id();
-				new_region_image.region_images_image_id = output_image.id;
-				sql << "UPDATE sample_region_images SET image_id = " << output_image.id << " WHERE id= " << new_region_image.region_images_id ;
-				sql.send_query();
-				sql.send_query("COMMIT");
-			}
-			//get storage for the output image.
-			bool had_to_use_volatile_storage;
-			(*mask_splitter.mask_info())[mask_region_value]->reciever = image_server.image_storage.request_storage(output_image,ns_tiff,_image_chunk_size,&sql,had_to_use_volatile_storage,false,false);
-			(*mask_splitter.mask_info())[mask_region_value]->reciever_provided = true;
-			output_images.push_back(output_image);
-		}
-		sql.send_query("COMMIT");
-		mask_splitter.specify_mask(mask_image);
-		//if the whole image is shifted down in relation to the reference image
-		//we need to shift the mask up to compensate!
-		mask_splitter.specify_registration_offset(offset*-1);
-		//we collect image statistics, such as average intensity, from the images
-		ns_image_statistics sample_image_statistics;
-		mask_splitter.specificy_sample_image_statistics(sample_image_statistics);
+		mask_regions.prepare_region_outputs(captured_image,output_regions,mask_application,offset,sql);
 
 		try{
-			source_im->pump(&mask_splitter,_image_chunk_size);
-
-			//mark all regions as processed.
-			for (unsigned int i = 0; i < output_regions.size(); i++){
-				(*mask_splitter.mask_info())[output_regions[i].mask_color]->image_stats.calculate_statistics_from_histogram();
-				ns_64_bit image_stats_db_id(0);
-				(*mask_splitter.mask_info())[output_regions[i].mask_color]->image_stats.submit_to_db(image_stats_db_id,sql,true,false);
-				sql << "UPDATE sample_region_images SET currently_under_processing=0, image_statistics_id=" << image_stats_db_id << " WHERE id= " << output_regions[i].region_images_id ;
-				sql.send_query();
-			}
-			if (delete_registration_profile_after_use){
-				profile->cleanup(&image_server.image_storage);
-				delete profile;
-			}
-			//update movement records to include the new regions
-			//ns_movement_database_maintainer m;
-			//m.create_movement_tables_for_masked_region_images(captured_image,output_regions,sql);
-
-			if (delete_captured_image){
-				image_server.image_storage.delete_from_storage(captured_image,ns_delete_long_term,&sql);
-				sql << "UPDATE captured_images SET image_id = 0 WHERE id = " << captured_image.captured_images_id;
-				sql.send_query();
-				sql << "DELETE FROM images WHERE id = " << captured_image.capture_images_image_id;
-				sql.send_query();
+			if (additional_outputs.empty())
+				source_im->pump(&mask_regions.region_splitter(),_image_chunk_size);
+			else{
+				additional_outputs.add_output(mask_regions.region_splitter());
+				source_im->pump(&additional_outputs,_image_chunk_size);
 			}
-
 		}
 		catch (ns_ex & ex){
-
-			
+			//the region writers may still be running
+			mask_regions.region_splitter().abandon();
 			if (delete_registration_profile_after_use){
 				profile->cleanup(&image_server.image_storage);
 				delete profile;
@@ -2143,43 +2185,36 @@ void ns_image_processing_pipeline::apply_mask(ns_image_server_captured_image & c
 			if (ex.type() == ns_file_io){
 				unsigned long event_id = image_server.register_server_event(ex,&sql);
 				captured_image.mark_as_problem(&sql,event_id);
-				for (unsigned int i = 0; i < output_regions.size(); i++){
-					sql << "DELETE images FROM images, sample_region_images WHERE sample_region_images.id= " << output_regions[i].region_images_id << " AND sample_region_images.image_id = images.id";
-					sql.send_query();
-					sql << "DELETE from sample_region_images WHERE id= " << output_regions[i].region_images_id ;
-					sql.send_query();
-				}
-				sql.send_query("COMMIT");
+				mask_regions.remove_region_images(output_regions,sql);
 				return;
 			}
 			else throw ex;
 		}
-		
-		//make region thumbnails
-		for (unsigned int i = 0; i < output_regions.size(); i++){
+		if (delete_registration_profile_after_use){
+			profile->cleanup(&image_server.image_storage);
+			delete profile;
+		}
+
+		if (thumbnail.is_null() == false && !thumbnail_failed){
 			try{
-				resize_region_image(output_regions[i],sql);
+				thumbnail().save(captured_image,sql);
 			}
 			catch(ns_ex & ex){
-				unsigned long ev(image_server.register_server_event(ex,&sql));
-				output_regions[i].mark_as_problem(&sql,ev);
+				thumbnail_error = ex;
+				thumbnail_failed = true;
 			}
 		}
+		if (thumbnail_failed){
+			image_server.register_server_event(ns_image_server_event("ns_image_processing_pipeline::apply_mask()::Could not create a small resized copy of the image, so it will not be deleted: ") << thumbnail_error.text(),&sql);
+			mask_application.delete_captured_image = false;
+		}
 
-
-		//once the files are written, mark them as so in the db
-		for (unsigned int i = 0; i < output_images.size(); i++)
-			output_images[i].mark_as_finished_processing(&sql);
-
-		sample_image_statistics.calculate_statistics_from_histogram();
-		ns_64_bit sample_stats_db_id(0);
-		sample_image_statistics.submit_to_db(sample_stats_db_id,sql);
-		sql << "UPDATE captured_images SET mask_applied=1, image_statistics_id=" << sample_stats_db_id << " WHERE id= " << captured_image.captured_images_id;
-		sql.send_query();
-		sql.send_query("COMMIT");
+		//Once the captured image has been deleted the regions are the only copy of it,
+		//so they are finished outside of the handler above, which removes them.
+		mask_regions.finish_applying_mask(captured_image,output_regions,mask_application,sql);
 		
 		unsigned long stop_time = ns_current_time();
-		ev.specify_processing_duration(stop_time - start_time);
+		ev.specify_processing_duration(stop_time - mask_application.start_time);
 //		image_server.update_registered_server_event(event_id,ev);
 		image_server.performance_statistics.finished_job(ns_process_apply_mask);
 	}
@@ -2617,8 +2652,10 @@ bool ns_image_processing_pipeline::check_for_precalculated_registration(const ns
 	return false;
 }
 
-ns_vector_2i ns_image_processing_pipeline::get_vertical_registration(const ns_image_server_captured_image & captured_image, ns_image_server_image & source, ns_sql & sql,ns_disk_buffered_image_registration_profile ** requested_image,bool & delete_profile_after_use){
+ns_vector_2i ns_image_processing_pipeline::get_vertical_registration(const ns_image_server_captured_image & captured_image, ns_image_server_image & source, ns_sql & sql,ns_disk_buffered_image_registration_profile ** requested_image,bool & delete_profile_after_use,ns_image_stream_fan_out<ns_component> * additional_outputs){
 	ns_vector_2i registration_offset;
+	*requested_image = 0;
+	delete_profile_after_use = false;
 	if (check_for_precalculated_registration(captured_image,registration_offset,sql)){
 	//	cerr << "Using existing vertical registration\n";
 		return registration_offset;
@@ -2684,13 +2721,16 @@ ns_vector_2i ns_image_processing_pipeline::get_vertical_registration(const ns_im
 		cerr << "Downsampling subject image...";
 		*requested_image = new ns_disk_buffered_image_registration_profile;
 		cerr << "\n";
-		(*requested_image)->prepare_images(source,500,sql,&image_server.image_storage,reference_image_profile->downsampling_factor);
+		(*requested_image)->prepare_images(source,500,sql,&image_server.image_storage,reference_image_profile->downsampling_factor,additional_outputs);
 	}
 //cerr << "cache subject: " << t.stop()/1000.0/1000.0 << "\n";
 	
 	image_server.register_server_event(ns_image_server::ns_register_in_central_db,ns_image_server_event("Aligning sample image to reference image."));
 	t.start();
-	ns_vector_2i offset(ns_image_registration<127,ns_8_bit>::register_full_images(*reference_image_profile,**requested_image,ns_vector_2i(400,400)));
+	ns_vector_2i offset;
+	if (image_server.image_registration_method() == ns_fft_registration)
+		offset = ns_image_registration<127,ns_8_bit>::register_fft_images(*reference_image_profile,**requested_image,ns_vector_2i(400,400));
+	else offset = ns_image_registration<127,ns_8_bit>::register_full_images(*reference_image_profile,**requested_image,ns_vector_2i(400,400));
 	//cerr << "Total Registration time: " << t.stop()/1000.0/1000.0 << "\n";
 	//exit(0);
 	//cerr << "Alignment: " << offset.x << "," << offset.y << "\n";
@@ -6,6 +6,7 @@
 #include "ns_worm_detector.h"
 #include "ns_spatial_avg.h"
 #include "ns_image_tools.h"
+#include "ns_resampler.h"
 #include "ns_image_server.h"
 #include "ns_worm_detection_constants.h"
 #include "ns_worm_detector.h"
@@ -56,11 +57,11 @@ struct ns_precomputed_processing_step_images{
 		images[i].id = 0;
 	}
 
-	///loads from disk the precomputed image for the specified processing task
+	///loads from disk the precomputed image for the specified processing task.
+	///Images that have been loaded before are memory mapped from an uncompressed copy in the local cache.
 	template<class ns_image_t, class ns_component>
 	void load_image(const ns_processing_task & i, ns_image_t & image,ns_sql & sql){
-		ns_image_storage_source_handle<ns_component> precomp = image_server.image_storage.request_from_storage(images[i],&sql);
-		precomp.input_stream().pump(image,512);
+		image_server.image_storage.request_mapped_image_from_storage<ns_component>(images[i],image,&sql);
 	}
 	bool worm_detection_needs_to_be_performed;
 private:
@@ -129,11 +130,11 @@ public:
 
 
 					//might as well save the long's spatial average so it doesn't have to be re-calculated
-					ns_image_server_image output_image = long_time_point.create_storage_for_processed_image(ns_process_spatial,ns_tiff,&sql);
+					ns_image_server_image output_image = long_time_point.create_storage_for_processed_image(ns_process_spatial,image_server.image_storage.processing_step_image_type(ns_process_spatial),&sql);
 					bool had_to_use_volatile_storage;
 					ns_image_storage_reciever_handle<ns_component> r = image_server.image_storage.request_storage(
 																output_image,
-																ns_tiff, _image_chunk_size,&sql,had_to_use_volatile_storage,false,false);
+																image_server.image_storage.processing_step_image_type(ns_process_spatial), _image_chunk_size,&sql,had_to_use_volatile_storage,false,false);
 					long_spatial.pump(r.output_stream(),_image_chunk_size);
 				}
 
@@ -222,6 +223,77 @@ class ns_lifespan_curve_cache{
 };
 
 
+///Creates the small copy of a captured image from the lines sent to input(), so that it can be made
+///during any other pass through the captured image.
+class ns_sample_image_thumbnail{
+public:
+	ns_sample_image_thumbnail(ns_image_server_captured_image & captured_image, const unsigned long chunk_size, ns_sql & sql):
+	  small_image(captured_image.make_small_image_storage(&sql)),
+	  small_image_output(image_server.image_storage.request_storage(small_image,ns_jpeg,1024,&sql,had_to_use_volatile_storage,false,false)),
+	  resampler(chunk_size),
+	  resampler_binding(resampler,small_image_output.output_stream(),chunk_size){
+		resampler.set_maximum_dimentions(ns_image_server_captured_image::small_image_maximum_dimensions());
+	}
+	ns_image_stream_binding< ns_resampler<ns_8_bit>, ns_image_storage_reciever<ns_8_bit> > & input(){return resampler_binding;}
+
+	///records the small image in the db once the whole captured image has been sent to input()
+	void save(ns_image_server_captured_image & captured_image, ns_sql & sql){
+		small_image.save_to_db(0,&sql);
+		sql << "UPDATE captured_images SET small_image_id = " << small_image.id << " WHERE id = " << captured_image.captured_images_id;
+		sql.send_query();
+		captured_image.capture_images_small_image_id = small_image.id;
+	}
+private:
+	bool had_to_use_volatile_storage;
+	ns_image_server_image small_image;
+	ns_image_storage_reciever_handle<ns_8_bit> small_image_output;
+	ns_resampler<ns_8_bit> resampler;
+	ns_image_stream_binding< ns_resampler<ns_8_bit>, ns_image_storage_reciever<ns_8_bit> > resampler_binding;
+};
+
+///Holds what is needed to split a captured image into its regions between the steps of ns_image_processing_pipeline::apply_mask().
+struct ns_mask_application{
+	ns_mask_application():mask_id(0),mask_image_id(0),resize_factor(0),apply_vertical_image_registration(false),delete_captured_image(false),start_time(0){}
+	ns_64_bit mask_id,
+			  mask_image_id;
+	unsigned long resize_factor;
+	bool apply_vertical_image_registration,
+		 delete_captured_image;
+	unsigned long start_time;
+	//the record in the images table for each masked region
+	std::vector<ns_image_server_image> output_images;
+	ns_image_statistics sample_image_statistics;
+	ns_image_cache<ns_8_bit>::read_handle mask_image;
+};
+
+///Splits a captured image into its region images using its sample's mask.
+///ns_image_processing_pipeline::apply_mask() is built from the steps below, which are kept separate from the rest of the pipeline
+///so that a captured image can also be split into its regions while it is being read for another purpose (see ns_image_capture_data_manager)
+///without allocating everything else the pipeline uses.
+class ns_captured_image_region_splitter{
+public:
+	typedef ns_8_bit ns_component;
+	ns_captured_image_region_splitter(const unsigned long image_chunk_size):_image_chunk_size(image_chunk_size),mask_splitter(image_chunk_size){}
+
+	///Returns false if the captured image's sample has no mask.
+	bool load_mask_application(ns_image_server_captured_image & captured_image, ns_mask_application & mask_application, ns_sql & sql);
+	///Creates the records and storage for each region image, after which the captured image should be sent to region_splitter().
+	void prepare_region_outputs(ns_image_server_captured_image & captured_image, std::vector<ns_image_server_captured_image_region> & output_regions, ns_mask_application & mask_application, const ns_vector_2i & registration_offset, ns_sql & sql);
+	ns_image_stream_mask_splitter<ns_component, ns_image_storage_reciever<ns_component> > & region_splitter(){return mask_splitter;}
+	///Records the region images and the captured image's statistics once the whole captured image has been sent to region_splitter().
+	void finish_applying_mask(ns_image_server_captured_image & captured_image, std::vector<ns_image_server_captured_image_region> & output_regions, ns_mask_application & mask_application, ns_sql & sql);
+	///Removes the records of region images that could not be written, for example because the captured image could not be read.
+	///Any region writers left running by the failed image are stopped first.
+	void remove_region_images(const std::vector<ns_image_server_captured_image_region> & output_regions, ns_sql & sql);
+	void resize_region_image(ns_image_server_captured_image_region & region,ns_sql & sql);
+
+	///used for debugging; frees all memory stored on the heap.
+	void clear_heap(){mask_splitter.clear_heap();}
+private:
+	unsigned long _image_chunk_size;
+	ns_image_stream_mask_splitter<ns_component, ns_image_storage_reciever<ns_component> > mask_splitter;
+};
+
 ///ns_image_processing_pipline takes images and performs a series of image-processing steps on them.
 ///Actual processing steps are implemented elsewhere, so ns_image_processing_pipeline's job is mainly
 ///to manage database records of tasks performed and coordinate correct ordering and storage of steps.
@@ -233,7 +305,7 @@ public:
 	ns_image_processing_pipeline(const unsigned int image_chunk_size):
 		_image_chunk_size(image_chunk_size),
 		spatial_averager(image_chunk_size,ns_image_processing_pipeline_spatial_average_kernal_width),
-		mask_splitter(image_chunk_size),
+		mask_regions(image_chunk_size),
 		threshold_applier(image_chunk_size),
 		mask_analyzer(image_chunk_size){}
 
@@ -292,8 +364,9 @@ public:
 	///Takes the image and applies the appropriate mask to make a series of region images.  The resulting images are saved to disk
 	///and annotated in the database.
 	void apply_mask(ns_image_server_captured_image & captured_image,std::vector<ns_image_server_captured_image_region> & output_regions, ns_sql & sql);
+
 	void resize_sample_image(ns_image_server_captured_image & captured_image, ns_sql & sql);
-	void resize_region_image(ns_image_server_captured_image_region & region,ns_sql & sql);
+	void resize_region_image(ns_image_server_captured_image_region & region,ns_sql & sql){mask_regions.resize_region_image(region,sql);}
 	static void register_event(const ns_processing_task & task, const ns_image_properties & properties, const ns_image_server_event & source_event,const bool precomputed,ns_sql & sql);
 	static void register_event(const ns_processing_task & task, const ns_image_server_event & source_event,const bool precomputed,ns_sql & sql);
 
@@ -315,7 +388,7 @@ private:
 					operations[ns_process_add_to_training_set]);
 	}
 
-	ns_image_stream_mask_splitter<ns_component, ns_image_storage_reciever<ns_component> > mask_splitter;
+	ns_captured_image_region_splitter mask_regions;
 
 	ns_spatial_median_calculator<ns_component,true> spatial_averager;
 
@@ -348,7 +421,9 @@ private:
 	//Confirmst that the specified operations are possible to calculate, and locates any steps that can be loaded from disk rather than re-computed.
 	void analyze_operations(const ns_image_server_captured_image_region & region_image, std::vector<char> & operations, ns_precomputed_processing_step_images & precomputed_images, ns_sql & sql);
 
-	ns_vector_2i get_vertical_registration(const ns_image_server_captured_image & captured_image, ns_image_server_image & source, ns_sql & sql,ns_disk_buffered_image_registration_profile ** requested_image,bool & delete_profile_after_use);
+	//If the sample image must be read to calculate its registration, it is also sent to additional_outputs (if specified)
+	//and delete_profile_after_use is set to true.
+	ns_vector_2i get_vertical_registration(const ns_image_server_captured_image & captured_image, ns_image_server_image & source, ns_sql & sql,ns_disk_buffered_image_registration_profile ** requested_image,bool & delete_profile_after_use,ns_image_stream_fan_out<ns_component> * additional_outputs=0);
 	//ns_vector_2i get_vertical_registration(const ns_image_server_captured_image & captured_image, const ns_image_whole<ns_component> & image, ns_sql & sql);
 	bool check_for_precalculated_registration(const ns_image_server_captured_image & captured_image, ns_vector_2i & registration_offset, ns_sql & sql);
 	//ns_vector_2i run_vertical_registration(const ns_image_server_captured_image & captured_image, const ns_image_whole<ns_component> & image, ns_sql & sql);
@@ -786,6 +786,8 @@ bool ns_processing_job_maintenance_processor::run_job(ns_sql & sql) {
 		//	o() << "\n";
 			
 			const bool skip_inferred_worm_analysis(image_server->get_cluster_constant_value("skip_inferred_worm_analysis","false",&sql) != "false");
+			//reuse the work done the last time the region was solved, so only recently captured images need to be processed
+			const bool incremental_time_path_solving(image_server->get_cluster_constant_value("incremental_time_path_solving","false",&sql) != "false");
 
 			ns_time_path_solution time_path_solution;
 			if (skip_inferred_worm_analysis){
@@ -812,8 +814,12 @@ bool ns_processing_job_maintenance_processor::run_job(ns_sql & sql) {
 					ns_time_path_solver_parameters solver_parameters(ns_time_path_solver_parameters::default_parameters(job.region_id,sql));
 			
 					ns_time_path_solver tp_solver;
-					tp_solver.load(job.region_id,sql);
-					tp_solver.solve(solver_parameters,time_path_solution);
+					if (incremental_time_path_solving)
+						tp_solver.solve_incrementally(job.region_id,solver_parameters,time_path_solution,sql);
+					else{
+						tp_solver.load(job.region_id,sql);
+						tp_solver.solve(solver_parameters,time_path_solution);
+					}
 				
 					image_server->register_server_event(ns_image_server_event("Filling gaps and adding path prefixes."),&sql);
 					std::string prefix_length_str= image_server->get_cluster_constant_value("path_prefix_length_in_frames",ns_to_string(ns_time_path_solution::default_length_of_fast_moving_prefix()),&sql);
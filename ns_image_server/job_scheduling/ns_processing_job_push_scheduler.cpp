@@ -2,6 +2,7 @@
 #include "ns_image_server.h"
 #include "ns_image_server_images.h"
 #include "ns_processing_job_processor.h"
+#include "ns_thread_pool.h"
 using namespace std;
 
 void ns_processing_job_queue_item::save_to_db(ns_sql & sql){
@@ -22,8 +23,8 @@ void ns_processing_job_queue_item::save_to_db(ns_sql & sql){
 	if (id != 0)
 		table_lock.unlock();
 }
-std::string ns_processing_job_queue_item::provide_stub(){
-	return "SELECT id, job_id, priority, experiment_id, capture_sample_id, captured_images_id, sample_region_info_id, sample_region_id, image_id, processor_id, problem, progress, movement_record_id, job_class FROM processing_job_queue ";
+std::string ns_processing_job_queue_item::provide_stub(const std::string & table_name){
+	return "SELECT id, job_id, priority, experiment_id, capture_sample_id, captured_images_id, sample_region_info_id, sample_region_id, image_id, processor_id, problem, progress, movement_record_id, job_class FROM " + table_name + " ";
 }
 void ns_processing_job_queue_item::from_result(std::vector<std::string> & result){
 		id = atol(result[0].c_str());
@@ -377,36 +378,16 @@ void ns_image_server_push_job_scheduler::report_new_job(const ns_processing_job
 }
 
 
-ns_processing_job ns_image_server_push_job_scheduler::request_job(ns_sql & sql,bool first_in_first_out){
+ns_processing_job ns_image_server_push_job_scheduler::request_job(ns_sql & sql, ns_processing_job_queue_claims & claims, bool first_in_first_out){
 	ns_processing_job job;
 	ns_processing_job_queue_item queue_item;
-	ns_sql_result queue_item_res;
 	sql.set_autocommit(false);
 
 	try{	
-		{
-			ns_sql_full_table_lock table_lock(sql);
-			table_lock.lock("processing_job_queue");
-			sql << ns_processing_job_queue_item::provide_stub() << " WHERE processor_id=0 AND problem=0 AND paused=0 ";
-			if (!image_server.compile_videos())
-				sql << " AND job_class = 0 ";
-			if (first_in_first_out)
-				sql << "ORDER BY priority DESC, id ASC LIMIT 1";
-			else
-				sql << "ORDER BY priority DESC, id DESC LIMIT 1";
-			
-			sql.get_rows(queue_item_res);
+		if (!claims.claim_next(sql,image_server.host_id(),first_in_first_out,!image_server.compile_videos(),queue_item)){
 			//no jobs
-			if (queue_item_res.size() == 0){
-				job.id = 0;
-				table_lock.unlock();
-				return job;
-			}
-			queue_item.from_result(queue_item_res[0]);
-			//cerr << "Taking pjq " << queue_item.id << "\n";
-			sql << "UPDATE processing_job_queue SET processor_id=" << image_server.host_id() << " WHERE id=" << queue_item.id;
-			sql.send_query();
-			table_lock.unlock();
+			job.id = 0;
+			return job;
 		}
 		try{
 			//look for job in cache
@@ -508,3 +489,269 @@ void ns_image_server_push_job_scheduler::get_processing_jobs_from_db(ns_sql & sq
 	for (unsigned int i = 0; i < job_data.size(); i++)
 		jobs[i].load_from_result(job_data[i]);
 }
+
+bool ns_processing_job_queue_claims::batch_claiming_supported(ns_image_server_sql & sql){
+	if (!claim_columns_checked){
+		sql << "SHOW COLUMNS FROM " << table_name << " WHERE field = 'claim_token'";
+		ns_sql_result res;
+		sql.get_rows(res);
+		claim_columns_present = !res.empty();
+		claim_columns_checked = true;
+	}
+	return claim_columns_present;
+}
+
+ns_64_bit ns_processing_job_queue_claims::next_claim_token(const ns_64_bit host_id){
+	//the counter is seeded from the clock so that a host does not reuse tokens after it restarts
+	if (claim_counter == 0)
+		claim_counter = (unsigned long)ns_current_time();
+	claim_counter = (claim_counter+1)&0xFFFFFFFF;
+	if (claim_counter == 0)
+		claim_counter = 1;
+	return (host_id << 32) | claim_counter;
+}
+
+bool ns_processing_job_queue_claims::claim_with_table_lock(ns_image_server_sql & sql, const std::string & table_name, const ns_64_bit host_id, const bool first_in_first_out, const bool exclude_nonzero_job_classes, ns_processing_job_queue_item & item){
+	ns_sql_full_table_lock table_lock(sql);
+	table_lock.lock(table_name);
+	sql << ns_processing_job_queue_item::provide_stub(table_name) << " WHERE processor_id=0 AND problem=0 AND paused=0 ";
+	if (exclude_nonzero_job_classes)
+		sql << " AND job_class = 0 ";
+	if (first_in_first_out)
+		sql << "ORDER BY priority DESC, id ASC LIMIT 1";
+	else
+		sql << "ORDER BY priority DESC, id DESC LIMIT 1";
+	ns_sql_result res;
+	sql.get_rows(res);
+	if (res.size() == 0){
+		table_lock.unlock();
+		return false;
+	}
+	item.from_result(res[0]);
+	sql << "UPDATE " << table_name << " SET processor_id=" << host_id << " WHERE id=" << item.id;
+	sql.send_query();
+	table_lock.unlock();
+	return true;
+}
+
+bool ns_processing_job_queue_claims::claim_batch(ns_image_server_sql & sql, const ns_64_bit host_id, const bool first_in_first_out, const bool exclude_nonzero_job_classes){
+	const ns_64_bit claim_token(next_claim_token(host_id));
+	//the UPDATE is atomic, so entries claimed by other hosts in the meantime no longer match processor_id=0
+	sql << "UPDATE " << table_name << " SET processor_id=" << host_id << ", claim_token=" << claim_token
+		<< ", claim_expiration_time=UNIX_TIMESTAMP()+" << lease_duration_in_seconds
+		<< " WHERE processor_id=0 AND problem=0 AND paused=0 ";
+	if (exclude_nonzero_job_classes)
+		sql << "AND job_class = 0 ";
+	sql << "ORDER BY priority DESC, id " << (first_in_first_out?"ASC":"DESC") << " LIMIT " << ((batch_size==0)?1:batch_size);
+	const ns_64_bit number_claimed(sql.send_query_get_affected_rows());
+	sql.send_query("COMMIT");
+	if (number_claimed == 0)
+		return false;
+
+	//measured from after the claim, so that the lease is never thought to last longer than it does in the database
+	const unsigned long lease_expiration_time(ns_current_time()+lease_duration_in_seconds);
+	sql << ns_processing_job_queue_item::provide_stub(table_name) << "WHERE claim_token=" << claim_token
+		<< " ORDER BY priority DESC, id " << (first_in_first_out?"ASC":"DESC");
+	ns_sql_result res;
+	sql.get_rows(res);
+	for (unsigned int i = 0; i < res.size(); i++){
+		prefetched.resize(prefetched.size()+1);
+		prefetched.rbegin()->item.from_result(res[i]);
+		prefetched.rbegin()->claim_token = claim_token;
+		prefetched.rbegin()->lease_expiration_time = lease_expiration_time;
+	}
+	return !res.empty();
+}
+
+bool ns_processing_job_queue_claims::confirm_claim(ns_image_server_sql & sql, const ns_64_bit host_id, const ns_processing_job_queue_item & item, const ns_64_bit claim_token){
+	//fails if the lease expired and the entry was taken by another host, or if the entry was paused or marked as a problem in the meantime.
+	sql << "UPDATE " << table_name << " SET claim_token=0, claim_expiration_time=0 WHERE id=" << item.id
+		<< " AND claim_token=" << claim_token << " AND processor_id=" << host_id << " AND problem=0 AND paused=0";
+	const bool owned(sql.send_query_get_affected_rows() == 1);
+	sql.send_query("COMMIT");
+	return owned;
+}
+
+void ns_processing_job_queue_claims::expire_abandoned_claims(ns_image_server_sql & sql){
+	sql << "UPDATE " << table_name << " SET processor_id=0, claim_token=0, claim_expiration_time=0 "
+		   "WHERE claim_token != 0 AND claim_expiration_time < UNIX_TIMESTAMP()";
+	sql.send_query();
+	sql.send_query("COMMIT");
+}
+
+bool ns_processing_job_queue_claims::claim_next(ns_image_server_sql & sql, const ns_64_bit host_id, const bool first_in_first_out, const bool exclude_nonzero_job_classes, ns_processing_job_queue_item & item){
+	if (!batch_claiming_supported(sql))
+		return claim_with_table_lock(sql,table_name,host_id,first_in_first_out,exclude_nonzero_job_classes,item);
+
+	//every host checks for abandoned claims, but not so often that the checks load the database
+	const unsigned long current_time(ns_current_time());
+	if (current_time > last_expiration_check + 60){
+		expire_abandoned_claims(sql);
+		last_expiration_check = current_time;
+	}
+	//If the host ran a long job, the rest of its batch may have sat here past its lease and been taken by other hosts.
+	//Rather than trying to confirm each of those entries in turn, the batch is returned to the queue and a fresh one claimed.
+	if (!prefetched.empty() && prefetched.front().lease_expiration_time <= current_time)
+		release(sql);
+	while(true){
+		if (prefetched.empty() && !claim_batch(sql,host_id,first_in_first_out,exclude_nonzero_job_classes))
+			return false;
+		while(!prefetched.empty()){
+			const ns_prefetched_entry entry(prefetched.front());
+			prefetched.pop_front();
+			if (confirm_claim(sql,host_id,entry.item,entry.claim_token)){
+				item = entry.item;
+				item.processor_id = host_id;
+				return true;
+			}
+		}
+	}
+}
+
+void ns_processing_job_queue_claims::release(ns_image_server_sql & sql){
+	if (prefetched.empty())
+		return;
+	sql << "UPDATE " << table_name << " SET processor_id=0, claim_token=0, claim_expiration_time=0 WHERE claim_token IN (";
+	//entries from the same batch are adjacent in the queue
+	for (std::deque<ns_prefetched_entry>::const_iterator p = prefetched.begin(); p != prefetched.end(); p++){
+		if (p == prefetched.begin())
+			sql << p->claim_token;
+		else if (p->claim_token != (p-1)->claim_token)
+			sql << "," << p->claim_token;
+	}
+	sql << ")";
+	sql.send_query();
+	sql.send_query("COMMIT");
+	prefetched.clear();
+}
+
+///Each benchmark job acts as one host, taking entries from the stand-in queue until none are left.
+class ns_job_queue_claim_benchmark_job : public ns_thread_pool_job{
+public:
+	ns_job_queue_claim_benchmark_job():sql(0),claims(0),host_id(0),use_table_lock(false),number_claimed(0),number_claimed_twice(0){}
+	void run(const unsigned long thread_id){
+		ns_processing_job_queue_item item;
+		while(true){
+			const bool claimed(use_table_lock?
+				ns_processing_job_queue_claims::claim_with_table_lock(*sql,table_name,host_id,false,false,item):
+				claims->claim_next(*sql,host_id,false,false,item));
+			if (!claimed)
+				break;
+			//remove the entry, as is done when a job is finished.  An entry that is already gone was claimed by two hosts.
+			*sql << "DELETE FROM " << table_name << " WHERE id=" << item.id;
+			if (sql->send_query_get_affected_rows() == 1)
+				number_claimed++;
+			else number_claimed_twice++;
+			sql->send_query("COMMIT");
+		}
+	}
+	ns_local_buffer_connection * sql;
+	ns_processing_job_queue_claims * claims;
+	ns_64_bit host_id;
+	bool use_table_lock;
+	std::string table_name;
+	unsigned long number_claimed,
+				  number_claimed_twice;
+};
+
+void ns_benchmark_job_queue_claims(const unsigned long number_of_connections, const unsigned long number_of_entries, const unsigned long batch_size, std::ostream & out){
+	const std::string table_name("job_queue_claim_benchmark");
+	std::vector<ns_local_buffer_connection *> connections(number_of_connections,(ns_local_buffer_connection *)0);
+	try{
+		for (unsigned int i = 0; i < number_of_connections; i++)
+			connections[i] = image_server.new_local_buffer_connection(__FILE__,__LINE__);
+		ns_local_buffer_connection & sql(*connections[0]);
+
+		for (unsigned int method = 0; method < 2; method++){
+			const bool use_table_lock(method == 0);
+			//the stand-in has the columns of processing_job_queue that are used to claim entries, and the same storage engine
+			sql << "DROP TABLE IF EXISTS " << table_name;
+			sql.send_query();
+			sql << "CREATE TABLE " << table_name << " ("
+				"`id` bigint(20) unsigned NOT NULL AUTO_INCREMENT,"
+				"`priority` int(10) unsigned NOT NULL DEFAULT '0',"
+				"`experiment_id` int(10) unsigned NOT NULL DEFAULT '0',"
+				"`capture_sample_id` int(10) unsigned NOT NULL DEFAULT '0',"
+				"`sample_region_info_id` int(10) unsigned NOT NULL DEFAULT '0',"
+				"`sample_region_id` int(10) unsigned NOT NULL DEFAULT '0',"
+				"`image_id` int(10) unsigned NOT NULL DEFAULT '0',"
+				"`processor_id` int(10) unsigned NOT NULL DEFAULT '0',"
+				"`problem` bigint(20) unsigned NOT NULL DEFAULT '0',"
+				"`progress` int(10) unsigned NOT NULL DEFAULT '0',"
+				"`job_id` int(10) unsigned NOT NULL DEFAULT '0',"
+				"`movement_record_id` int(10) unsigned NOT NULL DEFAULT '0',"
+				"`captured_images_id` int(10) unsigned NOT NULL DEFAULT '0',"
+				"`job_class` int(10) unsigned NOT NULL DEFAULT '0',"
+				"`paused` int(10) unsigned NOT NULL DEFAULT '0',"
+				"`claim_token` bigint(20) unsigned NOT NULL DEFAULT '0',"
+				"`claim_expiration_time` int(10) unsigned NOT NULL DEFAULT '0',"
+				"PRIMARY KEY (`id`),"
+				"KEY `priority_index` (`priority`,`problem`,`job_class`,`processor_id`),"
+				"KEY `claim_index` (`claim_token`)"
+				") ENGINE=MyISAM";
+			sql.send_query();
+			const unsigned long entries_per_insert(1000);
+			for (unsigned long i = 0; i < number_of_entries; i+=entries_per_insert){
+				sql << "INSERT INTO " << table_name << " (priority,job_id) VALUES ";
+				for (unsigned long j = i; j < number_of_entries && j < i+entries_per_insert; j++){
+					if (j != i)
+						sql << ",";
+					sql << "(" << 5*(1+j%5) << "," << j+1 << ")";
+				}
+				sql.send_query();
+			}
+
+			std::vector<ns_processing_job_queue_claims> claims(number_of_connections,ns_processing_job_queue_claims(table_name));
+			std::vector<ns_job_queue_claim_benchmark_job> jobs(number_of_connections);
+			std::vector<ns_thread_pool_job *> job_pointers(number_of_connections);
+			for (unsigned int i = 0; i < number_of_connections; i++){
+				claims[i].batch_size = batch_size;
+				jobs[i].sql = connections[i];
+				jobs[i].claims = &claims[i];
+				jobs[i].host_id = i+1;
+				jobs[i].use_table_lock = use_table_lock;
+				jobs[i].table_name = table_name;
+				job_pointers[i] = &jobs[i];
+			}
+			ns_thread_pool pool(number_of_connections);
+			ns_high_precision_timer timer;
+			timer.start();
+			pool.run(job_pointers);
+			const double seconds(timer.stop()/1000.0/1000.0);
+
+			unsigned long number_claimed(0),
+						  number_claimed_twice(0);
+			for (unsigned int i = 0; i < number_of_connections; i++){
+				number_claimed+=jobs[i].number_claimed;
+				number_claimed_twice+=jobs[i].number_claimed_twice;
+			}
+			if (use_table_lock)
+				out << "Table lock claiming: ";
+			else out << "Batch claiming (" << batch_size << " entries per claim): ";
+			out << number_claimed << " entries claimed by " << number_of_connections << " connections in " << seconds << " seconds ("
+				<< ((seconds > 0)?(number_claimed/seconds):0) << " claims per second).";
+			if (number_claimed_twice > 0)
+				out << " " << number_claimed_twice << " entries were claimed twice!";
+			if (number_claimed != number_of_entries)
+				out << " " << number_of_entries - number_claimed << " entries were never claimed!";
+			out << "\n";
+		}
+		sql << "DROP TABLE IF EXISTS " << table_name;
+		sql.send_query();
+	}
+	catch(...){
+		if (connections[0] != 0){
+			try{
+				connections[0]->clear_query();
+				*connections[0] << "DROP TABLE IF EXISTS " << table_name;
+				connections[0]->send_query();
+			}
+			catch(...){}
+		}
+		for (unsigned int i = 0; i < connections.size(); i++)
+			ns_safe_delete(connections[i]);
+		throw;
+	}
+	for (unsigned int i = 0; i < connections.size(); i++)
+		ns_safe_delete(connections[i]);
+}
@@ -2,6 +2,7 @@
 #define NS_IMAGE_SERVER_PUSH_JOB_SCHEDULER
 #include "ns_image_server_images.h"
 #include "ns_processing_job.h"
+#include <deque>
 
 
 class ns_processing_job_queue_item{
@@ -37,11 +38,67 @@ public:
 				  job_class; //certain jobs cannot be performed by certain types of hosts (ie movie compilation on linux hosts).  Job classes warn incapable clients off of inappropriate jobs
 
 	void save_to_db(ns_sql & sql);
-	static std::string provide_stub();
+	static std::string provide_stub(const std::string & table_name="processing_job_queue");
 	void from_result(std::vector<std::string> & result);
 
 };
 
+///ns_processing_job_queue_claims lets a host take jobs from the processing job queue without locking the whole table.
+///Several entries are claimed at once with a single UPDATE ... WHERE processor_id=0 that stamps them with the host's id,
+///a token unique to the claim, and a lease expiration time.  The claimed entries are read back by token and held in a local prefetch queue.
+///Before an entry is started, its claim is confirmed by an UPDATE that succeeds only if the entry still carries the token
+///and has not been paused or marked as a problem, so an entry whose lease expired and was claimed by another host is never run twice.
+///Claims that are never confirmed (for example, because the host crashed) are returned to the queue by the next host to check for expired leases.
+///If the queue table lacks the claim columns (see ns_image_server::upgrade_tables()), the old table-locking claim is used instead.
+class ns_processing_job_queue_claims{
+public:
+	ns_processing_job_queue_claims(const std::string & table_name_="processing_job_queue"):table_name(table_name_),batch_size(4),lease_duration_in_seconds(600),
+		claim_counter(0),last_expiration_check(0),claim_columns_checked(false),claim_columns_present(false){}
+
+	///Sets item to the next entry owned by the host and returns true, or returns false if the queue holds no available entries.
+	///Entries of job_class != 0 are skipped if exclude_nonzero_job_classes is set.
+	bool claim_next(ns_image_server_sql & sql, const ns_64_bit host_id, const bool first_in_first_out, const bool exclude_nonzero_job_classes, ns_processing_job_queue_item & item);
+
+	///returns all prefetched entries to the queue
+	void release(ns_image_server_sql & sql);
+
+	///returns entries whose claims have not been confirmed before their lease expired to the queue
+	void expire_abandoned_claims(ns_image_server_sql & sql);
+
+	///The claim used before batch claiming was introduced: the queue table is locked while a single entry is found and claimed.
+	static bool claim_with_table_lock(ns_image_server_sql & sql, const std::string & table_name, const ns_64_bit host_id, const bool first_in_first_out, const bool exclude_nonzero_job_classes, ns_processing_job_queue_item & item);
+
+	///the number of entries claimed at once
+	unsigned long batch_size;
+	///the time a host has to confirm a claimed entry before it is returned to the queue
+	unsigned long lease_duration_in_seconds;
+
+	bool batch_claiming_supported(ns_image_server_sql & sql);
+	unsigned long number_of_prefetched_entries() const{return (unsigned long)prefetched.size();}
+private:
+	bool claim_batch(ns_image_server_sql & sql, const ns_64_bit host_id, const bool first_in_first_out, const bool exclude_nonzero_job_classes);
+	bool confirm_claim(ns_image_server_sql & sql, const ns_64_bit host_id, const ns_processing_job_queue_item & item, const ns_64_bit claim_token);
+	ns_64_bit next_claim_token(const ns_64_bit host_id);
+
+	struct ns_prefetched_entry{
+		ns_processing_job_queue_item item;
+		ns_64_bit claim_token;
+		//after this time the entry may be returned to the queue by expire_abandoned_claims()
+		unsigned long lease_expiration_time;
+	};
+	std::deque<ns_prefetched_entry> prefetched;
+	std::string table_name;
+	unsigned long claim_counter,
+				  last_expiration_check;
+	bool claim_columns_checked,
+		 claim_columns_present;
+};
+
+///Measures how many queue entries per second can be claimed by several simultaneous connections,
+///using both the table-locking claim and batch claiming.  The measurement is made on a temporary stand-in
+///for the processing job queue created in the local buffer database, so the central database is not touched.
+void ns_benchmark_job_queue_claims(const unsigned long number_of_connections, const unsigned long number_of_entries, const unsigned long batch_size, std::ostream & out);
+
 class ns_image_server_push_job_scheduler{
 
 public:
@@ -51,7 +108,8 @@ public:
 	void report_new_job_and_mark_it_so(const ns_processing_job & job,ns_sql & sql);
 
 	void discover_new_jobs(ns_sql & sql);
-	ns_processing_job request_job(ns_sql & sql,bool first_in_first_out=false);
+	//queue entries are claimed through the specified claims object, so that entries prefetched during one request can be used by later ones.
+	ns_processing_job request_job(ns_sql & sql, ns_processing_job_queue_claims & claims, bool first_in_first_out=false);
 	void report_job_as_finished(const ns_processing_job & job,ns_sql & sql);
 	void report_job_as_unfinished(const ns_processing_job & job,ns_sql & sql);
 
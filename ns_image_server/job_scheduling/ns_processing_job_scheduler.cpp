@@ -77,7 +77,12 @@ bool ns_processing_job_scheduler::run_a_job(ns_sql & sql,bool first_in_first_out
 		return false;
 	ns_image_server_push_job_scheduler push_scheduler;
 
-	ns_processing_job job = push_scheduler.request_job(sql,first_in_first_out_job_queue);
+	if (!job_queue_claim_settings_loaded){
+		job_queue_claims.batch_size = atol(image_server.get_cluster_constant_value("job_queue_claim_batch_size","4",&sql).c_str());
+		job_queue_claims.lease_duration_in_seconds = 60*atol(image_server.get_cluster_constant_value("job_queue_claim_lease_in_minutes","10",&sql).c_str());
+		job_queue_claim_settings_loaded = true;
+	}
+	ns_processing_job job = push_scheduler.request_job(sql,job_queue_claims,first_in_first_out_job_queue);
 	
 	if (job.id == 0)
 		return false;
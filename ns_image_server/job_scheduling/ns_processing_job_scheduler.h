@@ -26,13 +26,16 @@ class ns_processing_error_specification{
 class ns_processing_job_scheduler{
 public:
 	ns_processing_job_scheduler(ns_image_server & cur_image_server):idle_timer_running(false),
-	  current_server(&cur_image_server),db_movement_build_probility(25),pipeline(0){init_pipeline();}
+	  current_server(&cur_image_server),db_movement_build_probility(25),pipeline(0),job_queue_claim_settings_loaded(false){init_pipeline();}
 	~ns_processing_job_scheduler(){destruct_pipeline();}		
 	
 	bool run_a_job(ns_sql & sql,bool first_in_first_out_job_queue=false);
 	
 	void clear_heap();
 
+	//returns any queue entries claimed but not yet started to the queue
+	void release_prefetched_jobs(ns_sql & sql){job_queue_claims.release(sql);}
+
 private:
 	ns_high_precision_timer idle_timer;
 	bool idle_timer_running;
@@ -41,6 +44,10 @@ private:
 	ns_image_server * current_server;
 	ns_image_processing_pipline_holder * pipeline;
 	unsigned int db_movement_build_probility;
+	//held between jobs, so that entries claimed as a batch are used by subsequent calls to run_a_job()
+	ns_processing_job_queue_claims job_queue_claims;
+	//the claim batch size and lease are read from the cluster constants once, on the first call to run_a_job()
+	bool job_queue_claim_settings_loaded;
 };
 
 #endif
@@ -0,0 +1,259 @@
+#include "ns_columnar_file.h"
+#include "ns_fast_lossless.h"
+#include <fstream>
+#include <algorithm>
+using namespace std;
+
+unsigned long ns_columnar_table::add_column(const std::string & name, const ns_columnar_type & type){
+	if (!segments.empty())
+		throw ns_ex("ns_columnar_table::Columns must be added to ") << this->name << " before any rows";
+	columns.resize(columns.size()+1);
+	columns.rbegin()->info.name = name;
+	columns.rbegin()->info.type = type;
+	return columns.size()-1;
+}
+
+ns_64_bit ns_columnar_table::number_of_rows() const{
+	if (columns.empty())
+		return 0;
+	const ns_64_bit rows(columns[0].data.size()/ns_columnar_type_size(columns[0].info.type));
+	for (unsigned int i = 1; i < columns.size(); i++){
+		if (columns[i].data.size()/ns_columnar_type_size(columns[i].info.type) != rows)
+			throw ns_ex("ns_columnar_table::Column ") << columns[i].info.name << " of table " << name << " has "
+				<< columns[i].data.size()/ns_columnar_type_size(columns[i].info.type) << " rows, but column " << columns[0].info.name << " has " << rows;
+	}
+	return rows;
+}
+
+void ns_columnar_table::begin_segment(const ns_64_bit key){
+	segments.push_back(ns_segment(key,number_of_rows()));
+}
+
+ns_columnar_file_writer::ns_columnar_file_writer(std::ostream & out_, const bool compress_blocks_):out(out_),compress_blocks(compress_blocks_),closed(false){
+	//the footer location is filled in by close()
+	ns_columnar_file_header header;
+	memset(&header,0,sizeof(header));
+	out.write(reinterpret_cast<const char *>(&header),sizeof(header));
+	if (out.fail())
+		throw ns_ex("ns_columnar_file_writer::Could not write header") << ns_file_io;
+}
+
+void ns_columnar_file_writer::write_block(const char * data, const ns_64_bit size, ns_columnar_block_info & info){
+	info.offset = out.tellp();
+	info.stored_size = size;
+	if (size == 0)
+		return;
+	if (compress_blocks){
+		ns_fast_lossless_compress(reinterpret_cast<const ns_8_bit *>(data),(unsigned long)size,compressed);
+		if (compressed.size() < size){
+			info.stored_size = compressed.size();
+			out.write(reinterpret_cast<const char *>(&compressed[0]),compressed.size());
+		}
+	}
+	if (info.stored_size == size)
+		out.write(data,size);
+	if (out.fail())
+		throw ns_ex("ns_columnar_file_writer::Could not write data") << ns_file_io;
+}
+
+void ns_columnar_file_writer::write(const ns_columnar_table & table){
+	if (closed)
+		throw ns_ex("ns_columnar_file_writer::Attempting to write to a closed file") << ns_file_io;
+	const ns_64_bit number_of_rows(table.number_of_rows());
+	if (number_of_rows > 0 && (table.segments.empty() || table.segments[0].first_row != 0))
+		throw ns_ex("ns_columnar_file_writer::Rows were added to table ") << table.name << " before a segment was started";
+
+	tables.resize(tables.size()+1);
+	ns_table_info & info(*tables.rbegin());
+	info.name = table.name;
+	info.columns.resize(table.columns.size());
+	for (unsigned int c = 0; c < table.columns.size(); c++)
+		info.columns[c] = table.columns[c].info;
+	info.segments.resize(table.segments.size());
+	for (unsigned int s = 0; s < table.segments.size(); s++){
+		const ns_64_bit first_row(table.segments[s].first_row),
+						last_row((s+1 == table.segments.size())?number_of_rows:table.segments[s+1].first_row);
+		info.segments[s].key = table.segments[s].key;
+		info.segments[s].number_of_rows = last_row-first_row;
+		info.segments[s].blocks.resize(table.columns.size());
+		for (unsigned int c = 0; c < table.columns.size(); c++){
+			const ns_64_bit width(ns_columnar_type_size(table.columns[c].info.type));
+			write_block((first_row == last_row)?0:&table.columns[c].data[first_row*width],(last_row-first_row)*width,info.segments[s].blocks[c]);
+		}
+	}
+}
+
+template<class T>
+void ns_columnar_append(const T & v, std::vector<char> & out){
+	const unsigned long s(out.size());
+	out.resize(s+sizeof(T));
+	memcpy(&out[s],&v,sizeof(T));
+}
+void ns_columnar_append(const std::string & v, std::vector<char> & out){
+	ns_columnar_append((unsigned int)v.size(),out);
+	out.insert(out.end(),v.begin(),v.end());
+}
+
+void ns_columnar_file_writer::close(){
+	if (closed)
+		return;
+	std::vector<char> footer;
+	ns_columnar_append((unsigned int)tables.size(),footer);
+	for (unsigned int t = 0; t < tables.size(); t++){
+		ns_columnar_append(tables[t].name,footer);
+		ns_columnar_append((unsigned int)tables[t].columns.size(),footer);
+		for (unsigned int c = 0; c < tables[t].columns.size(); c++){
+			ns_columnar_append(tables[t].columns[c].name,footer);
+			ns_columnar_append((unsigned int)tables[t].columns[c].type,footer);
+		}
+		ns_columnar_append((ns_64_bit)tables[t].segments.size(),footer);
+		for (unsigned int s = 0; s < tables[t].segments.size(); s++){
+			ns_columnar_append(tables[t].segments[s].key,footer);
+			ns_columnar_append(tables[t].segments[s].number_of_rows,footer);
+			for (unsigned int c = 0; c < tables[t].segments[s].blocks.size(); c++){
+				ns_columnar_append(tables[t].segments[s].blocks[c].offset,footer);
+				ns_columnar_append(tables[t].segments[s].blocks[c].stored_size,footer);
+			}
+		}
+	}
+	ns_columnar_file_header header;
+	memcpy(header.magic,ns_columnar_file_header::magic_string(),8);
+	header.byte_order_mark = 0x01020304;
+	header.version = ns_columnar_file_header::current_version;
+	header.footer_offset = out.tellp();
+	header.footer_size = footer.size();
+	out.write(&footer[0],footer.size());
+	out.seekp(0);
+	out.write(reinterpret_cast<const char *>(&header),sizeof(header));
+	out.flush();
+	if (out.fail())
+		throw ns_ex("ns_columnar_file_writer::Could not write footer") << ns_file_io;
+	closed = true;
+}
+
+bool ns_columnar_file_reader::is_columnar_file(const std::string & filename){
+	ifstream in(filename.c_str(),std::ios::binary);
+	if (in.fail())
+		return false;
+	char magic[8];
+	in.read(magic,8);
+	return !in.fail() && memcmp(magic,ns_columnar_file_header::magic_string(),8) == 0;
+}
+
+//reads values from the footer, checking that they lie within it
+class ns_columnar_footer_parser{
+public:
+	ns_columnar_footer_parser(const char * data_, const ns_64_bit size_, const std::string & filename_):data(data_),size(size_),pos(0),filename(filename_){}
+	template<class T>
+	T get(){
+		check(sizeof(T));
+		T v;
+		memcpy(&v,data+pos,sizeof(T));
+		pos+=sizeof(T);
+		return v;
+	}
+	std::string get_string(){
+		const unsigned int length(get<unsigned int>());
+		check(length);
+		std::string s(data+pos,length);
+		pos+=length;
+		return s;
+	}
+private:
+	void check(const ns_64_bit length){
+		if (pos + length > size)
+			throw ns_ex("ns_columnar_file_reader::") << filename << " has a truncated footer" << ns_file_io;
+	}
+	const char * data;
+	ns_64_bit size,pos;
+	const std::string & filename;
+};
+
+void ns_columnar_file_reader::open(const std::string & filename){
+	close();
+	file.open(filename);
+	ns_columnar_file_header header;
+	if (file.size() < sizeof(header))
+		throw ns_ex("ns_columnar_file_reader::") << filename << " is not a columnar file" << ns_file_io;
+	memcpy(&header,file.data(),sizeof(header));
+	if (memcmp(header.magic,ns_columnar_file_header::magic_string(),8) != 0)
+		throw ns_ex("ns_columnar_file_reader::") << filename << " is not a columnar file" << ns_file_io;
+	if (header.byte_order_mark != 0x01020304)
+		throw ns_ex("ns_columnar_file_reader::") << filename << " was written on a machine with a different byte order" << ns_file_io;
+	if (header.version != ns_columnar_file_header::current_version)
+		throw ns_ex("ns_columnar_file_reader::") << filename << " has an unsupported version: " << header.version << ns_file_io;
+	if (header.footer_offset < sizeof(header) || header.footer_offset + header.footer_size > file.size())
+		throw ns_ex("ns_columnar_file_reader::") << filename << " has a corrupt header" << ns_file_io;
+
+	ns_columnar_footer_parser footer(file.data()+header.footer_offset,header.footer_size,filename);
+	tables.resize(footer.get<unsigned int>());
+	for (unsigned int t = 0; t < tables.size(); t++){
+		ns_table & table(tables[t]);
+		table.name = footer.get_string();
+		table.columns.resize(footer.get<unsigned int>());
+		for (unsigned int c = 0; c < table.columns.size(); c++){
+			table.columns[c].name = footer.get_string();
+			const unsigned int type(footer.get<unsigned int>());
+			if (type > (unsigned int)ns_columnar_double)
+				throw ns_ex("ns_columnar_file_reader::") << filename << " has an unknown column type: " << type << ns_file_io;
+			table.columns[c].type = (ns_columnar_type)type;
+		}
+		table.segments.resize(footer.get<ns_64_bit>());
+		table.segment_index.resize(table.segments.size());
+		for (unsigned long s = 0; s < table.segments.size(); s++){
+			table.segments[s].key = footer.get<ns_64_bit>();
+			table.segments[s].number_of_rows = footer.get<ns_64_bit>();
+			table.segments[s].blocks.resize(table.columns.size());
+			for (unsigned int c = 0; c < table.columns.size(); c++){
+				ns_columnar_block_info & b(table.segments[s].blocks[c]);
+				b.offset = footer.get<ns_64_bit>();
+				b.stored_size = footer.get<ns_64_bit>();
+				if (b.offset + b.stored_size > header.footer_offset || b.stored_size > table.segments[s].number_of_rows*ns_columnar_type_size(table.columns[c].type))
+					throw ns_ex("ns_columnar_file_reader::") << filename << " has a corrupt footer" << ns_file_io;
+			}
+			table.segment_index[s] = std::pair<ns_64_bit,unsigned long>(table.segments[s].key,s);
+		}
+		std::sort(table.segment_index.begin(),table.segment_index.end());
+	}
+}
+
+void ns_columnar_file_reader::close(){
+	file.close();
+	tables.resize(0);
+}
+
+long ns_columnar_file_reader::ns_table::find_column(const std::string & name) const{
+	for (unsigned int i = 0; i < columns.size(); i++)
+		if (columns[i].name == name)
+			return i;
+	return -1;
+}
+
+long ns_columnar_file_reader::ns_table::find_segment(const ns_64_bit key) const{
+	std::vector<std::pair<ns_64_bit,unsigned long> >::const_iterator p(std::lower_bound(segment_index.begin(),segment_index.end(),std::pair<ns_64_bit,unsigned long>(key,0)));
+	if (p == segment_index.end() || p->first != key)
+		return -1;
+	return p->second;
+}
+
+bool ns_columnar_file_reader::has_table(const std::string & name) const{
+	for (unsigned int i = 0; i < tables.size(); i++)
+		if (tables[i].name == name)
+			return true;
+	return false;
+}
+
+const ns_columnar_file_reader::ns_table & ns_columnar_file_reader::table(const std::string & name) const{
+	for (unsigned int i = 0; i < tables.size(); i++)
+		if (tables[i].name == name)
+			return tables[i];
+	throw ns_ex("ns_columnar_file_reader::") << file.filename() << " has no table " << name << ns_file_io;
+}
+
+const char * ns_columnar_file_reader::load_block(const ns_columnar_block_info & b, const ns_64_bit size) const{
+	if (b.stored_size == size)
+		return file.data()+b.offset;
+	decompressed.resize(size+1);
+	ns_fast_lossless_decompress(reinterpret_cast<const ns_8_bit *>(file.data()+b.offset),(unsigned long)b.stored_size,&decompressed[0],(unsigned long)size);
+	return reinterpret_cast<const char *>(&decompressed[0]);
+}
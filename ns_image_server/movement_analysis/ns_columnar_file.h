@@ -0,0 +1,189 @@
+#ifndef NS_COLUMNAR_FILE
+#define NS_COLUMNAR_FILE
+#include "ns_ex.h"
+#include "ns_memory_mapped_file.h"
+#include <vector>
+#include <string>
+#include <ostream>
+#include <string.h>
+
+///ns_columnar files hold tables of fixed-width values, such as the elements of every time path in a region.
+///They replace text files whose parsing dominated the time needed to load large analyses.
+///
+///Each table is divided into segments (for example, one per path), each identified by a 64-bit key.
+///Within a segment, each column's values are stored together in their own block, so a reader
+///can load any one column of any one segment without touching the rest of the file.
+///The file consists of:
+///  a fixed header (ns_columnar_file_header);
+///  the data blocks;
+///  a footer listing each table's columns and segments, and the location of every block.
+///Blocks may be compressed with the LZ77 coder used by ns_fast_lossless; blocks that do not shrink are stored as-is.
+///Readers look columns up by name, so columns can be added in later versions without breaking older readers.
+///As in ns_fast_lossless files, values are stored in native byte order, and files written on a machine with a different byte order are rejected.
+typedef enum{ns_columnar_int8,ns_columnar_int32,ns_columnar_int64,ns_columnar_double} ns_columnar_type;
+
+inline unsigned long ns_columnar_type_size(const ns_columnar_type & t){
+	switch(t){
+		case ns_columnar_int8: return 1;
+		case ns_columnar_int32: return 4;
+		case ns_columnar_int64: return 8;
+		case ns_columnar_double: return 8;
+	}
+	throw ns_ex("ns_columnar_type_size()::Unknown type: ") << (int)t;
+}
+
+//the extension given to columnar files in long term storage
+inline std::string ns_columnar_file_extension(){return "col";}
+
+struct ns_columnar_file_header{
+	enum{current_version=1};
+	char magic[8];
+	unsigned int byte_order_mark,
+				 version;
+	ns_64_bit footer_offset,
+			  footer_size;
+
+	static const char * magic_string(){return "NSCOLUMN";}
+};
+
+struct ns_columnar_column_info{
+	std::string name;
+	ns_columnar_type type;
+};
+
+struct ns_columnar_block_info{
+	ns_64_bit offset,
+			  stored_size;
+};
+
+struct ns_columnar_segment_info{
+	ns_64_bit key,
+			  number_of_rows;
+	//one block per column
+	std::vector<ns_columnar_block_info> blocks;
+};
+
+///ns_columnar_table accumulates the values of a table in memory, row by row, so that it can be written by ns_columnar_file_writer.
+///Each row is added by pushing one value to each column, in any order.
+class ns_columnar_table{
+public:
+	ns_columnar_table(const std::string & name_):name(name_){}
+	unsigned long add_column(const std::string & name, const ns_columnar_type & type);
+
+	///rows added after this call belong to a new segment with the specified key.  Keys must be unique within a table.
+	void begin_segment(const ns_64_bit key);
+
+	template<class T>
+	void push(const unsigned long column, const T & value){
+		ns_column & c(columns[column]);
+		const unsigned long s(c.data.size());
+		c.data.resize(s+ns_columnar_type_size(c.info.type));
+		switch(c.info.type){
+			case ns_columnar_int8:{	const char v((char)value);			memcpy(&c.data[s],&v,sizeof(v)); break;}
+			case ns_columnar_int32:{ const int v((int)value);			memcpy(&c.data[s],&v,sizeof(v)); break;}
+			case ns_columnar_int64:{ const ns_s64_bit v((ns_s64_bit)value);	memcpy(&c.data[s],&v,sizeof(v)); break;}
+			case ns_columnar_double:{ const double v((double)value);	memcpy(&c.data[s],&v,sizeof(v)); break;}
+		}
+	}
+private:
+	struct ns_column{
+		ns_columnar_column_info info;
+		std::vector<char> data;
+	};
+	struct ns_segment{
+		ns_segment(const ns_64_bit k, const ns_64_bit r):key(k),first_row(r){}
+		ns_64_bit key,
+				  first_row;
+	};
+	std::string name;
+	std::vector<ns_column> columns;
+	std::vector<ns_segment> segments;
+	ns_64_bit number_of_rows() const;
+	friend class ns_columnar_file_writer;
+};
+
+///ns_columnar_file_writer writes any number of tables to a seekable stream.
+class ns_columnar_file_writer{
+public:
+	ns_columnar_file_writer(std::ostream & out, const bool compress_blocks);
+	void write(const ns_columnar_table & table);
+	//writes the footer.  The file is not valid until close() is called.
+	void close();
+private:
+	void write_block(const char * data, const ns_64_bit size, ns_columnar_block_info & info);
+	std::ostream & out;
+	bool compress_blocks,
+		 closed;
+	struct ns_table_info{
+		std::string name;
+		std::vector<ns_columnar_column_info> columns;
+		std::vector<ns_columnar_segment_info> segments;
+	};
+	std::vector<ns_table_info> tables;
+	std::vector<ns_8_bit> compressed;
+};
+
+///ns_columnar_file_reader memory maps a columnar file, so that only the blocks that are read are loaded from disk.
+///Decoding uses scratch storage held by the reader, so a reader can be used by only one thread at a time.
+class ns_columnar_file_reader{
+public:
+	///returns true if the file exists and starts with the columnar file magic string
+	static bool is_columnar_file(const std::string & filename);
+
+	void open(const std::string & filename);
+	void close();
+
+	struct ns_table{
+		std::string name;
+		std::vector<ns_columnar_column_info> columns;
+		std::vector<ns_columnar_segment_info> segments;
+		//returns the index of the column with the specified name, or -1 if it is not present
+		long find_column(const std::string & name) const;
+		//returns the index of the segment with the specified key, or -1 if it is not present
+		long find_segment(const ns_64_bit key) const;
+	private:
+		//<key,segment index> sorted by key
+		std::vector<std::pair<ns_64_bit,unsigned long> > segment_index;
+		friend class ns_columnar_file_reader;
+	};
+	bool has_table(const std::string & name) const;
+	const ns_table & table(const std::string & name) const;
+
+	///loads all the values of the specified column in one segment, converting them to type T.
+	template<class T>
+	void read(const ns_table & t, const unsigned long segment, const unsigned long column, std::vector<T> & values) const{
+		const ns_columnar_segment_info & s(t.segments[segment]);
+		const ns_columnar_type type(t.columns[column].type);
+		const char * data(load_block(s.blocks[column],s.number_of_rows*ns_columnar_type_size(type)));
+		values.resize(s.number_of_rows);
+		switch(type){
+			case ns_columnar_int8: convert<char>(data,values); break;
+			case ns_columnar_int32: convert<int>(data,values); break;
+			case ns_columnar_int64: convert<ns_s64_bit>(data,values); break;
+			case ns_columnar_double: convert<double>(data,values); break;
+		}
+	}
+	///as read(), but throws an exception if the column is not present
+	template<class T>
+	void read(const ns_table & t, const unsigned long segment, const std::string & column, std::vector<T> & values) const{
+		const long c(t.find_column(column));
+		if (c == -1)
+			throw ns_ex("ns_columnar_file_reader::") << file.filename() << " has no column " << column << " in table " << t.name << ns_file_io;
+		read(t,segment,(unsigned long)c,values);
+	}
+private:
+	template<class S, class T>
+	static void convert(const char * data, std::vector<T> & values){
+		for (unsigned long i = 0; i < values.size(); i++){
+			S v;
+			memcpy(&v,data+i*sizeof(S),sizeof(S));
+			values[i] = (T)v;
+		}
+	}
+	const char * load_block(const ns_columnar_block_info & b, const ns_64_bit size) const;
+	ns_memory_mapped_file file;
+	std::vector<ns_table> tables;
+	mutable std::vector<ns_8_bit> decompressed;
+};
+
+#endif
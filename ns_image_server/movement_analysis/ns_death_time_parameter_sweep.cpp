@@ -0,0 +1,198 @@
+#include "ns_death_time_parameter_sweep.h"
+#include "ns_columnar_file.h"
+#include "ns_thread_pool.h"
+#include <algorithm>
+#include <math.h>
+using namespace std;
+
+struct ns_hold_time_order_sorter{
+	ns_hold_time_order_sorter(const std::vector<double> & h):hold_times(h){}
+	bool operator()(const unsigned long a, const unsigned long b) const{return hold_times[a] < hold_times[b];}
+	const std::vector<double> & hold_times;
+};
+
+void ns_death_time_parameter_sweep::sort_hold_times(const std::vector<double> & hold_times, std::vector<unsigned long> & hold_time_order){
+	hold_time_order.resize(hold_times.size());
+	for (unsigned long i = 0; i < hold_times.size(); i++)
+		hold_time_order[i] = i;
+	std::stable_sort(hold_time_order.begin(),hold_time_order.end(),ns_hold_time_order_sorter(hold_times));
+}
+
+void ns_death_time_parameter_sweep::calculate_death_times(const unsigned long * times, const double * movement_scores, const unsigned long number_of_measurements, const unsigned long end_time,
+														  const std::vector<double> & thresholds, const std::vector<double> & hold_times, const std::vector<unsigned long> & hold_time_order,
+														  unsigned long * death_times){
+	const unsigned long number_of_hold_times(hold_times.size());
+	for (unsigned long t = 0; t < thresholds.size(); t++){
+		unsigned long * d(death_times + t*number_of_hold_times);
+		unsigned long next_hold_time(0);
+		if (number_of_measurements > 0){
+			//the animal is considered to be moving at the first measurement
+			unsigned long last_movement_time(times[0]);
+			for (unsigned long i = 0; i < number_of_measurements && next_hold_time < number_of_hold_times; i++){
+				if (movement_scores[i] >= thresholds[t])
+					last_movement_time = times[i];
+				const unsigned long time_since_movement(times[i]-last_movement_time);
+				//any hold time met now was not met earlier, so all shorter hold times have already been handled
+				while(next_hold_time < number_of_hold_times && time_since_movement >= hold_times[hold_time_order[next_hold_time]]){
+					d[hold_time_order[next_hold_time]] = last_movement_time;
+					next_hold_time++;
+				}
+			}
+		}
+		for (; next_hold_time < number_of_hold_times; next_hold_time++)
+			d[hold_time_order[next_hold_time]] = end_time;
+	}
+}
+
+void ns_death_time_parameter_sweep::set_parameters(const std::vector<double> & thresholds_, const std::vector<double> & hold_times_){
+	thresholds = thresholds_;
+	hold_times = hold_times_;
+	sort_hold_times(hold_times,hold_time_order);
+	paths.resize(0);
+	times.resize(0);
+	movement_scores.resize(0);
+	death_times.resize(0);
+}
+
+void ns_death_time_parameter_sweep::add_path(const ns_path_info & info, const std::vector<unsigned long> & times_, const std::vector<double> & movement_scores_, const unsigned long end_time){
+	if (times_.size() != movement_scores_.size())
+		throw ns_ex("ns_death_time_parameter_sweep::add_path()::") << times_.size() << " times were specified for " << movement_scores_.size() << " measurements";
+	paths.resize(paths.size()+1);
+	ns_path & p(*paths.rbegin());
+	p.info = info;
+	p.first_measurement = times.size();
+	p.number_of_measurements = times_.size();
+	p.end_time = end_time;
+	times.insert(times.end(),times_.begin(),times_.end());
+	movement_scores.insert(movement_scores.end(),movement_scores_.begin(),movement_scores_.end());
+}
+
+///Finds the death times of a contiguous range of paths.
+class ns_death_time_parameter_sweep_job : public ns_thread_pool_job{
+public:
+	ns_death_time_parameter_sweep_job():sweep(0),first_path(0),number_of_paths(0){}
+	void run(const unsigned long thread_id){
+		const unsigned long matrix_size(sweep->thresholds.size()*sweep->hold_times.size());
+		for (unsigned long i = first_path; i < first_path+number_of_paths; i++){
+			const ns_death_time_parameter_sweep::ns_path & p(sweep->paths[i]);
+			ns_death_time_parameter_sweep::calculate_death_times(
+				(p.number_of_measurements == 0)?0:&sweep->times[p.first_measurement],
+				(p.number_of_measurements == 0)?0:&sweep->movement_scores[p.first_measurement],
+				p.number_of_measurements,p.end_time,
+				sweep->thresholds,sweep->hold_times,sweep->hold_time_order,
+				&sweep->death_times[i*matrix_size]);
+		}
+	}
+	ns_death_time_parameter_sweep * sweep;
+	unsigned long first_path,
+				  number_of_paths;
+};
+
+void ns_death_time_parameter_sweep::run(const unsigned long number_of_threads){
+	death_times.resize(paths.size()*thresholds.size()*hold_times.size());
+	if (death_times.empty())
+		return;
+	ns_thread_pool pool(number_of_threads);
+	//use several jobs per thread so that threads given short paths can help with the rest
+	const unsigned long number_of_jobs(std::min((unsigned long)paths.size(),pool.number_of_threads()*8)),
+						paths_per_job((paths.size()+number_of_jobs-1)/number_of_jobs);
+	std::vector<ns_death_time_parameter_sweep_job> jobs;
+	jobs.reserve(number_of_jobs);
+	for (unsigned long i = 0; i < paths.size(); i+=paths_per_job){
+		jobs.resize(jobs.size()+1);
+		jobs.rbegin()->sweep = this;
+		jobs.rbegin()->first_path = i;
+		jobs.rbegin()->number_of_paths = std::min(paths_per_job,(unsigned long)paths.size()-i);
+	}
+	std::vector<ns_thread_pool_job *> job_pointers(jobs.size());
+	for (unsigned long i = 0; i < jobs.size(); i++)
+		job_pointers[i] = &jobs[i];
+	pool.run(job_pointers);
+}
+
+void ns_death_time_parameter_sweep::write(std::ostream & o) const{
+	if (death_times.size() != paths.size()*thresholds.size()*hold_times.size())
+		throw ns_ex("ns_death_time_parameter_sweep::write()::The sweep has not been run");
+	ns_columnar_file_writer writer(o,true);
+	{
+		ns_columnar_table t("thresholds");
+		const unsigned long c(t.add_column("threshold",ns_columnar_double));
+		t.begin_segment(0);
+		for (unsigned long i = 0; i < thresholds.size(); i++)
+			t.push(c,thresholds[i]);
+		writer.write(t);
+	}
+	{
+		ns_columnar_table t("hold_times");
+		const unsigned long c(t.add_column("hold_time",ns_columnar_double));
+		t.begin_segment(0);
+		for (unsigned long i = 0; i < hold_times.size(); i++)
+			t.push(c,hold_times[i]);
+		writer.write(t);
+	}
+	{
+		ns_columnar_table t("paths");
+		const unsigned long region_id(t.add_column("region_id",ns_columnar_int64)),
+							group_id(t.add_column("group_id",ns_columnar_int32)),
+							path_id(t.add_column("path_id",ns_columnar_int32)),
+							excluded(t.add_column("excluded",ns_columnar_int8)),
+							censored(t.add_column("censored",ns_columnar_int8)),
+							number_of_worms(t.add_column("number_of_worms",ns_columnar_int32)),
+							by_hand_death_time(t.add_column("by_hand_death_time",ns_columnar_int64)),
+							zero_age_time(t.add_column("time_at_which_animals_had_zero_age",ns_columnar_int64)),
+							normalization(t.add_column("movement_score_normalization",ns_columnar_int32)),
+							random_group(t.add_column("random_group",ns_columnar_int8));
+		t.begin_segment(0);
+		for (unsigned long i = 0; i < paths.size(); i++){
+			const ns_path_info & p(paths[i].info);
+			t.push(region_id,p.region_id);
+			t.push(group_id,p.group_id);
+			t.push(path_id,p.path_id);
+			t.push(excluded,p.excluded?1:0);
+			t.push(censored,p.censored?1:0);
+			t.push(number_of_worms,p.number_of_worms);
+			t.push(by_hand_death_time,p.by_hand_death_time);
+			t.push(zero_age_time,p.time_at_which_animals_had_zero_age);
+			t.push(normalization,p.movement_score_normalization);
+			t.push(random_group,p.random_group);
+		}
+		writer.write(t);
+	}
+	{
+		ns_columnar_table t("death_times");
+		const unsigned long c(t.add_column("death_time",ns_columnar_int64));
+		const unsigned long matrix_size(thresholds.size()*hold_times.size());
+		for (unsigned long i = 0; i < paths.size(); i++){
+			t.begin_segment(i);
+			for (unsigned long j = 0; j < matrix_size; j++)
+				t.push(c,death_times[i*matrix_size+j]);
+		}
+		writer.write(t);
+	}
+	writer.close();
+}
+
+void ns_death_time_parameter_sweep::write_csv(std::ostream & o) const{
+	if (death_times.size() != paths.size()*thresholds.size()*hold_times.size())
+		throw ns_ex("ns_death_time_parameter_sweep::write_csv()::The sweep has not been run");
+	for (unsigned long i = 0; i < paths.size(); i++){
+		const ns_path_info & p(paths[i].info);
+		const long by_hand_death_time(p.by_hand_death_time);
+		for (unsigned long t = 0; t < thresholds.size(); t++)
+			for (unsigned long h = 0; h < hold_times.size(); h++){
+				const unsigned long machine_death_time(death_time(i,t,h));
+				const double err(((double)machine_death_time - by_hand_death_time)/(60.0*60.0*24));
+				o << p.experiment_name << "," << p.device << "," << p.plate_name << "," << p.animal_details
+					<< "," << p.group_id << "," << p.path_id << ","
+					<< (p.excluded?"1":"0") << ","
+					<< (p.censored?"1":"0") << ","
+					<< p.number_of_worms << ","
+					<< thresholds[t] << "," << (hold_times[h])/60.0/60.0 << ","
+					<< p.denoising_technique << ","
+					<< (by_hand_death_time - p.time_at_which_animals_had_zero_age)/(60.0*60.0*24) << ","
+					<< (machine_death_time - p.time_at_which_animals_had_zero_age)/(60.0*60.0*24) << ","
+					<< by_hand_death_time << ","
+					<< err << "," << sqrt(err*err) << "," << p.random_group << "\n";
+			}
+	}
+}
@@ -0,0 +1,94 @@
+#ifndef NS_DEATH_TIME_PARAMETER_SWEEP
+#define NS_DEATH_TIME_PARAMETER_SWEEP
+#include "ns_ex.h"
+#include <vector>
+#include <string>
+#include <ostream>
+
+///ns_death_time_parameter_sweep finds, for many paths at once, the death time that the movement threshold posture analysis
+///would produce under every combination of movement threshold and hold time, so that the combination that best
+///matches by-hand annotations can be chosen.
+///
+///An animal is called dead at the last time its movement score met the threshold, once it has spent at least the hold time
+///without meeting it again.  The movement scores of each path are copied once, when the path is added, into flat arrays
+///shared by all paths.  Each path is then scanned once per threshold: hold times are handled in increasing order,
+///so a single scan finds the death times for all of them.  Paths are divided between threads, each of which writes
+///its own part of the result matrix.
+///
+///The results can be written as a columnar file (see ns_columnar_file.h) containing the tables
+///"thresholds" and "hold_times" (the parameter grid, in the order specified), "paths" (one row per path), and
+///"death_times", which holds one segment per path, keyed by the path's row in "paths".  Each segment contains the path's
+///death times, ordered by threshold and then by hold time.
+///The same results can also be written as CSV, with one line per path and parameter combination identifying the path
+///by experiment, device, plate, and strain (see ns_analyzed_image_time_path::write_analysis_optimization_data_header()).
+class ns_death_time_parameter_sweep{
+public:
+	struct ns_path_info{
+		ns_path_info():region_id(0),group_id(0),path_id(0),excluded(false),censored(false),number_of_worms(1),
+			by_hand_death_time(0),time_at_which_animals_had_zero_age(0),movement_score_normalization(0),random_group(0){}
+		ns_64_bit region_id;
+		std::string experiment_name,
+					device,
+					plate_name,
+					animal_details,
+					denoising_technique;
+		unsigned long group_id,
+					  path_id;
+		bool excluded,
+			 censored;
+		unsigned long number_of_worms,
+					  by_hand_death_time,
+					  time_at_which_animals_had_zero_age;
+		int movement_score_normalization;
+		//paths are randomly split into two groups so that parameters chosen using one can be tested on the other
+		unsigned long random_group;
+	};
+
+	///clears all paths and results
+	void set_parameters(const std::vector<double> & thresholds, const std::vector<double> & hold_times);
+
+	///Adds a path whose valid measurements were taken at the specified times (in increasing order).
+	///If no death is found, the death time is taken to be end_time.
+	void add_path(const ns_path_info & info, const std::vector<unsigned long> & times, const std::vector<double> & movement_scores, const unsigned long end_time);
+
+	///if number_of_threads is zero, one thread is used for each processor on the machine
+	void run(const unsigned long number_of_threads=0);
+
+	unsigned long number_of_paths() const{return (unsigned long)paths.size();}
+	const ns_path_info & path_info(const unsigned long path) const{return paths[path].info;}
+	unsigned long death_time(const unsigned long path, const unsigned long threshold, const unsigned long hold_time) const{
+		return death_times[(path*thresholds.size()+threshold)*hold_times.size()+hold_time];
+	}
+
+	void write(std::ostream & o) const;
+	///writes the lines that follow the header written by ns_analyzed_image_time_path::write_analysis_optimization_data_header()
+	void write_csv(std::ostream & o) const;
+
+	///Finds the death times of a single path for every combination of threshold and hold time.
+	///hold_time_order lists the indices of hold_times in order of increasing hold time.
+	///death_times must have room for thresholds.size()*hold_times.size() values, ordered by threshold and then by hold time.
+	static void calculate_death_times(const unsigned long * times, const double * movement_scores, const unsigned long number_of_measurements, const unsigned long end_time,
+									  const std::vector<double> & thresholds, const std::vector<double> & hold_times, const std::vector<unsigned long> & hold_time_order,
+									  unsigned long * death_times);
+	static void sort_hold_times(const std::vector<double> & hold_times, std::vector<unsigned long> & hold_time_order);
+
+private:
+	struct ns_path{
+		ns_path_info info;
+		unsigned long first_measurement,
+					  number_of_measurements,
+					  end_time;
+	};
+	std::vector<double> thresholds,
+						hold_times;
+	std::vector<unsigned long> hold_time_order;
+
+	std::vector<ns_path> paths;
+	std::vector<unsigned long> times;
+	std::vector<double> movement_scores;
+
+	std::vector<unsigned long> death_times;
+	friend class ns_death_time_parameter_sweep_job;
+};
+
+#endif
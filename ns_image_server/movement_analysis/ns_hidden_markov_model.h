@@ -4,6 +4,7 @@
 #include <vector>
 #include <iostream>
 #include <math.h>
+#include <limits>
 struct ns_state_loglikelihood_timeseries{
 	std::vector<double> loglikelihood;
 };
@@ -254,4 +255,214 @@ public:
 		}
 	}
 };
+///ns_hidden_markov_loglikelihood_table holds the loglikelihood that each state produced each observation in one or more time series,
+///along with running sums so that the loglikelihood of a state occupying any interval can be looked up in constant time.
+///Several series (for example, one per path in a region) can be stored in the same table and solved together
+///by ns_sequential_hidden_markov_viterbi_estimator.  Storage is kept when the table is cleared, so a table reused
+///across many series does not allocate memory once it has seen the largest set.
+class ns_hidden_markov_loglikelihood_table{
+public:
+	ns_hidden_markov_loglikelihood_table():number_of_states_(0){}
+
+	void clear(const int number_of_states){
+		number_of_states_ = number_of_states;
+		series_length.resize(0);
+		series_offset.resize(0);
+		observation_loglikelihoods.resize(0);
+		from_start.resize(0);
+		to_end.resize(0);
+		state_excluded.resize(0);
+		state_excluded.resize(number_of_states,0);
+	}
+	///excluded states are skipped in every solution
+	void exclude_state(const int state){state_excluded[state] = 1;}
+	bool state_is_excluded(const int state) const{return state_excluded[state] != 0;}
+
+	///adds a series with the specified number of observations and returns its index.
+	///Each observation's loglikelihoods must then be set, after which calculate_interval_sums() must be called.
+	unsigned long add_series(const unsigned long number_of_observations){
+		series_length.push_back(number_of_observations);
+		series_offset.push_back(observation_loglikelihoods.size());
+		const unsigned long size(observation_loglikelihoods.size()+number_of_states_*(number_of_observations+1));
+		observation_loglikelihoods.resize(size,0);
+		from_start.resize(size,0);
+		to_end.resize(size,0);
+		return series_length.size()-1;
+	}
+	double & observation_loglikelihood(const unsigned long series, const int state, const unsigned long i){return observation_loglikelihoods[cell(series,state,i)];}
+	double observation_loglikelihood(const unsigned long series, const int state, const unsigned long i) const{return observation_loglikelihoods[cell(series,state,i)];}
+
+	///calculates the loglikelihood of each state occupying every interval that starts at the first observation
+	///or ends at the last one.  The loglikelihood of every other interval is the difference of two of these sums.
+	void calculate_interval_sums(const unsigned long series){
+		const unsigned long n(series_length[series]);
+		for (int s = 0; s < number_of_states_; s++){
+			const unsigned long c(cell(series,s,0));
+			from_start[c] = 0;
+			for (unsigned long i = 0; i < n; i++)
+				from_start[c+i+1] = from_start[c+i] + observation_loglikelihoods[c+i];
+			//sum backwards, rather than subtracting from the total, so that intervals at the end of the series do not accumulate rounding error
+			to_end[c+n] = 0;
+			for (long i = (long)n-1; i >= 0; i--)
+				to_end[c+i] = to_end[c+i+1] + observation_loglikelihoods[c+i];
+		}
+	}
+	///Models whose likelihoods are not simple sums over the interval can replace the loglikelihood of
+	///a state occupying the observations [0,stop) or [start,n), after calculate_interval_sums() has been called.
+	void set_loglikelihood_from_start(const unsigned long series, const int state, const unsigned long stop, const double loglikelihood){from_start[cell(series,state,stop)] = loglikelihood;}
+	void set_loglikelihood_to_end(const unsigned long series, const int state, const unsigned long start, const double loglikelihood){to_end[cell(series,state,start)] = loglikelihood;}
+
+	///the loglikelihood of the state occupying the observations [start,stop)
+	double interval_loglikelihood(const unsigned long series, const int state, const unsigned long start, const unsigned long stop) const{
+		const unsigned long c(cell(series,state,0));
+		if (start == 0)
+			return from_start[c+stop];
+		if (stop == series_length[series])
+			return to_end[c+start];
+		return from_start[c+stop]-from_start[c+start];
+	}
+	double loglikelihood_from_start(const unsigned long series, const int state, const unsigned long stop) const{return from_start[cell(series,state,stop)];}
+	double loglikelihood_to_end(const unsigned long series, const int state, const unsigned long start) const{return to_end[cell(series,state,start)];}
+
+	int number_of_states() const{return number_of_states_;}
+	unsigned long number_of_series() const{return (unsigned long)series_length.size();}
+	unsigned long number_of_observations(const unsigned long series) const{return series_length[series];}
+
+private:
+	//each series stores, for each state, a row of number_of_observations+1 values
+	unsigned long cell(const unsigned long series, const int state, const unsigned long i) const{return series_offset[series]+state*(series_length[series]+1)+i;}
+	int number_of_states_;
+	std::vector<unsigned long> series_length,
+							   series_offset;
+	std::vector<double> observation_loglikelihoods,
+						from_start,
+						to_end;
+	std::vector<char> state_excluded;
+};
+
+///ns_sequential_hidden_markov_viterbi_estimator finds the same kind of solution as ns_sequential_hidden_markov_state_estimator:
+///the states are visited in order, each either skipped or occupying a contiguous, non-empty interval,
+///and the most likely such sequence is chosen.  Rather than searching over candidate solutions, it uses dynamic programming:
+///for each state s and observation t, it finds the most likely solution for the first t observations that ends in state s.
+///Using the interval sums held by ns_hidden_markov_loglikelihood_table, each series is solved in O(number_of_states^2 * number_of_observations) time.
+///Where several solutions are equally likely, the one that enters the last state earliest is chosen, which matches the order in which
+///ns_sequential_hidden_markov_state_estimator considers solutions when only the last two states are allowed.
+///All storage is kept between calls, so an estimator should be reused across series and used by only one thread at a time.
+class ns_sequential_hidden_markov_viterbi_estimator{
+public:
+	void run(const ns_hidden_markov_loglikelihood_table & table, const unsigned long series, ns_sequential_hidden_markov_solution & solution){
+		const int number_of_states(table.number_of_states());
+		const unsigned long n(table.number_of_observations(series)),
+							width(n+1);
+		if (n == 0)
+			throw ns_ex("ns_sequential_hidden_markov_viterbi_estimator::run()::Empty time series received");
+		const double minus_infinity(-std::numeric_limits<double>::infinity());
+
+		best.resize(0);
+		best.resize(number_of_states*width,minus_infinity);
+		previous_state.resize(0);
+		previous_state.resize(number_of_states*width,-1);
+		previous_index.resize(0);
+		previous_index.resize(number_of_states*width,0);
+		//the most likely solution for the first t observations that ends in any of the states already processed
+		best_earlier_state.resize(0);
+		best_earlier_state.resize(width,minus_infinity);
+		best_earlier_state_id.resize(0);
+		best_earlier_state_id.resize(width,-1);
+
+		for (int s = 0; s < number_of_states; s++){
+			if (table.state_is_excluded(s))
+				continue;
+			double * b(&best[s*width]);
+			long * ps(&previous_state[s*width]),
+				 * pi(&previous_index[s*width]);
+			//the most likely way to enter state s at or before t-1, minus the likelihood of the observations in state s before that entry
+			double running_maximum(minus_infinity);
+			long running_maximum_index(-1);
+			for (unsigned long t = 1; t < n; t++){
+				if (t > 1 && best_earlier_state_id[t-1] != -1){
+					const double d(best_earlier_state[t-1] - table.loglikelihood_from_start(series,s,t-1));
+					if (running_maximum_index == -1 || d > running_maximum){
+						running_maximum = d;
+						running_maximum_index = t-1;
+					}
+				}
+				b[t] = table.loglikelihood_from_start(series,s,t);
+				if (running_maximum_index != -1){
+					const double d(running_maximum + table.loglikelihood_from_start(series,s,t));
+					if (d > b[t]){
+						b[t] = d;
+						ps[t] = best_earlier_state_id[running_maximum_index];
+						pi[t] = running_maximum_index;
+					}
+				}
+			}
+			//solutions that end in state s.  The first candidate occupies s from the start, and later candidates enter s later.
+			b[n] = table.loglikelihood_from_start(series,s,n);
+			for (unsigned long t = 1; t < n; t++){
+				if (best_earlier_state_id[t] == -1)
+					continue;
+				const double d(best_earlier_state[t] + table.loglikelihood_to_end(series,s,t));
+				if (d > b[n]){
+					b[n] = d;
+					ps[n] = best_earlier_state_id[t];
+					pi[n] = t;
+				}
+			}
+			for (unsigned long t = 1; t < n; t++){
+				if (best_earlier_state_id[t] == -1 || b[t] > best_earlier_state[t]){
+					best_earlier_state[t] = b[t];
+					best_earlier_state_id[t] = s;
+				}
+			}
+		}
+
+		//prefer solutions that enter the last state
+		int last_state(-1);
+		for (int s = number_of_states-1; s >= 0; s--){
+			if (table.state_is_excluded(s))
+				continue;
+			if (last_state == -1 || best[s*width+n] > best[last_state*width+n])
+				last_state = s;
+		}
+		if (last_state == -1)
+			throw ns_ex("ns_sequential_hidden_markov_viterbi_estimator::run()::All states are excluded");
+
+		solution = ns_sequential_hidden_markov_solution(number_of_states);
+		for (int s = 0; s < number_of_states; s++)
+			solution.state_start_indices[s] = ns_sequential_hidden_markov_solution::ns_skipped;
+		int state(last_state);
+		unsigned long stop(n);
+		while(true){
+			const long p(previous_state[state*width+stop]);
+			const unsigned long start((p == -1)?0:previous_index[state*width+stop]);
+			solution.state_start_indices[state] = start;
+			solution.state_loglikelihoods[state] = table.interval_loglikelihood(series,state,start,stop);
+			if (p == -1)
+				break;
+			state = p;
+			stop = start;
+		}
+		//sum the states in order, as ns_sequential_hidden_markov_state_estimator does
+		solution.cumulative_solution_loglikelihood = 0;
+		for (int s = 0; s < number_of_states; s++)
+			if (!solution.state_was_skipped(s))
+				solution.cumulative_solution_loglikelihood += solution.state_loglikelihoods[s];
+		solution.set_current_state(number_of_states);
+	}
+
+	///solves every series in the table
+	void run(const ns_hidden_markov_loglikelihood_table & table, std::vector<ns_sequential_hidden_markov_solution> & solutions){
+		solutions.clear();
+		solutions.resize(table.number_of_series(),ns_sequential_hidden_markov_solution(table.number_of_states()));
+		for (unsigned long i = 0; i < table.number_of_series(); i++)
+			run(table,i,solutions[i]);
+	}
+private:
+	std::vector<double> best,
+						best_earlier_state;
+	std::vector<long> previous_state,
+					  previous_index,
+					  best_earlier_state_id;
+};
 #endif
@@ -87,7 +87,37 @@ public:
 	mutable std::vector<double> moving_cumulative_loglikelihood;
 	mutable std::vector<double> reverse_cumulative_dead_loglikelihood;
 
-	const ns_emperical_posture_quantification_value_estimator value_estimator;
+	//Adds the series to the table, giving each interval the loglikelihood calculated by operator() when no window is used.
+	unsigned long add_to_table(const std::vector<double> & movement, ns_hidden_markov_loglikelihood_table & table) const{
+		if (likelihood_window_size > 0)
+			throw ns_ex("ns_posture_change_markov_likelihood_estimator::add_to_table()::Windowed likelihoods cannot be tabulated");
+		if (movement.size() == 0)
+			throw ns_ex("ns_posture_change_markov_likelihood_estimator::add_to_table()::Empty time series received");
+		const unsigned long n(movement.size()),
+							series(table.add_series(n));
+		table.exclude_state(ns_moving);
+		for (unsigned long i = 0; i < n; i++){
+			table.observation_loglikelihood(series,ns_moving,i) = 0;
+			table.observation_loglikelihood(series,ns_slowing,i) = loglikelihood_of_moving_animal(movement[i]);
+			table.observation_loglikelihood(series,ns_dead,i) = loglikelihood_of_dead_animal(movement[i]);
+		}
+		table.calculate_interval_sums(series);
+		//operator() includes the observation at stop_index in slowing intervals that start at zero
+		for (unsigned long k = 1; k <= n; k++)
+			table.set_loglikelihood_from_start(series,ns_slowing,k,table.loglikelihood_from_start(series,ns_slowing,(k+1<n)?(k+1):n));
+		//and sums dead intervals that end at the last observation backwards, even when they start at zero
+		table.set_loglikelihood_from_start(series,ns_dead,n,table.loglikelihood_to_end(series,ns_dead,0));
+		return series;
+	}
+	double fill_in_loglikelihood_timeseries(int state, unsigned long index, const ns_hidden_markov_loglikelihood_table & table, const unsigned long series) const{
+		if (state == ns_slowing)
+			return table.loglikelihood_from_start(series,state,index+1);
+		if (state == ns_dead)
+			return table.loglikelihood_to_end(series,state,index);
+		return 1;
+	}
+
+	const ns_emperical_posture_quantification_value_estimator & value_estimator;
 };
 
 double inline ns_truncate_positive(const double & d){
@@ -135,14 +165,15 @@ void ns_posture_change_markov_likelihood_estimator::calculate_cumulative_loglike
 	out.close();*/
 };
 
-ns_time_path_posture_movement_solution ns_time_path_movement_markov_solver::estimate_posture_movement_states(const ns_analyzed_image_time_path * path, ns_analyzed_image_time_path * output_path, std::ostream * debug_output)const{
-	std::vector<double> movement_ratio, 
-					    tm;
-	std::vector<unsigned long> index_mapping;
+//collects the movement scores of all elements that are not excluded, recording the index of each in the path.
+//index_mapping ends with the number of elements in the path.
+void ns_get_posture_analysis_series(const ns_analyzed_image_time_path * path, std::vector<double> & movement_ratio, std::vector<double> & tm, std::vector<unsigned long> & index_mapping){
+	movement_ratio.resize(0);
+	tm.resize(0);
+	index_mapping.resize(0);
 	movement_ratio.reserve(path->element_count());
 	index_mapping.reserve(path->element_count()+1);
-	tm.reserve(path->element_count()); //we use tm to 
-	
+	tm.reserve(path->element_count()); 
 	for (unsigned int i = 0; i < path->element_count(); i++){
 		if (path->element(i).excluded)
 			continue;
@@ -151,12 +182,58 @@ ns_time_path_posture_movement_solution ns_time_path_movement_markov_solver::esti
 		index_mapping.push_back(i);
 	}
 	index_mapping.push_back(path->element_count());
-	//we ran the analysis using only data that was not excluded
-	//now we must replace the internal indices to our non-excluded time series
-	//with those that match the original time series
+}
+
+ns_time_path_posture_movement_solution ns_posture_movement_solution_from_markov_solution(const ns_sequential_hidden_markov_solution & markov_solution, const unsigned long number_of_observations){
+	ns_time_path_posture_movement_solution sol;
+	sol.loglikelihood_of_solution = markov_solution.cumulative_solution_loglikelihood;
+	sol.moving.skipped = markov_solution.state_was_skipped(0);
+	sol.slowing.skipped = markov_solution.state_was_skipped(1);
+	sol.dead.skipped = markov_solution.state_was_skipped(2);
+	if (!sol.moving.skipped){
+		sol.moving.start_index = markov_solution.state_start_indices[0];
+		if (!sol.slowing.skipped)
+			sol.moving.end_index = markov_solution.state_start_indices[1];
+		else if (!sol.dead.skipped)
+			sol.moving.end_index = markov_solution.state_start_indices[2];
+		else sol.moving.end_index = number_of_observations;
+	}
+	if (!sol.slowing.skipped){
+		sol.slowing.start_index = markov_solution.state_start_indices[1];
+		if (!sol.dead.skipped)
+			sol.slowing.end_index = markov_solution.state_start_indices[2];
+		else sol.slowing.end_index = number_of_observations;
+	}	
+	if (!sol.dead.skipped){
+		sol.dead.start_index = markov_solution.state_start_indices[2];
+		sol.dead.end_index = number_of_observations;
+	}
+	return sol;
+}
+
+//we ran the analysis using only data that was not excluded
+//now we must replace the internal indices to our non-excluded time series
+//with those that match the original time series
+void ns_map_posture_movement_solution_to_path(const unsigned long * index_mapping, ns_time_path_posture_movement_solution & solution){
+	if (!solution.dead.skipped){
+		solution.dead.start_index = index_mapping[solution.dead.start_index];
+		solution.dead.end_index = index_mapping[solution.dead.end_index];
+	}
+	if (!solution.moving.skipped){
+		solution.moving.start_index = index_mapping[solution.moving.start_index];
+		solution.moving.end_index = index_mapping[solution.moving.end_index];
+	}
+	if (!solution.slowing.skipped){
+		solution.slowing.start_index = index_mapping[solution.slowing.start_index];
+		solution.slowing.end_index = index_mapping[solution.slowing.end_index];
+	}
+}
+
+ns_time_path_posture_movement_solution ns_time_path_movement_markov_solver::estimate_posture_movement_states(const ns_analyzed_image_time_path * path, ns_analyzed_image_time_path * output_path, std::ostream * debug_output)const{
+	ns_get_posture_analysis_series(path,movement_ratio_temp,tm_temp,index_mapping_temp);
 	
 	ns_sequential_hidden_markov_solution markov_solution(3);
-	ns_time_path_posture_movement_solution solution(estimate_posture_movement_states(movement_ratio,tm,output_path!=0,markov_solution,debug_output));
+	ns_time_path_posture_movement_solution solution(estimate_posture_movement_states(movement_ratio_temp,tm_temp,output_path!=0,markov_solution,debug_output));
 	if (output_path != 0){
 		output_path->posture_quantification_extra_debug_field_names.resize(markov_solution.number_of_states()+1);
 		output_path->posture_quantification_extra_debug_field_names[0] = "Slow Moving State Loglikelihood";
@@ -164,7 +241,7 @@ ns_time_path_posture_movement_solution ns_time_path_movement_markov_solver::esti
 		output_path->posture_quantification_extra_debug_field_names[2] = "Dead Loglikelihood";
 		output_path->posture_quantification_extra_debug_field_names[3] = "Total Model Loglikelihood";
 		for (unsigned int i = 0; i < markov_solution.debug_state_loglikelihoods_over_time.size(); i++){
-			const int j = index_mapping[i];
+			const int j = index_mapping_temp[i];
 			output_path->element(j).measurements.posture_quantification_extra_debug_fields.resize(markov_solution.number_of_states()+1);
 			for (unsigned int k = 0; k < markov_solution.number_of_states(); k++){
 				output_path->element(j).measurements.posture_quantification_extra_debug_fields[k] = markov_solution.debug_state_loglikelihoods_over_time[i].loglikelihood[k];
@@ -174,18 +251,7 @@ ns_time_path_posture_movement_solution ns_time_path_movement_markov_solver::esti
 				output_path->element(j).measurements.posture_quantification_extra_debug_fields[2];
 		}
 	}
-	if (!solution.dead.skipped){
-		solution.dead.start_index = index_mapping[solution.dead.start_index];
-		solution.dead.end_index = index_mapping[solution.dead.end_index];
-	}
-	if (!solution.moving.skipped){
-		solution.moving.start_index = index_mapping[solution.moving.start_index];
-		solution.moving.end_index = index_mapping[solution.moving.end_index];
-	}
-	if (!solution.slowing.skipped){
-		solution.slowing.start_index = index_mapping[solution.slowing.start_index];
-		solution.slowing.end_index = index_mapping[solution.slowing.end_index];
-	}
+	ns_map_posture_movement_solution_to_path(&index_mapping_temp[0],solution);
 	return solution;
 }
 
@@ -194,34 +260,55 @@ ns_time_path_posture_movement_solution ns_time_path_movement_markov_solver::esti
 /*	for (unsigned int i = 0; i < movement_ratio.size(); i++)
 		if (movement_ratio[i] <= 0)
 			throw ns_ex("ns_movement_markov_solver()::solve()::Cannot handle negative ratios!");*/
+	if (tm.size() != movement_ratio.size())
+		throw ns_ex("ns_time_path_movement_markov_solver::estimate_posture_movement_states()::x and y do not agree in size");
+
+	//the exhaustive search of ns_sequential_hidden_markov_state_estimator finds the same solutions, but takes much longer.
+	const ns_posture_change_markov_likelihood_estimator likelihood_estimator(estimator,0);
+	loglikelihood_table.clear(likelihood_estimator.state_count());
+	const unsigned long series(likelihood_estimator.add_to_table(movement_ratio,loglikelihood_table));
+	markov_estimator.run(loglikelihood_table,series,markov_solution);
+
+	if (output_loglikelihood_series){
+		markov_solution.debug_state_loglikelihoods_over_time.resize(movement_ratio.size());
+		for (unsigned int i = 0; i < movement_ratio.size(); i++){
+			markov_solution.debug_state_loglikelihoods_over_time[i].loglikelihood.resize(likelihood_estimator.state_count());
+			for (int s = 0; s < likelihood_estimator.state_count(); s++)
+				markov_solution.debug_state_loglikelihoods_over_time[i].loglikelihood[s] = likelihood_estimator.fill_in_loglikelihood_timeseries(s,i,loglikelihood_table,series);
+		}
+	}
+	if (debug_output){
+		*debug_output << "Best solution: ";
+		for (int j = 0; j < markov_solution.number_of_states(); j++){
+			if (markov_solution.state_was_skipped(j))
+				*debug_output << "s ";
+			else *debug_output << markov_solution.state_start_indices[j] << " ";
+		}
+		*debug_output << ": " << markov_solution.cumulative_solution_loglikelihood << "\n";
+	}
+	return ns_posture_movement_solution_from_markov_solution(markov_solution,movement_ratio.size());
+}
 
-	ns_time_path_posture_movement_solution sol;
-	ns_sequential_hidden_markov_state_estimator<3,ns_posture_change_markov_likelihood_estimator> markov_estimator(debug_output);
-
-	markov_estimator.run(markov_solution,movement_ratio,tm,ns_posture_change_markov_likelihood_estimator(estimator,0),output_loglikelihood_series);
-	sol.loglikelihood_of_solution = markov_solution.cumulative_solution_loglikelihood;
-	sol.moving.skipped = markov_solution.state_was_skipped(0);
-	sol.slowing.skipped = markov_solution.state_was_skipped(1);
-	sol.dead.skipped = markov_solution.state_was_skipped(2);
-	if (!sol.moving.skipped){
-		sol.moving.start_index = markov_solution.state_start_indices[0];
-		if (!sol.slowing.skipped)
-			sol.moving.end_index = markov_solution.state_start_indices[1];
-		else if (!sol.dead.skipped)
-			sol.moving.end_index = markov_solution.state_start_indices[2];
-		else sol.moving.end_index = movement_ratio.size();
+void ns_time_path_movement_markov_solver::estimate_posture_movement_states(const std::vector<const ns_analyzed_image_time_path *> & paths, std::vector<ns_time_path_posture_movement_solution> & solutions) const{
+	const ns_posture_change_markov_likelihood_estimator likelihood_estimator(estimator,0);
+	loglikelihood_table.clear(likelihood_estimator.state_count());
+	//the index mappings of all paths are stored one after another
+	std::vector<unsigned long> index_mapping,
+							   index_mapping_start(paths.size());
+	for (unsigned int i = 0; i < paths.size(); i++){
+		ns_get_posture_analysis_series(paths[i],movement_ratio_temp,tm_temp,index_mapping_temp);
+		if (movement_ratio_temp.empty())
+			throw ns_ex("ns_time_path_movement_markov_solver::estimate_posture_movement_states()::Path ") << i << " has no measurements that are not excluded";
+		likelihood_estimator.add_to_table(movement_ratio_temp,loglikelihood_table);
+		index_mapping_start[i] = index_mapping.size();
+		index_mapping.insert(index_mapping.end(),index_mapping_temp.begin(),index_mapping_temp.end());
 	}
-	if (!sol.slowing.skipped){
-		sol.slowing.start_index = markov_solution.state_start_indices[1];
-		if (!sol.dead.skipped)
-			sol.slowing.end_index = markov_solution.state_start_indices[2];
-		else sol.slowing.end_index = movement_ratio.size();
-	}	
-	if (!sol.dead.skipped){
-		sol.dead.start_index = markov_solution.state_start_indices[2];
-		sol.dead.end_index = movement_ratio.size();
+	markov_estimator.run(loglikelihood_table,markov_solutions_temp);
+	solutions.resize(paths.size());
+	for (unsigned int i = 0; i < paths.size(); i++){
+		solutions[i] = ns_posture_movement_solution_from_markov_solution(markov_solutions_temp[i],loglikelihood_table.number_of_observations(i));
+		ns_map_posture_movement_solution_to_path(&index_mapping[index_mapping_start[i]],solutions[i]);
 	}
-	return sol;
 }
 
 void ns_emperical_posture_quantification_value_estimator::read(std::istream & moving_cdf_in,std::istream & dead_cdf_in){
@@ -97,10 +97,23 @@ public:
 
 	ns_time_path_posture_movement_solution estimate_posture_movement_states(const ns_analyzed_image_time_path * source_path, ns_analyzed_image_time_path * output_path = 0,std::ostream * debug_output=0) const;
 	ns_time_path_posture_movement_solution estimate_posture_movement_states(const std::vector<double> & movement_ratio, const std::vector<double> & tm, bool output_loglikelihood_series, ns_sequential_hidden_markov_solution & solution,std::ostream * debug_output=0) const;
+	
+	///Estimates the states of many paths at once, placing all their loglikelihoods in one table.
+	///This is much faster than solving each path separately when rerunning the model over every path in an experiment,
+	///for example while tuning the parameters of a ns_posture_analysis_model.
+	void estimate_posture_movement_states(const std::vector<const ns_analyzed_image_time_path *> & paths, std::vector<ns_time_path_posture_movement_solution> & solutions) const;
 	const ns_emperical_posture_quantification_value_estimator & estimator;
 
 	unsigned long latest_possible_death_time(const ns_analyzed_image_time_path * path,
 		const unsigned long last_observation_time) const{return  last_observation_time; }
+private:
+	//reused between paths, so a solver can be used by only one thread at a time
+	mutable ns_hidden_markov_loglikelihood_table loglikelihood_table;
+	mutable ns_sequential_hidden_markov_viterbi_estimator markov_estimator;
+	mutable std::vector<double> movement_ratio_temp,
+								tm_temp;
+	mutable std::vector<unsigned long> index_mapping_temp;
+	mutable std::vector<ns_sequential_hidden_markov_solution> markov_solutions_temp;
 };
 
 
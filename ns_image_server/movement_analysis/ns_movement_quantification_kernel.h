@@ -0,0 +1,177 @@
+#ifndef NS_MOVEMENT_QUANTIFICATION_KERNEL
+#define NS_MOVEMENT_QUANTIFICATION_KERNEL
+#include "ns_ex.h"
+#include <stdlib.h>
+
+//Calculates, in a single pass over each registered image, all the per-pixel sums
+//that ns_analyzed_image_time_path::quantify_movement() stores in ns_analyzed_image_time_path_element_measurements.
+//
+//Each row is read as three contiguous arrays: the registered image, the movement image,
+//and the worm/region threshold bitmap of ns_registered_image_set.
+//32 pixels are processed at a time using AVX2 if it is available.
+//Pixels at the end of a row, and all pixels on machines without AVX2, are processed by the scalar kernel.
+//Both kernels reproduce the results of the original per-pixel loops exactly.  The benchmark_movement_quantification
+//command confirms this on synthetic images; define NS_CHECK_MOVEMENT_QUANTIFICATION_KERNEL
+//to have quantify_movement() also confirm it on every image it processes by repeating those loops.
+//
+//The threshold bits are specified by the caller (see ns_registered_image_set).
+
+#if defined(__AVX2__)
+	#include <immintrin.h>
+	#define NS_MOVEMENT_QUANTIFICATION_USE_AVX2
+#endif
+
+struct ns_movement_quantification_sums{
+	ns_movement_quantification_sums(){zero();}
+	void zero(){
+		total_intensity_within_region =
+		total_intensity_within_worm_area =
+		total_worm_area =
+		unnormalized_movement_sum =
+		total_alternate_worm_area =
+		total_intensity_within_alternate_worm = 0;
+		alternate_movement_sum = 0;
+	}
+	bool operator==(const ns_movement_quantification_sums & s) const{
+		return total_intensity_within_region == s.total_intensity_within_region &&
+			   total_intensity_within_worm_area == s.total_intensity_within_worm_area &&
+			   total_worm_area == s.total_worm_area &&
+			   unnormalized_movement_sum == s.unnormalized_movement_sum &&
+			   total_alternate_worm_area == s.total_alternate_worm_area &&
+			   total_intensity_within_alternate_worm == s.total_intensity_within_alternate_worm &&
+			   alternate_movement_sum == s.alternate_movement_sum;
+	}
+	//sums over all pixels
+	ns_64_bit total_intensity_within_region;
+	//sums over pixels in the worm neighborhood
+	ns_64_bit total_intensity_within_worm_area,
+			  total_worm_area,
+			  unnormalized_movement_sum;
+	//sums over pixels in the region threshold but outside the worm neighborhood
+	ns_64_bit total_alternate_worm_area,
+			  total_intensity_within_alternate_worm;
+	ns_s64_bit alternate_movement_sum;
+};
+
+template<int region_mask, int worm_neighborhood_mask>
+class ns_movement_quantification_kernel{
+public:
+
+	//Adds the contribution of one row of width pixels to sums.
+	//The movement of each pixel in the worm neighborhood (and zero elsewhere) is written to masked_movement,
+	//truncated to 8 bits, for use by the local maximum search.
+	static inline void run(const ns_8_bit * image, const short * movement, const ns_8_bit * threshold,
+						   const unsigned long width, ns_8_bit * masked_movement, ns_movement_quantification_sums & sums){
+		unsigned long x(0);
+		#ifdef NS_MOVEMENT_QUANTIFICATION_USE_AVX2
+		//the movement sums are accumulated in 32 bit lanes, which are flushed
+		//to the 64 bit totals often enough that they cannot overflow.
+		const unsigned long pixels_per_block(4096);
+		while (x + 32 <= width){
+			unsigned long block_end(x+pixels_per_block);
+			if (block_end > width)
+				block_end = width;
+			const __m256i zero(_mm256_setzero_si256()),
+						  ones_8(_mm256_set1_epi8(1)),
+						  ones_16(_mm256_set1_epi16(1)),
+						  low_byte(_mm256_set1_epi16(0xFF)),
+						  region_bit(_mm256_set1_epi8(region_mask)),
+						  worm_neighborhood_bit(_mm256_set1_epi8(worm_neighborhood_mask));
+			__m256i region_intensity(zero),
+					worm_intensity(zero),
+					worm_area(zero),
+					alternate_area(zero),
+					alternate_intensity(zero),
+					worm_movement(zero),
+					alternate_movement(zero);
+			for (; x + 32 <= block_end; x+=32){
+				const __m256i t(_mm256_loadu_si256((const __m256i *)(threshold+x))),
+							  im(_mm256_loadu_si256((const __m256i *)(image+x)));
+				//0xFF where the bit is set, 0 elsewhere
+				const __m256i worm(_mm256_cmpeq_epi8(_mm256_and_si256(t,worm_neighborhood_bit),worm_neighborhood_bit)),
+							  region(_mm256_cmpeq_epi8(_mm256_and_si256(t,region_bit),region_bit)),
+							  alternate(_mm256_andnot_si256(worm,region));
+
+				//the sums of absolute differences against zero add up each group of 8 bytes into a 64 bit lane
+				region_intensity = _mm256_add_epi64(region_intensity,_mm256_sad_epu8(im,zero));
+				worm_intensity = _mm256_add_epi64(worm_intensity,_mm256_sad_epu8(_mm256_and_si256(im,worm),zero));
+				alternate_intensity = _mm256_add_epi64(alternate_intensity,_mm256_sad_epu8(_mm256_and_si256(im,alternate),zero));
+				worm_area = _mm256_add_epi64(worm_area,_mm256_sad_epu8(_mm256_and_si256(ones_8,worm),zero));
+				alternate_area = _mm256_add_epi64(alternate_area,_mm256_sad_epu8(_mm256_and_si256(ones_8,alternate),zero));
+
+				const __m256i m0(_mm256_loadu_si256((const __m256i *)(movement+x))),
+							  m1(_mm256_loadu_si256((const __m256i *)(movement+x+16))),
+							  worm0(_mm256_cvtepi8_epi16(_mm256_castsi256_si128(worm))),
+							  worm1(_mm256_cvtepi8_epi16(_mm256_extracti128_si256(worm,1))),
+							  alternate0(_mm256_cvtepi8_epi16(_mm256_castsi256_si128(alternate))),
+							  alternate1(_mm256_cvtepi8_epi16(_mm256_extracti128_si256(alternate,1)));
+
+				//abs(-32768) does not fit in a signed 16 bit value, so the absolute values are widened as unsigned numbers.
+				const __m256i a0(_mm256_and_si256(_mm256_abs_epi16(m0),worm0)),
+							  a1(_mm256_and_si256(_mm256_abs_epi16(m1),worm1));
+				worm_movement = _mm256_add_epi32(worm_movement,_mm256_add_epi32(_mm256_unpacklo_epi16(a0,zero),_mm256_unpackhi_epi16(a0,zero)));
+				worm_movement = _mm256_add_epi32(worm_movement,_mm256_add_epi32(_mm256_unpacklo_epi16(a1,zero),_mm256_unpackhi_epi16(a1,zero)));
+
+				alternate_movement = _mm256_add_epi32(alternate_movement,_mm256_madd_epi16(_mm256_and_si256(m0,alternate0),ones_16));
+				alternate_movement = _mm256_add_epi32(alternate_movement,_mm256_madd_epi16(_mm256_and_si256(m1,alternate1),ones_16));
+
+				//keep the low byte of each masked movement value.
+				//packus interleaves the 128 bit lanes of its arguments, which the permute undoes.
+				const __m256i masked(_mm256_packus_epi16(_mm256_and_si256(_mm256_and_si256(m0,worm0),low_byte),
+														 _mm256_and_si256(_mm256_and_si256(m1,worm1),low_byte)));
+				_mm256_storeu_si256((__m256i *)(masked_movement+x),_mm256_permute4x64_epi64(masked,0xD8));
+			}
+			sums.total_intensity_within_region += horizontal_sum_64(region_intensity);
+			sums.total_intensity_within_worm_area += horizontal_sum_64(worm_intensity);
+			sums.total_worm_area += horizontal_sum_64(worm_area);
+			sums.total_alternate_worm_area += horizontal_sum_64(alternate_area);
+			sums.total_intensity_within_alternate_worm += horizontal_sum_64(alternate_intensity);
+			sums.unnormalized_movement_sum += horizontal_sum_unsigned_32(worm_movement);
+			sums.alternate_movement_sum += horizontal_sum_signed_32(alternate_movement);
+		}
+		#endif
+		run_scalar(image+x,movement+x,threshold+x,width-x,masked_movement+x,sums);
+	}
+
+	static inline void run_scalar(const ns_8_bit * image, const short * movement, const ns_8_bit * threshold,
+								  const unsigned long width, ns_8_bit * masked_movement, ns_movement_quantification_sums & sums){
+		for (unsigned long x = 0; x < width; x++){
+			const bool worm((threshold[x]&worm_neighborhood_mask) != 0),
+					   alternate((threshold[x]&region_mask) != 0 && !worm);
+			sums.total_intensity_within_region+=image[x];
+			sums.total_intensity_within_worm_area+=worm?image[x]:0;
+			sums.total_worm_area+=worm?1:0;
+			sums.unnormalized_movement_sum+=worm?abs(movement[x]):0;
+			masked_movement[x] = worm?(ns_8_bit)movement[x]:0;
+			sums.alternate_movement_sum+=alternate?movement[x]:0;
+			sums.total_alternate_worm_area+=alternate?1:0;
+			sums.total_intensity_within_alternate_worm+=alternate?image[x]:0;
+		}
+	}
+private:
+	#ifdef NS_MOVEMENT_QUANTIFICATION_USE_AVX2
+	static inline ns_64_bit horizontal_sum_64(const __m256i & v){
+		ns_64_bit s[4];
+		_mm256_storeu_si256((__m256i *)s,v);
+		return s[0]+s[1]+s[2]+s[3];
+	}
+	static inline ns_64_bit horizontal_sum_unsigned_32(const __m256i & v){
+		unsigned int s[8];
+		_mm256_storeu_si256((__m256i *)s,v);
+		ns_64_bit r(0);
+		for (unsigned int i = 0; i < 8; i++)
+			r+=s[i];
+		return r;
+	}
+	static inline ns_s64_bit horizontal_sum_signed_32(const __m256i & v){
+		int s[8];
+		_mm256_storeu_si256((__m256i *)s,v);
+		ns_s64_bit r(0);
+		for (unsigned int i = 0; i < 8; i++)
+			r+=s[i];
+		return r;
+	}
+	#endif
+};
+
+#endif
@@ -0,0 +1,195 @@
+#include "ns_sparse_assignment_solver.h"
+#include "ns_ex.h"
+#include <algorithm>
+#include <limits>
+
+void ns_sparse_assignment_solver::clear(const unsigned long number_of_rows, const unsigned long number_of_columns){
+	pairs.resize(0);
+	row_assignment.resize(0);
+	row_assignment.resize(number_of_rows,-1);
+	column_assignment.resize(0);
+	column_assignment.resize(number_of_columns,-1);
+}
+
+void ns_sparse_assignment_solver::add_pair(const unsigned long row, const unsigned long column, const double cost){
+	if (row >= row_assignment.size() || column >= column_assignment.size())
+		throw ns_ex("ns_sparse_assignment_solver::add_pair()::Invalid pair (") << row << "," << column << ")";
+	if (cost < 0)
+		throw ns_ex("ns_sparse_assignment_solver::add_pair()::Negative cost specified: ") << cost;
+	pairs.push_back(ns_pair(row,column,cost));
+}
+
+unsigned long ns_sparse_assignment_solver::find_component(unsigned long i){
+	while(component_parent[i] != i){
+		component_parent[i] = component_parent[component_parent[i]];
+		i = component_parent[i];
+	}
+	return i;
+}
+
+void ns_sparse_assignment_solver::solve(){
+	const unsigned long number_of_rows(this->number_of_rows()),
+						number_of_columns(this->number_of_columns()),
+						number_of_nodes(number_of_rows+number_of_columns);
+	if (pairs.empty())
+		return;
+
+	//sort pairs by row
+	row_start.resize(0);
+	row_start.resize(number_of_rows+1,0);
+	for (unsigned long i = 0; i < pairs.size(); i++)
+		row_start[pairs[i].row+1]++;
+	for (unsigned long r = 0; r < number_of_rows; r++)
+		row_start[r+1]+=row_start[r];
+	pair_column.resize(pairs.size());
+	pair_cost.resize(pairs.size());
+	insert_position.assign(row_start.begin(),row_start.end()-1);
+	for (unsigned long i = 0; i < pairs.size(); i++){
+		const unsigned long p(insert_position[pairs[i].row]++);
+		pair_column[p] = pairs[i].column;
+		pair_cost[p] = pairs[i].cost;
+	}
+
+	//find connected components.  Node i < number_of_rows is a row; node number_of_rows+c is column c
+	component_parent.resize(number_of_nodes);
+	for (unsigned long i = 0; i < number_of_nodes; i++)
+		component_parent[i] = i;
+	for (unsigned long i = 0; i < pairs.size(); i++){
+		const unsigned long a(find_component(pairs[i].row)),
+							b(find_component(number_of_rows+pairs[i].column));
+		if (a < b) component_parent[b] = a;
+		else if (b < a) component_parent[a] = b;
+	}
+	component_start.resize(0);
+	component_start.resize(number_of_nodes+1,0);
+	for (unsigned long i = 0; i < number_of_nodes; i++)
+		component_start[find_component(i)+1]++;
+	for (unsigned long i = 0; i < number_of_nodes; i++)
+		component_start[i+1]+=component_start[i];
+	component_members.resize(number_of_nodes);
+	insert_position.assign(component_start.begin(),component_start.end()-1);
+	for (unsigned long i = 0; i < number_of_nodes; i++)
+		component_members[insert_position[find_component(i)]++] = i;
+
+	row_potential.resize(0);
+	row_potential.resize(number_of_rows,0);
+	column_potential.resize(0);
+	column_potential.resize(number_of_columns,0);
+	row_distance.resize(number_of_rows);
+	column_distance.resize(number_of_columns);
+	column_predecessor.resize(number_of_columns);
+	column_done.resize(number_of_columns);
+
+	for (unsigned long i = 0; i < number_of_nodes; i++){
+		const unsigned long n(component_start[i+1]-component_start[i]);
+		//isolated rows and columns cannot be matched
+		if (n < 2)
+			continue;
+		solve_component(&component_members[component_start[i]],n);
+	}
+}
+
+void ns_sparse_assignment_solver::solve_component(const unsigned long * members, const unsigned long number_of_members){
+	unsigned long rows(0);
+	for (unsigned long i = 0; i < number_of_members; i++)
+		if (members[i] < number_of_rows())
+			rows++;
+	const unsigned long max_matches(std::min(rows,number_of_members-rows));
+	for (unsigned long i = 0; i < max_matches; i++){
+		if (!augment(members,number_of_members))
+			break;
+	}
+}
+
+//Finds the cheapest way to match one more row in the component, by searching from all unmatched rows at once
+//for the nearest unmatched column.  Returns false if no more rows can be matched.
+bool ns_sparse_assignment_solver::augment(const unsigned long * members, const unsigned long number_of_members){
+	const unsigned long number_of_rows(this->number_of_rows());
+	const double infinity(std::numeric_limits<double>::infinity());
+	heap.resize(0);
+	for (unsigned long i = 0; i < number_of_members; i++){
+		if (members[i] < number_of_rows)
+			row_distance[members[i]] = infinity;
+		else{
+			const unsigned long c(members[i]-number_of_rows);
+			column_distance[c] = infinity;
+			column_done[c] = 0;
+			column_predecessor[c] = -1;
+		}
+	}
+	long target(-1);
+	unsigned long next_source(0);
+	while(true){
+		//start with every unmatched row, and then continue with the row matched to the nearest column found so far
+		long r(-1);
+		if (next_source < number_of_members){
+			for (; next_source < number_of_members; next_source++){
+				if (members[next_source] < number_of_rows && row_assignment[members[next_source]] == -1){
+					r = (long)members[next_source];
+					row_distance[r] = 0;
+					next_source++;
+					break;
+				}
+			}
+		}
+		if (r == -1){
+			if (heap.empty())
+				break;
+			std::pop_heap(heap.begin(),heap.end());
+			const ns_heap_entry e(heap.back());
+			heap.pop_back();
+			if (column_done[e.column] || e.distance > column_distance[e.column])
+				continue;
+			column_done[e.column] = 1;
+			if (column_assignment[e.column] == -1){
+				target = (long)e.column;
+				break;
+			}
+			r = column_assignment[e.column];
+			//matched pairs always have a reduced cost of zero
+			row_distance[r] = column_distance[e.column];
+		}
+		for (unsigned long p = row_start[r]; p < row_start[r+1]; p++){
+			const unsigned long c(pair_column[p]);
+			if (column_done[c] || row_assignment[r] == (long)c)
+				continue;
+			double reduced_cost(pair_cost[p] + row_potential[r] - column_potential[c]);
+			//guard against rounding error
+			if (reduced_cost < 0)
+				reduced_cost = 0;
+			const double d(row_distance[r] + reduced_cost);
+			if (d < column_distance[c]){
+				column_distance[c] = d;
+				column_predecessor[c] = r;
+				heap.push_back(ns_heap_entry(d,c));
+				std::push_heap(heap.begin(),heap.end());
+			}
+		}
+	}
+	if (target == -1)
+		return false;
+
+	//update the potentials so that all reduced costs remain non-negative
+	const double max_distance(column_distance[target]);
+	for (unsigned long i = 0; i < number_of_members; i++){
+		if (members[i] < number_of_rows)
+			row_potential[members[i]] += std::min(row_distance[members[i]],max_distance);
+		else{
+			const unsigned long c(members[i]-number_of_rows);
+			column_potential[c] += std::min(column_distance[c],max_distance);
+		}
+	}
+
+	//flip the matching along the path
+	long c(target);
+	while(true){
+		const long r(column_predecessor[c]),
+				   previous_column(row_assignment[r]);
+		row_assignment[r] = c;
+		column_assignment[c] = r;
+		if (previous_column == -1)
+			break;
+		c = previous_column;
+	}
+	return true;
+}
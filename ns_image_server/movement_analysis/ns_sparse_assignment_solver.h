@@ -0,0 +1,78 @@
+#ifndef NS_SPARSE_ASSIGNMENT_SOLVER
+#define NS_SPARSE_ASSIGNMENT_SOLVER
+#include <vector>
+
+///ns_sparse_assignment_solver matches "rows" (for example, paths) to "columns" (for example, the objects detected at a timepoint)
+///when only a few row/column pairs are allowed.  It produces the same kind of result as running the Hungarian algorithm
+///on a dense cost matrix in which disallowed pairs are given a prohibitively large cost: as many rows as possible are matched,
+///and among all such matchings one with the smallest total cost is chosen.  Where several matchings share the smallest cost,
+///the two methods may choose different ones.
+///
+///Allowed pairs are first split into connected components, which are solved separately.  Each component is solved
+///by successive shortest augmenting paths (the augmentation step of the Jonker-Volgenant algorithm), using Dijkstra's algorithm
+///on reduced costs so that each augmentation only visits allowed pairs.
+///
+///All storage is kept between calls to solve(), so a solver reused across many problems does not allocate memory
+///once it has seen the largest problem.
+class ns_sparse_assignment_solver{
+public:
+	///starts a new problem, discarding any previous pairs and solution
+	void clear(const unsigned long number_of_rows, const unsigned long number_of_columns);
+	///allows row to be matched to column at the specified cost, which must not be negative.
+	void add_pair(const unsigned long row, const unsigned long column, const double cost);
+	void solve();
+
+	///returns the column matched to the row, or -1 if it was left unmatched.
+	long column_assigned_to_row(const unsigned long row) const{return row_assignment[row];}
+	///returns the row matched to the column, or -1 if it was left unmatched.
+	long row_assigned_to_column(const unsigned long column) const{return column_assignment[column];}
+
+	unsigned long number_of_rows() const{return (unsigned long)row_assignment.size();}
+	unsigned long number_of_columns() const{return (unsigned long)column_assignment.size();}
+
+private:
+	struct ns_pair{
+		ns_pair(){}
+		ns_pair(const unsigned long r, const unsigned long c, const double cost_):row(r),column(c),cost(cost_){}
+		unsigned long row,column;
+		double cost;
+	};
+	struct ns_heap_entry{
+		ns_heap_entry(){}
+		ns_heap_entry(const double d, const unsigned long c):distance(d),column(c){}
+		double distance;
+		unsigned long column;
+		//std::push_heap builds a max heap, so order entries so that the nearest column is on top
+		bool operator<(const ns_heap_entry & e) const{return distance > e.distance || (distance == e.distance && column > e.column);}
+	};
+
+	std::vector<ns_pair> pairs;
+	//pairs sorted by row; the pairs of row r are pair_column[row_start[r]] to pair_column[row_start[r+1]-1]
+	std::vector<unsigned long> row_start,
+							   pair_column;
+	std::vector<double> pair_cost;
+
+	std::vector<long> row_assignment,
+					  column_assignment;
+
+	//each component lists its rows and columns
+	std::vector<unsigned long> component_parent,
+							   component_start,
+							   component_members;
+	std::vector<unsigned long> insert_position;
+
+	//shortest path search
+	std::vector<double> row_potential,
+						column_potential,
+						row_distance,
+						column_distance;
+	std::vector<long> column_predecessor;
+	std::vector<char> column_done;
+	std::vector<ns_heap_entry> heap;
+
+	unsigned long find_component(unsigned long i);
+	void solve_component(const unsigned long * members, const unsigned long number_of_members);
+	bool augment(const unsigned long * members, const unsigned long number_of_members);
+};
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef NS_SPATIAL_GRID
+#define NS_SPATIAL_GRID
+#include "ns_vector.h"
+#include <vector>
+#include <algorithm>
+#include <math.h>
+
+///ns_spatial_grid buckets a set of points into square cells, so that the points near a position
+///can be found by looking only at the cells around it rather than at every point.
+///Points are added with add(), after which build() must be called before any searches are made.
+///The grid's storage is kept when it is cleared, so it can be rebuilt repeatedly without allocating memory.
+class ns_spatial_grid{
+public:
+	ns_spatial_grid():cell_size(1){}
+
+	///Removes all points.  Searches will return every point within cell_size of the search position,
+	///along with some points up to 2*sqrt(2)*cell_size away; callers must check the exact distance themselves.
+	void clear(const double cell_size_){
+		cell_size = (cell_size_ > 0)?cell_size_:1;
+		entries.resize(0);
+	}
+	void add(const unsigned long id, const ns_vector_2d & position){
+		entries.push_back(ns_entry(cell(position.x),cell(position.y),id));
+	}
+	void build(){
+		std::sort(entries.begin(),entries.end());
+	}
+	///adds a point to a grid that has already been built.  Earlier entries for the same id are kept;
+	///to move a point, insert it at its new position and ignore the stale candidates found at its old one.
+	void insert(const unsigned long id, const ns_vector_2d & position){
+		const ns_entry e(cell(position.x),cell(position.y),id);
+		entries.insert(std::upper_bound(entries.begin(),entries.end(),e),e);
+	}
+
+	///appends to ids all points in the 3x3 block of cells around the position, in order of cell and then of id
+	void find_candidates(const ns_vector_2d & position, std::vector<unsigned long> & ids) const{
+		const long x(cell(position.x)),
+				   y(cell(position.y));
+		for (long dy = -1; dy <= 1; dy++){
+			std::vector<ns_entry>::const_iterator p(std::lower_bound(entries.begin(),entries.end(),ns_entry(x-1,y+dy,0)));
+			for (; p != entries.end() && p->y == y+dy && p->x <= x+1; p++)
+				ids.push_back(p->id);
+		}
+	}
+	bool empty() const{return entries.empty();}
+private:
+	struct ns_entry{
+		ns_entry(){}
+		ns_entry(const long x_, const long y_, const unsigned long id_):x(x_),y(y_),id(id_){}
+		long x,y;
+		unsigned long id;
+		bool operator<(const ns_entry & e) const{
+			if (y != e.y) return y < e.y;
+			if (x != e.x) return x < e.x;
+			return id < e.id;
+		}
+	};
+	long cell(const double v) const{return (long)floor(v/cell_size);}
+	double cell_size;
+	std::vector<ns_entry> entries;
+};
+
+#endif
@@ -3,6 +3,10 @@
 #include "ns_xml.h"
 #include "ns_image_tools.h"
 #include "ctmf.h"
+#include "ns_movement_quantification_kernel.h"
+#include "ns_high_precision_timer.h"
+#include <iomanip>
+#include "ns_death_time_parameter_sweep.h"
 using namespace std;
 
 #define NS_MARGIN_BACKGROUND 0
@@ -395,6 +399,47 @@ void ns_time_path_image_movement_analyzer::calculate_memory_pool_maximum_image_s
 #ifdef NS_OUTPUT_ALGINMENT_DEBUG
 string debug_path_name;
 #endif
+
+//Registers, generates movement images for, and quantifies one chunk of a single path.
+//Paths share nothing but the (locked) memory pools, so the jobs for different paths
+//can be run simultaneously by an ns_thread_pool.
+//Saving the results to disk and the database is left to the calling thread.
+class ns_analyzed_image_time_path_chunk_job : public ns_thread_pool_job{
+public:
+	ns_analyzed_image_time_path_chunk_job(ns_analyzed_image_time_path & path_):path(&path_),alignment_state(0),quantify(false){}
+
+	void set_registration(const ns_analyzed_time_image_chunk & chunk, ns_alignment_state & state, const ns_analyzed_time_image_chunk & first_chunk_){
+		registration_chunk = chunk;
+		first_chunk = first_chunk_;
+		alignment_state = &state;
+	}
+	void set_quantification(const ns_analyzed_time_image_chunk & chunk){
+		quantification_chunk = chunk;
+		quantify = true;
+	}
+	void run(const unsigned long thread_id){
+		if (alignment_state != 0){
+			path->calculate_image_registration(registration_chunk,*alignment_state,first_chunk);
+			path->generate_movement_images(registration_chunk,thread_id);
+		}
+		if (quantify)
+			path->quantify_movement(quantification_chunk,thread_id);
+	}
+	ns_analyzed_image_time_path * path;
+	ns_analyzed_time_image_chunk registration_chunk,
+								 first_chunk,
+								 quantification_chunk;
+	ns_alignment_state * alignment_state;
+	bool quantify;
+};
+
+void ns_run_path_chunk_jobs(std::vector<ns_analyzed_image_time_path_chunk_job> & jobs, ns_thread_pool & pool){
+	std::vector<ns_thread_pool_job *> job_pointers(jobs.size());
+	for (unsigned int i = 0; i < jobs.size(); i++)
+		job_pointers[i] = &jobs[i];
+	pool.run(job_pointers);
+}
+
 void ns_time_path_image_movement_analyzer::process_raw_images(const ns_64_bit region_id,const ns_time_path_solution & solution_, const ns_time_series_denoising_parameters & times_series_denoising_parameters,const ns_analyzed_image_time_path_death_time_estimator * e,ns_sql & sql, const long group_number,const bool write_status_to_db){
 	analysis_id = ns_current_time();
 	region_info_id = region_id;
@@ -481,6 +526,12 @@ void ns_time_path_image_movement_analyzer::process_raw_images(const ns_64_bit re
 				else
 					std::cout << "To fit everything into memory, we're doing this in " << number_of_repeats_required << " rounds\n";
 			}
+			//paths are registered and quantified in parallel, sharing the machine's processors
+			//with the other node processes running on it.
+			ns_thread_pool path_pool(ns_thread_pool::number_of_processors_per_process());
+			memory_pool.set_number_of_threads(path_pool.number_of_threads());
+			std::vector<ns_analyzed_image_time_path_chunk_job> jobs;
+
 			int current_round(0);
 			for (unsigned int g = 0; g < groups.size(); ){
 			
@@ -590,6 +641,7 @@ void ns_time_path_image_movement_analyzer::process_raw_images(const ns_64_bit re
 						}
 					}
 					//run chunks for all paths whose images have been loaded in the previous step
+					jobs.clear();
 					for (unsigned int i = start_group; i < stop_group; i++){
 						for (unsigned int j = 0; j < groups[i].paths.size(); j++){
 							if (ns_skip_low_density_paths && groups[i].paths[j].is_low_density_path())
@@ -599,32 +651,41 @@ void ns_time_path_image_movement_analyzer::process_raw_images(const ns_64_bit re
 							if (!chunk_generators[i][j].backwards_update_and_check_for_new_chunk(chunk))
 								continue;
 				//			cerr << "Registering " << i << ": " << chunk.start_i << "-" << chunk.stop_i << "\n";
-							groups[i].paths[j].calculate_image_registration(chunk,alignment_states[i][j],chunk_generators[i][j].first_chunk());
-							groups[i].paths[j].generate_movement_images(chunk);
+							jobs.push_back(ns_analyzed_image_time_path_chunk_job(groups[i].paths[j]));
+							jobs.rbegin()->set_registration(chunk,alignment_states[i][j],chunk_generators[i][j].first_chunk());
 						
+							//once we've registered back to the start of the path, 
+							//the path can be quantified up to the onset of stationarity.
 							if (chunk.stop_i == -1){
 									ns_analyzed_time_image_chunk chunk;
 									chunk.direction = ns_analyzed_time_image_chunk::ns_forward;
 									chunk.start_i = 0;
 									chunk.stop_i = groups[i].paths[j].first_stationary_timepoint();
-									if (chunk.stop_i != 0){
-										groups[i].paths[j].quantify_movement(chunk);
-										groups[i].paths[j].save_movement_images(chunk,sql);
-										for (long k = chunk.start_i; k < ((long)chunk.stop_i-(long)clear_lag); k++){
-											groups[i].paths[j].elements[k].clear_path_aligned_images();
-											groups[i].paths[j].elements[k].clear_movement_images();
-										}
-									}
-									groups[i].paths[j].volatile_backwards_path_data_written = true;
-									
-								
+									if (chunk.stop_i != 0)
+										jobs.rbegin()->set_quantification(chunk);
 							}
 						}
 					}
+					ns_run_path_chunk_jobs(jobs,path_pool);
+					for (unsigned int i = 0; i < jobs.size(); i++){
+						if (jobs[i].registration_chunk.stop_i != -1)
+							continue;
+						ns_analyzed_image_time_path & path(*jobs[i].path);
+						if (jobs[i].quantify){
+							const ns_analyzed_time_image_chunk & chunk(jobs[i].quantification_chunk);
+							path.save_movement_images(chunk,sql);
+							for (long k = chunk.start_i; k < ((long)chunk.stop_i-(long)clear_lag); k++){
+								path.elements[k].clear_path_aligned_images();
+								path.elements[k].clear_movement_images();
+							}
+						}
+						path.volatile_backwards_path_data_written = true;
+					}
 
 				}
 				debug_output_skip = 0;
 				//now we output (in forwards order) the images we registered backwards
+				jobs.clear();
 				for (unsigned int i = start_group; i < stop_group; i++){
 					for (unsigned int j = 0; j < groups[i].paths.size(); j++){
 						if (ns_skip_low_density_paths && groups[i].paths[j].is_low_density_path())
@@ -636,15 +697,21 @@ void ns_time_path_image_movement_analyzer::process_raw_images(const ns_64_bit re
 						chunk.start_i = 0;
 						chunk.stop_i = groups[i].paths[j].first_stationary_timepoint();
 						if (chunk.stop_i != 0){
-							groups[i].paths[j].quantify_movement(chunk);
-							groups[i].paths[j].save_movement_images(chunk,sql);
-							for (long k = chunk.start_i; k < ((long)chunk.stop_i-(long)clear_lag); k++){
-								groups[i].paths[j].elements[k].clear_path_aligned_images();
-								groups[i].paths[j].elements[k].clear_movement_images();
-							}
+							jobs.push_back(ns_analyzed_image_time_path_chunk_job(groups[i].paths[j]));
+							jobs.rbegin()->set_quantification(chunk);
 						}
 					}
 				}
+				ns_run_path_chunk_jobs(jobs,path_pool);
+				for (unsigned int i = 0; i < jobs.size(); i++){
+					ns_analyzed_image_time_path & path(*jobs[i].path);
+					const ns_analyzed_time_image_chunk & chunk(jobs[i].quantification_chunk);
+					path.save_movement_images(chunk,sql);
+					for (long k = chunk.start_i; k < ((long)chunk.stop_i-(long)clear_lag); k++){
+						path.elements[k].clear_path_aligned_images();
+						path.elements[k].clear_movement_images();
+					}
+				}
 				
 				//now we go ahead and work forwards
 				for (unsigned int i = start_group; i < stop_group; i++){
@@ -680,6 +747,7 @@ void ns_time_path_image_movement_analyzer::process_raw_images(const ns_64_bit re
 						}
 						throw ex_f;
 					}
+					jobs.clear();
 					for (unsigned int i = start_group; i < stop_group; i++){
 						for (unsigned int j = 0; j < groups[i].paths.size(); j++){
 							if (ns_skip_low_density_paths && groups[i].paths[j].is_low_density_path())
@@ -701,28 +769,31 @@ void ns_time_path_image_movement_analyzer::process_raw_images(const ns_64_bit re
 							cerr << "PATH " << i << "," << j << "\n";
 							debug_path_name = string("path") + ns_to_string(i) + "_" + ns_to_string(j);
 							#endif			
-							groups[i].paths[j].calculate_image_registration(chunk,alignment_states[i][j],chunk_generators[i][j].first_chunk());
-							//cerr << "Calculating Movement...";
-							groups[i].paths[j].generate_movement_images(chunk);
-							#ifdef NS_OUTPUT_ALGINMENT_DEBUG
-								for (unsigned int k = chunk.start_i; k < chunk.stop_i; k++){
-									oout << k << "," << groups[i].paths[j].element(k).registration_offset.x <<  "," <<
-										groups[i].paths[j].element(k).registration_offset.y <<  "," <<
-										groups[i].paths[j].element(k).registration_offset.mag() << "\n";
-								}
-								oout.flush();
-							#endif
-							groups[i].paths[j].quantify_movement(chunk);
-							groups[i].paths[j].save_movement_images(chunk,sql);
-						//	return;;
-						//	cerr << "Clearing path aligned images up to " << (long)chunk.stop_i << ")\n";
-							for (long k = 0; k < (long)chunk.stop_i; k++){
-								groups[i].paths[j].elements[k].clear_movement_images();
-							}
-							//const unsigned long ss((chunk.start_i > clear_lag)?(chunk.start_i - clear_lag):0);
-							for (long k = 0; k < ((long)chunk.stop_i-(long)clear_lag); k++){
-								groups[i].paths[j].elements[k].clear_path_aligned_images();
+							jobs.push_back(ns_analyzed_image_time_path_chunk_job(groups[i].paths[j]));
+							jobs.rbegin()->set_registration(chunk,alignment_states[i][j],chunk_generators[i][j].first_chunk());
+							jobs.rbegin()->set_quantification(chunk);
+						}
+					}
+					ns_run_path_chunk_jobs(jobs,path_pool);
+					for (unsigned int i = 0; i < jobs.size(); i++){
+						ns_analyzed_image_time_path & path(*jobs[i].path);
+						const ns_analyzed_time_image_chunk & chunk(jobs[i].quantification_chunk);
+						#ifdef NS_OUTPUT_ALGINMENT_DEBUG
+							for (unsigned int k = chunk.start_i; k < chunk.stop_i; k++){
+								oout << k << "," << path.element(k).registration_offset.x <<  "," <<
+									path.element(k).registration_offset.y <<  "," <<
+									path.element(k).registration_offset.mag() << "\n";
 							}
+							oout.flush();
+						#endif
+						path.save_movement_images(chunk,sql);
+					//	cerr << "Clearing path aligned images up to " << (long)chunk.stop_i << ")\n";
+						for (long k = 0; k < (long)chunk.stop_i; k++){
+							path.elements[k].clear_movement_images();
+						}
+						//const unsigned long ss((chunk.start_i > clear_lag)?(chunk.start_i - clear_lag):0);
+						for (long k = 0; k < ((long)chunk.stop_i-(long)clear_lag); k++){
+							path.elements[k].clear_path_aligned_images();
 						}
 					}
 				
@@ -983,16 +1054,18 @@ void ns_time_path_image_movement_analyzer::populate_movement_quantification_from
 	im.id = atol(res[0][0].c_str());
 	if (im.id == 0)
 		throw ns_ex("Movement quantification data has not been stored in db");
-	ifstream * i(image_server.image_storage.request_metadata_from_disk(im,false,&sql));
-
-	try{
-		load_movement_data_from_disk(*i,false);
-		delete i;
-	}
-	catch(...){
-		delete i;
-		throw;
+	const std::string filename(image_server.image_storage.request_metadata_filename(im,&sql));
+	//quantification is saved in the columnar format, but older analyses may still be stored as text
+	if (ns_columnar_file_reader::is_columnar_file(filename)){
+		ns_columnar_file_reader f;
+		f.open(filename);
+		load_movement_data_from_columnar_file(f);
+		return;
 	}
+	ifstream i(filename.c_str());
+	if (i.fail())
+		throw ns_ex("ns_time_path_image_movement_analyzer::populate_movement_quantification_from_file()::Could not open ") << filename << ns_file_io;
+	load_movement_data_from_disk(i,false);
 };
 
 void ns_time_path_image_movement_analyzer::reanalyze_with_different_movement_estimator(const ns_time_series_denoising_parameters &,const ns_analyzed_image_time_path_death_time_estimator * e){
@@ -1090,10 +1163,10 @@ void ns_time_path_image_movement_analyzer::save_movement_data_to_db(const unsign
 		im = image_server.image_storage.get_region_movement_metadata_info(region_id,"time_path_movement_image_analysis_quantification",sql);
 		update_db = true;
 	}
-	ofstream * o(image_server.image_storage.request_metadata_output(im,"csv",false,&sql));
+	ofstream * o(image_server.image_storage.request_metadata_output(im,ns_columnar_file_extension(),true,&sql));
 	im.save_to_db(im.id,&sql);
 	try{
-		save_movement_data_to_disk(*o);
+		save_movement_data_to_columnar_file(*o);
 		delete o;
 	}
 	catch(...){
@@ -1271,6 +1344,123 @@ void ns_time_path_image_movement_analyzer::save_movement_data_to_disk(ostream &
 	}
 }
 
+//columns of the columnar movement data table
+const char * ns_movement_data_integer_columns[] = {"absolute_time","interframe_time_scaled_movement_sum","movement_alternate_worm_sum",
+	"total_worm_area","total_intensity_within_worm_area","total_region_area","total_intensity_within_region",
+	"total_alternate_worm_area","total_intensity_within_alternate_worm","saturated_offset",
+	"local_maximum_movement_sum","local_maximum_stationary_sum","local_maximum_position_x","local_maximum_position_y",
+	"local_maximum_area_x","local_maximum_area_y","unnormalized_movement_sum"};
+const char * ns_movement_data_real_columns[] = {"change_in_average_region_intensity","change_in_average_normalized_worm_intensity",
+	"registration_offset_x","registration_offset_y","denoised_movement_score","movement_score","change_in_total_worm_intensity"};
+#define NS_MOVEMENT_DATA_INTEGER_COLUMNS 17
+#define NS_MOVEMENT_DATA_REAL_COLUMNS 7
+
+inline ns_64_bit ns_movement_data_segment_key(const unsigned long group_id, const unsigned long path_id){
+	return (((ns_64_bit)group_id) << 32) | (ns_64_bit)path_id;
+}
+
+void ns_time_path_image_movement_analyzer::save_movement_data_to_columnar_file(ostream & o) const{
+	//paths are loaded individually, so blocks are left uncompressed so they can be read directly from the memory mapped file
+	ns_columnar_file_writer file(o,false);
+	ns_columnar_table a("analysis");
+	a.add_column("analysis_id",ns_columnar_int64);
+	a.begin_segment(0);
+	a.push(0,analysis_id);
+	file.write(a);
+
+	ns_columnar_table t("movement_data");
+	for (unsigned int c = 0; c < NS_MOVEMENT_DATA_INTEGER_COLUMNS; c++)
+		t.add_column(ns_movement_data_integer_columns[c],ns_columnar_int64);
+	for (unsigned int c = 0; c < NS_MOVEMENT_DATA_REAL_COLUMNS; c++)
+		t.add_column(ns_movement_data_real_columns[c],ns_columnar_double);
+	const unsigned long r(NS_MOVEMENT_DATA_INTEGER_COLUMNS);
+	for (unsigned long i = 0; i < groups.size(); i++){
+		for (unsigned long j = 0; j < groups[i].paths.size(); j++){
+			t.begin_segment(ns_movement_data_segment_key(i,j));
+			for (unsigned long k = 0; k < groups[i].paths[j].elements.size(); k++){
+				const ns_analyzed_image_time_path_element & e(groups[i].paths[j].elements[k]);
+				t.push(0,e.absolute_time);
+				t.push(1,e.measurements.interframe_time_scaled_movement_sum);
+				t.push(2,e.measurements.movement_alternate_worm_sum);
+				t.push(3,e.measurements.total_worm_area);
+				t.push(4,e.measurements.total_intensity_within_worm_area);
+				t.push(5,e.measurements.total_region_area);
+				t.push(6,e.measurements.total_intensity_within_region);
+				t.push(7,e.measurements.total_alternate_worm_area);
+				t.push(8,e.measurements.total_intensity_within_alternate_worm);
+				t.push(9,e.saturated_offset?1:0);
+				t.push(10,e.measurements.local_maximum_movement_sum);
+				t.push(11,e.measurements.local_maximum_stationary_sum);
+				t.push(12,e.measurements.local_maximum_position.x);
+				t.push(13,e.measurements.local_maximum_position.y);
+				t.push(14,e.measurements.local_maximum_area.x);
+				t.push(15,e.measurements.local_maximum_area.y);
+				t.push(16,e.measurements.unnormalized_movement_sum);
+				t.push(r+0,e.measurements.change_in_average_region_intensity);
+				t.push(r+1,e.measurements.change_in_average_normalized_worm_intensity);
+				t.push(r+2,e.registration_offset.x);
+				t.push(r+3,e.registration_offset.y);
+				t.push(r+4,e.measurements.denoised_movement_score);
+				t.push(r+5,e.measurements.movement_score);
+				t.push(r+6,e.measurements.change_in_total_worm_intensity);
+			}
+		}
+	}
+	file.write(t);
+	file.close();
+}
+
+void ns_time_path_image_movement_analyzer::load_movement_data_from_columnar_file(const ns_columnar_file_reader & f){
+	const ns_columnar_file_reader::ns_table & a(f.table("analysis"));
+	std::vector<ns_64_bit> id;
+	if (a.segments.size() != 1)
+		throw ns_ex("ns_time_path_image_movement_analyzer::load_movement_data_from_columnar_file()::Empty Specification!");
+	f.read(a,0,"analysis_id",id);
+	if (id.size() != 1)
+		throw ns_ex("ns_time_path_image_movement_analyzer::load_movement_data_from_columnar_file()::Empty Specification!");
+	analysis_id = id[0];
+
+	//only the segments of the paths in the current solution are read
+	const ns_columnar_file_reader::ns_table & t(f.table("movement_data"));
+	std::vector<ns_s64_bit> v[NS_MOVEMENT_DATA_INTEGER_COLUMNS];
+	std::vector<double> d[NS_MOVEMENT_DATA_REAL_COLUMNS];
+	for (unsigned int i = 0; i < groups.size(); i++){
+		for (unsigned int j = 0; j < groups[i].paths.size(); j++){
+			const long s(t.find_segment(ns_movement_data_segment_key(i,j)));
+			if (s == -1 || t.segments[s].number_of_rows != groups[i].paths[j].elements.size())
+				throw ns_ex(" ns_time_path_image_movement_analyzer::load_movement_data_from_columnar_file():Not all data specified in file!");
+			for (unsigned int c = 0; c < NS_MOVEMENT_DATA_INTEGER_COLUMNS; c++)
+				f.read(t,s,ns_movement_data_integer_columns[c],v[c]);
+			for (unsigned int c = 0; c < NS_MOVEMENT_DATA_REAL_COLUMNS; c++)
+				f.read(t,s,ns_movement_data_real_columns[c],d[c]);
+			for (unsigned int k = 0; k < groups[i].paths[j].elements.size(); k++){
+				ns_analyzed_image_time_path_element & e(groups[i].paths[j].elements[k]);
+				e.absolute_time = v[0][k];
+				e.measurements.interframe_time_scaled_movement_sum = v[1][k];
+				e.measurements.movement_alternate_worm_sum = v[2][k];
+				e.measurements.total_worm_area = v[3][k];
+				e.measurements.total_intensity_within_worm_area = v[4][k];
+				e.measurements.total_region_area = v[5][k];
+				e.measurements.total_intensity_within_region = v[6][k];
+				e.measurements.total_alternate_worm_area = v[7][k];
+				e.measurements.total_intensity_within_alternate_worm = v[8][k];
+				e.saturated_offset = (v[9][k] != 0);
+				e.measurements.local_maximum_movement_sum = v[10][k];
+				e.measurements.local_maximum_stationary_sum = v[11][k];
+				e.measurements.local_maximum_position = ns_vector_2i(v[12][k],v[13][k]);
+				e.measurements.local_maximum_area = ns_vector_2i(v[14][k],v[15][k]);
+				e.measurements.unnormalized_movement_sum = v[16][k];
+				e.measurements.change_in_average_region_intensity = d[0][k];
+				e.measurements.change_in_average_normalized_worm_intensity = d[1][k];
+				e.registration_offset = ns_vector_2d(d[2][k],d[3][k]);
+				e.measurements.denoised_movement_score = d[4][k];
+				e.measurements.movement_score = d[5][k];
+				e.measurements.change_in_total_worm_intensity = d[6][k];
+			}
+		}
+	}
+}
+
 
 std::string ns_calc_rel_time_by_index(const unsigned long time, const ns_movement_state_observation_boundary_interval & i, const ns_analyzed_image_time_path & path){
 	if (i.skipped)
@@ -1355,7 +1545,9 @@ void ns_analyzed_image_time_path::write_analysis_optimization_data(const ns_stat
 		}
 }
 
-void ns_analyzed_image_time_path::calculate_analysis_optimization_data(const std::vector<double> & thresholds, const std::vector<double> & hold_times, std::vector< std::vector < unsigned long > > & death_times) const{
+//collects the measurements used to optimize the threshold posture analysis parameters:
+//all non-excluded measurements, starting with the first one taken after fast movement ceased.
+void ns_analyzed_image_time_path::get_analysis_optimization_series(std::vector<unsigned long> & times, std::vector<double> & movement_scores) const{
 	//find first valid observation
 	unsigned long start_i(0);
 	for (start_i = 0; start_i < elements.size(); start_i++){
@@ -1364,48 +1556,57 @@ void ns_analyzed_image_time_path::calculate_analysis_optimization_data(const std
 	}
 	if (start_i == elements.size())
 		throw ns_ex("No valid measurements found in the time path.");
-	std::vector<std::vector<unsigned long> > last_time_point_at_which_movement_was_found(
-	thresholds.size(),
-	std::vector<unsigned long>(hold_times.size(),elements[start_i].absolute_time));
+	times.resize(0);
+	movement_scores.resize(0);
+	for (unsigned long t = start_i; t < elements.size(); t++){
+		if (elements[t].excluded) continue;
+		times.push_back(elements[t].absolute_time);
+		movement_scores.push_back(elements[t].measurements.death_time_posture_analysis_measure());
+	}
+}
+
+void ns_analyzed_image_time_path::calculate_analysis_optimization_data(const std::vector<double> & thresholds, const std::vector<double> & hold_times, std::vector< std::vector < unsigned long > > & death_times) const{
+	std::vector<unsigned long> times;
+	std::vector<double> movement_scores;
+	get_analysis_optimization_series(times,movement_scores);
+	
+	std::vector<unsigned long> hold_time_order,
+							   death_time_matrix(thresholds.size()*hold_times.size());
+	ns_death_time_parameter_sweep::sort_hold_times(hold_times,hold_time_order);
+	//if no death is found, the animal is considered to have died at the end of the path
+	ns_death_time_parameter_sweep::calculate_death_times(&times[0],&movement_scores[0],times.size(),elements.rbegin()->absolute_time,thresholds,hold_times,hold_time_order,death_time_matrix.empty()?0:&death_time_matrix[0]);
 
 	death_times.resize(0);
 	death_times.resize(thresholds.size(),std::vector<unsigned long>(hold_times.size(),0));
-
-	for (long t = start_i; t < elements.size(); t++){
-		
-		if (elements[t].excluded) continue;
-
-		double r(elements[t].measurements.death_time_posture_analysis_measure());
-		const unsigned long &cur_time (elements[t].absolute_time);
-		//keep on pushing the last posture time and last sationary
-		//times forward until we hit a low enough movement ratio
-		//to meet the criteria.  At that point, the last posture 
-		//and last stationary cutoffs stick
-		
-		for (unsigned int thresh = 0; thresh < thresholds.size(); thresh++){
-			for (unsigned int hold_t = 0; hold_t < hold_times.size(); hold_t++){
-				if (death_times[thresh][hold_t] != 0) continue;
-				if (r >= thresholds[thresh])
-					last_time_point_at_which_movement_was_found[thresh][hold_t] = cur_time;
-				if (death_times[thresh][hold_t] == 0){
-					unsigned long dt;
-					if (last_time_point_at_which_movement_was_found[thresh][hold_t] == 0)
-						dt = cur_time - elements[start_i].absolute_time;
-					else dt = cur_time - last_time_point_at_which_movement_was_found[thresh][hold_t];
-					if (dt >= hold_times[hold_t])
-						death_times[thresh][hold_t] = last_time_point_at_which_movement_was_found[thresh][hold_t];
-				}
-			}
-		}
-	}
-	for (unsigned int thresh = 0; thresh < thresholds.size(); thresh++){
-			for (unsigned int hold_t = 0; hold_t < hold_times.size(); hold_t++){
-				if (death_times[thresh][hold_t] == 0)
-					death_times[thresh][hold_t] = elements.rbegin()->absolute_time;
-			}
-	}
+	for (unsigned int thresh = 0; thresh < thresholds.size(); thresh++)
+		for (unsigned int hold_t = 0; hold_t < hold_times.size(); hold_t++)
+			death_times[thresh][hold_t] = death_time_matrix[thresh*hold_times.size()+hold_t];
 }
 
+void ns_analyzed_image_time_path::add_to_parameter_sweep(const ns_stationary_path_id & id, const ns_region_metadata & m, const ns_time_series_denoising_parameters & denoising_parameters, ns_death_time_parameter_sweep & sweep) const{
+	if (by_hand_annotation_event_times[(int)ns_movement_cessation].fully_unbounded())
+		return;
+	ns_death_time_parameter_sweep::ns_path_info info;
+	info.region_id = m.region_id;
+	info.group_id = id.group_id;
+	info.path_id = id.path_id;
+	info.excluded = censoring_and_flag_details.is_excluded();
+	info.censored = censoring_and_flag_details.is_censored();
+	info.number_of_worms = censoring_and_flag_details.number_of_worms();
+	info.by_hand_death_time = by_hand_annotation_event_times[(int)ns_movement_cessation].period_end;
+	info.time_at_which_animals_had_zero_age = m.time_at_which_animals_had_zero_age;
+	info.movement_score_normalization = (int)denoising_parameters.movement_score_normalization;
+	info.experiment_name = m.experiment_name;
+	info.device = m.device;
+	info.plate_name = m.plate_name();
+	info.animal_details = m.plate_type_summary();
+	info.denoising_technique = denoising_parameters.to_string();
+	info.random_group = rand()%2;
+	std::vector<unsigned long> times;
+	std::vector<double> movement_scores;
+	get_analysis_optimization_series(times,movement_scores);
+	sweep.add_path(info,times,movement_scores,elements.rbegin()->absolute_time);
+}
 
 void ns_analyzed_image_time_path::write_summary_movement_quantification_analysis_data(const ns_region_metadata & m, const unsigned long group_id, const unsigned long path_id, std::ostream & o)const{
 	m.out_JMP_plate_identity_data(o);
@@ -1697,6 +1898,17 @@ void ns_time_path_image_movement_analyzer::write_analysis_optimization_data(cons
 		}
 	}
 }
+void ns_time_path_image_movement_analyzer::add_to_parameter_sweep(const ns_region_metadata & m, ns_death_time_parameter_sweep & sweep) const{
+	//paths are assigned the same random groups as by write_analysis_optimization_data()
+	srand(0);
+	for (unsigned int i = 0; i < groups.size(); i++){
+		for (unsigned int j = 0; j < groups[i].paths.size(); j++){	
+			if (ns_skip_low_density_paths && groups[i].paths[j].is_low_density_path() || groups[i].paths[j].excluded() || !groups[i].paths[j].by_hand_data_specified())
+					continue;
+			groups[i].paths[j].add_to_parameter_sweep(generate_stationary_path_id(i,j),m,denoising_parameters_used,sweep);
+		}
+	}
+}
 void ns_time_path_image_movement_analyzer::write_detailed_movement_quantification_analysis_data(const ns_region_metadata & m, std::ostream & o, const bool only_output_elements_with_by_hand_data, const long specific_animal_id, const bool abbreviated_time_series)const{
 	 
 	for (unsigned long i = 0; i < groups.size(); i++){
@@ -3244,7 +3456,94 @@ void ns_analyzed_image_time_path::denoise_movement_series( const ns_time_series_
 		}
 	}
 }
-void ns_analyzed_image_time_path::quantify_movement(const ns_analyzed_time_image_chunk & chunk){
+typedef ns_movement_quantification_kernel<ns_registered_image_set::region_mask,ns_registered_image_set::worm_neighborhood_mask> ns_registered_image_quantification_kernel;
+
+//Repeats the per-pixel loops that quantify_movement() used before ns_movement_quantification_kernel,
+//and throws an exception if the kernel's results differ from theirs.
+static void ns_check_movement_quantification(ns_registered_image_set & registered, const ns_movement_quantification_sums & sums, const unsigned char * masked_movement, const int image_width){
+	ns_64_bit total_intensity_within_region(0),
+			  total_intensity_within_worm_area(0),
+			  total_worm_area(0),
+			  unnormalized_movement_sum(0),
+			  total_alternate_worm_area(0),
+			  total_intensity_within_alternate_worm(0);
+	double alternate_movement_sum(0);
+	for (unsigned long y = 0; y < registered.movement_image_.properties().height; y++){
+		for (unsigned long x = 0; x < registered.movement_image_.properties().width; x++){
+			const bool worm_threshold(registered.get_worm_neighborhood_threshold(y,x));
+			total_intensity_within_region+=registered.image[y][x];
+			total_intensity_within_worm_area+=worm_threshold?registered.image[y][x]:0;
+			total_worm_area += (worm_threshold?1:0);
+		}
+	}
+	for (unsigned long y = 0; y < registered.movement_image_.properties().height; y++){
+		for (unsigned long x = 0; x < registered.movement_image_.properties().width; x++){
+			const bool worm_threshold(registered.get_worm_neighborhood_threshold(y,x));
+			const bool alternate_worm_threshold(registered.get_region_threshold(y,x) == 1 && 
+												!worm_threshold);
+			unnormalized_movement_sum+=(worm_threshold?abs(registered.movement_image_[y][x]):0);
+			const unsigned char m(worm_threshold?registered.movement_image_[y][x]:0);
+			if (masked_movement[y*image_width+x] != m)
+				throw ns_ex("ns_check_movement_quantification()::The masked movement differs at ") << x << "," << y;
+			alternate_movement_sum+= (alternate_worm_threshold)?registered.movement_image_[y][x]:0;
+			total_alternate_worm_area += (alternate_worm_threshold?1:0);
+			total_intensity_within_alternate_worm += alternate_worm_threshold?registered.image[y][x]:0;
+		}
+	}
+	if (total_intensity_within_region != sums.total_intensity_within_region ||
+		total_intensity_within_worm_area != sums.total_intensity_within_worm_area ||
+		total_worm_area != sums.total_worm_area ||
+		unnormalized_movement_sum != sums.unnormalized_movement_sum ||
+		total_alternate_worm_area != sums.total_alternate_worm_area ||
+		total_intensity_within_alternate_worm != sums.total_intensity_within_alternate_worm ||
+		(unsigned long)alternate_movement_sum != (unsigned long)sums.alternate_movement_sum)
+		throw ns_ex("ns_check_movement_quantification()::The movement sums differ from those of the original calculation");
+}
+
+void ns_benchmark_movement_quantification(std::ostream & out){
+	//a width that is not a multiple of 32 sends the end of each row through the scalar kernel
+	const ns_image_properties properties(1000,1001,1);
+	ns_registered_image_set registered(properties);
+	srand(0);
+	for (unsigned int y = 0; y < properties.height; y++){
+		for (unsigned int x = 0; x < properties.width; x++){
+			registered.image[y][x] = (ns_8_bit)(rand()%256);
+			//cover the whole range of movement values, including -32768
+			registered.movement_image_[y][x] = (x%97 == 0)?-32768:(short)((rand()%65536)-32768);
+			registered.set_thresholds(y,x,rand()%2 == 0,rand()%2 == 0,rand()%3 == 0);
+		}
+	}
+	std::vector<unsigned char> masked_movement(properties.width*properties.height);
+	const unsigned int repetitions(20);
+
+	ns_high_precision_timer timer;
+	timer.start();
+	ns_movement_quantification_sums sums;
+	for (unsigned int i = 0; i < repetitions; i++){
+		sums.zero();
+		for (unsigned long y = 0; y < properties.height; y++)
+			ns_registered_image_quantification_kernel::run(registered.image[y],registered.movement_image_[y],registered.worm_region_threshold[y],
+														   properties.width,&masked_movement[y*properties.width],sums);
+	}
+	const ns_64_bit kernel_microseconds(timer.stop());
+
+	timer.start();
+	for (unsigned int i = 0; i < repetitions; i++)
+		ns_check_movement_quantification(registered,sums,&masked_movement[0],properties.width);
+	const ns_64_bit original_microseconds(timer.stop());
+
+	const double megapixels(((double)properties.width)*properties.height*repetitions/(1000.0*1000.0));
+	#ifdef NS_MOVEMENT_QUANTIFICATION_USE_AVX2
+	out << "Kernel (AVX2): ";
+	#else
+	out << "Kernel (scalar): ";
+	#endif
+	out << std::fixed << std::setprecision(1) << megapixels/(kernel_microseconds/(1000.0*1000.0)) << " megapixels/s\n";
+	out << "Original loops, including comparison: " << megapixels/(original_microseconds/(1000.0*1000.0)) << " megapixels/s\n";
+	out << "The kernel's results match those of the original loops.\n";
+}
+
+void ns_analyzed_image_time_path::quantify_movement(const ns_analyzed_time_image_chunk & chunk,const unsigned long thread_id){
 	
 	/*for (unsigned long i = 0; i < 256; i++){
 		movement_histogram[i]=0;
@@ -3267,10 +3566,11 @@ void ns_analyzed_image_time_path::quantify_movement(const ns_analyzed_time_image
 
 	const int image_width(prop.width),
 			  image_height(prop.height);
-	if (image_analysis_temp1 == 0){
-		image_analysis_temp1 = new unsigned char[image_width*image_height];
-		image_analysis_temp2  = new unsigned char[image_width*image_height];
-	}
+	ns_time_path_image_movement_analysis_thread_scratch & scratch(memory_pool->scratch(thread_id));
+	scratch.image_analysis_temp1.resize(image_width*image_height);
+	scratch.image_analysis_temp2.resize(image_width*image_height);
+	unsigned char * image_analysis_temp1(&scratch.image_analysis_temp1[0]),
+				  * image_analysis_temp2(&scratch.image_analysis_temp2[0]);
 
 	for (unsigned int i = chunk.start_i; i < chunk.stop_i; i++){
 		elements[i].measurements.zero();
@@ -3279,14 +3579,22 @@ void ns_analyzed_image_time_path::quantify_movement(const ns_analyzed_time_image
 	//	elements[i].measurements.registration_offset = elements[i].registration_offset.mag();
 		if (elements[i].registered_images == 0)
 			throw ns_ex("ns_analyzed_image_time_path::quantify_movement()::Encountered an unloaded registered image!");
-		for (unsigned long y = 0; y < elements[i].registered_images->movement_image_.properties().height; y++){
-			for (unsigned long x = 0; x < elements[i].registered_images->movement_image_.properties().width; x++){
-				const bool worm_threshold(elements[i].registered_images->get_worm_neighborhood_threshold(y,x));
-				elements[i].measurements.total_intensity_within_region+=elements[i].registered_images->image[y][x];
-				elements[i].measurements.total_intensity_within_worm_area+=worm_threshold?elements[i].registered_images->image[y][x]:0;
-				elements[i].measurements.total_worm_area += (worm_threshold?1:0);
-			}
-		}
+
+		//calculate all the per-pixel sums in one pass, storing the movement within the worm neighborhood
+		//in image_analysis_temp1 for the local maximum search below.
+		ns_registered_image_set & registered(*elements[i].registered_images);
+		const unsigned long quantification_height(registered.movement_image_.properties().height),
+							quantification_width(registered.movement_image_.properties().width);
+		ns_movement_quantification_sums sums;
+		for (unsigned long y = 0; y < quantification_height; y++)
+			ns_registered_image_quantification_kernel::run(registered.image[y],registered.movement_image_[y],registered.worm_region_threshold[y],
+												   quantification_width,image_analysis_temp1+y*image_width,sums);
+		#ifdef NS_CHECK_MOVEMENT_QUANTIFICATION_KERNEL
+		ns_check_movement_quantification(registered,sums,image_analysis_temp1,image_width);
+		#endif
+		elements[i].measurements.total_intensity_within_region = sums.total_intensity_within_region;
+		elements[i].measurements.total_intensity_within_worm_area = sums.total_intensity_within_worm_area;
+		elements[i].measurements.total_worm_area = sums.total_worm_area;
 		
 	//	elements[i].measurements.total_region_area=elements[i].registered_images->movement_image_.properties().height*elements[i].registered_images->movement_image_.properties().width;
 	//	double interframe_scaling_factor;
@@ -3315,36 +3623,9 @@ void ns_analyzed_image_time_path::quantify_movement(const ns_analyzed_time_image
 		//										/ ((double)elements[i].measurements.total_intensity_within_region);
 			}
 		}
-		double movement_sum(0),
-			   alternate_movement_sum(0);
-		elements[i].measurements.unnormalized_movement_sum = 0;
-		for (unsigned long y = 0; y < elements[i].registered_images->movement_image_.properties().height; y++){
-			for (unsigned long x = 0; x < elements[i].registered_images->movement_image_.properties().width; x++){
-				
-		//		movement_histogram[elements[i].registered_images->movement_image_[y][x]]++;
-		//		stationary_histogram[elements[i].registered_images->image[y][x]]++;
-				const bool worm_threshold(elements[i].registered_images->get_worm_neighborhood_threshold(y,x));
-
-				const bool alternate_worm_threshold(elements[i].registered_images->get_region_threshold(y,x) == 1 && 
-													!worm_threshold);
-				elements[i].measurements.unnormalized_movement_sum+=(worm_threshold?abs(elements[i].registered_images->movement_image_[y][x]):0);
-
-				/*const double m(
-					fabs(
-					elements[i].registered_images->movement_image_[y][x]+
-					(elements[i].registered_images->image[y][x]*(interframe_scaling_factor-1))
-					)
-				);
-				movement_sum += worm_threshold?m:0.0;*/
-				image_analysis_temp1[y*image_width+x] = worm_threshold?elements[i].registered_images->movement_image_[y][x]:0;
-				
-				alternate_movement_sum+= (alternate_worm_threshold)?elements[i].registered_images->movement_image_[y][x]:0;
-
-				elements[i].measurements.total_alternate_worm_area += (alternate_worm_threshold?1:0);
-				elements[i].measurements.total_intensity_within_alternate_worm += alternate_worm_threshold?elements[i].registered_images->image[y][x]:0;
-
-			}
-		}
+		elements[i].measurements.unnormalized_movement_sum = sums.unnormalized_movement_sum;
+		elements[i].measurements.total_alternate_worm_area = sums.total_alternate_worm_area;
+		elements[i].measurements.total_intensity_within_alternate_worm = sums.total_intensity_within_alternate_worm;
 		double interframe_time_scaling_factor(1);
 		if (i >= movement_time_kernel_width){
 			const long dt_s(elements[i].absolute_time - elements[i-movement_time_kernel_width].absolute_time);
@@ -3353,7 +3634,7 @@ void ns_analyzed_image_time_path::quantify_movement(const ns_analyzed_time_image
 		}
 		
 		elements[i].measurements.interframe_time_scaled_movement_sum=elements[i].measurements.unnormalized_movement_sum*interframe_time_scaling_factor;
-		elements[i].measurements.movement_alternate_worm_sum= (unsigned long)alternate_movement_sum;
+		elements[i].measurements.movement_alternate_worm_sum= (unsigned long)sums.alternate_movement_sum;
 
 		const int kernel_half_width(11);
 		if (image_width < 2*kernel_half_width || image_height < 2*kernel_half_width){
@@ -3419,7 +3700,7 @@ void ns_analyzed_image_time_path::quantify_movement(const ns_analyzed_time_image
 	}
 }
 
-void ns_analyzed_image_time_path::generate_movement_images(const ns_analyzed_time_image_chunk & chunk){
+void ns_analyzed_image_time_path::generate_movement_images(const ns_analyzed_time_image_chunk & chunk,const unsigned long thread_id){
 	const long n(movement_detection_kernal_half_width);
 	const long kernel_area((2*n+1)*(2*n+1));
 
@@ -3435,10 +3716,11 @@ void ns_analyzed_image_time_path::generate_movement_images(const ns_analyzed_tim
 	prop.components = 1;
 	float m_min(FLT_MAX),m_max(0);
 
-	memory_pool->set_temporary_image_size(3);
-	ns_image_standard & worm_threshold(memory_pool->temporary_images[0]),
-					& region_threshold(memory_pool->temporary_images[1]),
-					& worm_neighborhood_threshold(memory_pool->temporary_images[2]);
+	ns_time_path_image_movement_analysis_thread_scratch & scratch(memory_pool->scratch(thread_id));
+	scratch.set_temporary_image_size(3);
+	ns_image_standard & worm_threshold(scratch.temporary_images[0]),
+					& region_threshold(scratch.temporary_images[1]),
+					& worm_neighborhood_threshold(scratch.temporary_images[2]);
 	worm_threshold.prepare_to_recieve_image(prop);
 	region_threshold.prepare_to_recieve_image(prop);
 	worm_neighborhood_threshold.prepare_to_recieve_image(prop);
@@ -4,8 +4,10 @@
 #include "ns_movement_measurement.h"
 #include "ns_survival_curve.h"
 #include "ns_time_path_posture_movement_solution.h"
+#include "ns_thread_pool.h"
 
 ns_analyzed_image_time_path_death_time_estimator * ns_get_death_time_estimator_from_posture_analysis_model(const ns_posture_analysis_model & m);
+class ns_death_time_parameter_sweep;
 
 struct ns_analyzed_image_time_path_element_measurements{
 
@@ -85,98 +87,119 @@ private:
 };
 
 //#define NS_DEBUG_POOL
+//Images are checked in and out of the pool by all the threads processing paths simultaneously,
+//so every access to the stack is made while holding pool_lock.
 template<class T, class dT = ns_default_resizer>
 class ns_image_pool{
 public:
-	ns_image_pool():number_checked_out(0),pre_allocated(0),min_stack_size_in_history(0){
+	ns_image_pool():number_checked_out(0),pre_allocated(0),min_stack_size_in_history(0),pool_lock("ns_image_pool::pool_lock"){
 		clear_history();
 	}
-	ns_image_pool(const unsigned long i):number_checked_out(0),pre_allocated(0),min_stack_size_in_history(0){
+	ns_image_pool(const unsigned long i):number_checked_out(0),pre_allocated(0),min_stack_size_in_history(0),pool_lock("ns_image_pool::pool_lock"){
 		clear_history();pre_allocate(i);
 	}
 	~ns_image_pool(){
 		clear();
 	}
 	void pre_allocate(const unsigned long s){
+		ns_acquire_lock_for_scope lock(pool_lock,__FILE__,__LINE__);
 		for (unsigned int i = 0; i < s; i++)
 			pool.push(new T);
+		lock.release();
 	}
 	template<class M>
 	void pre_allocate(const unsigned long s, const M & m){
+		ns_acquire_lock_for_scope lock(pool_lock,__FILE__,__LINE__);
 		pre_allocated+=s;
 		for (unsigned int i = 0; i < s; i++){
 			pool.push(new T(resizer.parse_initialization(m)));
 			resizer.resize_after_initialization(m,pool.top());
 		}
+		lock.release();
 	}
 	T * get(){
+		ns_acquire_lock_for_scope lock(pool_lock,__FILE__,__LINE__);
 		number_checked_out++;
 		if (pool.empty()){	
 			T * a(new T);
 			check_out(a);
+			lock.release();
 			return a;
 		}
 		T * a(pool.top());
 		pool.pop();
+		lock.release();
 		return a;
 	}
 	void clear(){
+		ns_acquire_lock_for_scope lock(pool_lock,__FILE__,__LINE__);
 		empty_pool();
 		#ifdef NS_DEBUG_POOL
 			if (checked_out.size() > 0){
 				std::cerr << "ns_image_pool::~ns_image_pool()::" << checked_out.size() << " objects remain checked out.  This is likely a memory leak.\n";
 			}
 		#endif
+		lock.release();
 	}
 	template<class M>
 	T * get(const M & m){
+		ns_acquire_lock_for_scope lock(pool_lock,__FILE__,__LINE__);
 		number_checked_out++;
 		#ifdef NS_DEBUG_POOL
 		std::cerr << "Number Checked out: " << number_checked_out << "\n";
 		#endif
 		if (pool.empty()){
+			//allocate outside the lock so that other threads can keep recycling images in the meantime
+			lock.release();
 			try{
 				T * a(new T(resizer.parse_initialization(m)));
 				resizer.resize_after_initialization(m,*a);
+				lock.get(__FILE__,__LINE__);
 				check_out(a);
+				lock.release();
 				return a;
 			}
 			catch(std::bad_alloc){
+				lock.get(__FILE__,__LINE__);
 				empty_pool();
-				throw ns_ex("ns_pool_allocator(): Ran out of memory with ") << number_checked_out << " checked out objects\n";
+				const unsigned long n(number_checked_out);
+				lock.release();
+				throw ns_ex("ns_pool_allocator(): Ran out of memory with ") << n << " checked out objects\n";
 			}
 		}
 		T * a(pool.top());
 		pool.pop();
+		lock.release();
 		resizer.resize_after_initialization(m,*a);
+		lock.get(__FILE__,__LINE__);
 		check_out(a);
+		lock.release();
 		return a;
 	}
 	void release(T *p){
 		if (p==0)
 			throw ns_ex("Checking in null pointer!");
+		ns_acquire_lock_for_scope lock(pool_lock,__FILE__,__LINE__);
 		number_checked_out--;
 		//delete p;
 		check_in(p);
 		pool.push(p);
+		lock.release();
 	}
 	void mark_stack_size_waypoint_and_trim(){
+		ns_acquire_lock_for_scope lock(pool_lock,__FILE__,__LINE__);
 		update_stack_size_history();
 	//	if (min_stack_size_in_history != 0){
 	//		std::cout << "ns_image_pool()::Freeing " << min_stack_size_in_history << " out of " << pool.size() << " pooled objects, with " << number_checked_out << " checked out\n";
 	//	}
 		trim_stack();
-	}
-	void empty_pool(){
-		while(!pool.empty()){	
-			T * t(pool.top());
-			delete t;
-			pool.pop();
-		}
+		lock.release();
 	}
 
 	void set_resizer(const dT & resizer_){
+		ns_acquire_lock_for_scope lock(pool_lock,__FILE__,__LINE__);
 		resizer = resizer_;
+		lock.release();
 	}
 	//const unsigned long & number_checked_out(){return checked_out;}
 private:
@@ -199,6 +222,14 @@ private:
 	void check_out(T * t){}
 	void check_in(T * t){}
 	#endif
+	//must be called while holding pool_lock
+	void empty_pool(){
+		while(!pool.empty()){	
+			T * t(pool.top());
+			delete t;
+			pool.pop();
+		}
+	}
 	int stack_size_history[ns_stack_history_size];
 	int min_stack_size_in_history;
 	inline void trim_stack(){
@@ -222,6 +253,7 @@ private:
 		stack_size_history[0] = pool.size();
 	}
 	dT resizer;
+	ns_lock pool_lock;
 };
 
 
@@ -509,7 +541,28 @@ struct ns_analyzed_time_path_quantification_summary{
 };
 
 
+//Scratch space used while generating and quantifying movement images.
+//Each thread processing paths gets its own copy, so paths can be processed concurrently.
+struct ns_time_path_image_movement_analysis_thread_scratch{
+	void set_temporary_image_size(unsigned long i){
+		if (i <= temporary_images.size())
+			return;
+		temporary_images.resize(i);
+		for (unsigned int i = 0; i < temporary_images.size(); i++)
+			temporary_images[i].use_more_memory_to_avoid_reallocations();
+	}
+	void clear(){
+		temporary_images.clear();
+		image_analysis_temp1.clear();
+		image_analysis_temp2.clear();
+	}
+	std::vector<ns_image_standard> temporary_images;
+	std::vector<unsigned char> image_analysis_temp1,
+							   image_analysis_temp2;
+};
+
 struct ns_time_path_image_movement_analysis_memory_pool{
+	ns_time_path_image_movement_analysis_memory_pool():thread_scratch(1){}
 	void set_overallocation_size(const ns_image_properties & p){
 		aligned_image_pool.set_resizer(ns_overallocation_resizer(p));
 		registered_image_pool.set_resizer(ns_overallocation_resizer(p));
@@ -520,21 +573,26 @@ struct ns_time_path_image_movement_analysis_memory_pool{
 	void clear(){
 		aligned_image_pool.clear();
 		registered_image_pool.clear();
-		temporary_images.clear();
+		for (unsigned int i = 0; i < thread_scratch.size(); i++)
+			thread_scratch[i].clear();
 	}
-	void set_temporary_image_size(unsigned long i){
-		if (i <= temporary_images.size())
-			return;
-		temporary_images.resize(i);
-		for (unsigned int i = 0; i < temporary_images.size(); i++)
-			temporary_images[i].use_more_memory_to_avoid_reallocations();
+	//must be called before any worker threads start using the pool
+	void set_number_of_threads(const unsigned long n){
+		if (n > thread_scratch.size())
+			thread_scratch.resize(n);
 	}
-	std::vector<ns_image_standard> temporary_images;
+	ns_time_path_image_movement_analysis_thread_scratch & scratch(const unsigned long thread_id){
+		if (thread_id >= thread_scratch.size())
+			throw ns_ex("ns_time_path_image_movement_analysis_memory_pool::No scratch space allocated for thread ") << thread_id;
+		return thread_scratch[thread_id];
+	}
+private:
+	std::vector<ns_time_path_image_movement_analysis_thread_scratch> thread_scratch;
 };
 
 class ns_analyzed_image_time_path{
 public:
-	ns_analyzed_image_time_path(ns_time_path_image_movement_analysis_memory_pool & memory_pool_):memory_pool(&memory_pool_),volatile_backwards_path_data_written(false),first_stationary_timepoint_(0),entirely_excluded(false),image_analysis_temp1(0),image_analysis_temp2(0),images_preallocated(false),low_density_path(false),output_reciever(0),path_db_id(0),region_info_id(0),movement_image_storage(0),number_of_images_loaded(0){by_hand_annotation_event_times.resize((int)ns_number_of_movement_event_types,ns_death_time_annotation_time_interval::unobserved_interval()); state_intervals.resize((int)ns_movement_number_of_states);
+	ns_analyzed_image_time_path(ns_time_path_image_movement_analysis_memory_pool & memory_pool_):memory_pool(&memory_pool_),volatile_backwards_path_data_written(false),first_stationary_timepoint_(0),entirely_excluded(false),images_preallocated(false),low_density_path(false),output_reciever(0),path_db_id(0),region_info_id(0),movement_image_storage(0),number_of_images_loaded(0){by_hand_annotation_event_times.resize((int)ns_number_of_movement_event_types,ns_death_time_annotation_time_interval::unobserved_interval()); state_intervals.resize((int)ns_movement_number_of_states);
 }
 	~ns_analyzed_image_time_path(){
 		ns_safe_delete(output_reciever); 
@@ -542,10 +600,6 @@ public:
 			elements[i].clear_movement_images();
 			elements[i].clear_path_aligned_images();
 		}
-		delete[] image_analysis_temp1; 
-		image_analysis_temp1 = 0;
-		delete[] image_analysis_temp2;
-		image_analysis_temp2 = 0;
 	}
 	unsigned long number_of_elements_not_processed_correctly() const;
 	void denoise_movement_series(const ns_time_series_denoising_parameters &);
@@ -582,6 +636,7 @@ public:
 	static void write_analysis_optimization_data_header(std::ostream & o);
 	void write_analysis_optimization_data(const ns_stationary_path_id & id,const std::vector<double> & thresholds, const std::vector<double> & hold_times, const ns_region_metadata & m,const ns_time_series_denoising_parameters & denoising_parameters,std::ostream & o) const;
 	void calculate_analysis_optimization_data(const std::vector<double> & thresholds, const std::vector<double> & hold_times, std::vector< std::vector < unsigned long > > & death_times) const;
+	void add_to_parameter_sweep(const ns_stationary_path_id & id, const ns_region_metadata & m, const ns_time_series_denoising_parameters & denoising_parameters, ns_death_time_parameter_sweep & sweep) const;
 
 	ns_vector_2i path_region_position,
 				 path_region_size,
@@ -639,11 +694,9 @@ public:
 		return ns_death_time_annotation_time_interval(elements[first_stationary_timepoint_-1].absolute_time,elements[first_stationary_timepoint_].absolute_time);
 	}
 private:
+	void get_analysis_optimization_series(std::vector<unsigned long> & times, std::vector<double> & movement_scores) const;
 		
 	ns_time_path_limits time_path_limits;
-
-	unsigned char * image_analysis_temp1,
-				  * image_analysis_temp2;
 	
 	unsigned long first_stationary_timepoint_;
 
@@ -664,7 +717,8 @@ private:
 	
 	std::vector<ns_death_time_annotation_time_interval> by_hand_annotation_event_times;
 
-	void quantify_movement(const ns_analyzed_time_image_chunk & chunk);
+	//thread_id selects which of the memory pool's scratch buffers is used
+	void quantify_movement(const ns_analyzed_time_image_chunk & chunk,const unsigned long thread_id=0);
 	//generates path_aligned_image from region visualiation
 	bool populate_images_from_region_visualization(const unsigned long time,const ns_image_standard & region_image,const ns_image_standard & interpolated_region_image,bool just_do_a_consistancy_check);
 	bool region_image_is_required(const unsigned long time,const bool interpolated, const bool direction_is_backwards);
@@ -679,7 +733,7 @@ private:
 
 	ns_analyzed_time_image_chunk initiate_image_registration(const ns_analyzed_time_image_chunk & chunk,ns_alignment_state & state);
 	void calculate_image_registration(const ns_analyzed_time_image_chunk & chunk,ns_alignment_state & state, const ns_analyzed_time_image_chunk & first_chunk_to_register);
-	void generate_movement_images(const ns_analyzed_time_image_chunk & chunk);
+	void generate_movement_images(const ns_analyzed_time_image_chunk & chunk,const unsigned long thread_id=0);
 
 	void analyze_movement(const ns_analyzed_image_time_path_death_time_estimator * movement_death_time_estimator,const ns_stationary_path_id & path_id,const unsigned long last_timepoint_in_analysis);
 
@@ -712,6 +766,7 @@ private:
 
 	friend struct ns_analyzed_image_time_path_group;
 	friend class  ns_time_path_image_movement_analyzer;
+	friend class ns_analyzed_image_time_path_chunk_job;
 	friend class ns_size_data_accessor;
 	friend class ns_intensity_data_accessor;
 	friend class ns_movement_data_accessor;
@@ -775,6 +830,8 @@ public:
 
 	void write_detailed_movement_quantification_analysis_data(const ns_region_metadata & m, std::ostream & o,const bool only_output_elements_with_by_hand_data,const long specific_animal_id=-1, const bool abbreviated_time_series=false)const;
 	void write_analysis_optimization_data(const std::vector<double> & thresholds, const std::vector<double> & hold_times, const ns_region_metadata & m,std::ostream & o) const;
+	//adds the paths that would be written by write_analysis_optimization_data()
+	void add_to_parameter_sweep(const ns_region_metadata & m, ns_death_time_parameter_sweep & sweep) const;
 	
 	void output_visualization(const std::string & base_directory) const;
 
@@ -815,8 +872,12 @@ private:
 	bool image_db_info_loaded;
 	unsigned long last_timepoint_in_analysis_,
 				 number_of_timepoints_in_analysis_;
+	//the older text format, which can still be read
 	void load_movement_data_from_disk(std::istream & i,bool skip_movement_data=false);
 	void save_movement_data_to_disk(std::ostream & o) const;
+	//see ns_columnar_file.h.  Each path's elements are stored in their own segment, so each path's data can be loaded directly.
+	void load_movement_data_from_columnar_file(const ns_columnar_file_reader & f);
+	void save_movement_data_to_columnar_file(std::ostream & o) const;
 
 	unsigned long analysis_id;
 	void get_processing_stats_from_solution(const ns_time_path_solution & solution_);
@@ -878,5 +939,8 @@ public:
 	void from_xml(const std::string & text);
 };
 
+///Runs ns_movement_quantification_kernel and the per-pixel loops it replaced on the same synthetic images,
+///throwing an exception if their results differ, and reports the speed of each.
+void ns_benchmark_movement_quantification(std::ostream & out);
 
 #endif
@@ -1,12 +1,10 @@
 #include "ns_time_path_solver.h"
 #include "ns_image_server.h"
-#include "hungarian.h"
 #include "ns_linear_regression_model.h"
 #include "ns_ini.h"
 using namespace std;
 
 
-const int ns_hungarian_impossible_value(std::numeric_limits<int>::max()/2);
 
 ns_time_path_solver_parameters ns_time_path_solver_parameters::default_parameters(const unsigned long experiment_length_in_seconds,
 														const unsigned long short_capture_interval_in_seconds_,
@@ -331,12 +329,41 @@ void ns_time_path_solver::solve(const ns_time_path_solver_parameters &param, ns_
 	ns_global_debug(ns_text_stream_t("ns_time_path_solver::solve()::maximum_fraction_of_points_allowed_to_be_missing_in_path_fragment: ") <<	  param.maximum_fraction_of_points_allowed_to_be_missing_in_path_fragment);
 	ns_global_debug(ns_text_stream_t("ns_time_path_solver::solve()::maximum_fraction_of_median_gap_allowed_in_low_density_paths: ") <<		  param.maximum_fraction_of_median_gap_allowed_in_low_density_paths);
 
+	find_and_merge_path_fragments(param,0);
+	finish_solution(param,solve);
+}
+
+void ns_time_path_solver::find_and_merge_path_fragments(const ns_time_path_solver_parameters & param, const unsigned long first_timepoint_to_solve){
+	//keep the paths, or the parts of paths, that lie before the first timepoint to be solved.
+	//Path elements are stored in order of decreasing time, so any elements to be solved again are at the start of each path.
+	unsigned long number_of_kept_paths(0);
+	for (unsigned long i = 0; i < paths.size(); i++){
+		ns_time_path_solver_path & p(paths[i]);
+		unsigned long number_to_solve_again(0);
+		while (number_to_solve_again < p.elements.size() && p.elements[number_to_solve_again].t_id >= first_timepoint_to_solve)
+			number_to_solve_again++;
+		if (p.elements.size() - number_to_solve_again < 2)
+			continue;
+		if (number_to_solve_again > 0){
+			p.elements.erase(p.elements.begin(),p.elements.begin()+number_to_solve_again);
+			p.max_time = time(p.elements[0]);
+			p.max_time_position = element(p.elements[0]).e.center;
+			p.unchanged_since_last_merge = false;
+		}
+		if (number_of_kept_paths != i)
+			paths[number_of_kept_paths] = p;
+		number_of_kept_paths++;
+		paths[number_of_kept_paths-1].path_id = number_of_kept_paths;
+	}
+	paths.resize(number_of_kept_paths);
+
 	//first we find all paths that are long enough and consistant enough to be real
 	//note we discard lots of stray points here
 	find_stationary_path_fragments(param. maximum_fraction_of_points_allowed_to_be_missing_in_path_fragment,
 				   param.min_stationary_object_path_fragment_duration_in_seconds,
 				   param.stationary_object_path_fragment_window_length_in_seconds,
-				   param.stationary_object_path_fragment_max_movement_distance);
+				   param.stationary_object_path_fragment_max_movement_distance,
+				   first_timepoint_to_solve);
 /*	ofstream dbg("c:\\server\\dbg.csv");
 	dbg << "round,id,t_id,t\n";
 	for (unsigned int i = 0; i < paths.size(); i++){
@@ -348,9 +375,9 @@ void ns_time_path_solver::solve(const ns_time_path_solver_parameters &param, ns_
 
 	unsigned long debug_paths_moving_fragments_removed(0);
 
-	//remove fragments that move to much
+	//remove new fragments that move to much
 	if (1){
-		for (std::vector<ns_time_path_solver_path>::iterator p = paths.begin(); p != paths.end();){
+		for (std::vector<ns_time_path_solver_path>::iterator p = paths.begin()+number_of_kept_paths; p != paths.end();){
 		if (p->max_time == p->min_time){
 			p++;
 			continue;
@@ -412,7 +439,10 @@ void ns_time_path_solver::solve(const ns_time_path_solver_parameters &param, ns_
 		}*/
 
 	}
-		remove_short_and_moving_paths(param);
+}
+
+void ns_time_path_solver::finish_solution(const ns_time_path_solver_parameters & param, ns_time_path_solution & solve){
+	remove_short_and_moving_paths(param);
 	/*for (unsigned int i = 0; i < paths.size(); i++){
 		for (unsigned int j = 0; j < paths[i].elements.size(); j++)
 			dbg << "4," << i << "," << paths[i].elements[j].t_id <<  "," <<timepoints[paths[i].elements[j].t_id].time << "\n";
@@ -498,13 +528,13 @@ void ns_time_path_solution::save_to_db(const unsigned long region_id, ns_sql & s
 		im = image_server.image_storage.get_region_movement_metadata_info(region_id,"time_path_solution_data",sql);
 		update_db = true;
 	}
-	ofstream * o(image_server.image_storage.request_metadata_output(im,"csv",false,&sql));
+	ofstream * o(image_server.image_storage.request_metadata_output(im,ns_columnar_file_extension(),true,&sql));
 	im.save_to_db(im.id,&sql);
 
-	if (ns_dir::extract_extension(im.filename) != "csv")
+	if (ns_dir::extract_extension(im.filename) != ns_columnar_file_extension())
 		update_db = true;
 	try{
-		save_to_disk(*o);
+		save_to_columnar_file(*o);
 		delete o;
 	}
 	catch(...){
@@ -524,37 +554,241 @@ void ns_time_path_solution::load_from_db(const ns_64_bit region_id, ns_sql & sql
 	if (res.size() == 0)
 		throw ns_ex("ns_time_path_solution::load_from_db():Could not load info from db");
 
-	ns_acquire_for_scope<ifstream> input_file(0);
-
 	if (load_directly_from_disk_without_db){
-
 		ns_image_server_image im;
 		im = image_server.image_storage.get_region_movement_metadata_info(region_id,"time_path_solution_data",sql);
-		im.filename += ".csv";
+		//solutions are saved in the columnar format, but older ones may still be stored as text
+		const std::string filename_without_extension(im.filename);
+		std::string filename;
 		try{
-			input_file.attach(image_server.image_storage.request_metadata_from_disk(im,false,&sql));
+			im.filename = filename_without_extension + "." + ns_columnar_file_extension();
+			filename = image_server.image_storage.request_metadata_filename(im,&sql);
+			if (!ns_dir::file_exists(filename)){
+				im.filename = filename_without_extension + ".csv";
+				filename = image_server.image_storage.request_metadata_filename(im,&sql);
+			}
 		}catch(ns_ex & ex){
 			throw ns_ex("Solution data could not be found on disk");
 		}
+		if (!ns_dir::file_exists(filename))
+			throw ns_ex("Solution data could not be found on disk");
+		load_from_file(filename);
 	}else{
 		ns_image_server_image im;
 		im.id = atol(res[0][0].c_str());
 		if (im.id == 0)
 			throw ns_ex("Solution data has not been stored in db");
-		input_file.attach(image_server.image_storage.request_metadata_from_disk(im,false,&sql));
+		load_from_file(image_server.image_storage.request_metadata_filename(im,&sql));
 	}
+}
+
+void ns_time_path_solution::load_from_file(const std::string & filename){
+	if (ns_columnar_file_reader::is_columnar_file(filename)){
+		ns_columnar_file_reader f;
+		f.open(filename);
+		load_from_columnar_file(f);
+		return;
+	}
+	ifstream in(filename.c_str());
+	if (in.fail())
+		throw ns_ex("ns_time_path_solution::load_from_file()::Could not open ") << filename << ns_file_io;
+	load_from_disk(in);
+}
+
+void ns_time_path_solution::save_to_columnar_file(ostream & o) const{
+	//solutions are always loaded in their entirety, so they are compressed to reduce the amount read from disk
+	ns_columnar_file_writer file(o,true);
 
+	ns_columnar_table t("timepoints");
+	const unsigned long timepoint_time(t.add_column("time",ns_columnar_int64)),
+						sample_region_image_id(t.add_column("sample_region_image_id",ns_columnar_int64));
+	t.begin_segment(0);
+	for (unsigned int i = 0; i < timepoints.size(); i++){
+		t.push(timepoint_time,timepoints[i].time);
+		t.push(sample_region_image_id,timepoints[i].sample_region_image_id);
+	}
+	file.write(t);
+
+	ns_columnar_table e("elements");
+	const unsigned long region_position_x(e.add_column("region_position_x",ns_columnar_int32)),
+						region_position_y(e.add_column("region_position_y",ns_columnar_int32)),
+						context_image_position_in_region_vis_image_x(e.add_column("context_image_position_in_region_vis_image_x",ns_columnar_int32)),
+						context_image_position_in_region_vis_image_y(e.add_column("context_image_position_in_region_vis_image_y",ns_columnar_int32)),
+						region_size_x(e.add_column("region_size_x",ns_columnar_int32)),
+						region_size_y(e.add_column("region_size_y",ns_columnar_int32)),
+						context_image_position_x(e.add_column("context_image_position_x",ns_columnar_int32)),
+						context_image_position_y(e.add_column("context_image_position_y",ns_columnar_int32)),
+						context_image_size_x(e.add_column("context_image_size_x",ns_columnar_int32)),
+						context_image_size_y(e.add_column("context_image_size_y",ns_columnar_int32)),
+						low_temporal_resolution(e.add_column("low_temporal_resolution",ns_columnar_int8)),
+						slowly_moving(e.add_column("slowly_moving",ns_columnar_int8)),
+						number_of_extra_worms_identified_at_location(e.add_column("number_of_extra_worms_identified_at_location",ns_columnar_int32)),
+						inferred_animal_location(e.add_column("inferred_animal_location",ns_columnar_int8)),
+						element_before_fast_movement_cessation(e.add_column("element_before_fast_movement_cessation",ns_columnar_int8));
+	for (unsigned int i = 0; i < timepoints.size(); i++){
+		e.begin_segment(i);
+		for (unsigned int j = 0; j < timepoints[i].elements.size(); j++){
+			const ns_time_path_element & el(timepoints[i].elements[j]);
+			e.push(region_position_x,el.region_position.x);
+			e.push(region_position_y,el.region_position.y);
+			e.push(context_image_position_in_region_vis_image_x,el.context_image_position_in_region_vis_image.x);
+			e.push(context_image_position_in_region_vis_image_y,el.context_image_position_in_region_vis_image.y);
+			e.push(region_size_x,el.region_size.x);
+			e.push(region_size_y,el.region_size.y);
+			e.push(context_image_position_x,el.context_image_position.x);
+			e.push(context_image_position_y,el.context_image_position.y);
+			e.push(context_image_size_x,el.context_image_size.x);
+			e.push(context_image_size_y,el.context_image_size.y);
+			e.push(low_temporal_resolution,el.low_temporal_resolution);
+			e.push(slowly_moving,el.slowly_moving);
+			e.push(number_of_extra_worms_identified_at_location,el.number_of_extra_worms_identified_at_location);
+			e.push(inferred_animal_location,el.inferred_animal_location);
+			e.push(element_before_fast_movement_cessation,el.element_before_fast_movement_cessation);
+		}
+	}
+	file.write(e);
+
+	ns_columnar_table p("paths");
+	const unsigned long center_x(p.add_column("center_x",ns_columnar_int32)),
+						center_y(p.add_column("center_y",ns_columnar_int32)),
+						is_low_density_path(p.add_column("is_low_density_path",ns_columnar_int8));
+	p.begin_segment(0);
+	for (unsigned int i = 0; i < paths.size(); i++){
+		p.push(center_x,paths[i].center.x);
+		p.push(center_y,paths[i].center.y);
+		p.push(is_low_density_path,paths[i].is_low_density_path);
+	}
+	file.write(p);
+
+	//path memberships.  The unassigned points are stored in a final segment.
+	ns_columnar_table l("path_elements");
+	const unsigned long t_id(l.add_column("t_id",ns_columnar_int64)),
+						index(l.add_column("index",ns_columnar_int64)),
+						moving(l.add_column("moving",ns_columnar_int8));
+	for (unsigned int i = 0; i <= paths.size(); i++){
+		const ns_time_path & path((i == paths.size())?unassigned_points:paths[i]);
+		l.begin_segment(i);
+		for (unsigned int j = 0; j < path.stationary_elements.size(); j++){
+			l.push(t_id,path.stationary_elements[j].t_id);
+			l.push(index,path.stationary_elements[j].index);
+			l.push(moving,0);
+		}
+		for (unsigned int j = 0; j < path.moving_elements.size(); j++){
+			l.push(t_id,path.moving_elements[j].t_id);
+			l.push(index,path.moving_elements[j].index);
+			l.push(moving,1);
+		}
+	}
+	file.write(l);
+
+	ns_columnar_table g("path_groups");
+	const unsigned long path_id(g.add_column("path_id",ns_columnar_int64));
+	for (unsigned int i = 0; i < path_groups.size(); i++){
+		g.begin_segment(i);
+		for (unsigned int j = 0; j < path_groups[i].path_ids.size(); j++)
+			g.push(path_id,path_groups[i].path_ids[j]);
+	}
+	file.write(g);
+	file.close();
+}
 
+void ns_time_path_solution::load_from_columnar_file(const ns_columnar_file_reader & f){
+	clear();
+	unassigned_points.moving_elements.resize(0);
+	worms_loaded = false;
+	std::vector<ns_64_bit> a,b,c;
+	std::vector<long> x[10];
+	std::vector<char> flags[5];
+
+	const ns_columnar_file_reader::ns_table & t(f.table("timepoints"));
+	if (t.segments.size() != 1)
+		throw ns_ex("ns_time_path_solution::load_from_columnar_file()::Invalid timepoint table");
+	f.read(t,0,"time",a);
+	f.read(t,0,"sample_region_image_id",b);
+	timepoints.resize(a.size());
+	for (unsigned int i = 0; i < timepoints.size(); i++){
+		timepoints[i].time = a[i];
+		timepoints[i].sample_region_image_id = b[i];
+	}
 
+	const ns_columnar_file_reader::ns_table & e(f.table("elements"));
+	const char * position_columns[10] = {"region_position_x","region_position_y",
+										"context_image_position_in_region_vis_image_x","context_image_position_in_region_vis_image_y",
+										"region_size_x","region_size_y",
+										"context_image_position_x","context_image_position_y",
+										"context_image_size_x","context_image_size_y"};
+	const char * flag_columns[5] = {"low_temporal_resolution","slowly_moving","inferred_animal_location","element_before_fast_movement_cessation","number_of_extra_worms_identified_at_location"};
+	for (unsigned int i = 0; i < timepoints.size(); i++){
+		const long s(e.find_segment(i));
+		if (s == -1)
+			throw ns_ex("ns_time_path_solution::load_from_columnar_file()::No elements were stored for timepoint ") << i;
+		for (unsigned int k = 0; k < 10; k++)
+			f.read(e,s,position_columns[k],x[k]);
+		for (unsigned int k = 0; k < 4; k++)
+			f.read(e,s,flag_columns[k],flags[k]);
+		f.read(e,s,flag_columns[4],a);
+		timepoints[i].elements.resize(x[0].size());
+		for (unsigned int j = 0; j < timepoints[i].elements.size(); j++){
+			ns_time_path_element & el(timepoints[i].elements[j]);
+			el.region_position = ns_vector_2i(x[0][j],x[1][j]);
+			el.context_image_position_in_region_vis_image = ns_vector_2i(x[2][j],x[3][j]);
+			el.region_size = ns_vector_2i(x[4][j],x[5][j]);
+			el.context_image_position = ns_vector_2i(x[6][j],x[7][j]);
+			el.context_image_size = ns_vector_2i(x[8][j],x[9][j]);
+			el.center = el.region_position + el.region_size/2;
+			el.low_temporal_resolution = flags[0][j] != 0;
+			el.slowly_moving = flags[1][j] != 0;
+			el.inferred_animal_location = flags[2][j] != 0;
+			el.element_before_fast_movement_cessation = flags[3][j] != 0;
+			el.number_of_extra_worms_identified_at_location = (unsigned long)a[j];
+		}
+	}
+
+	const ns_columnar_file_reader::ns_table & p(f.table("paths"));
+	if (p.segments.size() != 1)
+		throw ns_ex("ns_time_path_solution::load_from_columnar_file()::Invalid path table");
+	f.read(p,0,"center_x",x[0]);
+	f.read(p,0,"center_y",x[1]);
+	f.read(p,0,"is_low_density_path",flags[0]);
+	paths.resize(x[0].size());
+	for (unsigned int i = 0; i < paths.size(); i++){
+		paths[i].center = ns_vector_2i(x[0][i],x[1][i]);
+		paths[i].is_low_density_path = flags[0][i] != 0;
+	}
 
-	try{
-		load_from_disk(input_file());
-		input_file.release();
+	const ns_columnar_file_reader::ns_table & l(f.table("path_elements"));
+	for (unsigned int i = 0; i <= paths.size(); i++){
+		ns_time_path & path((i == paths.size())?unassigned_points:paths[i]);
+		const long s(l.find_segment(i));
+		if (s == -1)
+			continue;
+		f.read(l,s,"t_id",a);
+		f.read(l,s,"index",b);
+		f.read(l,s,"moving",flags[0]);
+		for (unsigned int j = 0; j < a.size(); j++){
+			if (a[j] >= timepoints.size() || b[j] >= timepoints[a[j]].elements.size())
+				throw ns_ex("ns_time_path_solution::load_from_columnar_file()::Invalid path element: ") << a[j] << "," << b[j];
+			(flags[0][j]?path.moving_elements:path.stationary_elements).push_back(ns_time_element_link(a[j],b[j]));
+		}
 	}
-	catch(...){
-		input_file.release();
-		throw;
+
+	const ns_columnar_file_reader::ns_table & g(f.table("path_groups"));
+	path_groups.resize(g.segments.size());
+	for (unsigned int i = 0; i < path_groups.size(); i++){
+		const long s(g.find_segment(i));
+		if (s == -1)
+			throw ns_ex("ns_time_path_solution::load_from_columnar_file()::Missing path group ") << i;
+		f.read(g,s,"path_id",c);
+		path_groups[i].path_ids.resize(c.size());
+		for (unsigned int j = 0; j < c.size(); j++){
+			if (c[j] >= paths.size())
+				throw ns_ex("ns_time_path_solution::load_from_columnar_file()::Invalid path id!");
+			path_groups[i].path_ids[j] = c[j];
+		}
 	}
+
+	ns_global_debug(ns_text_stream_t("ns_time_path_solution()::load_from_columnar_file()::Loaded ") << paths.size() << " paths in " << path_groups.size() << " groups over " << timepoints.size() << " timepoints.");
+	check_for_duplicate_events();
 }
 //it would be nice to use XML here but it is so verbose!
 void ns_time_path_solution::save_to_disk(ostream & o) const{
@@ -926,69 +1160,48 @@ inline void ns_is_interesting_point(const ns_vector_2i &p){
 
 
 void ns_time_path_solver::assign_timepoint_elements_to_paths(std::vector<ns_time_path_solver_element> & elements, const unsigned long max_dist_sq, std::vector<ns_time_path_solver_path_builder> & opaths){
-	hungarian_problem_t matching_problem;
 	int unassigned_count(0);
 	for (unsigned int i = 0; i < elements.size(); i++)
 		unassigned_count+=elements[i].element_assigned?0:1;
 	if (unassigned_count == 0)
 		return;
-	int ** cost_matrix = new int *[opaths.size()];
-	for (unsigned int i = 0; i < opaths.size(); i++)
-		cost_matrix[i] = new int[unassigned_count];
-	try{
-		for (unsigned int i = 0; i < opaths.size(); i++){
-			unsigned long k(0);
-			for (unsigned int j = 0; j < elements.size(); j++){
-				if (elements[j].element_assigned)
-					continue;
-				const unsigned long d((elements[j].e.center-opaths[i].center).squared());
-				if (d > max_dist_sq)
-					cost_matrix[i][k] = ns_hungarian_impossible_value;
-				else
-					cost_matrix[i][k] = d;
-				k++;
-			}
-		}
 
-		hungarian_init(&matching_problem,cost_matrix,
-			opaths.size(),//rows
-			unassigned_count,	//columns
-			HUNGARIAN_MODE_MINIMIZE_COST);
-
-		hungarian_solve(&matching_problem);
+	//Each element can only be assigned to paths within max_dist_sq of it.
+	//Only those pairs are considered, found by bucketing the path centers into cells
+	//large enough that any such path lies in the element's cell or one of its neighbors.
+	path_grid.clear(sqrt((double)max_dist_sq+1)+1);
+	for (unsigned int i = 0; i < opaths.size(); i++)
+		path_grid.add(i,opaths[i].center);
+	path_grid.build();
 
-		int k = 0;
-		for (unsigned int j = 0; j < elements.size(); j++){
-			if (elements[j].element_assigned){
-				elements[j].element_assigned_in_this_round = false;
-				continue;
-			}
-			bool found(false);
-			for (unsigned int i = 0; i < opaths.size(); i++){
-				if (matching_problem.assignment[i][k] != HUNGARIAN_ASSIGNED ||
-					cost_matrix[i][k] == ns_hungarian_impossible_value)
-					continue;
-				elements[j].path_id = i;
-				elements[j].element_assigned_in_this_round = true;
-				found = true;
-				break;
-			}
-			if (!found){
-			//	ns_is_interesting_point(timepoints[t_id].elements[j].e.center);
-				elements[j].element_assigned_in_this_round = false;
-			}
-			k++;
+	assignment_solver.clear(opaths.size(),elements.size());
+	for (unsigned int j = 0; j < elements.size(); j++){
+		if (elements[j].element_assigned)
+			continue;
+		grid_candidates.resize(0);
+		path_grid.find_candidates(ns_vector_2d(elements[j].e.center.x,elements[j].e.center.y),grid_candidates);
+		for (unsigned int k = 0; k < grid_candidates.size(); k++){
+			const unsigned long i(grid_candidates[k]);
+			const unsigned long d((elements[j].e.center-opaths[i].center).squared());
+			if (d <= max_dist_sq)
+				assignment_solver.add_pair(i,j,d);
 		}
-		hungarian_free(&matching_problem);
-		for (unsigned int i = 0; i < opaths.size(); i++)
-			delete[] cost_matrix[i];
-		delete[] cost_matrix;
 	}
-	catch(...){
-		for (unsigned int i = 0; i < opaths.size(); i++)
-			delete[] cost_matrix[i];
-		delete[] cost_matrix;
-		throw;
+	assignment_solver.solve();
+
+	for (unsigned int j = 0; j < elements.size(); j++){
+		if (elements[j].element_assigned){
+			elements[j].element_assigned_in_this_round = false;
+			continue;
+		}
+		const long i(assignment_solver.row_assigned_to_column(j));
+		if (i == -1){
+		//	ns_is_interesting_point(timepoints[t_id].elements[j].e.center);
+			elements[j].element_assigned_in_this_round = false;
+			continue;
+		}
+		elements[j].path_id = i;
+		elements[j].element_assigned_in_this_round = true;
 	}
 }
 double ns_time_path_solver_path_builder::calculate_current_density(const unsigned long time_density_window, const std::vector<ns_time_path_solver_timepoint> & timepoints,const unsigned long current_timepoint_i) const{
@@ -1065,13 +1278,6 @@ ns_time_path_solution_stationary_drift_estimator ns_estimator_for_point(const ns
 	return estimator;
 }
 
-int ns_find_linked(const int id, const int size, int ** assignments){
-	for (unsigned int i = 0; i < size; i++){
-		if (assignments[id][i] == HUNGARIAN_ASSIGNED)
-			return i;
-	}
-	return -1;
-}
 struct ns_estimator_group_group{
 	ns_estimator_group_group():to_be_deleted(false){}
 	ns_estimator_group_group(const ns_time_path_solution_stationary_drift_estimator_group * est, const ns_time_path_solution_stationary_drift_estimator_group * tgt):to_be_deleted(false),estimators(2){
@@ -1192,6 +1398,11 @@ bool ns_time_path_solver::merge_estimator_groups(const unsigned long max_dist_sq
 	//est contains the estimators that will be used as the "later" of merged pairs that absorb "earlier" targets
 	//tgt contains the targets that will be absorbed by the "later" estimators.
 	vector<ns_time_path_solution_stationary_drift_estimator_group *> est,tgt;
+	typedef std::pair<unsigned long,unsigned long> ns_target_time;
+	std::vector<ns_target_time> target_order;
+	ns_spatial_grid target_grid;
+	ns_sparse_assignment_solver assignment_solver;
+	std::vector<unsigned long> candidates;
 	//go through all the targets sorted from earliest to latest
 	for (ns_sorted_estimator_list::reverse_iterator t = estimators.rbegin(); t != estimators.rend(); t++){
 		est.resize(0);
@@ -1213,117 +1424,91 @@ bool ns_time_path_solver::merge_estimator_groups(const unsigned long max_dist_sq
 		}
 		if (est.size() == 0)
 			continue;
-		int ** cost_matrix = new int *[est.size()];
-		for (unsigned int i = 0; i <est.size(); i++)
-			cost_matrix[i] = new int[tgt.size()];
 
-		try{
+		//An estimator can only absorb targets that lie within max_dist_sq of where it is estimated to be at the target's time.
+		//Targets are grouped by their time, and each group is bucketed into a grid so that
+		//each estimator needs only to be compared to the targets near its estimated position at that time.
+		//Only these pairs are given to the assignment solver.
+		target_order.resize(tgt.size());
+		for (unsigned int j = 0; j < tgt.size(); j++)
+			target_order[j] = ns_target_time(tgt[j]->latest().late_parameters.estimation_time,j);
+		std::sort(target_order.begin(),target_order.end());
+
+		assignment_solver.clear(est.size(),tgt.size());
+		for (unsigned int g = 0; g < target_order.size();){
+			const unsigned long target_time(target_order[g].first);
+			target_grid.clear(sqrt((double)max_dist_sq+1)+1);
+			unsigned int h(g);
+			for (; h < target_order.size() && target_order[h].first == target_time; h++)
+				target_grid.add(target_order[h].second,tgt[target_order[h].second]->latest().late_parameters.estimation_position);
+			target_grid.build();
+			g = h;
+
 			//i is the estimator
 			for (unsigned int i = 0; i < est.size(); i++){
-				//j is the target
-				for (unsigned int j = 0; j < tgt.size(); j++){
+				const ns_vector_2d estimated_position(estimate(*est[i],target_time));
+				candidates.resize(0);
+				target_grid.find_candidates(estimated_position,candidates);
+				for (unsigned int k = 0; k < candidates.size(); k++){
+					//j is the target
+					const unsigned long j(candidates[k]);
 					if (est[i] == tgt[j]){
 						//dont attempt to match estimators to themselves!
 						throw ns_ex("Attempting to match target to itself!");
 					}
 					//don't allow estimators to chose very far away objects,
 					//or to overlap unpleasantly with it.
-					//bool is_interesting(ns_is_close2(est[i]->earliest().early_parameters.estimation_position) &&
-					//	ns_is_close2(tgt[j]->latest().late_parameters.estimation_position));
-
-					double d((estimate(*est[i],tgt[j]->latest().late_parameters.estimation_time) -
-								tgt[j]->latest().late_parameters.estimation_position).squared());
+					const double d((estimated_position - tgt[j]->latest().late_parameters.estimation_position).squared());
 
 					if (d >= 0 && d < max_dist_sq &&
 						is_ok_to_merge_overlap(*est[i],*tgt[j],INT_MAX,INT_MAX,max_fraction_points_overlap))
-						{
-						/*if (is_interesting){
-							cerr << "Accepted";
-							cerr << "\n";
-						}*/
-						cost_matrix[i][j] = d;
-					}
-					else{
-						/*if (is_interesting){
-							if (!(d > 0 && d < max_dist_sq))
-								cerr << "Too large a distance. ";
-							cerr << "Rejected";
-							cerr << "\n";
-						}*/
-						cost_matrix[i][j] =  ns_hungarian_impossible_value;
-					}
+						assignment_solver.add_pair(i,j,d);
 				}
 			}
-
-			hungarian_problem_t matching_problem;
-			hungarian_init(&matching_problem,cost_matrix,
-				est.size(),//rows
-				tgt.size(),	//columns
-				HUNGARIAN_MODE_MINIMIZE_COST);
-
-			hungarian_solve(&matching_problem);
-
-			//merge all targets up into their matched estimators
-			for (unsigned int i = 0; i < est.size(); i++){
-				if (est[i]->to_be_deleted)
-					throw ns_ex("Deleted Estimators were matched to targets!");
-				const long linked_id = ns_find_linked(i,tgt.size(),matching_problem.assignment);
-				if (linked_id != -1 && cost_matrix[i][linked_id] != ns_hungarian_impossible_value){
-
-					/*if(ns_is_close3(tgt[linked_id]->latest().late_parameters.estimation_position)){
-						cerr << "Found: ";
-						if (!tgt[linked_id]->latest().is_a_path())
-							cerr << tgt[linked_id]->latest().stray_point_id.t_id << ": ";
-						else cerr << paths[tgt[linked_id]->latest().path_id].elements.begin()->t_id << ": ";
-						cerr << tgt[linked_id]->latest().late_parameters.estimation_position;
-						cerr << "\n";
-					}*/
-					//note that the group automatically sorts the new estimators such that the estimator() function will return the corrent one next time
-					for (ns_time_path_solution_stationary_drift_estimator_group::ns_estimator_list::iterator p = tgt[linked_id]->estimators.begin();
-							p!= tgt[linked_id]->estimators.end(); p++){
-						/*
-						if (p->is_a_path()){
-
-							for (unsigned int k = 0; k < paths[p->path_id].elements.size(); k++){
-								if (ns_is_close4(paths[p->path_id].elements[k]))
-									cerr << "Found it in an estimator; " << p->path_id << "\n";
-								if (element(paths[p->path_id].elements[k]).element_assigned_in_this_round)
-									cerr << "WHA!";
-								else
-									element(paths[p->path_id].elements[k]).element_assigned_in_this_round = true;
-							}
-						}
-						else{
-							if (ns_is_close4(p->stray_point_id))
-								cerr << "Found it in an estimator; stray point\n";
-							if (element(p->stray_point_id).element_assigned_in_this_round)
+		}
+		assignment_solver.solve();
+
+		//merge all targets up into their matched estimators
+		for (unsigned int i = 0; i < est.size(); i++){
+			if (est[i]->to_be_deleted)
+				throw ns_ex("Deleted Estimators were matched to targets!");
+			const long j(assignment_solver.column_assigned_to_row(i));
+			if (j != -1){
+				//note that the group automatically sorts the new estimators such that the estimator() function will return the corrent one next time
+				for (ns_time_path_solution_stationary_drift_estimator_group::ns_estimator_list::iterator p = tgt[j]->estimators.begin();
+						p!= tgt[j]->estimators.end(); p++){
+					/*
+					if (p->is_a_path()){
+
+						for (unsigned int k = 0; k < paths[p->path_id].elements.size(); k++){
+							if (ns_is_close4(paths[p->path_id].elements[k]))
+								cerr << "Found it in an estimator; " << p->path_id << "\n";
+							if (element(paths[p->path_id].elements[k]).element_assigned_in_this_round)
 								cerr << "WHA!";
 							else
-								element(p->stray_point_id).element_assigned_in_this_round = true;
-						}*/
-						bool element_already_existed(!est[i]->estimators.insert(*p).second);
-						est[i]->clear_cached_path();	//since we've changed the estimator, we'll need to rebuild a path from it next time it's needed
-														//the path is used to calculate overlaps only.
-						//if (element_already_existed)
-						//	std::cerr << "WAHA";
-						changes_made = true;
+								element(paths[p->path_id].elements[k]).element_assigned_in_this_round = true;
+						}
 					}
-
-					//we need to delete the absorbed target, but we can't do it yet because
-					//we have pointers into its container that need to stay valid.
-					tgt[linked_id]->to_be_deleted = true;
+					else{
+						if (ns_is_close4(p->stray_point_id))
+							cerr << "Found it in an estimator; stray point\n";
+						if (element(p->stray_point_id).element_assigned_in_this_round)
+							cerr << "WHA!";
+						else
+							element(p->stray_point_id).element_assigned_in_this_round = true;
+					}*/
+					bool element_already_existed(!est[i]->estimators.insert(*p).second);
+					est[i]->clear_cached_path();	//since we've changed the estimator, we'll need to rebuild a path from it next time it's needed
+													//the path is used to calculate overlaps only.
+					//if (element_already_existed)
+					//	std::cerr << "WAHA";
+					changes_made = true;
 				}
+
+				//we need to delete the absorbed target, but we can't do it yet because
+				//we have pointers into its container that need to stay valid.
+				tgt[j]->to_be_deleted = true;
 			}
-			hungarian_free(&matching_problem);
-			for (unsigned int i = 0; i < est.size(); i++)
-				delete[] cost_matrix[i];
-			delete[] cost_matrix;
-		}
-		catch(...){
-			for (unsigned int i = 0; i < est.size(); i++)
-				delete[] cost_matrix[i];
-			delete[] cost_matrix;
-			throw;
 		}
 	}
 
@@ -1384,6 +1569,11 @@ struct ns_time_element_link_orderer{
 		return a.t_id < b.t_id;
 	}
 };
+struct ns_time_element_link_is_later_than{
+	bool operator()(const ns_time_element_link & a, const unsigned long t) const{
+		return a.t_id > t;
+	}
+};
 
 void ns_time_path_solver::handle_low_density_stationary_paths_and_stray_points(const unsigned long max_movement_distance, const double min_final_stationary_path_duration_in_minutes){
 	//this is important, finicky code. The details matter.
@@ -1406,9 +1596,9 @@ void ns_time_path_solver::handle_low_density_stationary_paths_and_stray_points(c
 	//we allow a little overlap between estimator and target, ordering is done by the latest point on each estimator
 
 	//Given a set of possible estimators and possible targets,
-	//we a big cost matrix and run a hungarian algorithm
-	//to find the optimal assignments.
-	//Note that the hungarian algorithm is done *not* considering time; so everything
+	//we find all the estimator/target pairs close enough to be joined
+	//and solve the assignment problem between them to find the optimal assignments.
+	//Note that the assignment is done *not* considering time; so everything
 	//is joined without regard to how far things are appart in time
 
 	//after everything is joined together, everything might be out of order (i.e paths linked
@@ -1471,45 +1661,50 @@ void ns_time_path_solver::handle_low_density_stationary_paths_and_stray_points(c
 	}
 
 	//detect stray points and add them as estimators (ie. elements capable of being matched up)
+	//At each time, the unassigned points are bucketed into a grid, so that each path estimator
+	//needs only to be compared to the points near its estimated position at that time.
+	ns_spatial_grid point_grid;
+	std::vector<unsigned long> candidates;
+	std::vector<char> point_is_near_a_path;
 	for (unsigned int i = 0; i < timepoints.size(); i++){
-		unsigned long number_of_stationary_paths_at_current_time(0);
 		if (i < index_where_paths_dominate)
 			continue;
+		point_grid.clear(sqrt((double)max_dist_sq+1)+1);
 		for (unsigned int j = 0; j < timepoints[i].elements.size(); j++){
-		//	if (ns_is_close2(timepoints[i].elements[j].e.center))
-		//		cerr << "B";
-			if (timepoints[i].elements[j].element_assigned)
-					continue;
-
-			for (unsigned int k = 0; k < number_of_path_estimators; k++){
-
-				if (estimators[k].within_time_span(timepoints[i].time))
-					continue;
+			if (!timepoints[i].elements[j].element_assigned)
+				point_grid.add(j,timepoints[i].elements[j].e.center);
+		}
+		if (point_grid.empty())
+			continue;
+		point_grid.build();
+		point_is_near_a_path.resize(0);
+		point_is_near_a_path.resize(timepoints[i].elements.size(),0);
 
-				const double d((timepoints[i].elements[j].e.center - estimators[k].earliest().estimate(timepoints[i].time)).squared());
-
-
-				if (d <= max_dist_sq){
-		//			if (ns_is_close4(ns_time_element_link(i,j)))
-		//				cerr << "Found it in stray\n";
-
-		//			for (unsigned int m = 0; m < estimators.size(); m++){
-		//				if (estimators[m].estimators.begin()->stray_point_id.index == j &&
-		//					estimators[m].estimators.begin()->stray_point_id.t_id == i)
-		//					cerr << "WHA!";
-		//			}
-					estimators.push_back(ns_time_path_solution_stationary_drift_estimator_group(
-						ns_estimator_for_point(
-						timepoints[i].elements[j].e.center,timepoints[i].time,ns_time_element_link(i,j)
-						)
-						)
-						);
-					timepoints[i].elements[j].element_assigned = true; //prevent repeat additions
-					va++;
-					break;	//prevent repeat additions
-				}
+		for (unsigned int k = 0; k < number_of_path_estimators; k++){
+			if (estimators[k].within_time_span(timepoints[i].time))
+				continue;
+			const ns_vector_2d estimated_position(estimators[k].earliest().estimate(timepoints[i].time));
+			candidates.resize(0);
+			point_grid.find_candidates(estimated_position,candidates);
+			for (unsigned int c = 0; c < candidates.size(); c++){
+				const unsigned long j(candidates[c]);
+				const double d((timepoints[i].elements[j].e.center - estimated_position).squared());
+				if (d <= max_dist_sq)
+					point_is_near_a_path[j] = 1;
 			}
 		}
+		for (unsigned int j = 0; j < timepoints[i].elements.size(); j++){
+			if (!point_is_near_a_path[j])
+				continue;
+			estimators.push_back(ns_time_path_solution_stationary_drift_estimator_group(
+				ns_estimator_for_point(
+				timepoints[i].elements[j].e.center,timepoints[i].time,ns_time_element_link(i,j)
+				)
+				)
+				);
+			timepoints[i].elements[j].element_assigned = true; //prevent repeat additions
+			va++;
+		}
 	}
 	cout << "Considering " << va << " unassigned matching positions\n";
 	//add the low density paths as free points
@@ -1668,51 +1863,87 @@ void ns_time_path_solver::handle_low_density_stationary_paths_and_stray_points(c
 	//This is actually hard to deal with elsewhere correctly, so we do it after the fact here.
 	cerr << "Identifying any remaining unassigned positions.\n";
 
+	//Only paths that span a time can absorb points observed at it.  Paths are sorted by their earliest point,
+	//so that the list of paths spanning each time can be updated as time advances.
+	//At each time, the position of each spanning path is calculated once, and these positions are bucketed into a grid
+	//so that each unassigned point is compared only to the paths near it.
+	std::vector<std::pair<unsigned long,unsigned long> > paths_by_earliest_point(paths.size());
+	for (unsigned int i = 0; i < paths.size(); i++)
+		paths_by_earliest_point[i] = std::pair<unsigned long,unsigned long>(paths[i].elements.rbegin()->t_id,i);
+	std::sort(paths_by_earliest_point.begin(),paths_by_earliest_point.end());
+	unsigned long next_path_to_span(0);
+	std::vector<unsigned long> spanning_paths,
+							   paths_able_to_absorb,
+							   insertion_locations;
+	std::vector<ns_vector_2d> path_positions;
+
 	for (unsigned int t = 0; t < timepoints.size(); t++){
+		//add paths that start before t, and drop those that end at or before it.
+		for (; next_path_to_span < paths_by_earliest_point.size() && paths_by_earliest_point[next_path_to_span].first < t; next_path_to_span++)
+			spanning_paths.push_back(paths_by_earliest_point[next_path_to_span].second);
+		unsigned long number_still_spanning(0);
+		for (unsigned int i = 0; i < spanning_paths.size(); i++){
+			if (paths[spanning_paths[i]].elements[0].t_id > t)
+				spanning_paths[number_still_spanning++] = spanning_paths[i];
+		}
+		spanning_paths.resize(number_still_spanning);
+		if (spanning_paths.empty())
+			continue;
+
+		bool unassigned_points_exist(false);
+		for (unsigned int e = 0; e < timepoints[t].elements.size() && !unassigned_points_exist; e++)
+			unassigned_points_exist = !timepoints[t].elements[e].element_assigned;
+		if (!unassigned_points_exist)
+			continue;
+
+		paths_able_to_absorb.resize(0);
+		insertion_locations.resize(0);
+		path_positions.resize(0);
+		point_grid.clear(sqrt((double)max_dist_sq+1)+1);
+		for (unsigned int i = 0; i < spanning_paths.size(); i++){
+			const ns_time_path_solver_path & p(paths[spanning_paths[i]]);
+			//path elements are sorted in reverse temporal order, so this finds the first element at or before t
+			const unsigned long location_to_insert(std::lower_bound(p.elements.begin(),p.elements.end(),t,ns_time_element_link_is_later_than())-p.elements.begin());
+			//skip if path already has a point at the specified time.
+			if (p.elements[location_to_insert].t_id == t)
+				continue;
+			ns_vector_2d path_pos = element(p.elements[location_to_insert-1]).e.center + element(p.elements[location_to_insert]).e.center;
+			path_pos/=2.0;
+			point_grid.add(paths_able_to_absorb.size(),path_pos);
+			paths_able_to_absorb.push_back(spanning_paths[i]);
+			insertion_locations.push_back(location_to_insert);
+			path_positions.push_back(path_pos);
+		}
+		if (point_grid.empty())
+			continue;
+		point_grid.build();
+
 		for (unsigned int e = 0; e < timepoints[t].elements.size(); e++){
 			if (timepoints[t].elements[e].element_assigned)
 				continue;
 
-			vector<ns_time_path_solver_path>::iterator closest_path(paths.end());
+			long closest_path(-1);
 			double closest_distance(DBL_MAX);
 			unsigned long location_to_insert_in_closest(0);
 
-
-			for (vector<ns_time_path_solver_path>::iterator p = paths.begin(); p != paths.end();p++){
-				const long stop_i(p->elements[p->elements.size()-1].t_id),
-							  start_i(p->elements[0].t_id);
-				if (t <= stop_i || t >= start_i)	//point does not fall within the current path
-					continue;
-				bool path_already_has_point_at_curent_time(false);
-				unsigned long location_to_insert(0);
-				for (unsigned int i = 0; i < p->elements.size(); i++){
-					//skip if path already has a point at the specified time.
-					if (p->elements[i].t_id == t){
-						path_already_has_point_at_curent_time = true;
-						break;
-					}
-					if (p->elements[i].t_id <= t){	// path elements are sorted in reverse temporal order so we don't need to search further.
-						location_to_insert = i;
-						break;
-					}
-				}
-				if (path_already_has_point_at_curent_time)
-					continue;
-				ns_vector_2d path_pos = element(p->elements[location_to_insert-1]).e.center + element(p->elements[location_to_insert]).e.center;
-				path_pos/=2.0;
-				const double d((path_pos-timepoints[t].elements[e].e.center).squared());
-				if  (d <= max_dist_sq && d < closest_distance){
-						closest_path = p;
-						location_to_insert_in_closest = location_to_insert;
+			candidates.resize(0);
+			point_grid.find_candidates(timepoints[t].elements[e].e.center,candidates);
+			for (unsigned int c = 0; c < candidates.size(); c++){
+				const unsigned long k(candidates[c]);
+				const double d((path_positions[k]-timepoints[t].elements[e].e.center).squared());
+				//where paths are equally close, choose the first.
+				if  (d <= max_dist_sq && (d < closest_distance || (d == closest_distance && (long)paths_able_to_absorb[k] < closest_path))){
+						closest_path = paths_able_to_absorb[k];
+						location_to_insert_in_closest = insertion_locations[k];
 						closest_distance = d;
 				}
 			}
-			if (closest_path != paths.end()){
+			if (closest_path != -1){
 				timepoints[t].elements[e].e.low_temporal_resolution = true;
 				//insert immediately before the next path_element_id;
 	//			if (ns_is_close4(ns_time_element_link(t,e)))
 	//				cerr << "ADDING IT!\n";
-				closest_path->elements.insert(closest_path->elements.begin()+location_to_insert_in_closest,ns_time_element_link(t,e));
+				paths[closest_path].elements.insert(paths[closest_path].elements.begin()+location_to_insert_in_closest,ns_time_element_link(t,e));
 				break;
 			}
 		}
@@ -1720,7 +1951,7 @@ void ns_time_path_solver::handle_low_density_stationary_paths_and_stray_points(c
 }
 
 
-void ns_time_path_solver::find_stationary_path_fragments(const double fraction_of_points_required_to_be_detected, const unsigned long min_path_duration_in_seconds, const unsigned long time_window_length_in_seconds,const unsigned long max_movement_distance){
+void ns_time_path_solver::find_stationary_path_fragments(const double fraction_of_points_required_to_be_detected, const unsigned long min_path_duration_in_seconds, const unsigned long time_window_length_in_seconds,const unsigned long max_movement_distance, const unsigned long first_timepoint){
 	const unsigned long mdsq(max_movement_distance*max_movement_distance);
 
 	std::vector<ns_time_path_solver_path_builder> open_paths;
@@ -1730,7 +1961,7 @@ void ns_time_path_solver::find_stationary_path_fragments(const double fraction_o
 	unsigned long max_discarded_path_length(0), min_discarded_path_length(INT_MAX);
 	unsigned long debug_paths_discarded_for_being_short_at_end(0);
 	unsigned long longest_path_length(0);
-	for (long i = (long)timepoints.size()-1; i >= 0; i--){
+	for (long i = (long)timepoints.size()-1; i >= (long)first_timepoint; i--){
 		//attempt to assign an element to an existing path
 
 		//xxx
@@ -2030,16 +2261,19 @@ void ns_time_path_solver::load_detection_results(unsigned long region_id,ns_sql
 void ns_time_path_solver::load(unsigned long region_id, ns_sql & sql){
 
 	load_detection_results(region_id,sql);
+	load_timepoint_elements(0,sql);
+}
 
+void ns_time_path_solver::load_timepoint_elements(const unsigned long first_timepoint, ns_sql & sql){
 	long last_c(-2);
 	cerr << "Compiling Detection Point Cloud...";
 	unsigned long debug_max_points_per_timepoint(0);
 	bool problem = false;
-	for (unsigned int i = 0; i < timepoints.size(); i++){
+	for (unsigned int i = first_timepoint; i < timepoints.size(); i++){
 
-		if ((long)((i*100)/timepoints.size()) >= last_c+5){
-			cerr << (i*100)/timepoints.size() << "%...";
-			last_c = i;
+		if ((long)(((i-first_timepoint)*100)/(timepoints.size()-first_timepoint)) >= last_c+5){
+			cerr << ((i-first_timepoint)*100)/(timepoints.size()-first_timepoint) << "%...";
+			last_c = i-first_timepoint;
 		}
 	//	if (timepoints[i].time == 1321821542)
 	//		cerr << "WHA";
@@ -2065,7 +2299,7 @@ void ns_time_path_solver::load(unsigned long region_id, ns_sql & sql){
 	ns_global_debug(ns_text_stream_t("ns_time_path_solver::load()::Max number of elements per timepoint:") << debug_max_points_per_timepoint);
 
 	unsigned long debug_combined_elements(0);
-	for (unsigned int i = 0; i < timepoints.size(); i++){
+	for (unsigned int i = first_timepoint; i < timepoints.size(); i++){
 		if (timepoints[i].combine_very_close_elements(i))
 			debug_combined_elements++;
 	}
@@ -2107,6 +2341,281 @@ bool ns_time_path_solver_timepoint::combine_very_close_elements(const unsigned l
 //	for (unsigned int i = 0; i < timepoints.size(); i++)
 //		timepoints[i].combine_very_close_elements(4);
 //}
+//the parameters that affect the solver state.  They are all stored as doubles, which represent the integer parameters exactly.
+void ns_solver_state_parameters(const ns_time_path_solver_parameters & p, std::vector<std::pair<std::string,double> > & v){
+	v.resize(0);
+	v.push_back(std::pair<std::string,double>("min_stationary_object_path_fragment_duration_in_seconds",p.min_stationary_object_path_fragment_duration_in_seconds));
+	v.push_back(std::pair<std::string,double>("stationary_object_path_fragment_window_length_in_seconds",p.stationary_object_path_fragment_window_length_in_seconds));
+	v.push_back(std::pair<std::string,double>("stationary_object_path_fragment_max_movement_distance",p.stationary_object_path_fragment_max_movement_distance));
+	v.push_back(std::pair<std::string,double>("maximum_time_gap_between_joined_path_fragments",p.maximum_time_gap_between_joined_path_fragments));
+	v.push_back(std::pair<std::string,double>("maximum_time_overlap_between_joined_path_fragments",p.maximum_time_overlap_between_joined_path_fragments));
+	v.push_back(std::pair<std::string,double>("maximum_distance_betweeen_joined_path_fragments",p.maximum_distance_betweeen_joined_path_fragments));
+	v.push_back(std::pair<std::string,double>("maximum_fraction_duplicated_points_between_joined_path_fragments",p.maximum_fraction_duplicated_points_between_joined_path_fragments));
+	v.push_back(std::pair<std::string,double>("maximum_path_fragment_displacement_per_hour",p.maximum_path_fragment_displacement_per_hour));
+	v.push_back(std::pair<std::string,double>("maximum_fraction_of_points_allowed_to_be_missing_in_path_fragment",p.maximum_fraction_of_points_allowed_to_be_missing_in_path_fragment));
+}
+
+void ns_time_path_solver::save_state(const ns_time_path_solver_parameters & param, std::ostream & o) const{
+	ns_columnar_file_writer file(o,true);
+
+	std::vector<std::pair<std::string,double> > parameter_values;
+	ns_solver_state_parameters(param,parameter_values);
+	ns_columnar_table p("parameters");
+	for (unsigned int i = 0; i < parameter_values.size(); i++)
+		p.add_column(parameter_values[i].first,ns_columnar_double);
+	p.begin_segment(0);
+	for (unsigned int i = 0; i < parameter_values.size(); i++)
+		p.push(i,parameter_values[i].second);
+	file.write(p);
+
+	ns_columnar_table t("timepoints");
+	const unsigned long timepoint_time(t.add_column("time",ns_columnar_int64)),
+						sample_region_image_id(t.add_column("sample_region_image_id",ns_columnar_int64)),
+						worm_results_id(t.add_column("worm_results_id",ns_columnar_int64));
+	t.begin_segment(0);
+	for (unsigned int i = 0; i < timepoints.size(); i++){
+		t.push(timepoint_time,timepoints[i].time);
+		t.push(sample_region_image_id,timepoints[i].sample_region_image_id);
+		t.push(worm_results_id,timepoints[i].worm_results_id);
+	}
+	file.write(t);
+
+	ns_columnar_table e("elements");
+	const unsigned long region_position_x(e.add_column("region_position_x",ns_columnar_int32)),
+						region_position_y(e.add_column("region_position_y",ns_columnar_int32)),
+						region_size_x(e.add_column("region_size_x",ns_columnar_int32)),
+						region_size_y(e.add_column("region_size_y",ns_columnar_int32)),
+						context_image_position_x(e.add_column("context_image_position_x",ns_columnar_int32)),
+						context_image_position_y(e.add_column("context_image_position_y",ns_columnar_int32)),
+						context_image_size_x(e.add_column("context_image_size_x",ns_columnar_int32)),
+						context_image_size_y(e.add_column("context_image_size_y",ns_columnar_int32)),
+						context_image_position_in_region_vis_image_x(e.add_column("context_image_position_in_region_vis_image_x",ns_columnar_int32)),
+						context_image_position_in_region_vis_image_y(e.add_column("context_image_position_in_region_vis_image_y",ns_columnar_int32)),
+						part_of_a_multiple_worm_disambiguation_cluster(e.add_column("part_of_a_multiple_worm_disambiguation_cluster",ns_columnar_int8)),
+						number_of_extra_elements(e.add_column("number_of_extra_elements",ns_columnar_int32));
+	for (unsigned int i = 0; i < timepoints.size(); i++){
+		e.begin_segment(i);
+		for (unsigned int j = 0; j < timepoints[i].elements.size(); j++){
+			const ns_time_path_element & el(timepoints[i].elements[j].e);
+			e.push(region_position_x,el.region_position.x);
+			e.push(region_position_y,el.region_position.y);
+			e.push(region_size_x,el.region_size.x);
+			e.push(region_size_y,el.region_size.y);
+			e.push(context_image_position_x,el.context_image_position.x);
+			e.push(context_image_position_y,el.context_image_position.y);
+			e.push(context_image_size_x,el.context_image_size.x);
+			e.push(context_image_size_y,el.context_image_size.y);
+			e.push(context_image_position_in_region_vis_image_x,el.context_image_position_in_region_vis_image.x);
+			e.push(context_image_position_in_region_vis_image_y,el.context_image_position_in_region_vis_image.y);
+			e.push(part_of_a_multiple_worm_disambiguation_cluster,el.part_of_a_multiple_worm_disambiguation_cluster);
+			e.push(number_of_extra_elements,timepoints[i].elements[j].extra_elements_at_current_position.size());
+		}
+	}
+	file.write(e);
+
+	ns_columnar_table a("paths");
+	const unsigned long max_time_position_x(a.add_column("max_time_position_x",ns_columnar_int32)),
+						max_time_position_y(a.add_column("max_time_position_y",ns_columnar_int32)),
+						min_time_position_x(a.add_column("min_time_position_x",ns_columnar_int32)),
+						min_time_position_y(a.add_column("min_time_position_y",ns_columnar_int32));
+	a.begin_segment(0);
+	for (unsigned int i = 0; i < paths.size(); i++){
+		a.push(max_time_position_x,paths[i].max_time_position.x);
+		a.push(max_time_position_y,paths[i].max_time_position.y);
+		a.push(min_time_position_x,paths[i].min_time_position.x);
+		a.push(min_time_position_y,paths[i].min_time_position.y);
+	}
+	file.write(a);
+
+	ns_columnar_table l("path_elements");
+	const unsigned long t_id(l.add_column("t_id",ns_columnar_int64)),
+						index(l.add_column("index",ns_columnar_int64));
+	for (unsigned int i = 0; i < paths.size(); i++){
+		l.begin_segment(i);
+		for (unsigned int j = 0; j < paths[i].elements.size(); j++){
+			l.push(t_id,paths[i].elements[j].t_id);
+			l.push(index,paths[i].elements[j].index);
+		}
+	}
+	file.write(l);
+	file.close();
+}
+
+bool ns_time_path_solver::load_state(const ns_time_path_solver_parameters & param, const ns_columnar_file_reader & f, std::vector<ns_time_path_solver_timepoint> & saved_timepoints){
+	std::vector<double> d;
+	std::vector<std::pair<std::string,double> > parameter_values;
+	ns_solver_state_parameters(param,parameter_values);
+	const ns_columnar_file_reader::ns_table & p(f.table("parameters"));
+	if (p.segments.size() != 1)
+		throw ns_ex("ns_time_path_solver::load_state()::Invalid parameter table");
+	for (unsigned int i = 0; i < parameter_values.size(); i++){
+		if (p.find_column(parameter_values[i].first) == -1)
+			return false;
+		f.read(p,0,parameter_values[i].first,d);
+		if (d.size() != 1 || d[0] != parameter_values[i].second)
+			return false;
+	}
+
+	std::vector<ns_64_bit> a,b,c;
+	std::vector<long> x[10];
+	std::vector<char> flags;
+	const ns_columnar_file_reader::ns_table & t(f.table("timepoints"));
+	if (t.segments.size() != 1)
+		throw ns_ex("ns_time_path_solver::load_state()::Invalid timepoint table");
+	f.read(t,0,"time",a);
+	f.read(t,0,"sample_region_image_id",b);
+	f.read(t,0,"worm_results_id",c);
+	saved_timepoints.resize(0);
+	saved_timepoints.resize(a.size());
+	for (unsigned int i = 0; i < saved_timepoints.size(); i++){
+		saved_timepoints[i].time = a[i];
+		saved_timepoints[i].sample_region_image_id = b[i];
+		saved_timepoints[i].worm_results_id = c[i];
+	}
+
+	const ns_columnar_file_reader::ns_table & e(f.table("elements"));
+	const char * position_columns[10] = {"region_position_x","region_position_y",
+										"region_size_x","region_size_y",
+										"context_image_position_x","context_image_position_y",
+										"context_image_size_x","context_image_size_y",
+										"context_image_position_in_region_vis_image_x","context_image_position_in_region_vis_image_y"};
+	for (unsigned int i = 0; i < saved_timepoints.size(); i++){
+		const long s(e.find_segment(i));
+		if (s == -1)
+			throw ns_ex("ns_time_path_solver::load_state()::No elements were stored for timepoint ") << i;
+		for (unsigned int k = 0; k < 10; k++)
+			f.read(e,s,position_columns[k],x[k]);
+		f.read(e,s,"part_of_a_multiple_worm_disambiguation_cluster",flags);
+		f.read(e,s,"number_of_extra_elements",a);
+		saved_timepoints[i].elements.resize(x[0].size());
+		for (unsigned int j = 0; j < saved_timepoints[i].elements.size(); j++){
+			ns_time_path_solver_element & el(saved_timepoints[i].elements[j]);
+			el.e.region_position = ns_vector_2i(x[0][j],x[1][j]);
+			el.e.region_size = ns_vector_2i(x[2][j],x[3][j]);
+			el.e.context_image_position = ns_vector_2i(x[4][j],x[5][j]);
+			el.e.context_image_size = ns_vector_2i(x[6][j],x[7][j]);
+			el.e.context_image_position_in_region_vis_image = ns_vector_2i(x[8][j],x[9][j]);
+			el.e.center = el.e.region_position + el.e.region_size/2;
+			el.e.part_of_a_multiple_worm_disambiguation_cluster = flags[j] != 0;
+			//only the number of objects combined into each element is used
+			el.extra_elements_at_current_position.resize(a[j]);
+		}
+	}
+
+	const ns_columnar_file_reader::ns_table & r(f.table("paths"));
+	if (r.segments.size() != 1)
+		throw ns_ex("ns_time_path_solver::load_state()::Invalid path table");
+	f.read(r,0,"max_time_position_x",x[0]);
+	f.read(r,0,"max_time_position_y",x[1]);
+	f.read(r,0,"min_time_position_x",x[2]);
+	f.read(r,0,"min_time_position_y",x[3]);
+	paths.resize(0);
+	paths.resize(x[0].size());
+	const ns_columnar_file_reader::ns_table & l(f.table("path_elements"));
+	for (unsigned int i = 0; i < paths.size(); i++){
+		const long s(l.find_segment(i));
+		if (s == -1)
+			throw ns_ex("ns_time_path_solver::load_state()::No elements were stored for path ") << i;
+		f.read(l,s,"t_id",a);
+		f.read(l,s,"index",b);
+		if (a.empty())
+			throw ns_ex("ns_time_path_solver::load_state()::Empty path ") << i;
+		paths[i].elements.resize(a.size());
+		for (unsigned int j = 0; j < a.size(); j++){
+			if (a[j] >= saved_timepoints.size() || b[j] >= saved_timepoints[a[j]].elements.size())
+				throw ns_ex("ns_time_path_solver::load_state()::Invalid path element: ") << a[j] << "," << b[j];
+			if (j > 0 && a[j] > a[j-1])
+				throw ns_ex("ns_time_path_solver::load_state()::Out of order path element in path ") << i;
+			paths[i].elements[j] = ns_time_element_link(a[j],b[j]);
+		}
+		paths[i].path_id = i+1;
+		paths[i].group_id = 0;
+		paths[i].max_time = saved_timepoints[paths[i].elements.begin()->t_id].time;
+		paths[i].min_time = saved_timepoints[paths[i].elements.rbegin()->t_id].time;
+		paths[i].max_time_position = ns_vector_2i(x[0][i],x[1][i]);
+		paths[i].min_time_position = ns_vector_2i(x[2][i],x[3][i]);
+		paths[i].unchanged_since_last_merge = true;
+	}
+	return true;
+}
+
+bool ns_time_path_solver::solve_incrementally(const ns_64_bit region_id, const ns_time_path_solver_parameters & param, ns_time_path_solution & solution, ns_sql & sql){
+	ns_image_server_image state_image(image_server.image_storage.get_region_movement_metadata_info(region_id,"time_path_solver_state",sql));
+	state_image.filename += "." + ns_columnar_file_extension();
+
+	std::vector<ns_time_path_solver_timepoint> saved_timepoints;
+	bool state_loaded(false);
+	try{
+		const std::string filename(image_server.image_storage.request_metadata_filename(state_image,&sql));
+		if (ns_dir::file_exists(filename) && ns_columnar_file_reader::is_columnar_file(filename)){
+			ns_columnar_file_reader f;
+			f.open(filename);
+			state_loaded = load_state(param,f,saved_timepoints);
+		}
+	}
+	catch(ns_ex & ex){
+		image_server.register_server_event(ns_image_server::ns_register_in_central_db,ex);
+		state_loaded = false;
+	}
+
+	load_detection_results(region_id,sql);
+
+	//the saved timepoints can be used only if every one of them is still present, unchanged,
+	//so that the element links stored in the saved paths remain valid.
+	unsigned long first_new_timepoint(0);
+	if (state_loaded && saved_timepoints.size() <= timepoints.size()){
+		first_new_timepoint = saved_timepoints.size();
+		for (unsigned long i = 0; i < saved_timepoints.size(); i++){
+			if (saved_timepoints[i].time != timepoints[i].time ||
+				saved_timepoints[i].sample_region_image_id != timepoints[i].sample_region_image_id ||
+				saved_timepoints[i].worm_results_id != timepoints[i].worm_results_id){
+				first_new_timepoint = 0;
+				break;
+			}
+		}
+	}
+	if (first_new_timepoint == 0)
+		paths.resize(0);
+	for (unsigned long i = 0; i < first_new_timepoint; i++)
+		timepoints[i].elements.swap(saved_timepoints[i].elements);
+	saved_timepoints.resize(0);
+
+	load_timepoint_elements(first_new_timepoint,sql);
+
+	//Fragments are found again over an interval before the new timepoints that is long enough for any fragment
+	//crossing into the new timepoints to be detected on its own, so that it can be merged with the part kept from before.
+	unsigned long first_timepoint_to_solve(first_new_timepoint);
+	if (first_new_timepoint > 0){
+		const unsigned long last_saved_time(timepoints[first_new_timepoint-1].time),
+							interval_to_solve_again(param.min_stationary_object_path_fragment_duration_in_seconds + param.stationary_object_path_fragment_window_length_in_seconds);
+		while (first_timepoint_to_solve > 0 && timepoints[first_timepoint_to_solve-1].time + interval_to_solve_again >= last_saved_time)
+			first_timepoint_to_solve--;
+	}
+	ns_global_debug(ns_text_stream_t("ns_time_path_solver::solve_incrementally()::Reusing ") << first_new_timepoint << " of " << timepoints.size()
+		<< " timepoints and " << paths.size() << " paths; solving from timepoint " << first_timepoint_to_solve);
+
+	find_and_merge_path_fragments(param,first_timepoint_to_solve);
+
+	//the state is only an optimization, so a failure to save it does not prevent the solution from being produced
+	try{
+		ofstream * o(image_server.image_storage.request_metadata_output(state_image,ns_columnar_file_extension(),true,&sql));
+		try{
+			save_state(param,*o);
+			delete o;
+		}
+		catch(...){
+			delete o;
+			throw;
+		}
+	}
+	catch(ns_ex & ex){
+		image_server.register_server_event(ns_image_server::ns_register_in_central_db,ex);
+	}
+
+	finish_solution(param,solution);
+	return first_new_timepoint > 0;
+}
+
 void ns_time_path_solver::generate_raw_solution(ns_time_path_solution & solution){
 	this->paths.resize(0);
 	this->path_groups.resize(0);
@@ -2355,10 +2864,6 @@ void ns_time_path_solver::assign_path_ids_to_elements(){
 	}
 }
 
-typedef std::vector<ns_time_path_solver_path> ns_time_path_solver_path_list;
-typedef std::vector<ns_time_path_solver_path_list::iterator> ns_time_path_solver_path_orderer_list;
-typedef std::map<unsigned long,ns_time_path_solver_path_orderer_list > ns_time_path_solver_path_orderer;
-
 bool ns_is_close(ns_vector_2i & p){
 
 	return (abs(p.x - 4580)<50 && abs(p.y-3500) < 50);
@@ -2440,87 +2945,76 @@ void ns_time_path_solver::merge_overlapping_path_fragments(const unsigned long m
 	//1) All their elements sorted in order of decreasing time
 	//2) Their center matched as the center of their earliest fragment
 	const long max_dist_sq(max_center_distance*max_center_distance);
-	ns_time_path_solver_path_orderer paths_ordered_by_max_time;
-	ns_time_path_solver_path_orderer paths_ordered_by_min_time;
 
 
 	const unsigned long erase_constant(6666666666666);
 	for (std::vector<ns_time_path_solver_path>::iterator p = paths.begin(); p != paths.end();p++){
 		p->group_id = 0;
 	}
-	bool merge_performed = false;
+
+	//A path can only absorb paths whose earliest position lies near its latest position,
+	//so the earliest positions of all paths are bucketed into a grid.
+	//When a path absorbs another, its earliest position changes and it is inserted into the grid again.
+	path_grid.clear(sqrt((double)max_dist_sq+1)+1);
+	for (unsigned long i = 0; i < paths.size(); i++)
+		path_grid.add(i,paths[i].min_time_position);
+	path_grid.build();
+	//<max_time,path id>
+	std::vector<std::pair<unsigned long,unsigned long> > paths_ordered_by_max_time;
+
 	//merge paths forward in time
-	for (std::vector<ns_time_path_solver_path>::iterator later = paths.begin(); later != paths.end();){
-		if (later->path_id == erase_constant){
-			later++;
+	for (unsigned long l = 0; l < paths.size();){
+		ns_time_path_solver_path & later(paths[l]);
+		if (later.path_id == erase_constant){
+			l++;
 			continue;
 		}
-		if (!merge_performed){
-			//paths_ordered_by_max_time.clear();
-			paths_ordered_by_min_time.clear();
-			for (std::vector<ns_time_path_solver_path>::iterator q = paths.begin(); q != paths.end();q++){
-				if (q->group_id == erase_constant)  //ignore paths marked for deletion
-					continue;
-				//if (p == q)	//don't merge with self
-				//	continue;
-				//if (q->max_time > p->max_time)
-				//	continue;
-				//paths_ordered_by_max_time[p->max_time].push_back(q);
-				paths_ordered_by_min_time[q->max_time].push_back(q);
-
-			}
-		}
-		merge_performed = false;
-		for (ns_time_path_solver_path_orderer::iterator q =paths_ordered_by_min_time.begin();
-				q != paths_ordered_by_min_time.end() && !merge_performed; q++){
-			for (ns_time_path_solver_path_orderer_list::iterator earlier = q->second.begin(); earlier != q->second.end();earlier++){
-			//	if ((later->path_id == 24 || later->path_id == 2 ) &&
-				//	((*earlier)->path_id == 24 || (*earlier)->path_id == 2))
-					//cerr << "WHA";
-				if (later == *earlier)
-					continue;
-				if (later->max_time <= (*earlier)->max_time)
-					continue;
-				if ((*earlier)->group_id == erase_constant)
-					continue;
-	//ns_is_close((*r)->min_time_position);
-	//				ns_is_close(p->max_time_position);
-			//	if (ns_is_close(later->max_time_position) && ns_is_close((*earlier)->min_time_position))
-			//		cerr << "WHA";
-				if (is_ok_to_merge_overlap(*later,*(*earlier),max_time_gap,max_time_overlap, max_fraction_points_overlap)){
-				//if (p->max_time < (*r)->min_time &&
-				//	p->max_time + max_time_gap >= (*r)->min_time){
-					//the two paths overlap spacially
-					//if (element(p->elements[0]).x
-					if (((*earlier)->min_time_position - later->max_time_position).squared() > max_dist_sq){
-				//		if (ns_is_close(later->max_time_position) && ns_is_close((*earlier)->min_time_position))
-				//			cerr << "WHA";
-						//not close enough
-						continue;
-					}
-			//		if (((*earlier)->path_id == 24 || (*earlier)->path_id == 32 || (*earlier)->path_id ==  74) ||
-				//		(later->path_id == 24 || later->path_id == 32 || later->path_id ==  74))
-					//	cerr << "Merging " << (*earlier)->path_id << " with " << later->path_id << "\n";
-					bool overlap(false);
-					if (later->elements.rbegin()->t_id < (*earlier)->elements.begin()->t_id)
-						overlap = true;
-					later->elements.insert(later->elements.end(),(*earlier)->elements.begin(),(*earlier)->elements.end());
-					if (overlap){
-						std::sort(later->elements.rbegin(),later->elements.rend(),ns_time_element_link_orderer());
-
+		grid_candidates.resize(0);
+		path_grid.find_candidates(later.max_time_position,grid_candidates);
+		//consider the nearby paths from earliest to latest, and in the order they are stored where their latest points coincide
+		paths_ordered_by_max_time.resize(0);
+		for (unsigned int i = 0; i < grid_candidates.size(); i++)
+			paths_ordered_by_max_time.push_back(std::pair<unsigned long,unsigned long>(paths[grid_candidates[i]].max_time,grid_candidates[i]));
+		std::sort(paths_ordered_by_max_time.begin(),paths_ordered_by_max_time.end());
+		paths_ordered_by_max_time.erase(std::unique(paths_ordered_by_max_time.begin(),paths_ordered_by_max_time.end()),paths_ordered_by_max_time.end());
+
+		bool merge_performed = false;
+		for (unsigned int i = 0; i < paths_ordered_by_max_time.size(); i++){
+			const unsigned long e(paths_ordered_by_max_time[i].second);
+			ns_time_path_solver_path & earlier(paths[e]);
+			if (e == l)
+				continue;
+			if (later.max_time <= earlier.max_time)
+				continue;
+			if (earlier.group_id == erase_constant)
+				continue;
+			//paths kept from a previous solution have already been considered for merging with each other
+			if (later.unchanged_since_last_merge && earlier.unchanged_since_last_merge)
+				continue;
+			//the two paths must overlap spacially
+			if ((earlier.min_time_position - later.max_time_position).squared() > max_dist_sq)
+				continue;
+			if (!is_ok_to_merge_overlap(later,earlier,max_time_gap,max_time_overlap, max_fraction_points_overlap))
+				continue;
 
-					}
-					later->min_time = timepoints[later->elements.rbegin()->t_id].time;
-					later->min_time_position = find_min_time_position(*later);//element(*p->elements.begin()).e.center;
-					(*earlier)->group_id = erase_constant; //delete it
-					merge_performed = true;
-					break;
-				}
+			bool overlap(false);
+			if (later.elements.rbegin()->t_id < earlier.elements.begin()->t_id)
+				overlap = true;
+			later.elements.insert(later.elements.end(),earlier.elements.begin(),earlier.elements.end());
+			if (overlap){
+				std::sort(later.elements.rbegin(),later.elements.rend(),ns_time_element_link_orderer());
 			}
+			later.min_time = timepoints[later.elements.rbegin()->t_id].time;
+			later.min_time_position = find_min_time_position(later);//element(*p->elements.begin()).e.center;
+			path_grid.insert(l,later.min_time_position);
+			later.unchanged_since_last_merge = false;
+			earlier.group_id = erase_constant; //delete it
+			merge_performed = true;
+			break;
 		}
 		if (merge_performed) //if we've made a change to the current timepoint, do another search
 			continue;
-		else later++;
+		else l++;
 	}
 
 	for (std::vector<ns_time_path_solver_path>::iterator p = paths.begin(); p != paths.end();){
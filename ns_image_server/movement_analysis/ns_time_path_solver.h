@@ -4,6 +4,9 @@
 #include "ns_detected_worm_info.h"
 #include "ns_vector_bitmap_interface.h"
 #include "ns_time_path_solver_parameters.h"
+#include "ns_spatial_grid.h"
+#include "ns_sparse_assignment_solver.h"
+#include "ns_columnar_file.h"
 
 struct ns_time_path_limits{
 	ns_time_path_limits(){}
@@ -138,8 +141,14 @@ public:
 
 	void save_to_db(const unsigned long region_id, ns_sql & sql) const;
 	void load_from_db(const ns_64_bit region_id, ns_sql & sql, bool load_directly_from_disk_without_db);
+	//the older text format, which can still be read
 	void save_to_disk(std::ostream & o) const;
 	void load_from_disk(std::istream & o);
+	//see ns_columnar_file.h.  Elements are stored in one segment per timepoint, path memberships in one segment per path.
+	void save_to_columnar_file(std::ostream & o) const;
+	void load_from_columnar_file(const ns_columnar_file_reader & f);
+	//loads a solution stored in either format
+	void load_from_file(const std::string & filename);
 	void check_for_duplicate_events();
 private:
 	ns_worm_detection_results_set * detection_results;
@@ -200,7 +209,7 @@ struct ns_time_path_solver_path_builder{
 };
 
 struct ns_time_path_solver_path{
-	ns_time_path_solver_path():is_low_density_path(false),is_not_stationary(false){}
+	ns_time_path_solver_path():is_low_density_path(false),is_not_stationary(false),unchanged_since_last_merge(false){}
 	
 	unsigned long path_id,
 				  group_id;
@@ -211,6 +220,9 @@ struct ns_time_path_solver_path{
 	std::vector<ns_time_element_link> elements;
 	bool is_low_density_path;
 	bool is_not_stationary;
+	//set for paths loaded from a previous solver state that have not been modified since.
+	//Two such paths have already been considered for merging, so merge_overlapping_path_fragments() skips the pair.
+	bool unchanged_since_last_merge;
 
 	ns_time_element_link & end(){return elements[elements.size()-1];}
 
@@ -218,6 +230,7 @@ struct ns_time_path_solver_path{
 		elements.resize(b.elements.size());
 		is_low_density_path =false;
 		is_not_stationary =false;
+		unchanged_since_last_merge = false;
 		if (b.elements.empty()){
 			max_time_position = min_time_position = ns_vector_2i(0,0);
 			min_time = max_time = 0;
@@ -363,6 +376,18 @@ public:
 	void generate_raw_solution(ns_time_path_solution & solution);
 	void load_from_raw_solution(const unsigned long region_id,const ns_time_path_solution & solution,ns_sql & sql);
 
+	//During an experiment, the solution is recalculated each time new images are captured.
+	//To avoid redoing all the work each time, solve_incrementally() saves the point cloud and the merged path fragments
+	//as the region's solver state.  The next time it is called, it loads worm detection results only for the timepoints
+	//captured since then, and finds path fragments only near the end of the experiment.  The fragments found earlier
+	//in the experiment are kept, cut at the start of the re-solved interval, and merged with the new fragments.
+	//The later steps of solve() are then run on all paths, as they depend on the whole experiment.
+	//Paths are cut and re-joined at the boundary, so the solution can differ slightly from that found by load() and solve();
+	//a full solve should be used for final analyses.
+	//If the saved state is missing, was made with different parameters, or any previously loaded timepoint has since
+	//been removed or changed, a full solve is run and false is returned.
+	bool solve_incrementally(const ns_64_bit region_id, const ns_time_path_solver_parameters & parameters, ns_time_path_solution & solution, ns_sql & sql);
+
 	ns_time_path_solver():detection_results(new ns_worm_detection_results_set){}
 	~ns_time_path_solver(){if (detection_results != 0) delete detection_results; detection_results = 0;}
 private:
@@ -382,6 +407,10 @@ private:
 	ns_worm_detection_results_set * detection_results;
 	
 	std::vector<char> path_assign_temp;
+	//reused by assign_timepoint_elements_to_paths() at each timepoint, and by merge_overlapping_path_fragments()
+	ns_spatial_grid path_grid;
+	ns_sparse_assignment_solver assignment_solver;
+	std::vector<unsigned long> grid_candidates;
 	//mark all points as unassigned in the timepoints[] structure.
 	//this is important for finding stray points,
 	//preventing various algorithms for assigning single points to multiple 
@@ -392,8 +421,9 @@ private:
 	//the points in the timepoints[] structure
 	void assign_path_ids_to_elements();
 
-	//find high density paths and merge them together when appropriate
-	void find_stationary_path_fragments(const double min_path_density_in_points_per_hour, const unsigned long min_path_duration_in_seconds, const unsigned long time_window_length_in_seconds,const unsigned long max_movement_distance);
+	//find high density paths and merge them together when appropriate.
+	//Only timepoints from first_timepoint onwards are considered.
+	void find_stationary_path_fragments(const double min_path_density_in_points_per_hour, const unsigned long min_path_duration_in_seconds, const unsigned long time_window_length_in_seconds,const unsigned long max_movement_distance, const unsigned long first_timepoint);
 	void merge_overlapping_path_fragments(const unsigned long max_center_distance,const unsigned long max_time_gap, const unsigned long max_time_overlap, const double max_fraction_points_overlap);
 
 
@@ -448,6 +478,18 @@ private:
 
 	//load the detection results for aggregated point cloud from the database
 	void load_detection_results(unsigned long region_id,ns_sql & sql);
+	//load the objects detected at each timepoint, starting at first_timepoint
+	void load_timepoint_elements(const unsigned long first_timepoint, ns_sql & sql);
+
+	//The steps of solve().  find_and_merge_path_fragments() keeps the paths already found before first_timepoint_to_solve
+	//(cutting any that extend past it) and finds new fragments from that timepoint onwards.
+	//finish_solution() runs the rest of the solution steps on all paths.
+	void find_and_merge_path_fragments(const ns_time_path_solver_parameters & param, const unsigned long first_timepoint_to_solve);
+	void finish_solution(const ns_time_path_solver_parameters & param, ns_time_path_solution & solution);
+
+	//the solver state used by solve_incrementally().  load_state() returns false if the state was made with different parameters.
+	void save_state(const ns_time_path_solver_parameters & param, std::ostream & o) const;
+	bool load_state(const ns_time_path_solver_parameters & param, const ns_columnar_file_reader & f, std::vector<ns_time_path_solver_timepoint> & saved_timepoints);
 
 	void break_paths_at_large_gaps(double fraction_max_gap_factor);
 };
@@ -73,6 +73,26 @@ const bool ns_dir::file_exists(const string & f){
 	#endif
 }
 
+const bool ns_dir::get_file_size_and_modification_time(const string & f, ns_64_bit & size, ns_64_bit & modification_time){
+	#ifdef _WIN32 
+	WIN32_FILE_ATTRIBUTE_DATA info;
+	if (!GetFileAttributesEx(f.c_str(),GetFileExInfoStandard,&info))
+		return false;
+	size = (((ns_64_bit)info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+	//file times count 100ns intervals since 1601
+	const ns_64_bit t((((ns_64_bit)info.ftLastWriteTime.dwHighDateTime) << 32) | info.ftLastWriteTime.dwLowDateTime);
+	modification_time = (t < 116444736000000000ULL)?0:(t - 116444736000000000ULL)/10000000;
+	return true;
+	#else
+	struct stat s;
+	if (stat(f.c_str(),&s) != 0)
+		return false;
+	size = s.st_size;
+	modification_time = s.st_mtime;
+	return true;
+	#endif
+}
+
 const bool ns_dir::copy_file(const string & source, const string & destination){
 #ifdef _WIN32
 	ifstream in(source.c_str(), std::ios::binary);
@@ -70,6 +70,8 @@ class ns_dir{
 	static double get_directory_size(const std::string & path, const std::string & du_path="du", const bool recurse=true);
 
 	static const bool file_exists(const std::string & f);
+	///returns false if the file does not exist.  modification_time is in seconds since the epoch.
+	static const bool get_file_size_and_modification_time(const std::string & f, ns_64_bit & size, ns_64_bit & modification_time);
 	static const bool file_is_writeable(const std::string & f);
 	static const bool rename_to_unique_filename(std::string & f);
 
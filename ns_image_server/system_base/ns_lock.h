@@ -11,6 +11,7 @@
 	#include <windows.h>
 	typedef CRITICAL_SECTION ns_mutex_handle;
 #else
+	#include <pthread.h>
 	typedef pthread_mutex_t ns_mutex_handle;
 #endif
 
@@ -71,4 +72,25 @@ private:
 	bool  currently_held;
 
 };
+
+///A counting semaphore, used to hand work from one thread to another.
+///wait() blocks until the count is positive and then decrements it; signal() increments it.
+class ns_semaphore{
+public:
+	ns_semaphore(const unsigned long initial_count=0);
+	~ns_semaphore();
+	void wait();
+	void signal();
+private:
+	#ifdef _WIN32
+	HANDLE handle;
+	#else
+	pthread_mutex_t mutex;
+	pthread_cond_t condition;
+	unsigned long count;
+	#endif
+	//semaphores cannot be copied
+	ns_semaphore(const ns_semaphore &);
+	ns_semaphore & operator=(const ns_semaphore &);
+};
 #endif
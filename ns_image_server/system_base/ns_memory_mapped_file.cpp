@@ -0,0 +1,97 @@
+#include "ns_memory_mapped_file.h"
+#ifndef _WIN32
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <errno.h>
+	#include <string.h>
+#endif
+using namespace std;
+
+#ifdef _WIN32
+ns_memory_mapped_file::ns_memory_mapped_file():data_(0),size_(0),file_handle(INVALID_HANDLE_VALUE),mapping_handle(NULL){}
+#else
+ns_memory_mapped_file::ns_memory_mapped_file():data_(0),size_(0),file_descriptor(-1){}
+#endif
+
+void ns_memory_mapped_file::open(const std::string & filename){
+	close();
+	filename_ = filename;
+	#ifdef _WIN32
+	file_handle = CreateFile(filename.c_str(),GENERIC_READ,FILE_SHARE_READ|FILE_SHARE_DELETE,NULL,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,NULL);
+	if (file_handle == INVALID_HANDLE_VALUE)
+		throw ns_ex("ns_memory_mapped_file::Could not open ") << filename << ns_file_io;
+	LARGE_INTEGER s;
+	if (!GetFileSizeEx(file_handle,&s)){
+		close();
+		throw ns_ex("ns_memory_mapped_file::Could not determine the size of ") << filename << ns_file_io;
+	}
+	size_ = s.QuadPart;
+	if (size_ == 0){
+		close();
+		throw ns_ex("ns_memory_mapped_file::Cannot map empty file ") << filename << ns_file_io;
+	}
+	mapping_handle = CreateFileMapping(file_handle,NULL,PAGE_WRITECOPY,0,0,NULL);
+	if (mapping_handle == NULL){
+		close();
+		throw ns_ex("ns_memory_mapped_file::Could not create a mapping for ") << filename << ns_file_io;
+	}
+	data_ = (char *)MapViewOfFile(mapping_handle,FILE_MAP_COPY,0,0,0);
+	if (data_ == 0){
+		close();
+		throw ns_ex("ns_memory_mapped_file::Could not map ") << filename << ns_memory_allocation;
+	}
+	#else
+	file_descriptor = ::open(filename.c_str(),O_RDONLY);
+	if (file_descriptor == -1)
+		throw ns_ex("ns_memory_mapped_file::Could not open ") << filename << ": " << strerror(errno) << ns_file_io;
+	struct stat s;
+	if (fstat(file_descriptor,&s) != 0){
+		const int err(errno);
+		close();
+		throw ns_ex("ns_memory_mapped_file::Could not determine the size of ") << filename << ": " << strerror(err) << ns_file_io;
+	}
+	size_ = s.st_size;
+	if (size_ == 0){
+		close();
+		throw ns_ex("ns_memory_mapped_file::Cannot map empty file ") << filename << ns_file_io;
+	}
+	void * d(mmap(0,(size_t)size_,PROT_READ|PROT_WRITE,MAP_PRIVATE,file_descriptor,0));
+	if (d == MAP_FAILED){
+		const int err(errno);
+		close();
+		throw ns_ex("ns_memory_mapped_file::Could not map ") << filename << ": " << strerror(err) << ns_memory_allocation;
+	}
+	data_ = (char *)d;
+	#endif
+}
+
+void ns_memory_mapped_file::close(){
+	#ifdef _WIN32
+	if (data_ != 0)
+		UnmapViewOfFile(data_);
+	if (mapping_handle != NULL)
+		CloseHandle(mapping_handle);
+	if (file_handle != INVALID_HANDLE_VALUE)
+		CloseHandle(file_handle);
+	mapping_handle = NULL;
+	file_handle = INVALID_HANDLE_VALUE;
+	#else
+	if (data_ != 0)
+		munmap(data_,(size_t)size_);
+	if (file_descriptor != -1)
+		::close(file_descriptor);
+	file_descriptor = -1;
+	#endif
+	data_ = 0;
+	size_ = 0;
+}
+
+void ns_memory_mapped_file::advise_sequential_access(){
+	if (data_ == 0)
+		return;
+	#ifndef _WIN32
+	madvise(data_,(size_t)size_,MADV_SEQUENTIAL);
+	#endif
+}
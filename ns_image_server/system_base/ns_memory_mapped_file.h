@@ -0,0 +1,47 @@
+#ifndef NS_MEMORY_MAPPED_FILE
+#define NS_MEMORY_MAPPED_FILE
+#include "ns_ex.h"
+#include <string>
+#ifdef _WIN32
+	#include <winsock2.h>
+	#include <windows.h>
+#endif
+
+///ns_memory_mapped_file maps the entire contents of a file into the process's address space.
+///Pages are read from disk by the operating system only when they are first accessed,
+///and can be discarded by the operating system under memory pressure rather than written to swap.
+///
+///Files are mapped copy-on-write: the mapping may be modified, but changes are private
+///to the process and are never written back to the file.
+class ns_memory_mapped_file{
+public:
+	ns_memory_mapped_file();
+	~ns_memory_mapped_file(){close();}
+
+	void open(const std::string & filename);
+	void close();
+
+	bool is_open() const{return data_ != 0;}
+	const std::string & filename() const{return filename_;}
+	ns_64_bit size() const{return size_;}
+	char * data(){return data_;}
+	const char * data() const{return data_;}
+
+	///hints to the operating system that the mapping will be read from beginning to end
+	void advise_sequential_access();
+private:
+	std::string filename_;
+	char * data_;
+	ns_64_bit size_;
+	#ifdef _WIN32
+	HANDLE file_handle,
+		   mapping_handle;
+	#else
+	int file_descriptor;
+	#endif
+	//mappings cannot be copied
+	ns_memory_mapped_file(const ns_memory_mapped_file &);
+	ns_memory_mapped_file & operator=(const ns_memory_mapped_file &);
+};
+
+#endif
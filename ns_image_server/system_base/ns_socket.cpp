@@ -212,6 +212,8 @@ unsigned int ns_socket_connection::read(char * buf, const unsigned long size){
 	       
 		if (recieve_result == -1)
 			throw ns_ex("Error during send!");
+		if (recieve_result == 0)
+			throw ns_ex("Connection gracefully closed.");
 		//cerr << "received " << recieve_result << "\n";
 		bytes_read+=recieve_result;
 	}
@@ -234,9 +236,13 @@ void ns_socket_connection::write(const char * buf, const unsigned long size){
 		bytes_written+=send_result;
 	}
 	#else
-		bytes_written = ::write(handle, buf, size);
-		if (bytes_written == -1)
+	//large writes may be split by the kernel, so keep writing until everything has been sent
+	while((unsigned)bytes_written < size){
+		send_result = ::write(handle, &buf[bytes_written], size - bytes_written);
+		if (send_result == -1)
 			throw ns_ex("Error during send!");
+		bytes_written+=send_result;
+	}
 	#endif
 
 }
@@ -415,6 +415,19 @@ ns_64_bit ns_sql_connection::send_query_get_id(){
 		throw ns_ex("ns_sql_connection::Attempting to send an empty cached query.");
 	return this->send_query_get_id(current_query.to_str());
 }
+ns_64_bit ns_sql_connection::send_query_get_affected_rows(const std::string & query){
+	this->send_query(query);
+	const ns_64_bit rows(ns_mysql_header::mysql_affected_rows(&mysql));
+	//mysql reports errors as (my_ulonglong)-1
+	if (rows == (ns_64_bit)-1)
+		throw ns_ex("ns_sql_connection::send_query_get_affected_rows()::Could not determine the number of rows affected by the query");
+	return rows;
+}
+ns_64_bit ns_sql_connection::send_query_get_affected_rows(){
+	if (current_query.to_str().size() == 0)
+		throw ns_ex("ns_sql_connection::Attempting to send an empty cached query.");
+	return this->send_query_get_affected_rows(current_query.to_str());
+}
 void ns_sql_full_table_lock::lock(const ns_table_list & tables_to_lock){
 	if(sql->query().size())
 		throw ns_ex("ns_sql_full_table_lock::lock()::Query not cleared before attempting Lock");
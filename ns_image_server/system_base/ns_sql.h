@@ -117,6 +117,10 @@ class ns_sql_connection{
   ns_64_bit send_query_get_id(const std::string & query);
   ns_64_bit send_query_get_id();
 
+  //returns the number of rows changed by an UPDATE, INSERT, or DELETE
+  ns_64_bit send_query_get_affected_rows(const std::string & query);
+  ns_64_bit send_query_get_affected_rows();
+
   template<class T>
   ns_sql_connection & operator<<(const T & s){current_query << s;return *this;}
   ns_sql_connection & write_data(const char *, const unsigned long length);
@@ -8,6 +8,7 @@
 #include <sys/resource.h>
 #endif
 #include <cerrno>
+#include <climits>
 #include <string.h>
 #include <stdio.h>
 
@@ -975,6 +976,58 @@ ns_lock::~ns_lock(){
 	pthread_mutex_destroy(&mutex_handle);
 #endif
 }
+ns_semaphore::ns_semaphore(const unsigned long initial_count){
+#ifdef _WIN32
+	handle = CreateSemaphore(NULL,initial_count,LONG_MAX,NULL);
+	if (handle == NULL)
+		throw ns_ex("ns_semaphore::Could not create semaphore");
+#else
+	count = initial_count;
+	if (pthread_mutex_init(&mutex,0))
+		throw ns_ex("ns_semaphore::Could not initialize mutex");
+	if (pthread_cond_init(&condition,0)){
+		pthread_mutex_destroy(&mutex);
+		throw ns_ex("ns_semaphore::Could not initialize condition variable");
+	}
+#endif
+}
+
+ns_semaphore::~ns_semaphore(){
+#ifdef _WIN32
+	CloseHandle(handle);
+#else
+	pthread_cond_destroy(&condition);
+	pthread_mutex_destroy(&mutex);
+#endif
+}
+
+void ns_semaphore::wait(){
+#ifdef _WIN32
+	if (WaitForSingleObject(handle,INFINITE) != WAIT_OBJECT_0)
+		throw ns_ex("ns_semaphore::An error occured while waiting on a semaphore");
+#else
+	if (pthread_mutex_lock(&mutex))
+		throw ns_ex("ns_semaphore::An error occured while waiting on a semaphore");
+	while (count == 0)
+		pthread_cond_wait(&condition,&mutex);
+	count--;
+	pthread_mutex_unlock(&mutex);
+#endif
+}
+
+void ns_semaphore::signal(){
+#ifdef _WIN32
+	if (!ReleaseSemaphore(handle,1,NULL))
+		throw ns_ex("ns_semaphore::An error occured while signaling a semaphore");
+#else
+	if (pthread_mutex_lock(&mutex))
+		throw ns_ex("ns_semaphore::An error occured while signaling a semaphore");
+	count++;
+	pthread_cond_signal(&condition);
+	pthread_mutex_unlock(&mutex);
+#endif
+}
+
 ns_process_termination_manager::~ns_process_termination_manager(){}
 
 
@@ -0,0 +1,127 @@
+#include "ns_thread_pool.h"
+#include <iostream>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+using namespace std;
+
+struct ns_thread_pool_worker_spec{
+	ns_thread_pool * pool;
+	unsigned long thread_id;
+};
+
+ns_thread_pool::ns_thread_pool(const unsigned long number_of_threads):current_jobs(0),next_job(0),error_occurred(false),job_lock("ns_thread_pool::job_lock"){
+	set_number_of_threads(number_of_threads);
+}
+
+void ns_thread_pool::set_number_of_threads(const unsigned long number_of_threads){
+	thread_count = number_of_threads;
+	if (thread_count == 0)
+		thread_count = number_of_processors();
+}
+
+unsigned long ns_thread_pool_processes_per_machine(1);
+void ns_thread_pool::set_number_of_processes_per_machine(const unsigned long number_of_processes){
+	ns_thread_pool_processes_per_machine = (number_of_processes == 0)?1:number_of_processes;
+}
+unsigned long ns_thread_pool::number_of_processors_per_process(){
+	const unsigned long n(number_of_processors()/ns_thread_pool_processes_per_machine);
+	return (n == 0)?1:n;
+}
+
+unsigned long ns_thread_pool::number_of_processors(){
+	#ifdef _WIN32
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		if (info.dwNumberOfProcessors == 0)
+			return 1;
+		return info.dwNumberOfProcessors;
+	#else
+		long n(sysconf(_SC_NPROCESSORS_ONLN));
+		if (n <= 0)
+			return 1;
+		return (unsigned long)n;
+	#endif
+}
+
+ns_thread_return_type ns_thread_pool::run_worker(void * worker_spec){
+	ns_thread_pool_worker_spec * spec(static_cast<ns_thread_pool_worker_spec *>(worker_spec));
+	spec->pool->process_jobs(spec->thread_id);
+	return 0;
+}
+
+void ns_thread_pool::process_jobs(const unsigned long thread_id){
+	while(true){
+		ns_thread_pool_job * job(0);
+		job_lock.wait_to_acquire(__FILE__,__LINE__);
+		if (!error_occurred && next_job < current_jobs->size()){
+			job = (*current_jobs)[next_job];
+			next_job++;
+		}
+		job_lock.release();
+		if (job == 0)
+			return;
+		try{
+			job->run(thread_id);
+		}
+		catch(ns_ex & ex){
+			ns_acquire_lock_for_scope lock(job_lock,__FILE__,__LINE__);
+			if (!error_occurred){
+				error = ex;
+				error_occurred = true;
+			}
+			lock.release();
+		}
+		catch(std::exception & ex){
+			ns_acquire_lock_for_scope lock(job_lock,__FILE__,__LINE__);
+			if (!error_occurred){
+				error = ns_ex(ex);
+				error_occurred = true;
+			}
+			lock.release();
+		}
+		catch(...){
+			ns_acquire_lock_for_scope lock(job_lock,__FILE__,__LINE__);
+			if (!error_occurred){
+				error = ns_ex("ns_thread_pool::A job threw an unknown exception");
+				error_occurred = true;
+			}
+			lock.release();
+		}
+	}
+}
+
+void ns_thread_pool::run(std::vector<ns_thread_pool_job *> & jobs){
+	if (jobs.empty())
+		return;
+	current_jobs = &jobs;
+	next_job = 0;
+	error_occurred = false;
+
+	unsigned long number_of_workers(thread_count);
+	if (number_of_workers > jobs.size())
+		number_of_workers = (unsigned long)jobs.size();
+
+	std::vector<ns_thread_pool_worker_spec> specs(number_of_workers);
+	std::vector<ns_thread> threads(number_of_workers);
+	unsigned long threads_started(0);
+	try{
+		for (unsigned long i = 1; i < number_of_workers; i++){
+			specs[i].pool = this;
+			specs[i].thread_id = i;
+			threads[i].run(run_worker,&specs[i]);
+			threads_started = i;
+		}
+	}
+	catch(ns_ex & ex){
+		//if we can't start all the threads, the workers that did start
+		//(along with this one) will still finish the job list.
+		cerr << "ns_thread_pool::Could only start " << threads_started+1 << " of " << number_of_workers << " workers: " << ex.text() << "\n";
+	}
+	process_jobs(0);
+	for (unsigned long i = 1; i <= threads_started; i++)
+		threads[i].block_on_finish();
+	current_jobs = 0;
+	if (error_occurred)
+		throw error;
+}
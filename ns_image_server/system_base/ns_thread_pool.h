@@ -0,0 +1,54 @@
+#ifndef NS_THREAD_POOL
+#define NS_THREAD_POOL
+#include "ns_thread.h"
+#include <vector>
+
+///A unit of work that can be handed to ns_thread_pool::run().
+///thread_id identifies which worker is running the job (0 to number_of_threads()-1),
+///so that jobs can index per-thread scratch storage without locking.
+class ns_thread_pool_job{
+public:
+	virtual void run(const unsigned long thread_id)=0;
+	virtual ~ns_thread_pool_job(){}
+};
+
+///ns_thread_pool runs a batch of independent jobs on a fixed number of worker threads.
+///Jobs are claimed one at a time from a shared counter, so workers that finish early
+///pick up the remaining work and long jobs do not stall the rest of the batch.
+///The calling thread participates as worker 0, so a pool of size 1 runs everything serially
+///without creating any threads.
+///If any job throws, the remaining unclaimed jobs are abandoned and the first exception is
+///re-thrown from run() once all workers have stopped.
+class ns_thread_pool{
+public:
+	//if number_of_threads is zero, one thread is started for each processor on the machine.
+	ns_thread_pool(const unsigned long number_of_threads=0);
+
+	void set_number_of_threads(const unsigned long number_of_threads);
+	unsigned long number_of_threads() const{return thread_count;}
+
+	//runs every job in the list and blocks until all have finished
+	void run(std::vector<ns_thread_pool_job *> & jobs);
+
+	static unsigned long number_of_processors();
+
+	//When several node processes run on one machine, each should only use its share of the processors.
+	//number_of_processors_per_process() returns that share (at least one), which is the whole machine
+	//until set_number_of_processes_per_machine() is called.
+	static void set_number_of_processes_per_machine(const unsigned long number_of_processes);
+	static unsigned long number_of_processors_per_process();
+
+private:
+	static ns_thread_return_type run_worker(void * worker_spec);
+	void process_jobs(const unsigned long thread_id);
+
+	unsigned long thread_count;
+
+	std::vector<ns_thread_pool_job *> * current_jobs;
+	unsigned long next_job;
+	bool error_occurred;
+	ns_ex error;
+	ns_lock job_lock;
+};
+
+#endif
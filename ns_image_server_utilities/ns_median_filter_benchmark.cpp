@@ -0,0 +1,140 @@
+#include "ns_ex.h"
+#include "ns_image.h"
+#include "ns_spatial_avg.h"
+#include "ns_high_precision_timer.h"
+#include "ctmf.h"
+#include <iostream>
+#include <stdlib.h>
+using namespace std;
+
+//Times the spatial median filters on a synthetic plate-sized image.
+//Usage: ns_median_filter_benchmark [width] [height] [kernal width] [number of threads]
+
+//fills the image with a noisy background and a few hundred bright worm-sized blobs,
+//with a zero-valued border to exercise the mask handling.
+template<class ns_component>
+void ns_make_synthetic_plate(ns_image_whole<ns_component> & im, const unsigned long w, const unsigned long h){
+	im.init(ns_image_properties(h,w,1));
+	const unsigned long max_value((sizeof(ns_component)==1)?255:65535);
+	srand(0);
+	for (unsigned long y = 0; y < h; y++)
+		for (unsigned long x = 0; x < w; x++)
+			im[y][x] = (ns_component)((max_value/4) + rand()%(max_value/8));
+	for (unsigned int i = 0; i < 400; i++){
+		const long cx(rand()%w), cy(rand()%h);
+		for (long y = cy-6; y < cy+6; y++)
+			for (long x = cx-30; x < cx+30; x++)
+				if (y >= 0 && x >= 0 && y < (long)h && x < (long)w)
+					im[y][x] = (ns_component)(max_value - rand()%(max_value/8));
+	}
+	for (unsigned long y = 0; y < h; y++)
+		for (unsigned long x = 0; x < w; x++)
+			if (y < 16 || x < 16 || y+16 >= h || x+16 >= w)
+				im[y][x] = 0;
+}
+
+//the Huang sliding-window algorithm with a flat 256 bin histogram, which the hierarchical histograms replace.
+void ns_flat_histogram_median(const ns_8_bit * src, ns_8_bit * dst, const long w, const long h, const long r){
+	const unsigned long t(2*r*r+2*r);
+	for (long y = 0; y < h; y++){
+		unsigned long hist[256];
+		for (unsigned int i = 0; i < 256; i++)
+			hist[i] = 0;
+		for (long dy = -r; dy <= r; dy++){
+			const ns_8_bit * row(src + w*((y+dy<0)?0:((y+dy>=h)?h-1:y+dy)));
+			for (long dx = -r; dx <= r; dx++)
+				hist[row[(dx<0)?0:((dx>=w)?w-1:dx)]]++;
+		}
+		for (long x = 0; x < w; x++){
+			unsigned long sum(0);
+			unsigned int m(0);
+			for (; m < 255; m++){
+				sum+=hist[m];
+				if (sum > t)
+					break;
+			}
+			dst[w*y+x] = m;
+			const long x_out((x-r<0)?0:x-r),
+					   x_in((x+r+1>=w)?w-1:x+r+1);
+			for (long dy = -r; dy <= r; dy++){
+				const ns_8_bit * row(src + w*((y+dy<0)?0:((y+dy>=h)?h-1:y+dy)));
+				hist[row[x_out]]--;
+				hist[row[x_in]]++;
+			}
+		}
+	}
+}
+
+template<class ns_component>
+void ns_copy_to_array(const ns_image_whole<ns_component> & im, std::vector<ns_component> & a){
+	const unsigned long w(im.properties().width),
+						h(im.properties().height);
+	a.resize(w*h);
+	for (unsigned long y = 0; y < h; y++)
+		for (unsigned long x = 0; x < w; x++)
+			a[w*y+x] = im[y][x];
+}
+
+template<class ns_component>
+double ns_time_streaming_calculator(const ns_image_whole<ns_component> & im, const long kernal_width, const unsigned long number_of_threads){
+	const unsigned long block_height(1024);
+	ns_image_whole<ns_component> out;
+	ns_spatial_median_calculator<ns_component,true> calc(block_height,kernal_width,number_of_threads);
+	ns_image_stream_binding<ns_spatial_median_calculator<ns_component,true>,ns_image_whole<ns_component> > binding(calc,out,block_height);
+	ns_high_precision_timer t;
+	t.start();
+	im.pump(binding,block_height);
+	return t.stop()/1000000.0;
+}
+
+int main(int argc, char ** argv){
+	const unsigned long w((argc > 1)?atol(argv[1]):8192),
+						h((argc > 2)?atol(argv[2]):8192);
+	//the image processing pipeline runs the filter with the same radius convention
+	const long kernal_width((argc > 3)?atol(argv[3]):24),
+			   r(2*(kernal_width/2));
+	const unsigned long number_of_threads((argc > 4)?atol(argv[4]):0);
+	try{
+		cout << "Filtering a " << w << "x" << h << " image with radius " << r << "\n";
+
+		ns_image_whole<ns_8_bit> im8;
+		ns_make_synthetic_plate(im8,w,h);
+		std::vector<ns_8_bit> src8,dst8(w*h),ref8(w*h);
+		ns_copy_to_array(im8,src8);
+
+		ns_high_precision_timer t;
+		t.start();
+		ns_flat_histogram_median(&src8[0],&ref8[0],w,h,r);
+		cout << "Flat histogram (8 bit):\t\t" << t.stop()/1000000.0 << "s\n";
+
+		t.start();
+		ctmf(&src8[0],&dst8[0],w,h,w,w,r,1,512*1024);
+		cout << "ctmf (8 bit):\t\t\t" << t.stop()/1000000.0 << "s\n";
+
+		t.start();
+		ns_median_filter_kernel<ns_8_bit>::run(&src8[0],&dst8[0],w,h,w,w,r);
+		cout << "ns_median_filter_kernel (8 bit):\t" << t.stop()/1000000.0 << "s\n";
+		unsigned long mismatches(0);
+		for (unsigned long i = 0; i < w*h; i++)
+			mismatches+=(dst8[i]!=ref8[i]);
+		if (mismatches != 0)
+			throw ns_ex("ns_median_filter_kernel and flat histogram medians differ at ") << mismatches << " pixels";
+
+		ns_image_whole<ns_16_bit> im16;
+		ns_make_synthetic_plate(im16,w,h);
+		std::vector<ns_16_bit> src16,dst16(w*h);
+		ns_copy_to_array(im16,src16);
+		t.start();
+		ns_median_filter_kernel<ns_16_bit>::run(&src16[0],&dst16[0],w,h,w,w,r);
+		cout << "ns_median_filter_kernel (16 bit):\t" << t.stop()/1000000.0 << "s\n";
+
+		const unsigned long threads((number_of_threads==0)?ns_thread_pool::number_of_processors():number_of_threads);
+		cout << "Streaming calculator, " << threads << " thread(s) (8 bit):\t" << ns_time_streaming_calculator(im8,kernal_width,threads) << "s\n";
+		cout << "Streaming calculator, " << threads << " thread(s) (16 bit):\t" << ns_time_streaming_calculator(im16,kernal_width,threads) << "s\n";
+		return 0;
+	}
+	catch(ns_ex & ex){
+		cerr << ex.text() << "\n";
+		return 1;
+	}
+}
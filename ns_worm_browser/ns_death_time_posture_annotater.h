@@ -27,6 +27,11 @@ private:
 	 ns_image_storage_source_handle<ns_8_bit> get_image(ns_sql & sql){
 		return image_server.image_storage.request_from_storage(vis_image,&sql);
 	 }
+	 //Visualizations are large and only every resize_factor-th pixel is displayed, so they are
+	 //memory mapped rather than decoded, and only the lines that are shown are read from disk.
+	 void load_full_size_image(ns_sql & sql,ns_image_standard & temp_buffer){
+		 image_server.image_storage.request_mapped_image_from_storage(vis_image,temp_buffer,&sql);
+	 }
 
 public:
 	bool output_absolute_times;
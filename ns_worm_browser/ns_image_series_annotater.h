@@ -15,9 +15,13 @@ public:
 	
 	unsigned long resize_factor;
 	virtual ns_image_storage_source_handle<ns_8_bit> get_image(ns_sql & sql)=0;
+	//loads the full size image, which is then subsampled into the display buffer
+	virtual void load_full_size_image(ns_sql & sql,ns_image_standard & temp_buffer){
+		get_image(sql).input_stream().pump(temp_buffer,1024);
+	}
 	virtual void load_image(const unsigned long bottom_border,ns_annotater_image_buffer_entry & im,ns_sql & sql,ns_image_standard & temp_buffer,const unsigned long resize_factor_=1){
 		resize_factor = resize_factor_;
-		get_image(sql).input_stream().pump(temp_buffer,1024);
+		load_full_size_image(sql,temp_buffer);
 		ns_image_properties prop(temp_buffer.properties());
 		prop.width/=resize_factor;
 		prop.height/=resize_factor;
@@ -11,6 +11,7 @@
 #include "ns_movement_visualization_generator.h"
 #include "ns_time_path_image_analyzer.h"
 #include "ns_hidden_markov_model_posture_analyzer.h"
+#include "ns_death_time_parameter_sweep.h"
 #include "ns_fl_modal_dialogs.h"
 #include <set>
 #include "ns_processing_job_processor.h"
@@ -1660,8 +1661,9 @@ void ns_worm_learner::output_movement_analysis_optimization_data(const ns_parame
 	}
 	ns_image_server_results_subject sub;
 	sub.experiment_id = experiment_id;
-	ns_acquire_for_scope<ostream> o2(image_server.results_storage.time_path_image_analysis_quantification(sub,"optimization_stats",true,sql()).output());
-	ns_analyzed_image_time_path::write_analysis_optimization_data_header(o2());
+	//the paths of all regions are collected and then analyzed together
+	ns_death_time_parameter_sweep sweep;
+	sweep.set_parameters(thresholds,hold_times);
 	unsigned region_count(0);
 	for (unsigned int i = 0; i < data_selector.samples.size(); i++)
 		region_count+=data_selector.samples[i].regions.size();
@@ -1707,10 +1709,9 @@ void ns_worm_learner::output_movement_analysis_optimization_data(const ns_parame
 						metadata.load_from_db(region_id,"",sql());
 					}
 
-				
-					o2() << "\n";
+					metadata.region_id = region_id;
 					cerr << metadata.plate_name() << "\n";
-					time_path_image_analyzer.write_analysis_optimization_data(thresholds,hold_times,metadata,o2());
+					time_path_image_analyzer.add_to_parameter_sweep(metadata,sweep);
 				}
 			}
 			catch(ns_ex & ex){
@@ -1718,7 +1719,17 @@ void ns_worm_learner::output_movement_analysis_optimization_data(const ns_parame
 			}
 		}
 	}
-
+	cerr << "Calculating death times for " << sweep.number_of_paths() << " paths under " << thresholds.size()*hold_times.size() << " parameter combinations...";
+	sweep.run();
+	ns_acquire_for_scope<ostream> o2(image_server.results_storage.time_path_image_analysis_optimization_matrix(sub,true,sql()).output(true));
+	sweep.write(o2());
+	o2.release();
+	ns_acquire_for_scope<ostream> csv(image_server.results_storage.time_path_image_analysis_quantification(sub,"optimization_stats",true,sql()).output());
+	ns_analyzed_image_time_path::write_analysis_optimization_data_header(csv());
+	csv() << "\n";
+	sweep.write_csv(csv());
+	csv.release();
+	cerr << "Done.\n";
 }
 
 void ns_write_emperical_posture_model(const std::string & path_and_base_filename, const std::string &experiment_name,const std::string & strain,ns_emperical_posture_quantification_value_estimator & e){
@@ -4995,6 +5006,10 @@ ns_mask_info ns_worm_learner::send_mask_to_server(const std::string & ip_address
 	mask_info.image_id = sql->send_query_get_id();
 	*sql << "INSERT INTO image_masks SET image_id = " << mask_info.image_id << ", processed='0'";
 	mask_info.mask_id = sql->send_query_get_id();
+	//version 2 of the image socket protocol can only be read by upgraded servers, so it is used only once the cluster has opted in.
+	ns_image_socket_protocol_version protocol;
+	bool compress;
+	image_server.get_image_socket_protocol(protocol,compress,sql);
 	sql->disconnect();
 	delete sql;
 	cerr << "\nSending image......";
@@ -5003,6 +5018,7 @@ ns_mask_info ns_worm_learner::send_mask_to_server(const std::string & ip_address
 	c.write(mask_info.image_id); //image_id
 	c.write((unsigned long)8);  //bits in image
 	ns_image_socket_sender<ns_8_bit>sender(512);
+	sender.set_protocol(protocol,compress);
 	sender.bind_socket(c);
 	current_mask.pump(sender,512);
 	c.close();